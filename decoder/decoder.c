@@ -27,104 +27,480 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
+#include <getopt.h>
 #include "memtrace.h"
 
+typedef struct {
+   bool quiet;
+   bool limit;
+   double limit_time;
+   MemTraceColumnWriter *columns;   // Export instead of printing, if set
+   MemTraceTextWriter *text;        // Print, unless quiet or exporting
+} DecoderOptions;
+
+
+/*
+ * openIndex --
+ *
+ *    Open <traceFile>.mtidx, if there is one.
+ */
+
+static bool
+openIndex(MemTraceIndex *index, const char *traceFile)
+{
+   char indexFile[strlen(traceFile) + sizeof ".mtidx"];
+
+   sprintf(indexFile, "%s.mtidx", traceFile);
+   return MemTraceIndex_Open(index, indexFile);
+}
+
+
+/*
+ * seekWithIndex --
+ *
+ *    Try to use the trace's index to jump directly to 'limit_time'.
+ *    Returns true if that worked, false if the caller should decode
+ *    the trace from the beginning instead.
+ */
+
+static bool
+seekWithIndex(MemTraceState *state, const char *traceFile, double limit_time)
+{
+   static MemTraceIndex index;
+   MemTraceResult result;
+
+   if (!openIndex(&index, traceFile)) {
+      return false;
+   }
+
+   result = MemTrace_SeekToTime(state, &index, limit_time * RAM_CLOCK_HZ);
+   MemTraceIndex_Close(&index);
+
+   if (result == MEMTR_ERR_INDEX) {
+      fprintf(stderr, "Ignoring %s.mtidx: %s\n", traceFile, MemTrace_ErrorString(result));
+
+      // Start over with a clean slate
+      MemTrace_Close(state);
+      if (!MemTrace_Open(state, traceFile)) {
+         perror("open");
+         exit(1);
+      }
+      return false;
+   }
+
+   if (result == MEMTR_SUCCESS) {
+      fprintf(stderr, "Exiting per user request before entry @ %11.06f\n",
+              state->timestamp.seconds);
+   }
+   return true;
+}
+
+
+/*
+ * printBatch --
+ *
+ *    Print (or export) one batch of decoded operations, and the error
+ *    that ended it, if any. Returns false once we pass the time limit.
+ */
+
+static bool
+printBatch(MemTraceState *state, const MemOpBatch *batch,
+           MemTraceResult result, void *userdata)
+{
+   const DecoderOptions *opts = userdata;
+   bool pastLimit = false;
+   uint32_t n;
+
+   for (n = 0; n < batch->count; n++) {
+      if (opts->limit && batch->clocks[n] / (double)RAM_CLOCK_HZ > opts->limit_time) {
+         pastLimit = true;
+         break;
+      }
+
+      if (opts->columns) {
+         MemTraceColumns_Add(opts->columns, batch, n);
+      }
+   }
+
+   if (opts->text && !MemTraceText_Write(opts->text, batch, 0, n)) {
+      perror("write");
+      exit(1);
+   }
+
+   if (pastLimit) {
+      fprintf(stderr, "Exiting per user request before entry @ %11.06f\n",
+              batch->clocks[n] / (double)RAM_CLOCK_HZ);
+      return false;
+   }
+
+   if (result == MEMTR_ERR_SYNC) {
+      fprintf(stderr, "*** Error at offset %llx: %s, skipped %llu bytes (%llu clocks)\n",
+              state->resync.fileOffset, MemTrace_ErrorString(result),
+              state->resync.length, state->resync.clockUncertainty);
+
+   } else if (result != MEMTR_SUCCESS && result != MEMTR_EOF) {
+      fprintf(stderr, "*** Error at offset %llx: %s\n", state->fileOffset,
+              MemTrace_ErrorString(result));
+   }
+
+   return true;
+}
+
+
+/*
+ * findAccesses --
+ *
+ *    Print every operation that touched [addr, addr + length), using
+ *    the trace's index to skip the parts that didn't.
+ */
+
+static void
+findAccesses(MemTraceState *state, const char *traceFile, uint32_t addr,
+             uint32_t length, DecoderOptions *opts)
+{
+   static MemTraceIndex index;
+   bool haveIndex = openIndex(&index, traceFile);
+   MemTraceResult result;
+
+   result = MemTrace_FindAccesses(state, haveIndex ? &index : NULL, addr, length,
+                                  printBatch, opts);
+
+   if (result == MEMTR_ERR_INDEX && haveIndex) {
+      fprintf(stderr, "Ignoring %s.mtidx: %s\n", traceFile, MemTrace_ErrorString(result));
+      MemTrace_FindAccesses(state, NULL, addr, length, printBatch, opts);
+   }
+
+   if (haveIndex) {
+      MemTraceIndex_Close(&index);
+   }
+}
+
+
+/*
+ * writeStats --
+ *
+ *    Decode the whole trace in one pass, counting every packet and
+ *    operation, and print a JSON report of bus utilization and bursts.
+ */
+
+static bool
+writeStats(MemTraceState *state, double windowSeconds, const MemTraceSymbols *symbols)
+{
+   MemTraceStats stats;
+   MemTraceResult result;
+   MemOpBatch batch;
+   bool ok = true;
+
+   if (!MemOpBatch_Alloc(&batch, 4096)) {
+      return false;
+   }
+
+   if (!MemTraceStats_Init(&stats, windowSeconds * RAM_CLOCK_HZ + 0.5, symbols)) {
+      MemOpBatch_Free(&batch);
+      return false;
+   }
+   state->stats = &stats;
+
+   do {
+      result = MemTrace_NextBatch(state, &batch, batch.capacity);
+      ok = MemTraceStats_Add(&stats, &batch, result);
+   } while (ok && result != MEMTR_EOF);
+
+   state->stats = NULL;
+   ok = ok && MemTraceStats_WriteJSON(&stats, stdout);
+
+   MemTraceStats_Free(&stats);
+   MemOpBatch_Free(&batch);
+   return ok;
+}
+
+
+/*
+ * parseRange --
+ *
+ *    Parse an address range, as "first..end" or "first+length".
+ */
+
+static bool
+parseRange(const char *str, uint32_t *addr, uint32_t *length)
+{
+   unsigned long first, second;
+   char *end;
+
+   first = strtoul(str, &end, 0);
+   if (end == str) {
+      return false;
+   }
+
+   if (end[0] == '+') {
+      second = strtoul(end + 1, &end, 0);
+      *length = second;
+   } else if (end[0] == '.' && end[1] == '.') {
+      second = strtoul(end + 2, &end, 0);
+      if (second <= first) {
+         return false;
+      }
+      *length = second - first;
+   } else {
+      return false;
+   }
+
+   *addr = first;
+   return *end == '\0' && *length > 0 && *length <= MEM_SIZE_BYTES;
+}
+
+
+/*
+ * usage --
+ */
+
+static void
+usage(const char *argv0)
+{
+   fprintf(stderr,
+           "\n"
+           "RAM Trace Decoder, for new 32-bit trace logs.\n"
+           "-- Micah Elizabeth Scott <beth@scanlime.org>\n"
+           "\n"
+           "usage: %s [options] <trace.raw> [<mem-image.bin>  [limit_time] ]\n"
+           "\n"
+           "Options:\n"
+           "  -j, --jobs=N      Decode with N threads. Output is identical.\n"
+           "                    Ignored with a limit_time.\n"
+           "  -c, --columns=DIR Export decoded operations to column files in\n"
+           "                    DIR (see memtrace.h), instead of printing them.\n"
+           "  -f, --format-jobs=N\n"
+           "                    Format text output with N threads.\n"
+           "  -a, --addr-range=FIRST..END, --addr-range=FIRST+LENGTH\n"
+           "                    Only show operations touching these addresses.\n"
+           "                    Can't be used with <mem-image.bin>.\n"
+           "  -s, --stats       Print a JSON report of bus utilization, burst\n"
+           "                    lengths, read/write ratios and idle gaps,\n"
+           "                    instead of the operations themselves.\n"
+           "  -w, --window=SECONDS\n"
+           "                    Report utilization per window this long.\n"
+           "                    Default 1.\n"
+           "  -y, --symbols=FILE\n"
+           "                    Name the symbol at each operation's address,\n"
+           "                    and count operations per symbol with --stats.\n"
+           "                    FILE is an ELF file, or a map file with lines\n"
+           "                    of \"ADDR [SIZE] NAME\" in hex (nm output works).\n"
+           "                    May be given more than once.\n"
+           "\n"
+           "If <trace.raw>.mtidx exists (see mtindex), it's used to find\n"
+           "the memory image at limit_time without decoding the whole trace,\n"
+           "and to skip parts of the trace outside an --addr-range.\n"
+           "\n", argv0);
+}
+
 
 int
 main(int argc, char **argv)
 {
+   static const struct option longOpts[] = {
+      { "jobs", required_argument, NULL, 'j' },
+      { "columns", required_argument, NULL, 'c' },
+      { "format-jobs", required_argument, NULL, 'f' },
+      { "addr-range", required_argument, NULL, 'a' },
+      { "stats", no_argument, NULL, 's' },
+      { "window", required_argument, NULL, 'w' },
+      { "symbols", required_argument, NULL, 'y' },
+      { "help", no_argument, NULL, 'h' },
+      { NULL },
+   };
    static MemTraceState state;
+   static MemTraceSymbols symbols;
    MemTraceResult result;
-   MemOp op;
+   MemOpBatch batch;
+   DecoderOptions opts = { 0 };
+   const char *traceFile;
    const char *memImageFile = NULL;
-   bool quiet = false;
-   bool limit = false;
-   double limit_time = 0.0;
+   const char *columnsDir = NULL;
+   int jobs = 1;
+   int formatJobs = 1;
+   bool addrRange = false;
+   uint32_t rangeAddr = 0, rangeLength = 0;
+   bool stats = false;
+   double windowSeconds = 1.0;
+   bool haveSymbols = false;
+   int nargs, c;
 
    /*
     * Command line gook...
     */
 
-   if (argc < 2 || argc > 4) {
-      fprintf(stderr,
-              "\n"
-              "RAM Trace Decoder, for new 32-bit trace logs.\n"
-              "-- Micah Elizabeth Scott <beth@scanlime.org>\n"
-              "\n"
-              "usage: %s <trace.raw> [<mem-image.bin>  [limit_time] ]\n"
-              "\n", argv[0]);
+   while ((c = getopt_long(argc, argv, "j:c:f:a:sw:y:h", longOpts, NULL)) != -1) {
+      switch (c) {
+
+      case 'j':
+         jobs = atoi(optarg);
+         if (jobs < 1) {
+            fprintf(stderr, "Invalid job count '%s'\n", optarg);
+            return 1;
+         }
+         break;
+
+      case 'c':
+         columnsDir = optarg;
+         break;
+
+      case 'a':
+         if (!parseRange(optarg, &rangeAddr, &rangeLength)) {
+            fprintf(stderr, "Invalid address range '%s'\n", optarg);
+            return 1;
+         }
+         addrRange = true;
+         break;
+
+      case 's':
+         stats = true;
+         break;
+
+      case 'w':
+         windowSeconds = strtod(optarg, NULL);
+         if (!(windowSeconds * RAM_CLOCK_HZ >= 1)) {
+            fprintf(stderr, "Invalid window length '%s'\n", optarg);
+            return 1;
+         }
+         break;
+
+      case 'y':
+         if (!haveSymbols) {
+            MemTraceSymbols_Init(&symbols);
+            haveSymbols = true;
+         }
+         if (!MemTraceSymbols_Load(&symbols, optarg)) {
+            return 1;
+         }
+         break;
+
+      case 'f':
+         formatJobs = atoi(optarg);
+         if (formatJobs < 1) {
+            fprintf(stderr, "Invalid job count '%s'\n", optarg);
+            return 1;
+         }
+         break;
+
+      default:
+         usage(argv[0]);
+         return 1;
+      }
+   }
+
+   nargs = argc - optind;
+   if (nargs < 1 || nargs > 3 || ((addrRange || stats) && nargs > 1) ||
+       (stats && (addrRange || columnsDir))) {
+      usage(argv[0]);
       return 1;
    }
-   if (argc >= 3) {
-      memImageFile = argv[2];
-      quiet = true;
+   traceFile = argv[optind];
+
+   if (nargs >= 2) {
+      memImageFile = argv[optind + 1];
+      opts.quiet = true;
    }
 
-   if (argc >= 4) {
-      limit = true;
+   if (nargs >= 3) {
+      opts.limit = true;
       errno = 0;
-      limit_time = strtod(argv[3], NULL);
+      opts.limit_time = strtod(argv[optind + 2], NULL);
       if(errno != 0) {
          perror("strtod");
          return -1;
       }
    }
 
-   if (!MemTrace_Open(&state, argv[1])) {
-      perror("open");
+   if (haveSymbols && !MemTraceSymbols_Finish(&symbols)) {
+      perror("malloc");
       return 1;
    }
 
-   /*
-    * Main loop- ask MemTrace to fetch us one burst at a time.
-    */
+   if (!MemTrace_Open(&state, traceFile)) {
+      perror("open");
+      return 1;
+   }
 
-   while ((result = MemTrace_Next(&state, &op)) != MEMTR_EOF) {
-      if (result != MEMTR_SUCCESS) {
-	 fprintf(stderr, "*** Error at offset %llx: %s\n", state.fileOffset,
-		 MemTrace_ErrorString(result));
-         continue;
+   if (stats) {
+      if (!writeStats(&state, windowSeconds, haveSymbols ? &symbols : NULL)) {
+         perror("stats");
+         return 1;
       }
+      return 0;
+   }
 
-      if(limit && state.timestamp.seconds > limit_time) {
-         fprintf(stderr, "Exiting per user request before entry @ %11.06f\n", state.timestamp.seconds);
-         result = MEMTR_EOF;
-         break;
+   if (columnsDir) {
+      opts.columns = MemTraceColumns_Create(columnsDir);
+      if (!opts.columns) {
+         perror(columnsDir);
+         return 1;
       }
+   } else if (!opts.quiet) {
+      opts.text = MemTraceText_Create(stdout, formatJobs, haveSymbols ? &symbols : NULL);
+      if (!opts.text) {
+         perror("malloc");
+         return 1;
+      }
+   }
 
-      if (!quiet) {
-         const char *label;
-         int i;
-
-         assert(op.type == MEMOP_READ || op.type == MEMOP_WRITE);
-         label = op.type == MEMOP_WRITE ? "WRITE" : "read";
+   if (addrRange) {
+      findAccesses(&state, traceFile, rangeAddr, rangeLength, &opts);
+      goto finished;
+   }
 
-         printf("%11.06fs %-5s [%2d] %08x: ", state.timestamp.seconds,
-                label, op.length, op.addr);
+   /*
+    * Without a time limit, the whole trace is fair game. Split it
+    * up among as many threads as we were asked for.
+    */
 
-         for (i = 0; i < op.length || i < 32; i++) {
-            const char *pad = (i & 1) ? "" : " ";
-            if (i < op.length)
-               printf("%s%02x", pad, state.memory[op.addr + i]);
-            else
-               printf("%s  ", pad);
-         }
+   if (!opts.limit) {
+      if (!MemTrace_DecodeParallel(&state, jobs, printBatch, &opts)) {
+         perror("decode");
+         return 1;
+      }
+      goto finished;
+   }
 
-         printf("  ");
+   /*
+    * With a time limit, we must not decode past the first burst that
+    * crosses it, or that burst's successors would end up in the memory
+    * image. Decode one burst at a time in that case.
+    *
+    * If there's an index, we can skip most of the decoding entirely,
+    * unless we're exporting everything we decode.
+    */
 
-         for (i = 0; i < op.length || i < 32; i++) {
-            char c = i < op.length ? (char)state.memory[op.addr + i] : ' ';
-            printf("%c", isprint(c) ? c : '.');
-         }
+   if (!opts.columns && seekWithIndex(&state, traceFile, opts.limit_time)) {
+      goto finished;
+   }
 
-         printf("\n");
-      }
+   if (!MemOpBatch_Alloc(&batch, 1)) {
+      perror("malloc");
+      return 1;
    }
 
+   do {
+      result = MemTrace_NextBatch(&state, &batch, 1);
+   } while (printBatch(&state, &batch, result, &opts) && result != MEMTR_EOF);
+
+   MemOpBatch_Free(&batch);
+
    /*
     * Finished successfully. Write out a memory image, if we were asked to.
     */
 
+ finished:
+   if (opts.text && !MemTraceText_Close(opts.text)) {
+      perror("write");
+      return 1;
+   }
+
+   if (opts.columns && !MemTraceColumns_Close(opts.columns)) {
+      fprintf(stderr, "Error writing columns to %s\n", columnsDir);
+      return 1;
+   }
+
    if (memImageFile) {
       FILE *img = fopen(memImageFile, "wb");
 
@@ -133,7 +509,7 @@ main(int argc, char **argv)
          return 1;
       }
 
-      if (fwrite(state.memory, sizeof state.memory, 1, img) != 1) {
+      if (!MemTrace_WriteImage(&state, img)) {
          perror("write");
          return 1;
       }
@@ -0,0 +1,138 @@
+/*
+ * libmemtrace.h - Stable C interface to the shared decoder library,
+ *                 for tools that decode traces in-process.
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __LIBMEMTRACE_H
+#define __LIBMEMTRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Everything in libmemtrace.so is reached through this header. The
+ * structures here only ever grow at the end, and only the library
+ * allocates them, so a tool built against an older header keeps
+ * working with a newer library of the same major version.
+ *
+ * MemTraceReader_Version returns the library's version, which should
+ * have the same major version as MEMTRACE_READER_VERSION.
+ */
+
+#define MEMTRACE_READER_VERSION_MAJOR  1
+#define MEMTRACE_READER_VERSION_MINOR  0
+#define MEMTRACE_READER_VERSION        ((MEMTRACE_READER_VERSION_MAJOR << 16) | \
+                                        MEMTRACE_READER_VERSION_MINOR)
+
+/*
+ * Results. These have the same values as MemTraceResult.
+ */
+
+#define MTREADER_SUCCESS        0
+#define MTREADER_EOF            1   // End of the trace
+#define MTREADER_ERR_SYNC       2   // Damaged packets were skipped
+#define MTREADER_ERR_CHECKSUM   3
+#define MTREADER_ERR_BADBURST   4
+#define MTREADER_ERR_INDEX      5   // Index doesn't match the trace, or can't seek
+#define MTREADER_ERR_NOMEM      6   // Out of memory; one operation was lost
+
+/*
+ * Operation types, as in MemOpType.
+ */
+
+#define MTREADER_READ   1
+#define MTREADER_WRITE  2
+
+/*
+ * Memory is 16 MB of trace addresses, in 4 kB pages.
+ */
+
+#define MTREADER_MEM_SIZE   (16 * 1024 * 1024)
+#define MTREADER_PAGE_SIZE  4096
+#define MTREADER_NUM_PAGES  (MTREADER_MEM_SIZE / MTREADER_PAGE_SIZE)
+
+/*
+ * For MemTraceReader_Query.
+ */
+
+typedef enum {
+   MTREADER_CLOCKS,            // Trace timestamp
+   MTREADER_CLOCK_HZ,          // Clocks per second
+   MTREADER_FILE_OFFSET,       // Position in the uncompressed trace
+   MTREADER_FILE_SIZE,         // Size of the uncompressed trace
+   MTREADER_HAS_INDEX,         // 1 if seeking uses an index, 0 if it decodes
+   MTREADER_RESYNC_OFFSET,     // Span skipped by the last MTREADER_ERR_SYNC
+   MTREADER_RESYNC_LENGTH,
+   MTREADER_RESYNC_CLOCKS,     // Clocks the skipped span may have covered
+} MemTraceReaderQuery;
+
+/*
+ * One batch of decoded operations, as parallel arrays. Operation 'i'
+ * finished at clocks[i], and its data is at data[dataOffset[i]]. The
+ * reader owns all of it, until the reader's next call.
+ */
+
+typedef struct {
+   uint32_t count;
+   uint32_t dataLength;
+   const uint8_t *type;        // MTREADER_READ or MTREADER_WRITE
+   const uint32_t *addr;       // In bytes
+   const uint32_t *length;     // In bytes
+   const uint64_t *clocks;
+   const uint32_t *dataOffset;
+   const uint8_t *data;
+} MemTraceReaderBatch;
+
+typedef struct MemTraceReader MemTraceReader;
+
+
+/*
+ * Public functions
+ */
+
+uint32_t MemTraceReader_Version(void);
+const char *MemTraceReader_ErrorString(int result);
+
+MemTraceReader *MemTraceReader_Open(const char *filename);
+MemTraceReader *MemTraceReader_Snapshot(const MemTraceReader *reader);
+void MemTraceReader_Close(MemTraceReader *reader);
+
+int MemTraceReader_NextBatch(MemTraceReader *reader, uint32_t maxOps,
+                             const MemTraceReaderBatch **batch);
+int MemTraceReader_Seek(MemTraceReader *reader, uint64_t clocks);
+uint64_t MemTraceReader_Query(const MemTraceReader *reader, MemTraceReaderQuery what);
+
+void MemTraceReader_ReadMemory(const MemTraceReader *reader, uint32_t addr,
+                               void *data, uint32_t length);
+const uint8_t *MemTraceReader_PeekPage(const MemTraceReader *reader, uint32_t page);
+bool MemTraceReader_WriteImage(const MemTraceReader *reader, const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBMEMTRACE_H */
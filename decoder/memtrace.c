@@ -24,8 +24,13 @@
 
 #define _FILE_OFFSET_BITS 64
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "memtrace.h"
 #include "memtrace_fmt.h"
 
@@ -34,8 +39,18 @@
  * Local functions
  */
 
-bool MemTraceData(MemTraceState *state, MemOp *op, MemPacket packet,
+bool MemTraceData(MemTraceState *state, MemOp *op, uint32_t payload,
                   MemTraceResult *result);
+static void MemTraceMap(MemTraceState *state);
+static MemTraceResult MemTraceNextOp(MemTraceState *state, MemOp *nextOp);
+
+
+/*
+ * When the trace is memory-mapped, we ask the kernel to start reading
+ * this far ahead of the decoder, one window at a time.
+ */
+
+#define MAP_READAHEAD  (8 * 1024 * 1024)
 
 
 /*
@@ -43,6 +58,11 @@ bool MemTraceData(MemTraceState *state, MemOp *op, MemPacket packet,
  *
  *    Open a binary memory trace log, in the raw format saved by
  *    our logging FPGA. Returns true on success, false on error.
+ *
+ *    Regular files are memory-mapped, and packets are decoded
+ *    directly out of the mapping. Anything we can't map (pipes,
+ *    character devices, very large files on 32-bit hosts) is read
+ *    through stdio instead. Either way, the results are identical.
  */
 
 bool
@@ -50,40 +70,219 @@ MemTrace_Open(MemTraceState *state, const char *filename)
 {
    memset(state, 0, sizeof *state);
    state->file = fopen(filename, "rb");
-   return state->file != NULL;
+   if (!state->file) {
+      return false;
+   }
+
+   MemTraceMap(state);
+
+   if (state->file) {
+      state->fileBuf = malloc(MEMTRACE_FILEBUF_SIZE);
+      if (!state->fileBuf) {
+         goto fail;
+      }
+
+      /*
+       * Compressed archives are decompressed on the fly. Anything
+       * else we read while checking stays in the buffer.
+       */
+
+      state->fileBufTail = fread(state->fileBuf, 1, MEMTRACE_ARCHIVE_MAGIC_SIZE,
+                                 state->file);
+      if (MemTraceArchive_IsArchive(state->fileBuf, state->fileBufTail)) {
+         state->fileBufTail = 0;
+         state->archive = MemTraceArchive_Open(state->file);
+         if (!state->archive) {
+            goto fail;
+         }
+      }
+   }
+   return true;
+
+ fail:
+   MemTrace_Close(state);
+   return false;
+}
+
+
+/*
+ * MemTraceMap --
+ *
+ *    Internal function which tries to switch an open trace over to
+ *    memory-mapped I/O. If this fails, the trace stays on the stdio path.
+ */
+
+static void
+MemTraceMap(MemTraceState *state)
+{
+   int fd = fileno(state->file);
+   struct stat st;
+   void *map;
+
+   if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+       (uint64_t)st.st_size > (size_t)-1) {
+      return;
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (map == MAP_FAILED) {
+      return;
+   }
+
+   if (MemTraceArchive_IsArchive(map, st.st_size)) {
+      // Archives are read through stdio, one block at a time.
+      munmap(map, st.st_size);
+      return;
+   }
+
+   /*
+    * We touch every page exactly once, in order. Let the kernel
+    * read ahead aggressively and drop pages we've already passed.
+    */
+
+   madvise(map, st.st_size, MADV_SEQUENTIAL);
+#ifdef POSIX_FADV_SEQUENTIAL
+   posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+   state->map = map;
+   state->mapSize = st.st_size;
+   state->mapAdvised = 0;
+
+   fclose(state->file);
+   state->file = NULL;
+}
+
+
+/*
+ * MemTrace_Seek --
+ *
+ *    Move the read position to a particular byte offset. This
+ *    doesn't change the timestamp, memory, or burst address; the
+ *    caller is responsible for those making sense at 'offset'.
+ *    Returns false if the trace can't seek (it's a pipe, for example).
+ */
+
+bool
+MemTrace_Seek(MemTraceState *state, uint64_t offset)
+{
+   if (state->map) {
+      if (offset > state->mapSize) {
+         return false;
+      }
+      state->mapAdvised = offset;
+
+   } else if (state->archive) {
+      if (!MemTraceArchive_Seek(state->archive, offset)) {
+         return false;
+      }
+      state->fileBufHead = 0;
+      state->fileBufTail = 0;
+
+   } else {
+      if (!state->file || fseeko(state->file, offset, SEEK_SET)) {
+         return false;
+      }
+      state->fileBufHead = 0;
+      state->fileBufTail = 0;
+   }
+
+   state->fileOffset = offset;
+   state->batchHead = 0;
+   state->batchCount = 0;
+   return true;
 }
 
 
 /*
  * MemTrace_Close --
  *
- *    Close a trace log, clean up after MemTrace_Open.
+ *    Close a trace log, clean up after MemTrace_Open or MemTrace_Clone.
+ *    This also frees the memory image.
  */
 
 void
 MemTrace_Close(MemTraceState *state)
 {
-   fclose(state->file);
-   state->file = NULL;
+   if (state->map && !state->mapBorrowed) {
+      munmap((void *)state->map, state->mapSize);
+   }
+   state->map = NULL;
+
+   if (state->archive) {
+      MemTraceArchive_Close(state->archive);
+      state->archive = NULL;
+   }
+
+   if (state->file) {
+      fclose(state->file);
+      state->file = NULL;
+   }
+
+   free(state->fileBuf);
+   state->fileBuf = NULL;
+
+   MemTrace_ClearMemory(state);
 }
 
 
 /*
- * MemTraceReadBuffered --
+ * MemTracePeekMapped --
  *
- *    Internal function for buffered reads. Should be a little faster
- *    than calling fread repeatedly. Returns true on success, false on
- *    EOF. (Does not differentiate EOF from other errors currently!)
+ *    Internal function for reads from a memory-mapped trace. Returns
+ *    a pointer to the data at the current file offset, and the number
+ *    of bytes remaining in the file. Nothing is copied.
  */
 
-static inline bool
-MemTraceReadBuffered(MemTraceState *state, uint8_t *bytes, uint32_t size)
+static inline const uint8_t *
+MemTracePeekMapped(MemTraceState *state, uint32_t *avail)
 {
-   int i;
-   uint8_t *src;
+   uint64_t remaining = state->mapSize - state->fileOffset;
+
+   if (state->fileOffset >= state->mapAdvised) {
+      /*
+       * Crossed into the last readahead window. Request the next one,
+       * so the disk stays busy while we decode this one.
+       */
+
+      uint64_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+      uint64_t start = state->fileOffset & ~pageMask;
+      uint64_t length = MAP_READAHEAD * 2;
+
+      if (start + length > state->mapSize) {
+         length = state->mapSize - start;
+      }
+
+      madvise((void *)(state->map + start), length, MADV_WILLNEED);
+      state->mapAdvised = start + MAP_READAHEAD;
+   }
+
+   *avail = remaining > UINT32_MAX ? UINT32_MAX : remaining;
+   return state->map + state->fileOffset;
+}
+
+
+/*
+ * MemTracePeekBuffered --
+ *
+ *    Internal function for buffered reads. Should be a little faster
+ *    than calling fread repeatedly. Tries to make at least 'size' bytes
+ *    available in our buffer, and returns a pointer to them along with
+ *    the number of bytes actually available. (Does not differentiate
+ *    EOF from other errors currently!)
+ */
 
+static inline const uint8_t *
+MemTracePeekBuffered(MemTraceState *state, uint32_t size, uint32_t *avail)
+{
    assert(state->fileBufHead <= state->fileBufTail);
 
+   if (!state->file) {
+      // A clone of a trace we couldn't map. It can't read any further.
+      *avail = 0;
+      return NULL;
+   }
+
    if (size + state->fileBufHead > state->fileBufTail) {
       /* Not enough data in the buffer. */
 
@@ -95,42 +294,111 @@ MemTraceReadBuffered(MemTraceState *state, uint8_t *bytes, uint32_t size)
       state->fileBufHead = 0;
 
       /* Fill the rest of the buffer from disk (well, from stdio's buffer) */
-      result = fread(state->fileBuf + state->fileBufTail, 1,
-                     sizeof state->fileBuf - state->fileBufTail,
-                     state->file);
-      if (result < 1) {
-         /* Nothing to read */
-         return false;
+      if (state->archive) {
+         result = MemTraceArchive_Read(state->archive,
+                                       state->fileBuf + state->fileBufTail,
+                                       MEMTRACE_FILEBUF_SIZE - state->fileBufTail);
+      } else {
+         result = fread(state->fileBuf + state->fileBufTail, 1,
+                        MEMTRACE_FILEBUF_SIZE - state->fileBufTail,
+                        state->file);
       }
       state->fileBufTail += result;
    }
 
-   if (size + state->fileBufHead > state->fileBufTail) {
-      /* We read something, but not enough. EOF. */
-      return false;
+   *avail = state->fileBufTail - state->fileBufHead;
+   return state->fileBuf + state->fileBufHead;
+}
+
+
+/*
+ * MemTracePeek --
+ *
+ *    Internal function to look at upcoming bytes in the trace without
+ *    consuming them, by whichever method the trace was opened with.
+ *    '*avail' may be less than 'size' near EOF. The returned pointer is
+ *    only valid until the next peek.
+ */
+
+static inline const uint8_t *
+MemTracePeek(MemTraceState *state, uint32_t size, uint32_t *avail)
+{
+   if (state->map) {
+      return MemTracePeekMapped(state, avail);
    }
+   return MemTracePeekBuffered(state, size, avail);
+}
 
-   /*
-    * This is such a small copy that the function call overhead on
-    * memcpy isn't likely to make it worthwhile. Also, this loop can
-    * be unrolled by a smart compiler when 'size' is constant.
-    */
 
-   src = state->fileBuf + state->fileBufHead;
-   for (i = 0; i < size; i++) {
-      *(bytes++) = *(src++);
+/*
+ * MemTraceSkip --
+ *
+ *    Internal function to consume 'size' bytes which the last
+ *    MemTracePeek() showed were available.
+ */
+
+static inline void
+MemTraceSkip(MemTraceState *state, uint32_t size)
+{
+   if (!state->map) {
+      state->fileBufHead += size;
+      assert(state->fileBufHead <= state->fileBufTail);
    }
-   state->fileBufHead += size;
    state->fileOffset += size;
-   assert(state->fileBufHead <= state->fileBufTail);
+}
 
-   return true;
+
+/*
+ * MemTraceRead --
+ *
+ *    Internal function to consume exactly 'size' bytes from the trace.
+ *    Returns a pointer to them, or NULL on EOF.
+ */
+
+static inline const uint8_t *
+MemTraceRead(MemTraceState *state, uint32_t size)
+{
+   uint32_t avail;
+   const uint8_t *bytes = MemTracePeek(state, size, &avail);
+
+   if (avail < size) {
+      return NULL;
+   }
+
+   MemTraceSkip(state, size);
+   return bytes;
 }
 
 
+/*
+ * MemTraceRefill --
+ *
+ *    Internal function to validate and unpack the next run of packets
+ *    with the batch kernel. Returns false if the very next packet is
+ *    missing or damaged, in which case it's up to the caller to look
+ *    at it more carefully. Doesn't consume any bytes.
+ */
+
+static inline bool
+MemTraceRefill(MemTraceState *state)
+{
+   uint32_t avail;
+   const uint8_t *bytes = MemTracePeek(state, sizeof state->batch.packet, &avail);
+   uint32_t count = avail / sizeof(MemPacket);
+
+   if (count > MEMPKT_BATCH_SIZE) {
+      count = MEMPKT_BATCH_SIZE;
+   }
+
+   state->batchHead = 0;
+   state->batchCount = count ? MemPacket_DecodeBatch(bytes, count, &state->batch) : 0;
+
+   return state->batchCount != 0;
+}
+
 
 /*
- * MemTrace --
+ * MemTrace_Next --
  *
  *    Advance to the next memory operation in the log.
  *    The current timestamp and memory contents in 'state'
@@ -144,6 +412,130 @@ MemTraceReadBuffered(MemTraceState *state, uint8_t *bytes, uint32_t size)
 
 MemTraceResult
 MemTrace_Next(MemTraceState *state, MemOp *nextOp)
+{
+   MemTraceResult result = MemTraceNextOp(state, nextOp);
+
+   state->timestamp.seconds = state->timestamp.clocks / (double)RAM_CLOCK_HZ;
+   return result;
+}
+
+
+/*
+ * MemTrace_NextBatch --
+ *
+ *    Decode up to 'n' memory operations into 'out', which must have
+ *    been set up with MemOpBatch_Alloc. 'n' is limited to the batch's
+ *    capacity. Each operation's data is copied out of the memory image
+ *    as it's decoded, so it isn't affected by later operations.
+ *
+ *    Returns the result which ended the batch: MEMTR_SUCCESS if we
+ *    decoded 'n' operations, otherwise the error or EOF that stopped
+ *    us early. Either way, out->count operations are valid, and they
+ *    all happened before the error. On error, 'state' is positioned
+ *    just as MemTrace_Next would have left it.
+ *
+ *    If the batch's data heap can't grow, we return MEMTR_ERR_NOMEM
+ *    just after the operation which didn't fit, and describe it in
+ *    state->lostOp like an abandoned burst.
+ */
+
+MemTraceResult
+MemTrace_NextBatch(MemTraceState *state, MemOpBatch *out, uint32_t n)
+{
+   MemTraceResult result = MEMTR_SUCCESS;
+
+   if (n > out->capacity) {
+      n = out->capacity;
+   }
+
+   out->count = 0;
+   out->dataLength = 0;
+
+   while (out->count < n) {
+      MemOp op;
+
+      result = MemTraceNextOp(state, &op);
+      if (result != MEMTR_SUCCESS) {
+         break;
+      }
+
+      if (!MemOpBatch_Add(out, &op, state->timestamp.clocks, state)) {
+         /*
+          * Keep what we have, but say so: this operation is already in
+          * the memory image, and nobody else will see it.
+          */
+         state->lostOp = op;
+         result = MEMTR_ERR_NOMEM;
+         break;
+      }
+   }
+
+   state->timestamp.seconds = state->timestamp.clocks / (double)RAM_CLOCK_HZ;
+
+   return result;
+}
+
+
+/*
+ * MemTraceFindSync --
+ *
+ *    Internal function to recover from a misaligned packet at the
+ *    current offset. Skips to the next point where MEMTR_SYNC_PACKETS
+ *    packets in a row are good, or to EOF, and describes the skipped
+ *    span in state->resync.
+ *
+ *    Each packet takes at least one clock, so we count one clock of
+ *    uncertainty per packet-sized piece of the span. A lost TIMESTAMP
+ *    packet could have covered more.
+ */
+
+static void
+MemTraceFindSync(MemTraceState *state)
+{
+   uint64_t start = state->fileOffset;
+
+   // The current offset is known to be bad
+   MemTraceSkip(state, 1);
+
+   if (state->map) {
+      uint64_t end = state->syncLimit > state->mapSize ? state->syncLimit
+                                                       : state->mapSize;
+      uint64_t found = state->fileOffset +
+         MemPacket_FindSync(state->map + state->fileOffset, end - state->fileOffset,
+                            MEMTR_SYNC_PACKETS, true);
+
+      state->fileOffset = found < state->mapSize ? found : state->mapSize;
+
+   } else {
+      for (;;) {
+         uint32_t avail;
+         const uint8_t *bytes = MemTracePeek(state, MEMTRACE_FILEBUF_SIZE, &avail);
+         bool atEnd = avail < MEMTRACE_FILEBUF_SIZE;
+         size_t found = MemPacket_FindSync(bytes, avail, MEMTR_SYNC_PACKETS, atEnd);
+
+         MemTraceSkip(state, found);
+         if (atEnd || found + MEMTR_SYNC_PACKETS * sizeof(MemPacket) <= avail) {
+            break;
+         }
+      }
+   }
+
+   state->resync.fileOffset = start;
+   state->resync.length = state->fileOffset - start;
+   state->resync.clockUncertainty = (state->resync.length + sizeof(MemPacket) - 1) /
+                                    sizeof(MemPacket);
+}
+
+
+/*
+ * MemTraceNextOp --
+ *
+ *    Internal function that does the work for MemTrace_Next, except
+ *    for updating 'timestamp.seconds'.
+ */
+
+static MemTraceResult
+MemTraceNextOp(MemTraceState *state, MemOp *nextOp)
 {
    /*
     * We can read any number of packets from the file.
@@ -157,44 +549,72 @@ MemTrace_Next(MemTraceState *state, MemOp *nextOp)
    op.type = MEMOP_INVALID;
 
    while (!done) {
-      MemPacket packet;
-      uint8_t packetBytes[sizeof packet];
+      MemPacketType type;
+      uint32_t payload;
+      uint32_t duration;
 
-      if (!MemTraceReadBuffered(state, packetBytes, sizeof packetBytes)) {
+      if (state->batchHead < state->batchCount || MemTraceRefill(state)) {
          /*
-          * If we've reached EOF and we're in the middle of a burst,
-          * flush the burst before exiting.
+          * Fast path: this packet was already checked by the batch kernel.
           */
-         if (op.length) {
-            break;
-         }
 
-         return MEMTR_EOF;
-      }
-      packet = MemPacket_FromBytes(packetBytes);
+         uint32_t i = state->batchHead++;
+
+         MemTraceSkip(state, sizeof(MemPacket));
+         type = state->batch.type[i];
+         payload = state->batch.payload[i];
+         duration = state->batch.duration[i];
+
+      } else {
+         /*
+          * Slow path: EOF, or a packet the kernel rejected. Take it
+          * apart one step at a time so we can say what went wrong.
+          */
+
+         MemPacket packet;
+         uint32_t avail;
+         const uint8_t *packetBytes = MemTracePeek(state, sizeof packet, &avail);
+
+         if (avail < sizeof packet) {
+            /*
+             * If we've reached EOF and we're in the middle of a burst,
+             * flush the burst before exiting.
+             */
+            if (op.length) {
+               break;
+            }
 
-      if (!MemPacket_IsAligned(packet)) {
-         // Half-hearted attempt to recover from sync errors.
-         // We could do better than this...
-         if (!MemTraceReadBuffered(state, packetBytes, 1)) {
             return MEMTR_EOF;
          }
+         packet = MemPacket_FromBytes(packetBytes);
 
-         return MEMTR_ERR_SYNC;
-      }
+         if (!MemPacket_IsAligned(packet)) {
+            MemTraceFindSync(state);
+            result = MEMTR_ERR_SYNC;
+            goto lost;
+         }
+         MemTraceSkip(state, sizeof packet);
+
+         if (!MemPacket_IsChecksumCorrect(packet)) {
+            result = MEMTR_ERR_CHECKSUM;
+            goto lost;
+         }
 
-      if (!MemPacket_IsChecksumCorrect(packet)) {
-         return MEMTR_ERR_CHECKSUM;
+         type = MemPacket_GetType(packet);
+         payload = MemPacket_GetPayload(packet);
+         duration = MemPacket_GetDuration(packet);
       }
 
-      state->timestamp.clocks += MemPacket_GetDuration(packet);
-      state->timestamp.seconds = state->timestamp.clocks / (double)RAM_CLOCK_HZ;
+      state->timestamp.clocks += duration;
+      if (__builtin_expect(state->stats != NULL, 0)) {
+         MemTraceStats_Packet(state->stats, type, duration, state->timestamp.clocks);
+      }
 
-      switch (MemPacket_GetType(packet)) {
+      switch (type) {
 
       case MEMPKT_ADDR:
          // Addresses end this burst, but we store the address for next time.
-         state->nextAddr = MemPacket_GetPayload(packet);
+         state->nextAddr = payload;
          if (op.length) {
             done = true;
          }
@@ -202,27 +622,67 @@ MemTrace_Next(MemTraceState *state, MemOp *nextOp)
 
       case MEMPKT_READ:
          if (op.type == MEMOP_WRITE) {
-            return MEMTR_ERR_BADBURST;
+            result = MEMTR_ERR_BADBURST;
+            goto lost;
          }
          op.type = MEMOP_READ;
-         done = MemTraceData(state, &op, packet, &result);
+         done = MemTraceData(state, &op, payload, &result);
          break;
 
       case MEMPKT_WRITE:
          if (op.type == MEMOP_READ) {
-            return MEMTR_ERR_BADBURST;
+            result = MEMTR_ERR_BADBURST;
+            goto lost;
          }
          op.type = MEMOP_WRITE;
-         done = MemTraceData(state, &op, packet, &result);
+         done = MemTraceData(state, &op, payload, &result);
          break;
       }
    }
 
+   if (result != MEMTR_SUCCESS) {
+      state->lostOp = op;
+   }
    if (nextOp) {
       *nextOp = op;
    }
 
    return result;
+
+ lost:
+   /*
+    * The burst in progress is abandoned, but its data is already in
+    * memory. Remember it for anyone keeping their own memory log.
+    */
+   state->lostOp = op;
+   return result;
+}
+
+
+/*
+ * MemTraceByte --
+ *
+ *    Internal function to find the byte at 'addr' in memory, ready to be
+ *    written. Marks its page dirty. Pages we already own exclusively are
+ *    the fast path; anything else goes through MemTrace_EditPage.
+ */
+
+static inline uint8_t *
+MemTraceByte(MemTraceState *state, uint32_t addr)
+{
+   uint32_t page = (addr & MEM_MASK) >> MEM_PAGE_SHIFT;
+   MemTracePage *p = state->pages[page];
+
+   /*
+    * A clone may drop its reference to a page from another thread. The
+    * acquire makes sure it's done reading before we write in place.
+    */
+   if (__builtin_expect(!p || __atomic_load_n(&p->refCount, __ATOMIC_ACQUIRE) != 1, 0)) {
+      return MemTrace_EditPage(state, page) + (addr & (MEM_PAGE_SIZE - 1));
+   }
+
+   state->dirtyPages[page >> 5] |= 1 << (page & 31);
+   return p->data + (addr & (MEM_PAGE_SIZE - 1));
 }
 
 
@@ -231,7 +691,7 @@ MemTrace_Next(MemTraceState *state, MemOp *nextOp)
  *
  *    Internal function for processing word read/write packets.
  *
- *    We split the packet into timestamp, UB/LB, and data,
+ *    We split the packet's payload into timestamp, UB/LB, and data,
  *    and use the data to update 'state' and 'op'.
  *
  *    If this function returns 'true', the current burst
@@ -239,12 +699,12 @@ MemTrace_Next(MemTraceState *state, MemOp *nextOp)
  */
 
 bool
-MemTraceData(MemTraceState *state, MemOp *op, MemPacket packet,
+MemTraceData(MemTraceState *state, MemOp *op, uint32_t payload,
              MemTraceResult *result)
 {
-   bool ub = MemPacket_RW_UpperByte(packet);
-   bool lb = MemPacket_RW_LowerByte(packet);
-   uint16_t word = MemPacket_RW_Word(packet);
+   bool ub = (payload >> 17) & 1;
+   bool lb = (payload >> 16) & 1;
+   uint16_t word = payload & 0xFFFF;
    bool byteWide = !(ub && lb);
 
    if (op->length == 0) {
@@ -262,20 +722,131 @@ MemTraceData(MemTraceState *state, MemOp *op, MemPacket packet,
 
    if (byteWide) {
       if (lb) {
-         state->memory[op->addr + op->length++] = word & 0xFF;
+         *MemTraceByte(state, op->addr + op->length++) = word & 0xFF;
       } else {
-         state->memory[++op->addr + op->length++] = word >> 8;
+         *MemTraceByte(state, ++op->addr + op->length++) = word >> 8;
       }
       return true;
    }
 
-   state->memory[MEM_MASK & (op->addr + op->length++)] = word & 0xFF;
-   state->memory[MEM_MASK & (op->addr + op->length++)] = word >> 8;
+   // Both bytes of a word are always on the same page
+   {
+      uint8_t *bytes = MemTraceByte(state, op->addr + op->length);
+      bytes[0] = word & 0xFF;
+      bytes[1] = word >> 8;
+      op->length += 2;
+   }
 
    return false;
 }
 
 
+/*
+ * MemOpBatch_Alloc --
+ *
+ *    Allocate the arrays for a MemOpBatch which can hold up to
+ *    'capacity' operations. Returns false if we're out of memory.
+ */
+
+bool
+MemOpBatch_Alloc(MemOpBatch *batch, uint32_t capacity)
+{
+   memset(batch, 0, sizeof *batch);
+
+   batch->capacity = capacity;
+   batch->dataCapacity = capacity * 32;
+
+   batch->type = malloc(capacity * sizeof *batch->type);
+   batch->addr = malloc(capacity * sizeof *batch->addr);
+   batch->length = malloc(capacity * sizeof *batch->length);
+   batch->clocks = malloc(capacity * sizeof *batch->clocks);
+   batch->dataOffset = malloc(capacity * sizeof *batch->dataOffset);
+   batch->data = malloc(batch->dataCapacity);
+
+   if (!batch->type || !batch->addr || !batch->length ||
+       !batch->clocks || !batch->dataOffset || !batch->data) {
+      MemOpBatch_Free(batch);
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ * MemOpBatch_Add --
+ *
+ *    Append one operation to a batch, copying its data out of the
+ *    memory image in 'state'. Returns false if the batch is full or we
+ *    can't grow its data heap.
+ */
+
+bool
+MemOpBatch_Add(MemOpBatch *batch, const MemOp *op, uint64_t clocks,
+               const MemTraceState *state)
+{
+   uint32_t n = batch->count;
+
+   if (n >= batch->capacity) {
+      return false;
+   }
+
+   if (batch->dataLength + op->length > batch->dataCapacity) {
+      uint32_t capacity = batch->dataCapacity * 2;
+      uint8_t *data;
+
+      while (batch->dataLength + op->length > capacity) {
+         capacity *= 2;
+      }
+      data = realloc(batch->data, capacity);
+      if (!data) {
+         return false;
+      }
+      batch->data = data;
+      batch->dataCapacity = capacity;
+   }
+
+   batch->type[n] = op->type;
+   batch->addr[n] = op->addr;
+   batch->length[n] = op->length;
+   batch->clocks[n] = clocks;
+   batch->dataOffset[n] = batch->dataLength;
+
+   if (((op->addr & (MEM_PAGE_SIZE - 1)) + op->length) <= MEM_PAGE_SIZE &&
+       state->pages[(op->addr & MEM_MASK) >> MEM_PAGE_SHIFT]) {
+      // Usual case: the whole burst is on one page, which we just wrote
+      memcpy(batch->data + batch->dataLength,
+             state->pages[(op->addr & MEM_MASK) >> MEM_PAGE_SHIFT]->data +
+             (op->addr & (MEM_PAGE_SIZE - 1)), op->length);
+   } else {
+      MemTrace_Read(state, op->addr, batch->data + batch->dataLength, op->length);
+   }
+
+   batch->dataLength += op->length;
+   batch->count++;
+   return true;
+}
+
+
+/*
+ * MemOpBatch_Free --
+ *
+ *    Free the arrays allocated by MemOpBatch_Alloc.
+ */
+
+void
+MemOpBatch_Free(MemOpBatch *batch)
+{
+   free(batch->type);
+   free(batch->addr);
+   free(batch->length);
+   free(batch->clocks);
+   free(batch->dataOffset);
+   free(batch->data);
+   memset(batch, 0, sizeof *batch);
+}
+
+
 /*
  * MemTrace_ErrorString --
  *
@@ -291,9 +862,11 @@ MemTrace_ErrorString(MemTraceResult result)
       "Packet synchronization error",
       "Packet checksum error",
       "Malformed read/write burst",
+      "Index does not match trace",
+      "Out of memory",
    };
 
-   if (result < 0 || result > sizeof strings / sizeof strings[0]) {
+   if (result < 0 || result >= sizeof strings / sizeof strings[0]) {
       return "(Unknown error)";
    }
 
@@ -28,6 +28,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include "memtrace_batch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
 /*
@@ -47,12 +52,158 @@ typedef struct {
 } MemOp;
 
 
+/*
+ * MemOpBatch - Many memory operations, stored as parallel arrays.
+ *
+ *    Operation 'i' has the given type, address, and length. 'clocks' is
+ *    the trace timestamp after the operation completed, and its data
+ *    bytes are at data[dataOffset[i]]. The batch owns all of these
+ *    arrays; 'data' grows as needed.
+ */
+
+typedef struct {
+   uint32_t   count;      // Number of valid operations
+   uint32_t   capacity;   // Size of each per-operation array
+   uint32_t   dataLength; // Bytes used in 'data'
+   uint32_t   dataCapacity;
+
+   uint8_t   *type;       // MemOpType
+   uint32_t  *addr;
+   uint32_t  *length;
+   uint64_t  *clocks;
+   uint32_t  *dataOffset;
+   uint8_t   *data;
+} MemOpBatch;
+
+
 /*
  * MemTraceState - Current state of the memory trace log.
  */
 
 #define MEM_SIZE_BYTES (16 * 1024 * 1024)
 #define MEM_MASK       (MEM_SIZE_BYTES - 1)
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE  (1 << MEM_PAGE_SHIFT)
+#define MEM_NUM_PAGES  (MEM_SIZE_BYTES >> MEM_PAGE_SHIFT)
+
+/*
+ * After a misaligned packet, we skip ahead until this many packets in
+ * a row look good. Fewer would risk locking on to a false alignment.
+ */
+#define MEMTR_SYNC_PACKETS  8
+
+#define MEMTRACE_FILEBUF_SIZE  (64 * 1024)
+
+/*
+ * A compressed archive of a trace (.mtz), read in place of the raw file.
+ */
+typedef struct MemTraceArchive MemTraceArchive;
+
+#define MEMTRACE_ARCHIVE_MAGIC_SIZE  8
+
+/*
+ * Describes the span skipped by the last MEMTR_ERR_SYNC.
+ */
+typedef struct {
+   uint64_t fileOffset;        // Where the damage starts
+   uint64_t length;            // Bytes skipped
+   uint64_t clockUncertainty;  // Clocks the skipped span may have covered
+} MemTraceResync;
+
+/*
+ * MemTraceSymbols - Names for ranges of trace addresses, loaded from ELF
+ *                   symbol tables or map files. 'symbols' is sorted by
+ *                   address once MemTraceSymbols_Finish builds the
+ *                   lookup table.
+ */
+
+#define MEM_CPU_BASE        0x02000000   // Traced RAM, as the CPUs see it
+#define MEMTRACE_NO_SYMBOL  UINT32_MAX
+
+typedef struct {
+   uint32_t addr;           // Trace address
+   uint32_t size;           // In bytes, or 0 to run until the next symbol
+   const char *name;
+} MemTraceSymbol;
+
+typedef struct {
+   uint32_t numSymbols;
+   MemTraceSymbol *symbols;
+   uint32_t maxNameLength;
+
+   /* Private */
+
+   uint32_t symbolsAlloc;
+   uint32_t numIntervals;
+   uint32_t *keys;          // Interval starts, in Eytzinger order
+   uint32_t *owners;        // Symbol before each key
+} MemTraceSymbols;
+
+/*
+ * MemTraceStats - Bus utilization and burst statistics, gathered in
+ *                 one pass. Point state->stats at one of these to have
+ *                 every packet counted as it's decoded, and hand it
+ *                 each batch of operations with MemTraceStats_Add.
+ *
+ *    If there are symbols, operations are also counted by the symbol
+ *    at their first address.
+ *
+ *    A clock is busy if an address or data packet was captured on it.
+ *    Idle gaps are runs of clocks with no packet, binned by
+ *    floor(log2(length)). Burst lengths are in bytes, with everything
+ *    of MEMTRACE_STATS_MAX_BURST bytes or more in the last bin.
+ */
+
+#define MEMTRACE_STATS_MAX_BURST  256
+
+typedef struct {
+   uint64_t busyClocks;
+   uint64_t ops[3];            // By MemOpType
+   uint64_t bytes[3];
+} MemTraceStatsWindow;
+
+typedef struct {
+   uint64_t ops[3];            // By MemOpType
+   uint64_t bytes[3];
+} MemTraceStatsSymbol;
+
+typedef struct {
+   uint64_t windowClocks;
+   uint64_t clocks;            // End of the last packet
+   uint64_t busyClocks;
+   uint64_t packets[4];        // By MemPacketType
+   uint64_t errors;            // Results other than success or EOF
+   uint64_t ops[3];            // By MemOpType
+   uint64_t bytes[3];
+   uint64_t bursts[3][MEMTRACE_STATS_MAX_BURST + 1];
+   uint64_t gaps[64];
+
+   uint32_t numWindows;
+   MemTraceStatsWindow *windows;
+
+   const MemTraceSymbols *symbols;
+   MemTraceStatsSymbol *perSymbol;
+
+   /* Private */
+
+   uint32_t windowsAlloc;
+   uint64_t windowStart;       // Range of 'window', in clocks
+   uint64_t windowEnd;
+   uint32_t window;            // Window of the last busy clock
+   uint64_t idleClocks;        // Gap in progress
+   bool outOfMemory;
+} MemTraceStats;
+
+/*
+ * Memory is a table of 4 kB pages. Pages are allocated the first time
+ * they're written; until then they read as zeroes. A page can be shared
+ * by several states (see MemTrace_Clone) and is copied before any of
+ * them writes to it.
+ */
+typedef struct {
+   uint32_t refCount;
+   uint8_t  data[MEM_PAGE_SIZE];
+} MemTracePage;
 
 typedef struct {
    struct {
@@ -61,16 +212,31 @@ typedef struct {
    } timestamp;
 
    uint64_t  fileOffset;
+   MemTraceResync resync;
+   MemTraceStats *stats;          // If set, every packet is counted here
 
-   uint8_t  memory[MEM_SIZE_BYTES];
+   MemTracePage *pages[MEM_NUM_PAGES];        // NULL pages are all zero
+   uint32_t dirtyPages[MEM_NUM_PAGES / 32];   // Bitmap, pages touched since cleared
 
    /* Private */
 
    FILE *file;
+   const uint8_t *map;            // Entire file, if memory-mapped
+   uint64_t mapSize;
+   bool mapBorrowed;              // Map belongs to another state; don't unmap
+   uint64_t mapAdvised;           // Readahead has been requested up to here
+   uint64_t syncLimit;            // Resync may look this far, if past mapSize
    uint32_t fileBufHead;
    uint32_t fileBufTail;
-   uint8_t fileBuf[64 * 1024];
+   uint8_t *fileBuf;              // MEMTRACE_FILEBUF_SIZE, if not memory-mapped
+   MemTraceArchive *archive;      // Decompresses 'file', if it's an archive
    uint32_t nextAddr;             // In words
+
+   MemPacketBatch batch;          // Packets already validated and unpacked
+   uint32_t batchHead;
+   uint32_t batchCount;
+
+   MemOp lostOp;                  // Partial burst abandoned by the last error
 } MemTraceState;
 
 
@@ -84,19 +250,326 @@ typedef enum {
    MEMTR_ERR_SYNC,       // Packet synchronization error
    MEMTR_ERR_CHECKSUM,   // Packet checksum error
    MEMTR_ERR_BADBURST,   // Malformed read/write burst
+   MEMTR_ERR_INDEX,      // Index doesn't match the trace, or can't seek
+   MEMTR_ERR_NOMEM,      // Couldn't grow a batch to hold an operation
 } MemTraceResult;
 
 
+/*
+ * MemTraceIndex - A time index for a trace, stored in a sidecar file
+ *                 (usually the trace's name plus ".mtidx").
+ *
+ *    Entries are taken at burst boundaries, roughly every
+ *    MTIDX_ENTRY_INTERVAL bytes of trace. Every MTIDX_CHECKPOINT_INTERVAL
+ *    entries, we also store each memory page that changed since the
+ *    previous checkpoint. Any checkpoint's memory image can be rebuilt by
+ *    walking backwards until every page has been found.
+ *
+ *    Address summaries, taken separately every MTIDX_SUMMARY_INTERVAL
+ *    bytes, let MemTrace_FindAccesses skip spans of trace that never
+ *    touched the addresses it's looking for.
+ */
+
+#define MTIDX_ENTRY_INTERVAL       (256 * 1024)
+#define MTIDX_CHECKPOINT_INTERVAL  32
+#define MTIDX_SUMMARY_INTERVAL     (64 * 1024)
+
+typedef struct {
+   uint64_t clocks;
+   uint64_t fileOffset;
+   uint32_t nextAddr;
+   uint32_t checkpoint;   // Latest checkpoint at or before this entry
+} MemTraceIndexEntry;
+
+typedef struct {
+   uint32_t entry;        // Entry this checkpoint was taken at
+   uint32_t numPages;     // Pages changed since the previous checkpoint
+   uint64_t pagesOffset;  // Location of MemTraceIndexPage[numPages]
+} MemTraceIndexCheckpoint;
+
+typedef struct {
+   uint32_t page;
+   uint32_t size;         // Compressed size in bytes
+   uint64_t offset;       // Location of the compressed page
+} MemTraceIndexPage;
+
+/*
+ * Which addresses the operations in one span of roughly
+ * MTIDX_SUMMARY_INTERVAL bytes touched: a bitmap of pages, and the
+ * lowest and highest byte. A span with no operations has
+ * minAddr > maxAddr. Like an entry, it has everything needed to start
+ * decoding there, except for memory.
+ */
+typedef struct {
+   uint64_t clocks;
+   uint64_t fileOffset;
+   uint32_t nextAddr;
+   uint32_t minAddr;
+   uint32_t maxAddr;      // Inclusive
+   uint32_t reserved;
+   uint32_t pages[MEM_NUM_PAGES / 32];
+} MemTraceIndexSummary;
+
+typedef struct {
+   uint64_t traceSize;
+   uint32_t numEntries;
+   uint32_t numCheckpoints;
+   uint32_t numSummaries;
+   const MemTraceIndexEntry *entries;
+   const MemTraceIndexCheckpoint *checkpoints;
+   const MemTraceIndexSummary *summaries;
+
+   /* Private */
+
+   const uint8_t *map;
+   uint64_t mapSize;
+} MemTraceIndex;
+
+/*
+ * MemTraceFile - One trace, shared by any number of MemTraceCursors.
+ *
+ *    The trace's data and index are read-only once it's open, so its
+ *    cursors can decode independently on different threads.
+ */
+
+typedef struct {
+   const uint8_t *data;     // The entire trace
+   uint64_t size;
+   bool hasIndex;
+   MemTraceIndex index;     // If hasIndex
+
+   /* Private */
+
+   bool mapped;             // 'data' is mmap()'ed rather than malloc()'ed
+} MemTraceFile;
+
+typedef struct {
+   MemTraceState state;     // Use with MemTrace_Next, MemTrace_NextBatch, ...
+   const MemTraceFile *file;
+} MemTraceCursor;
+
+/*
+ * MemTraceColumn - One column of decoded operations, exported to its
+ *                  own file by a MemTraceColumnWriter.
+ *
+ *    Element 'i' of every column but MTCOL_DATA describes operation
+ *    'i'. Its data bytes are elements [offset, offset + length) of
+ *    MTCOL_DATA. Columns are compressed in blocks, and read back in
+ *    any range with MemTraceColumn_Read.
+ */
+
+typedef enum {
+   MTCOL_CLOCKS,        // uint64_t, trace timestamp after the operation
+   MTCOL_TYPE,          // uint8_t, MemOpType
+   MTCOL_ADDR,          // uint32_t, in bytes
+   MTCOL_LENGTH,        // uint32_t, in bytes
+   MTCOL_DATA_OFFSET,   // uint64_t, index into MTCOL_DATA
+   MTCOL_DATA,          // uint8_t, every operation's data back to back
+   MTCOL_NUM_COLUMNS,
+} MemTraceColumnId;
+
+typedef struct MemTraceColumnWriter MemTraceColumnWriter;
+
+/*
+ * MemTraceTextWriter - Writes decoded operations as a text dump, one
+ *                      line per operation, optionally formatting on
+ *                      several threads.
+ */
+
+typedef struct MemTraceTextWriter MemTraceTextWriter;
+
+typedef struct {
+   uint32_t elemSize;       // Bytes per element
+   uint64_t count;          // Number of elements
+
+   /* Private */
+
+   uint32_t blockElems;
+   uint32_t numBlocks;
+   bool delta;
+   const void *blocks;
+   const uint8_t *map;
+   uint64_t mapSize;
+} MemTraceColumn;
+
+/*
+ * MemTraceHeatmap - Read and write counts for every page, in fixed-size
+ *                   time buckets. rows[b] holds MEM_NUM_PAGES read
+ *                   counts followed by MEM_NUM_PAGES write counts, or
+ *                   is NULL if bucket 'b' had no accesses.
+ */
+
+typedef struct {
+   uint64_t bucketClocks;
+   uint32_t numBuckets;
+   uint32_t **rows;
+
+   /* Private */
+
+   uint32_t rowsAlloc;
+} MemTraceHeatmap;
+
+/*
+ * MemTraceGen - Generates synthetic traces, for tests and benchmarks.
+ *
+ *    The workloads are made of well-formed bursts. Faults can be
+ *    injected into any packet, each with its own probability: dropping
+ *    1-3 bytes, corrupting the checksum, or inserting the hardware's
+ *    0xFFFFFFFF overflow marker before it.
+ */
+
+typedef enum {
+   MTGEN_RANDOM,            // Random addresses and lengths, some bytes
+   MTGEN_SEQUENTIAL,        // Block copies, in full-length bursts
+   MTGEN_POLLING,           // One word read at a steady rate
+   MTGEN_IOHOOK,            // Log messages through the I/O Hook at IOH_ADDR
+   MTGEN_MIXED,             // All of the above
+} MemTraceGenWorkload;
+
+typedef struct {
+   MemTraceGenWorkload workload;
+   uint64_t seed;
+   uint32_t maxBurst;       // In words, up to 64
+   uint32_t idleClocks;     // Average gap between bursts
+   double writeFraction;    // Of random bursts
+   double dropRate;         // Per packet
+   double corruptRate;
+   double overflowRate;
+} MemTraceGenOptions;
+
+#define MEMTRACE_GEN_PENDING  1024
+
+typedef struct {
+   MemTraceGenOptions opts;
+   uint64_t bytes;          // Written so far
+   uint64_t packets;        // Generated, including damaged ones
+   uint64_t bursts;
+   uint64_t clocks;
+   uint64_t drops;
+   uint64_t corruptions;
+   uint64_t overflows;
+
+   /* Private */
+
+   uint64_t rng;
+   uint64_t writeLimit;
+   uint64_t dropLimit;
+   uint64_t corruptLimit;
+   uint64_t overflowLimit;
+   uint32_t seqWord;
+   bool seqWrite;
+   uint32_t pollWord;
+   uint32_t polls;
+   uint32_t iohPackets;
+   uint32_t pendingHead;
+   uint32_t pendingLength;
+   uint8_t pending[MEMTRACE_GEN_PENDING];
+} MemTraceGen;
+
+/*
+ * Receives decoded operations from MemTrace_DecodeParallel.
+ * Return false to stop decoding.
+ */
+
+typedef bool (MemTraceBatchFn)(MemTraceState *state, const MemOpBatch *ops,
+                               MemTraceResult result, void *userdata);
+
+
 /*
  * Public functions
  */
 
 bool MemTrace_Open(MemTraceState *state, const char *filename);
 void MemTrace_Close(MemTraceState *state);
+bool MemTrace_Seek(MemTraceState *state, uint64_t offset);
 
 MemTraceResult MemTrace_Next(MemTraceState *state, MemOp *nextOp);
+MemTraceResult MemTrace_NextBatch(MemTraceState *state, MemOpBatch *out, uint32_t n);
+
+bool MemOpBatch_Alloc(MemOpBatch *batch, uint32_t capacity);
+bool MemOpBatch_Add(MemOpBatch *batch, const MemOp *op, uint64_t clocks,
+                    const MemTraceState *state);
+void MemOpBatch_Free(MemOpBatch *batch);
+
+const uint8_t *MemTrace_PeekPage(const MemTraceState *state, uint32_t page);
+uint8_t *MemTrace_EditPage(MemTraceState *state, uint32_t page);
+void MemTrace_DropPage(MemTraceState *state, uint32_t page);
+void MemTrace_Read(const MemTraceState *state, uint32_t addr, uint8_t *data,
+                   uint32_t length);
+void MemTrace_Write(MemTraceState *state, uint32_t addr, const uint8_t *data,
+                    uint32_t length);
+void MemTrace_ClearMemory(MemTraceState *state);
+bool MemTrace_WriteImage(const MemTraceState *state, FILE *f);
+void MemTrace_Clone(MemTraceState *dest, const MemTraceState *src);
+bool MemTrace_DecodeParallel(MemTraceState *state, int jobs,
+                             MemTraceBatchFn *callback, void *userdata);
 
 const char *MemTrace_ErrorString(MemTraceResult result);
 
+bool MemTraceIndex_Build(MemTraceState *state, const char *filename);
+bool MemTraceIndex_Open(MemTraceIndex *index, const char *filename);
+void MemTraceIndex_Close(MemTraceIndex *index);
+MemTraceResult MemTrace_SeekToTime(MemTraceState *state, const MemTraceIndex *index,
+                                   uint64_t clocks);
+MemTraceResult MemTrace_FindAccesses(MemTraceState *state, const MemTraceIndex *index,
+                                     uint32_t addr, uint32_t length,
+                                     MemTraceBatchFn *callback, void *userdata);
+
+bool MemTraceFile_Open(MemTraceFile *file, const char *filename);
+void MemTraceFile_Close(MemTraceFile *file);
+void MemTraceCursor_Open(MemTraceCursor *cursor, const MemTraceFile *file);
+void MemTraceCursor_Clone(MemTraceCursor *dest, const MemTraceCursor *src);
+void MemTraceCursor_Close(MemTraceCursor *cursor);
+MemTraceResult MemTraceCursor_SeekToTime(MemTraceCursor *cursor, uint64_t clocks);
+
+MemTraceColumnWriter *MemTraceColumns_Create(const char *dir);
+void MemTraceColumns_Add(MemTraceColumnWriter *w, const MemOpBatch *batch, uint32_t n);
+bool MemTraceColumns_Close(MemTraceColumnWriter *w);
+bool MemTraceColumn_Open(MemTraceColumn *col, const char *dir, MemTraceColumnId id);
+void MemTraceColumn_Close(MemTraceColumn *col);
+uint64_t MemTraceColumn_Read(const MemTraceColumn *col, uint64_t first, uint64_t count,
+                             void *out);
+
+MemTraceTextWriter *MemTraceText_Create(FILE *out, int jobs,
+                                        const MemTraceSymbols *symbols);
+bool MemTraceText_Write(MemTraceTextWriter *w, const MemOpBatch *batch,
+                        uint32_t first, uint32_t count);
+bool MemTraceText_Close(MemTraceTextWriter *w);
+
+void MemTraceHeatmap_Init(MemTraceHeatmap *heat, uint64_t bucketClocks);
+void MemTraceHeatmap_Free(MemTraceHeatmap *heat);
+bool MemTraceHeatmap_Add(MemTraceHeatmap *heat, const MemOpBatch *batch);
+bool MemTraceHeatmap_Write(const MemTraceHeatmap *heat, const char *filename);
+bool MemTraceHeatmap_Render(const MemTraceHeatmap *heat, const char *filename);
+
+bool MemTraceStats_Init(MemTraceStats *stats, uint64_t windowClocks,
+                        const MemTraceSymbols *symbols);
+void MemTraceStats_Free(MemTraceStats *stats);
+void MemTraceStats_Packet(MemTraceStats *stats, MemPacketType type, uint32_t duration,
+                          uint64_t clocks);
+bool MemTraceStats_Add(MemTraceStats *stats, const MemOpBatch *batch,
+                       MemTraceResult result);
+bool MemTraceStats_WriteJSON(const MemTraceStats *stats, FILE *f);
+
+void MemTraceSymbols_Init(MemTraceSymbols *syms);
+void MemTraceSymbols_Free(MemTraceSymbols *syms);
+bool MemTraceSymbols_Load(MemTraceSymbols *syms, const char *fileName);
+bool MemTraceSymbols_Finish(MemTraceSymbols *syms);
+uint32_t MemTraceSymbols_Find(const MemTraceSymbols *syms, uint32_t addr);
+
+void MemTraceGen_Init(MemTraceGen *gen, const MemTraceGenOptions *opts);
+void MemTraceGen_Fill(MemTraceGen *gen, uint8_t *buffer, size_t length);
+
+bool MemTraceArchive_IsArchive(const uint8_t *bytes, size_t length);
+bool MemTraceArchive_Create(FILE *in, FILE *out);
+MemTraceArchive *MemTraceArchive_Open(FILE *f);
+void MemTraceArchive_Close(MemTraceArchive *ar);
+size_t MemTraceArchive_Read(MemTraceArchive *ar, uint8_t *buffer, size_t length);
+bool MemTraceArchive_Seek(MemTraceArchive *ar, uint64_t offset);
+uint64_t MemTraceArchive_RawSize(const MemTraceArchive *ar);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* __MEMTRACE_H */
@@ -0,0 +1,378 @@
+/*
+ * memtrace.hpp - Header-only C++ decoder, compiled separately for each
+ *                combination of features a caller needs.
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef __MEMTRACE_HPP
+#define __MEMTRACE_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+/*
+ * g++ warns about the AVX-512 intrinsics used by memtrace_batch.h, which
+ * gcc's own header leaves uninitialized on purpose. The C compiler doesn't.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include "memtrace.h"
+#pragma GCC diagnostic pop
+
+namespace memtrace {
+
+/*
+ * Policy flags for Decoder. Each one adds work to the inner loop, and
+ * anything a decoder wasn't asked for is compiled out of it.
+ */
+
+enum {
+   TRACK_MEMORY = 1 << 0,   // Replay operations into a MemTraceState's memory
+   TRACK_TIME   = 1 << 1,   // Count clocks, and timestamp each operation
+   VALIDATE     = 1 << 2,   // Check every packet, and resync after damage
+   INCLUDE_DATA = 1 << 3,   // Give each operation its data bytes
+
+   FULL = TRACK_MEMORY | TRACK_TIME | VALIDATE | INCLUDE_DATA,
+};
+
+
+/*
+ * Op - One memory operation. It's a MemOp, so the C library will take
+ *      it as one. 'clocks' is the trace timestamp after the operation,
+ *      with TRACK_TIME. 'data' is its 'length' bytes, with INCLUDE_DATA,
+ *      and is only valid until the decoder moves on.
+ */
+
+struct Op : MemOp {
+   uint64_t clocks;
+   const uint8_t *data;
+};
+
+
+/*
+ * Decoder - Decodes a trace that's already in memory, such as a
+ *           MemTraceFile's data, into the same operations as
+ *           MemTrace_Next.
+ *
+ *    Without VALIDATE, the trace has to be known good, like an archive
+ *    that decoded cleanly before. Damage is decoded as garbage instead
+ *    of being reported. TRACK_MEMORY needs a MemTraceState to hold the
+ *    memory image; only its memory is used.
+ *
+ *    A decoder is a range of operations:
+ *
+ *       memtrace::Decoder<memtrace::VALIDATE> decoder(file.data, file.size);
+ *
+ *       for (const memtrace::Op &op : decoder) {
+ *          ...
+ *       }
+ *
+ *    which skips over errors, counting them in 'errors'. Call Next
+ *    instead to see every result, as with MemTrace_Next.
+ */
+
+template <unsigned Policy>
+class Decoder {
+public:
+   static const bool trackMemory = (Policy & TRACK_MEMORY) != 0;
+   static const bool trackTime = (Policy & TRACK_TIME) != 0;
+   static const bool validate = (Policy & VALIDATE) != 0;
+   static const bool includeData = (Policy & INCLUDE_DATA) != 0;
+
+   uint64_t clocks;               // With TRACK_TIME
+   uint64_t fileOffset;
+   MemTraceResync resync;         // Span skipped by the last MEMTR_ERR_SYNC
+   uint64_t errors;               // Skipped while iterating
+   MemTraceResult lastError;
+
+   Decoder(const uint8_t *data, uint64_t size, MemTraceState *state = NULL)
+      : clocks(0), fileOffset(0), resync(), errors(0), lastError(MEMTR_SUCCESS),
+        data(data), size(size), state(state), nextAddr(0) {}
+
+   /*
+    * Pick up where a cursor left off, for example after
+    * MemTraceCursor_SeekToTime. Memory is tracked in the cursor's state.
+    * The cursor itself doesn't move.
+    */
+   explicit Decoder(MemTraceCursor &cursor)
+      : clocks(cursor.state.timestamp.clocks), fileOffset(cursor.state.fileOffset),
+        resync(), errors(0), lastError(MEMTR_SUCCESS),
+        data(cursor.file->data), size(cursor.file->size), state(&cursor.state),
+        nextAddr(cursor.state.nextAddr) {}
+
+   double Seconds() const { return clocks / (double)RAM_CLOCK_HZ; }
+
+   MemTraceResult Next(Op &op);
+
+   class iterator {
+   public:
+      typedef std::input_iterator_tag iterator_category;
+      typedef Op value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const Op *pointer;
+      typedef const Op &reference;
+
+      iterator() : decoder(NULL) {}
+      explicit iterator(Decoder *decoder) : decoder(decoder) { ++*this; }
+
+      const Op &operator*() const { return op; }
+      const Op *operator->() const { return &op; }
+      bool operator==(const iterator &other) const { return decoder == other.decoder; }
+      bool operator!=(const iterator &other) const { return decoder != other.decoder; }
+
+      iterator &operator++() {
+         for (;;) {
+            MemTraceResult result = decoder->Next(op);
+
+            if (result == MEMTR_SUCCESS) {
+               break;
+            }
+            if (result == MEMTR_EOF) {
+               decoder = NULL;
+               break;
+            }
+            decoder->errors++;
+            decoder->lastError = result;
+         }
+         return *this;
+      }
+
+   private:
+      Decoder *decoder;   // NULL at the end
+      Op op;
+   };
+
+   iterator begin() { return iterator(this); }
+   iterator end() { return iterator(); }
+
+private:
+   const uint8_t *data;
+   uint64_t size;
+   MemTraceState *state;
+   uint32_t nextAddr;             // In words
+   std::vector<uint8_t> opData;
+   uint32_t ownedPage;            // Page we made writable during this Next
+   uint8_t *ownedData;
+
+   bool Data(Op &op, uint32_t payload, MemTraceResult &result);
+   void Store(const Op &op, uint16_t bytes, uint32_t length);
+   void FindSync();
+};
+
+
+/*
+ * Decoder::Next --
+ *
+ *    Advance to the next memory operation, like MemTrace_Next. On EOF
+ *    or error, 'op' isn't valid.
+ */
+
+template <unsigned Policy>
+MemTraceResult
+Decoder<Policy>::Next(Op &op)
+{
+   MemTraceResult result = MEMTR_SUCCESS;
+
+   op.type = MEMOP_INVALID;
+   op.addr = 0;
+   op.length = 0;
+   op.clocks = 0;
+   op.data = NULL;
+   ownedPage = MEM_NUM_PAGES;
+
+   for (;;) {
+      MemPacket packet;
+      MemPacketType type;
+      uint32_t payload;
+
+      if (size - fileOffset < sizeof packet) {
+         // Flush any burst in progress before reporting EOF
+         if (op.length) {
+            break;
+         }
+         return MEMTR_EOF;
+      }
+      packet = MemPacket_FromBytes(data + fileOffset);
+
+      if (validate && !MemPacket_IsAligned(packet)) {
+         FindSync();
+         return MEMTR_ERR_SYNC;
+      }
+      fileOffset += sizeof packet;
+
+      if (validate && !MemPacket_IsChecksumCorrect(packet)) {
+         return MEMTR_ERR_CHECKSUM;
+      }
+
+      if (trackTime) {
+         clocks += MemPacket_GetDuration(packet);
+      }
+
+      type = MemPacket_GetType(packet);
+      payload = MemPacket_GetPayload(packet);
+
+      if (type == MEMPKT_ADDR) {
+         // Addresses end this burst, but we store the address for next time.
+         nextAddr = payload;
+         if (op.length) {
+            break;
+         }
+
+      } else if (type != MEMPKT_TIMESTAMP) {
+         MemOpType opType = type == MEMPKT_READ ? MEMOP_READ : MEMOP_WRITE;
+
+         if (op.type != MEMOP_INVALID && op.type != opType) {
+            return MEMTR_ERR_BADBURST;
+         }
+         op.type = opType;
+         if (Data(op, payload, result)) {
+            break;
+         }
+      }
+   }
+
+   if (result != MEMTR_SUCCESS) {
+      return result;
+   }
+   if (trackTime) {
+      op.clocks = clocks;
+   }
+   if (includeData) {
+      op.data = &opData[0];
+   }
+   return MEMTR_SUCCESS;
+}
+
+
+/*
+ * Decoder::Data --
+ *
+ *    Internal function for read/write packets, the same as MemTraceData.
+ *    Returns true if the burst ends after this packet.
+ */
+
+template <unsigned Policy>
+inline bool
+Decoder<Policy>::Data(Op &op, uint32_t payload, MemTraceResult &result)
+{
+   bool ub = (payload >> 17) & 1;
+   bool lb = (payload >> 16) & 1;
+   uint16_t word = payload & 0xFFFF;
+   bool byteWide = !(ub && lb);
+
+   if (op.length == 0) {
+      op.addr = nextAddr << 1;
+   }
+
+   nextAddr++;
+
+   if (byteWide && op.length) {
+      // We don't support byte and word access in the same burst
+      result = MEMTR_ERR_BADBURST;
+      return true;
+   }
+
+   if (byteWide) {
+      if (!lb) {
+         op.addr++;
+         word >>= 8;
+      }
+      Store(op, word & 0xFF, 1);
+      op.length = 1;
+      return true;
+   }
+
+   // Both bytes of a word are always on the same page
+   Store(op, word, 2);
+   op.length += 2;
+
+   return false;
+}
+
+
+/*
+ * Decoder::Store --
+ *
+ *    Internal function to append one or two bytes to an operation, in
+ *    memory and/or the operation's data, as the policy asks.
+ *
+ *    A page made writable stays that way until the end of this Next,
+ *    so a burst only has to check its page once.
+ */
+
+template <unsigned Policy>
+inline void
+Decoder<Policy>::Store(const Op &op, uint16_t bytes, uint32_t length)
+{
+   if (trackMemory) {
+      uint32_t addr = op.addr + op.length;
+      uint32_t page = (addr & MEM_MASK) >> MEM_PAGE_SHIFT;
+      uint8_t *dest;
+
+      if (__builtin_expect(page != ownedPage, 0)) {
+         ownedData = MemTrace_EditPage(state, page);
+         ownedPage = page;
+      }
+      dest = ownedData + (addr & (MEM_PAGE_SIZE - 1));
+      dest[0] = bytes & 0xFF;
+      if (length == 2) {
+         dest[1] = bytes >> 8;
+      }
+   }
+
+   if (includeData) {
+      if (opData.size() < op.length + length) {
+         opData.resize(2 * (op.length + length));
+      }
+      opData[op.length] = bytes & 0xFF;
+      if (length == 2) {
+         opData[op.length + 1] = bytes >> 8;
+      }
+   }
+}
+
+
+/*
+ * Decoder::FindSync --
+ *
+ *    Internal function to skip past a misaligned packet, the same way
+ *    MemTraceFindSync does.
+ */
+
+template <unsigned Policy>
+void
+Decoder<Policy>::FindSync()
+{
+   uint64_t start = fileOffset++;
+
+   fileOffset += MemPacket_FindSync(data + fileOffset, size - fileOffset,
+                                    MEMTR_SYNC_PACKETS, true);
+
+   resync.fileOffset = start;
+   resync.length = fileOffset - start;
+   resync.clockUncertainty = (resync.length + sizeof(MemPacket) - 1) / sizeof(MemPacket);
+}
+
+}  // namespace memtrace
+
+#endif /* __MEMTRACE_HPP */
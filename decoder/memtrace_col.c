@@ -0,0 +1,549 @@
+/*
+ * memtrace_col.c - Export decoded operations as compressed column files,
+ *                  and read them back.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "memtrace.h"
+
+/*
+ * Column file layout. All integers are in host byte order.
+ *
+ *   ColumnHeader
+ *   Compressed blocks
+ *   ColumnBlock[numBlocks]
+ *
+ * Each block holds MTCOL_BLOCK_BYTES worth of elements (fewer in the
+ * last block) and is compressed on its own, so readers only inflate
+ * the blocks they ask for. Before compressing, monotonic columns are
+ * stored as differences from the previous element, then the bytes of
+ * all elements are transposed so zlib sees each byte position as one
+ * run: the high bytes of a delta are almost always zero.
+ */
+
+#define MTCOL_MAGIC       "MTCOL\r\n\032"
+#define MTCOL_VERSION     1
+#define MTCOL_BLOCK_BYTES (512 * 1024)
+
+typedef struct {
+   char     magic[8];
+   uint32_t version;
+   uint32_t column;        // MemTraceColumnId
+   uint32_t elemSize;
+   uint32_t blockElems;
+   uint64_t count;
+   uint32_t numBlocks;
+   uint32_t delta;         // Elements are delta-coded
+   uint64_t blocksOffset;
+} ColumnHeader;
+
+typedef struct {
+   uint64_t offset;
+   uint32_t size;          // Compressed
+   uint32_t count;         // Elements
+} ColumnBlock;
+
+static const struct {
+   const char *name;
+   uint32_t elemSize;
+   bool delta;
+} columnInfo[MTCOL_NUM_COLUMNS] = {
+   [MTCOL_CLOCKS]      = { "clocks", sizeof(uint64_t), true },
+   [MTCOL_TYPE]        = { "type",   sizeof(uint8_t),  false },
+   [MTCOL_ADDR]        = { "addr",   sizeof(uint32_t), true },
+   [MTCOL_LENGTH]      = { "length", sizeof(uint32_t), false },
+   [MTCOL_DATA_OFFSET] = { "offset", sizeof(uint64_t), true },
+   [MTCOL_DATA]        = { "data",   sizeof(uint8_t),  false },
+};
+
+typedef struct {
+   FILE *file;
+   ColumnHeader header;
+   uint8_t *buffer;        // Current block, not yet compressed
+   uint32_t fill;          // Elements in 'buffer'
+   ColumnBlock *blocks;
+   uint32_t blocksAlloc;
+} ColumnOut;
+
+struct MemTraceColumnWriter {
+   ColumnOut columns[MTCOL_NUM_COLUMNS];
+   uint8_t *encoded;
+   uint8_t *compressed;
+   uLongf compressedMax;
+   uint64_t dataLength;
+   bool error;
+};
+
+
+/*
+ * columnPath --
+ *
+ *    Internal function to build the file name for one column.
+ */
+
+static char *
+columnPath(const char *dir, MemTraceColumnId id)
+{
+   char *path = malloc(strlen(dir) + strlen(columnInfo[id].name) + sizeof "/.col");
+
+   if (path) {
+      sprintf(path, "%s/%s.col", dir, columnInfo[id].name);
+   }
+   return path;
+}
+
+
+/*
+ * encodeElements --
+ * decodeElements --
+ *
+ *    Internal functions for the pre-compression transform: optional
+ *    delta coding, then a byte transpose. 'in' and 'out' hold 'count'
+ *    elements and must not overlap.
+ */
+
+static void
+encodeElements(const uint8_t *in, uint8_t *out, uint32_t count,
+               uint32_t elemSize, bool delta)
+{
+   uint64_t prev = 0;
+   uint32_t i, b;
+
+   for (i = 0; i < count; i++) {
+      uint64_t value = 0;
+
+      memcpy(&value, in + i * elemSize, elemSize);
+      if (delta) {
+         uint64_t diff = value - prev;
+         prev = value;
+         value = diff;
+      }
+      for (b = 0; b < elemSize; b++) {
+         out[b * count + i] = value >> (b * 8);
+      }
+   }
+}
+
+static void
+decodeElements(const uint8_t *in, uint8_t *out, uint32_t count,
+               uint32_t elemSize, bool delta)
+{
+   uint64_t prev = 0;
+   uint32_t i, b;
+
+   for (i = 0; i < count; i++) {
+      uint64_t value = 0;
+
+      for (b = 0; b < elemSize; b++) {
+         value |= (uint64_t)in[b * count + i] << (b * 8);
+      }
+      if (delta) {
+         value += prev;
+         prev = value;
+      }
+      memcpy(out + i * elemSize, &value, elemSize);
+   }
+}
+
+
+/*
+ * flushBlock --
+ *
+ *    Internal function to compress and write out a column's current
+ *    block. Errors are remembered until MemTraceColumns_Close.
+ */
+
+static void
+flushBlock(MemTraceColumnWriter *w, ColumnOut *c)
+{
+   uint32_t length = c->fill * c->header.elemSize;
+   uLongf compressedLength = w->compressedMax;
+   ColumnBlock *block;
+
+   if (!c->fill) {
+      return;
+   }
+   if (w->error) {
+      goto error;
+   }
+
+   if (c->header.numBlocks == c->blocksAlloc) {
+      ColumnBlock *bigger;
+
+      c->blocksAlloc = c->blocksAlloc ? c->blocksAlloc * 2 : 64;
+      bigger = realloc(c->blocks, c->blocksAlloc * sizeof *bigger);
+      if (!bigger) {
+         goto error;
+      }
+      c->blocks = bigger;
+   }
+
+   encodeElements(c->buffer, w->encoded, c->fill, c->header.elemSize,
+                  c->header.delta);
+   if (compress2(w->compressed, &compressedLength, w->encoded, length,
+                 Z_DEFAULT_COMPRESSION) != Z_OK) {
+      goto error;
+   }
+
+   block = &c->blocks[c->header.numBlocks++];
+   block->offset = ftello(c->file);
+   block->size = compressedLength;
+   block->count = c->fill;
+
+   if (fwrite(w->compressed, compressedLength, 1, c->file) != 1) {
+      goto error;
+   }
+
+   c->header.count += c->fill;
+   c->fill = 0;
+   return;
+
+ error:
+   // Nothing more will be written, but keep accepting elements
+   w->error = true;
+   c->fill = 0;
+}
+
+
+/*
+ * putElements --
+ *
+ *    Internal function to append elements to a column.
+ */
+
+static void
+putElements(MemTraceColumnWriter *w, MemTraceColumnId id, const void *elements,
+            uint32_t count)
+{
+   ColumnOut *c = &w->columns[id];
+   uint32_t elemSize = c->header.elemSize;
+   const uint8_t *in = elements;
+
+   while (count) {
+      uint32_t chunk = c->header.blockElems - c->fill;
+
+      if (chunk > count) {
+         chunk = count;
+      }
+      memcpy(c->buffer + c->fill * elemSize, in, chunk * elemSize);
+      c->fill += chunk;
+      in += chunk * elemSize;
+      count -= chunk;
+
+      if (c->fill == c->header.blockElems) {
+         flushBlock(w, c);
+      }
+   }
+}
+
+
+/*
+ * MemTraceColumns_Create --
+ *
+ *    Start exporting decoded operations to a set of column files in
+ *    'dir', which is created if necessary. Existing columns are
+ *    overwritten. Returns NULL on error, with errno set.
+ */
+
+MemTraceColumnWriter *
+MemTraceColumns_Create(const char *dir)
+{
+   MemTraceColumnWriter *w = calloc(1, sizeof *w);
+   int id;
+
+   if (!w) {
+      return NULL;
+   }
+
+   if (mkdir(dir, 0777) && errno != EEXIST) {
+      free(w);
+      return NULL;
+   }
+
+   w->encoded = malloc(MTCOL_BLOCK_BYTES);
+   w->compressedMax = compressBound(MTCOL_BLOCK_BYTES);
+   w->compressed = malloc(w->compressedMax);
+   if (!w->encoded || !w->compressed) {
+      goto fail;
+   }
+
+   for (id = 0; id < MTCOL_NUM_COLUMNS; id++) {
+      ColumnOut *c = &w->columns[id];
+      char *path = columnPath(dir, id);
+
+      memcpy(c->header.magic, MTCOL_MAGIC, sizeof c->header.magic);
+      c->header.version = MTCOL_VERSION;
+      c->header.column = id;
+      c->header.elemSize = columnInfo[id].elemSize;
+      c->header.blockElems = MTCOL_BLOCK_BYTES / c->header.elemSize;
+      c->header.delta = columnInfo[id].delta;
+
+      c->file = path ? fopen(path, "wb") : NULL;
+      free(path);
+      c->buffer = malloc(MTCOL_BLOCK_BYTES);
+
+      if (!c->file || !c->buffer ||
+          fwrite(&c->header, sizeof c->header, 1, c->file) != 1) {
+         goto fail;
+      }
+   }
+
+   return w;
+
+ fail:
+   w->error = true;
+   MemTraceColumns_Close(w);
+   return NULL;
+}
+
+
+/*
+ * MemTraceColumns_Add --
+ *
+ *    Export operation 'n' from a batch. Its data is appended to the
+ *    data column, and the offset column records where.
+ */
+
+void
+MemTraceColumns_Add(MemTraceColumnWriter *w, const MemOpBatch *batch, uint32_t n)
+{
+   putElements(w, MTCOL_CLOCKS, &batch->clocks[n], 1);
+   putElements(w, MTCOL_TYPE, &batch->type[n], 1);
+   putElements(w, MTCOL_ADDR, &batch->addr[n], 1);
+   putElements(w, MTCOL_LENGTH, &batch->length[n], 1);
+   putElements(w, MTCOL_DATA_OFFSET, &w->dataLength, 1);
+   putElements(w, MTCOL_DATA, batch->data + batch->dataOffset[n], batch->length[n]);
+   w->dataLength += batch->length[n];
+}
+
+
+/*
+ * MemTraceColumns_Close --
+ *
+ *    Finish writing all columns and free the writer. Returns false if
+ *    anything went wrong since MemTraceColumns_Create.
+ */
+
+bool
+MemTraceColumns_Close(MemTraceColumnWriter *w)
+{
+   bool ok;
+   int id;
+
+   for (id = 0; id < MTCOL_NUM_COLUMNS; id++) {
+      ColumnOut *c = &w->columns[id];
+
+      if (c->file) {
+         flushBlock(w, c);
+
+         c->header.blocksOffset = ftello(c->file);
+         if (w->error ||
+             (c->header.numBlocks &&
+              fwrite(c->blocks, sizeof *c->blocks, c->header.numBlocks, c->file) !=
+              c->header.numBlocks) ||
+             fseeko(c->file, 0, SEEK_SET) ||
+             fwrite(&c->header, sizeof c->header, 1, c->file) != 1) {
+            w->error = true;
+         }
+         if (fclose(c->file)) {
+            w->error = true;
+         }
+      }
+      free(c->buffer);
+      free(c->blocks);
+   }
+
+   ok = !w->error;
+   free(w->encoded);
+   free(w->compressed);
+   free(w);
+   return ok;
+}
+
+
+/*
+ * MemTraceColumn_Open --
+ *
+ *    Map one column of an export for reading. Returns false if it's
+ *    missing or doesn't look right.
+ */
+
+bool
+MemTraceColumn_Open(MemTraceColumn *col, const char *dir, MemTraceColumnId id)
+{
+   const ColumnHeader *header;
+   const ColumnBlock *blocks;
+   char *path = columnPath(dir, id);
+   struct stat st;
+   uint64_t total = 0;
+   uint32_t i;
+   void *map;
+   int fd;
+
+   memset(col, 0, sizeof *col);
+
+   fd = path ? open(path, O_RDONLY) : -1;
+   free(path);
+   if (fd < 0) {
+      return false;
+   }
+
+   if (fstat(fd, &st) || st.st_size < (off_t)sizeof *header ||
+       (uint64_t)st.st_size > (size_t)-1) {
+      close(fd);
+      return false;
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      return false;
+   }
+
+   col->map = map;
+   col->mapSize = st.st_size;
+   header = map;
+
+   if (memcmp(header->magic, MTCOL_MAGIC, sizeof header->magic) ||
+       header->version != MTCOL_VERSION ||
+       header->column != id ||
+       header->elemSize != columnInfo[id].elemSize ||
+       header->blockElems == 0 ||
+       header->blockElems > MTCOL_BLOCK_BYTES / header->elemSize ||
+       header->blocksOffset > col->mapSize ||
+       header->numBlocks > (col->mapSize - header->blocksOffset) / sizeof *blocks) {
+      goto fail;
+   }
+
+   /*
+    * Every block but the last is full, so we can find any element's
+    * block by division.
+    */
+
+   blocks = (const ColumnBlock *)(col->map + header->blocksOffset);
+   for (i = 0; i < header->numBlocks; i++) {
+      if (blocks[i].offset > col->mapSize ||
+          blocks[i].size > col->mapSize - blocks[i].offset ||
+          blocks[i].count == 0 ||
+          blocks[i].count > header->blockElems ||
+          (i + 1 < header->numBlocks && blocks[i].count != header->blockElems)) {
+         goto fail;
+      }
+      total += blocks[i].count;
+   }
+   if (total != header->count) {
+      goto fail;
+   }
+
+   col->elemSize = header->elemSize;
+   col->count = header->count;
+   col->blockElems = header->blockElems;
+   col->numBlocks = header->numBlocks;
+   col->delta = header->delta;
+   col->blocks = blocks;
+   return true;
+
+ fail:
+   MemTraceColumn_Close(col);
+   return false;
+}
+
+
+/*
+ * MemTraceColumn_Close --
+ */
+
+void
+MemTraceColumn_Close(MemTraceColumn *col)
+{
+   if (col->map) {
+      munmap((void *)col->map, col->mapSize);
+   }
+   memset(col, 0, sizeof *col);
+}
+
+
+/*
+ * MemTraceColumn_Read --
+ *
+ *    Copy elements [first, first + count) of a column into 'out', which
+ *    must have room for count * elemSize bytes. Only the blocks in that
+ *    range are decompressed, so it's cheapest to read whole blocks at a
+ *    time. Any number of threads may read one column at once.
+ *
+ *    Returns the number of elements read, which is short if the range
+ *    goes past the end of the column or a block is damaged.
+ */
+
+uint64_t
+MemTraceColumn_Read(const MemTraceColumn *col, uint64_t first, uint64_t count,
+                    void *out)
+{
+   uint32_t blockBytes = col->blockElems * col->elemSize;
+   uint8_t *encoded, *decoded;
+   uint64_t done = 0;
+
+   if (first >= col->count) {
+      return 0;
+   }
+   if (count > col->count - first) {
+      count = col->count - first;
+   }
+
+   encoded = malloc(blockBytes);
+   decoded = malloc(blockBytes);
+
+   while (encoded && decoded && done < count) {
+      uint64_t index = first + done;
+      const ColumnBlock *block = (const ColumnBlock *)col->blocks + index / col->blockElems;
+      uint32_t within = index % col->blockElems;
+      uint64_t chunk = block->count - within;
+      uLongf length = blockBytes;
+
+      if (uncompress(encoded, &length, col->map + block->offset, block->size) != Z_OK ||
+          length != block->count * col->elemSize) {
+         break;
+      }
+      decodeElements(encoded, decoded, block->count, col->elemSize, col->delta);
+
+      if (chunk > count - done) {
+         chunk = count - done;
+      }
+      memcpy((uint8_t *)out + done * col->elemSize,
+             decoded + within * col->elemSize, chunk * col->elemSize);
+      done += chunk;
+   }
+
+   free(encoded);
+   free(decoded);
+   return done;
+}
@@ -0,0 +1,303 @@
+/*
+ * memtrace_file.c - Shared trace handles, and cursors for reading them.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "memtrace.h"
+
+/*
+ * A MemTraceFile never changes after it's opened, so any number of
+ * cursors on any number of threads can read it without locking. Each
+ * cursor is an ordinary MemTraceState which borrows the file's data;
+ * cursors only share memory pages, through MemTrace_Clone's reference
+ * counts.
+ */
+
+
+/*
+ * readWhole --
+ *
+ *    Internal function to read an entire stream we couldn't map
+ *    (a pipe, for example) into memory.
+ */
+
+static bool
+readWhole(MemTraceFile *file, FILE *f)
+{
+   size_t capacity = 1024 * 1024;
+   size_t size = 0;
+   uint8_t *data = malloc(capacity);
+
+   while (data) {
+      size_t result = fread(data + size, 1, capacity - size, f);
+      uint8_t *bigger;
+
+      size += result;
+      if (size < capacity) {
+         if (ferror(f)) {
+            break;
+         }
+         file->data = data;
+         file->size = size;
+         return true;
+      }
+
+      capacity *= 2;
+      bigger = realloc(data, capacity);
+      if (!bigger) {
+         break;
+      }
+      data = bigger;
+   }
+
+   free(data);
+   return false;
+}
+
+
+/*
+ * releaseData --
+ *
+ *    Internal function to free or unmap the file's data.
+ */
+
+static void
+releaseData(MemTraceFile *file)
+{
+   if (file->mapped) {
+      munmap((void *)file->data, file->size);
+   } else {
+      free((void *)file->data);
+   }
+   file->data = NULL;
+   file->size = 0;
+   file->mapped = false;
+}
+
+
+/*
+ * decompress --
+ *
+ *    Internal function to replace the contents of a compressed archive
+ *    with the raw trace it holds. Cursors need the whole trace in
+ *    memory, so we decompress it all up front.
+ */
+
+static bool
+decompress(MemTraceFile *file)
+{
+   FILE *f = fmemopen((void *)(file->data + MEMTRACE_ARCHIVE_MAGIC_SIZE),
+                      file->size - MEMTRACE_ARCHIVE_MAGIC_SIZE, "rb");
+   MemTraceArchive *ar = f ? MemTraceArchive_Open(f) : NULL;
+   uint64_t size = ar ? MemTraceArchive_RawSize(ar) : 0;
+   uint8_t *data = NULL;
+   bool ok = false;
+
+   if (ar && size <= (size_t)-1) {
+      data = malloc(size ? size : 1);
+      ok = data && MemTraceArchive_Read(ar, data, size) == size;
+   }
+
+   if (ar) {
+      MemTraceArchive_Close(ar);
+   }
+   if (f) {
+      fclose(f);
+   }
+
+   releaseData(file);
+   if (!ok) {
+      free(data);
+      return false;
+   }
+   file->data = data;
+   file->size = size;
+   return true;
+}
+
+
+/*
+ * MemTraceFile_Open --
+ *
+ *    Open a trace to be shared by cursors. Regular files are memory-
+ *    mapped; anything else is read into memory up front, as are
+ *    compressed archives after decompressing them. If there's a
+ *    matching index at <filename>.mtidx, it's opened too, and cursors
+ *    will use it to seek. Returns false on error.
+ */
+
+bool
+MemTraceFile_Open(MemTraceFile *file, const char *filename)
+{
+   char indexFile[strlen(filename) + sizeof ".mtidx"];
+   struct stat st;
+   FILE *f;
+
+   memset(file, 0, sizeof *file);
+
+   f = fopen(filename, "rb");
+   if (!f) {
+      return false;
+   }
+
+   if (!fstat(fileno(f), &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+       (uint64_t)st.st_size <= (size_t)-1) {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+
+      if (map != MAP_FAILED) {
+         file->data = map;
+         file->size = st.st_size;
+         file->mapped = true;
+      }
+   }
+
+   if (!file->mapped && !readWhole(file, f)) {
+      fclose(f);
+      return false;
+   }
+   fclose(f);
+
+   if (MemTraceArchive_IsArchive(file->data, file->size) && !decompress(file)) {
+      return false;
+   }
+
+   sprintf(indexFile, "%s.mtidx", filename);
+   if (MemTraceIndex_Open(&file->index, indexFile)) {
+      if (file->index.traceSize == file->size) {
+         file->hasIndex = true;
+      } else {
+         MemTraceIndex_Close(&file->index);
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ * MemTraceFile_Close --
+ *
+ *    Close a shared trace. All of its cursors must be closed first.
+ */
+
+void
+MemTraceFile_Close(MemTraceFile *file)
+{
+   if (file->hasIndex) {
+      MemTraceIndex_Close(&file->index);
+   }
+   releaseData(file);
+   memset(file, 0, sizeof *file);
+}
+
+
+/*
+ * MemTraceCursor_Open --
+ *
+ *    Start a new cursor at the beginning of a shared trace, with empty
+ *    memory. Decode with MemTrace_Next or MemTrace_NextBatch on
+ *    &cursor->state, as with any other trace.
+ */
+
+void
+MemTraceCursor_Open(MemTraceCursor *cursor, const MemTraceFile *file)
+{
+   memset(cursor, 0, sizeof *cursor);
+
+   cursor->file = file;
+   cursor->state.map = file->data;
+   cursor->state.mapSize = file->size;
+   cursor->state.mapBorrowed = true;
+}
+
+
+/*
+ * MemTraceCursor_Clone --
+ *
+ *    Start a new cursor at the same position as 'src', sharing its
+ *    memory pages until one of the two writes to them.
+ */
+
+void
+MemTraceCursor_Clone(MemTraceCursor *dest, const MemTraceCursor *src)
+{
+   MemTrace_Clone(&dest->state, &src->state);
+   dest->file = src->file;
+}
+
+
+/*
+ * MemTraceCursor_Close --
+ */
+
+void
+MemTraceCursor_Close(MemTraceCursor *cursor)
+{
+   MemTrace_Close(&cursor->state);
+   cursor->file = NULL;
+}
+
+
+/*
+ * MemTraceCursor_SeekToTime --
+ *
+ *    Move a cursor to the given time, with the memory image as it was
+ *    then. This is MemTrace_SeekToTime, using the file's index if it
+ *    has one. Without an index, we decode forward from the cursor's
+ *    current position, or from the beginning if that's already too late.
+ */
+
+MemTraceResult
+MemTraceCursor_SeekToTime(MemTraceCursor *cursor, uint64_t clocks)
+{
+   MemTraceState *state = &cursor->state;
+   MemTraceResult result;
+
+   if (cursor->file->hasIndex) {
+      return MemTrace_SeekToTime(state, &cursor->file->index, clocks);
+   }
+
+   if (state->timestamp.clocks > clocks) {
+      MemTrace_ClearMemory(state);
+      MemTrace_Seek(state, 0);
+      state->timestamp.clocks = 0;
+      state->timestamp.seconds = 0;
+      state->nextAddr = 0;
+   }
+
+   do {
+      result = MemTrace_Next(state, NULL);
+      if (result == MEMTR_SUCCESS && state->timestamp.clocks > clocks) {
+         return MEMTR_SUCCESS;
+      }
+   } while (result != MEMTR_EOF);
+
+   return MEMTR_EOF;
+}
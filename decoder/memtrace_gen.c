@@ -0,0 +1,430 @@
+/*
+ * memtrace_gen.c - Synthetic memory traces, for tests and benchmarks.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <math.h>
+#include "iohook_defs.h"
+#include "memtrace.h"
+
+#define GEN_MAX_BURST     64        // Words
+#define GEN_SEQ_REGION    (MEM_SIZE_BYTES / 4)
+#define GEN_IOH_WORD      ((IOH_ADDR & MEM_MASK) >> 1)
+#define GEN_IOH_POLLS     4         // Reads of the hook buffer after each write
+
+
+/*
+ * nextRandom --
+ *
+ *    Internal xorshift64* generator. Fast, and the same everywhere for a
+ *    given seed, which is all we need.
+ */
+
+static inline uint64_t
+nextRandom(MemTraceGen *gen)
+{
+   uint64_t x = gen->rng;
+
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   gen->rng = x;
+   return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+/*
+ * randomBelow --
+ */
+
+static inline uint32_t
+randomBelow(MemTraceGen *gen, uint32_t limit)
+{
+   return ((nextRandom(gen) >> 32) * limit) >> 32;
+}
+
+
+/*
+ * rateThreshold --
+ *
+ *    Internal function to turn a probability into a threshold for
+ *    nextRandom().
+ */
+
+static uint64_t
+rateThreshold(double rate)
+{
+   if (!(rate > 0)) {
+      return 0;
+   }
+   if (rate >= 1) {
+      return UINT64_MAX;
+   }
+   return (uint64_t)(rate * 18446744073709551616.0);
+}
+
+
+/*
+ * MemTraceGen_Init --
+ *
+ *    Start generating a trace. The same options always produce the
+ *    same bytes.
+ */
+
+void
+MemTraceGen_Init(MemTraceGen *gen, const MemTraceGenOptions *opts)
+{
+   uint64_t seed = opts->seed;
+
+   memset(gen, 0, sizeof *gen);
+   gen->opts = *opts;
+
+   if (gen->opts.maxBurst < 1) {
+      gen->opts.maxBurst = 1;
+   }
+   if (gen->opts.maxBurst > GEN_MAX_BURST) {
+      gen->opts.maxBurst = GEN_MAX_BURST;
+   }
+
+   // splitmix64, so similar seeds give unrelated streams (and never zero)
+   seed += 0x9E3779B97F4A7C15ULL;
+   seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+   gen->rng = (seed ^ (seed >> 31)) | 1;
+
+   gen->writeLimit = rateThreshold(opts->writeFraction);
+   gen->dropLimit = rateThreshold(opts->dropRate);
+   gen->corruptLimit = gen->dropLimit + rateThreshold(opts->corruptRate);
+   gen->overflowLimit = gen->corruptLimit + rateThreshold(opts->overflowRate);
+   if (gen->corruptLimit < gen->dropLimit || gen->overflowLimit < gen->corruptLimit) {
+      gen->overflowLimit = UINT64_MAX;
+   }
+
+   gen->pollWord = randomBelow(gen, MEM_SIZE_BYTES / 2);
+}
+
+
+/*
+ * addPacket --
+ *
+ *    Internal function to queue one packet for output, injecting faults
+ *    along the way.
+ */
+
+static void
+addPacket(MemTraceGen *gen, MemPacketType type, uint32_t payload)
+{
+   MemPacket p = MemPacket_Create(type, payload);
+   uint8_t *out = gen->pending + gen->pendingLength;
+
+   gen->packets++;
+   gen->clocks += MemPacket_GetDuration(p);
+
+   if (gen->overflowLimit) {
+      uint64_t r = nextRandom(gen);
+
+      if (r < gen->dropLimit) {
+         // Lose the first 1 to 3 bytes, throwing off alignment
+         uint32_t dropped = 1 + (r >> 8) % 3;
+
+         MemPacket_ToBytes(p, out);
+         memmove(out, out + dropped, sizeof p - dropped);
+         gen->pendingLength += sizeof p - dropped;
+         gen->drops++;
+         return;
+      }
+      if (r < gen->corruptLimit) {
+         p ^= 1 << ((r >> 8) % 3);
+         gen->corruptions++;
+      } else if (r < gen->overflowLimit) {
+         MemPacket_ToBytes(0xFFFFFFFF, out);
+         out += sizeof p;
+         gen->pendingLength += sizeof p;
+         gen->overflows++;
+      }
+   }
+
+   MemPacket_ToBytes(p, out);
+   gen->pendingLength += sizeof p;
+}
+
+
+/*
+ * addIdle --
+ *
+ *    Internal function to add an idle gap. Long gaps get a timestamp
+ *    packet, which holds up to 2^23 clocks; longer ones are cut short.
+ *    Short ones ride along in the next data packet's extra clocks,
+ *    which hold up to 31.
+ */
+
+static uint32_t
+addIdle(MemTraceGen *gen, uint64_t clocks)
+{
+   if (clocks < 32) {
+      return clocks;
+   }
+   if (clocks > 0x800000) {
+      clocks = 0x800000;
+   }
+   addPacket(gen, MEMPKT_TIMESTAMP, clocks - 1);
+   return 0;
+}
+
+
+/*
+ * randomIdle --
+ *
+ *    Internal function for an exponentially distributed gap, averaging
+ *    opts.idleClocks.
+ */
+
+static uint64_t
+randomIdle(MemTraceGen *gen)
+{
+   double u = ((nextRandom(gen) >> 11) + 1) * (1.0 / 9007199254740992.0);
+
+   if (!gen->opts.idleClocks) {
+      return 0;
+   }
+   return (uint64_t)(-log(u) * gen->opts.idleClocks);
+}
+
+
+/*
+ * addBurst --
+ *
+ *    Internal function to add one burst of 'length' words at word
+ *    address 'word', after 'extra' idle clocks. 'words' may be NULL for
+ *    random data.
+ */
+
+static void
+addBurst(MemTraceGen *gen, MemPacketType type, uint32_t word, uint32_t length,
+         uint32_t extra, const uint16_t *words)
+{
+   uint32_t i;
+
+   addPacket(gen, MEMPKT_ADDR, word);
+
+   for (i = 0; i < length; i++) {
+      uint32_t data = words ? words[i] : (nextRandom(gen) >> 48);
+
+      addPacket(gen, type, data | (3 << 16) | (extra << 18));
+      extra = 0;
+   }
+
+   gen->bursts++;
+}
+
+
+/*
+ * addRandom --
+ *
+ *    Random access: anywhere, any length, reads or writes. Some are
+ *    single bytes.
+ */
+
+static void
+addRandom(MemTraceGen *gen)
+{
+   uint32_t extra = addIdle(gen, randomIdle(gen));
+   MemPacketType type = nextRandom(gen) < gen->writeLimit ? MEMPKT_WRITE : MEMPKT_READ;
+   uint64_t r = nextRandom(gen);
+
+   if ((r & 7) == 0) {
+      // One byte, in either lane
+      uint32_t lanes = (r & 8) ? 1 : 2;
+
+      addPacket(gen, MEMPKT_ADDR, randomBelow(gen, MEM_SIZE_BYTES / 2));
+      addPacket(gen, type, (r >> 48) | (lanes << 16) | (extra << 18));
+      gen->bursts++;
+   } else {
+      uint32_t length = 1 + randomBelow(gen, gen->opts.maxBurst);
+
+      addBurst(gen, type, randomBelow(gen, MEM_SIZE_BYTES / 2 - length),
+               length, extra, NULL);
+   }
+}
+
+
+/*
+ * addSequential --
+ *
+ *    Sequential bursts, like a block copy: read a full-length burst,
+ *    then write it to another region, and move along.
+ */
+
+static void
+addSequential(MemTraceGen *gen)
+{
+   uint32_t length = gen->opts.maxBurst;
+   uint32_t word = gen->seqWord;
+   uint32_t extra = addIdle(gen, randomIdle(gen));
+
+   if (gen->seqWrite) {
+      addBurst(gen, MEMPKT_WRITE, word + MEM_SIZE_BYTES / 4, length, extra, NULL);
+      gen->seqWord = (word + length) % (GEN_SEQ_REGION / 2 - GEN_MAX_BURST);
+   } else {
+      addBurst(gen, MEMPKT_READ, word, length, extra, NULL);
+   }
+   gen->seqWrite = !gen->seqWrite;
+}
+
+
+/*
+ * addPolling --
+ *
+ *    A polling loop: the same word read at a steady rate, and now and
+ *    then written by whatever it's waiting on.
+ */
+
+static void
+addPolling(MemTraceGen *gen)
+{
+   uint32_t extra = addIdle(gen, gen->opts.idleClocks);
+   bool write = ++gen->polls % 64 == 0;
+
+   addBurst(gen, write ? MEMPKT_WRITE : MEMPKT_READ, gen->pollWord, 1, extra, NULL);
+}
+
+
+/*
+ * addIOHook --
+ *
+ *    I/O Hook traffic: a log message written to the hook buffer at
+ *    IOH_ADDR, with a footer the host will accept, then a few reads of
+ *    the buffer while the patch polls for a response.
+ */
+
+static void
+addIOHook(MemTraceGen *gen)
+{
+   static const char text[] = "Synthetic I/O Hook log message, number ";
+   uint32_t data[IOH_PACKET_LEN / 4];
+   uint16_t words[IOH_PACKET_LEN / 2];
+   uint8_t *bytes = (uint8_t *)data;
+   uint32_t service = gen->iohPackets ? IOH_SVC_LOG_STR : IOH_SVC_INIT;
+   uint32_t length = IOH_DATA_LEN;
+   uint32_t sum = 0;
+   uint32_t i, extra;
+
+   for (i = 0; i < IOH_DATA_LEN; i++) {
+      bytes[i] = text[(gen->iohPackets + i) % (sizeof text - 1)];
+   }
+   for (i = 0; i < IOH_DATA_LEN / 4; i++) {
+      sum += data[i];
+   }
+   sum = (sum + (sum << 8) + (sum << 16) + (sum << 24)) >> 24;
+
+   data[IOH_DATA_LEN / 4] = (service << IOH_SVC_SHIFT) |
+                            ((gen->iohPackets & 0xFF) << IOH_SEQ_SHIFT) |
+                            (length << IOH_LEN_SHIFT) |
+                            (sum << IOH_CHECK_SHIFT);
+
+   // The bus is little-endian, 16 bits wide
+   for (i = 0; i < IOH_PACKET_LEN / 2; i++) {
+      words[i] = data[i / 2] >> (16 * (i & 1));
+   }
+
+   extra = addIdle(gen, randomIdle(gen));
+   addBurst(gen, MEMPKT_WRITE, GEN_IOH_WORD, IOH_PACKET_LEN / 2, extra, words);
+   gen->iohPackets++;
+
+   for (i = 0; i < GEN_IOH_POLLS; i++) {
+      extra = addIdle(gen, randomIdle(gen));
+      addBurst(gen, MEMPKT_READ, GEN_IOH_WORD, IOH_PACKET_LEN / 2, extra, NULL);
+   }
+}
+
+
+/*
+ * addWorkload --
+ *
+ *    Internal function to queue the next piece of the workload.
+ */
+
+static void
+addWorkload(MemTraceGen *gen)
+{
+   MemTraceGenWorkload workload = gen->opts.workload;
+
+   if (workload == MTGEN_MIXED) {
+      uint32_t r = randomBelow(gen, 100);
+
+      workload = r < 50 ? MTGEN_RANDOM :
+                 r < 75 ? MTGEN_SEQUENTIAL :
+                 r < 98 ? MTGEN_POLLING : MTGEN_IOHOOK;
+   }
+
+   switch (workload) {
+
+   case MTGEN_SEQUENTIAL:
+      addSequential(gen);
+      break;
+
+   case MTGEN_POLLING:
+      addPolling(gen);
+      break;
+
+   case MTGEN_IOHOOK:
+      addIOHook(gen);
+      break;
+
+   default:
+      addRandom(gen);
+      break;
+   }
+}
+
+
+/*
+ * MemTraceGen_Fill --
+ *
+ *    Write the next 'length' bytes of the trace to 'buffer'. The trace
+ *    never ends; stop whenever you have enough.
+ */
+
+void
+MemTraceGen_Fill(MemTraceGen *gen, uint8_t *buffer, size_t length)
+{
+   while (length) {
+      uint32_t chunk;
+
+      if (gen->pendingHead == gen->pendingLength) {
+         gen->pendingHead = 0;
+         gen->pendingLength = 0;
+         addWorkload(gen);
+      }
+
+      chunk = gen->pendingLength - gen->pendingHead;
+      if (chunk > length) {
+         chunk = length;
+      }
+      memcpy(buffer, gen->pending + gen->pendingHead, chunk);
+      gen->pendingHead += chunk;
+      buffer += chunk;
+      length -= chunk;
+      gen->bytes += chunk;
+   }
+}
@@ -0,0 +1,409 @@
+/*
+ * memtrace_heat.c - Per-page access counts over time, and renderings
+ *                   of them as images.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <zlib.h>
+#include "memtrace.h"
+
+/*
+ * Heatmap file layout, all gzip-compressed. Integers are in host
+ * byte order.
+ *
+ *   HeatHeader
+ *   For each time bucket with any accesses, in order:
+ *      uint32_t bucket
+ *      uint32_t reads[numPages]
+ *      uint32_t writes[numPages]
+ *
+ * Bucket 'b' covers clocks [b * bucketClocks, (b + 1) * bucketClocks).
+ * Buckets that aren't stored had no accesses at all.
+ */
+
+#define HEAT_MAGIC    "MTHEAT\n\032"
+#define HEAT_VERSION  1
+
+typedef struct {
+   char     magic[8];
+   uint32_t version;
+   uint32_t numPages;
+   uint32_t pageSize;
+   uint32_t numRows;        // Buckets stored
+   uint64_t bucketClocks;
+   uint32_t numBuckets;     // Including empty ones
+   uint32_t reserved;
+} HeatHeader;
+
+#define ROW_COUNTERS  (2 * MEM_NUM_PAGES)
+
+
+/*
+ * MemTraceHeatmap_Init --
+ *
+ *    Start an empty heatmap, with time buckets 'bucketClocks' long.
+ */
+
+void
+MemTraceHeatmap_Init(MemTraceHeatmap *heat, uint64_t bucketClocks)
+{
+   memset(heat, 0, sizeof *heat);
+   heat->bucketClocks = bucketClocks ? bucketClocks : 1;
+}
+
+
+/*
+ * MemTraceHeatmap_Free --
+ */
+
+void
+MemTraceHeatmap_Free(MemTraceHeatmap *heat)
+{
+   uint32_t b;
+
+   for (b = 0; b < heat->numBuckets; b++) {
+      free(heat->rows[b]);
+   }
+   free(heat->rows);
+   memset(heat, 0, sizeof *heat);
+}
+
+
+/*
+ * getRow --
+ *
+ *    Internal function to find the counters for a bucket, allocating
+ *    them if it's new. Returns NULL with errno set to ENOMEM if we're
+ *    out of memory, or ERANGE if there would be too many buckets.
+ */
+
+static uint32_t *
+getRow(MemTraceHeatmap *heat, uint64_t bucket)
+{
+   if (bucket >= heat->numBuckets) {
+      uint64_t alloc = heat->rowsAlloc ? heat->rowsAlloc : 64;
+      uint32_t **rows;
+
+      if (bucket >= UINT32_MAX / 2) {
+         errno = ERANGE;
+         return NULL;
+      }
+      while (alloc <= bucket) {
+         alloc *= 2;
+      }
+      if (alloc != heat->rowsAlloc) {
+         rows = realloc(heat->rows, alloc * sizeof *rows);
+         if (!rows) {
+            errno = ENOMEM;
+            return NULL;
+         }
+         heat->rows = rows;
+         heat->rowsAlloc = alloc;
+      }
+
+      memset(heat->rows + heat->numBuckets, 0,
+             (bucket + 1 - heat->numBuckets) * sizeof *heat->rows);
+      heat->numBuckets = bucket + 1;
+   }
+
+   if (!heat->rows[bucket]) {
+      heat->rows[bucket] = calloc(ROW_COUNTERS, sizeof(uint32_t));
+      if (!heat->rows[bucket]) {
+         errno = ENOMEM;
+      }
+   }
+   return heat->rows[bucket];
+}
+
+
+/*
+ * MemTraceHeatmap_Add --
+ *
+ *    Count every operation in a batch, once for each page it touches.
+ *    Operations usually arrive in time order, so we keep the current
+ *    bucket's row handy. It's 32 kB, small enough to stay in cache.
+ *    Returns false with errno set to ENOMEM if we're out of memory, or
+ *    ERANGE if the trace needs more buckets than we can count.
+ */
+
+bool
+MemTraceHeatmap_Add(MemTraceHeatmap *heat, const MemOpBatch *batch)
+{
+   uint64_t bucketStart = 1, bucketEnd = 0;
+   uint32_t *row = NULL;
+   uint32_t n;
+
+   for (n = 0; n < batch->count; n++) {
+      uint32_t first = batch->addr[n] & MEM_MASK;
+      uint32_t page = first >> MEM_PAGE_SHIFT;
+      uint32_t lastPage = ((first + batch->length[n] - 1) & MEM_MASK) >> MEM_PAGE_SHIFT;
+      uint32_t *counters;
+
+      if (!batch->length[n]) {
+         continue;
+      }
+
+      if (batch->clocks[n] < bucketStart || batch->clocks[n] >= bucketEnd) {
+         uint64_t bucket = batch->clocks[n] / heat->bucketClocks;
+
+         row = getRow(heat, bucket);
+         if (!row) {
+            return false;
+         }
+         bucketStart = bucket * heat->bucketClocks;
+         bucketEnd = bucketStart + heat->bucketClocks;
+      }
+
+      counters = batch->type[n] == MEMOP_WRITE ? row + MEM_NUM_PAGES : row;
+      counters[page]++;
+      while (page != lastPage) {
+         page = (page + 1) % MEM_NUM_PAGES;
+         counters[page]++;
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ * MemTraceHeatmap_Write --
+ *
+ *    Save the counts as a gzip-compressed matrix (see above). Returns
+ *    false on I/O errors.
+ */
+
+bool
+MemTraceHeatmap_Write(const MemTraceHeatmap *heat, const char *filename)
+{
+   HeatHeader header;
+   gzFile f;
+   uint32_t b;
+   bool ok = true;
+
+   memset(&header, 0, sizeof header);
+   memcpy(header.magic, HEAT_MAGIC, sizeof header.magic);
+   header.version = HEAT_VERSION;
+   header.numPages = MEM_NUM_PAGES;
+   header.pageSize = MEM_PAGE_SIZE;
+   header.bucketClocks = heat->bucketClocks;
+   header.numBuckets = heat->numBuckets;
+   for (b = 0; b < heat->numBuckets; b++) {
+      header.numRows += heat->rows[b] != NULL;
+   }
+
+   // Mostly zeroes, so fast compression does nearly as well as the best.
+   f = gzopen(filename, "wb1");
+   if (!f) {
+      return false;
+   }
+
+   if (gzwrite(f, &header, sizeof header) != sizeof header) {
+      ok = false;
+   }
+
+   for (b = 0; ok && b < heat->numBuckets; b++) {
+      if (heat->rows[b] &&
+          (gzwrite(f, &b, sizeof b) != sizeof b ||
+           gzwrite(f, heat->rows[b], ROW_COUNTERS * sizeof(uint32_t)) !=
+           ROW_COUNTERS * sizeof(uint32_t))) {
+         ok = false;
+      }
+   }
+
+   if (gzclose(f) != Z_OK) {
+      ok = false;
+   }
+   return ok;
+}
+
+
+/*
+ * renderRow --
+ *
+ *    Internal function to draw one bucket as a row of gray pixels, one
+ *    per page. Brightness is the log of reads plus writes, scaled so
+ *    the busiest page in the whole map is white.
+ */
+
+static void
+renderRow(const MemTraceHeatmap *heat, uint32_t bucket, double scale, uint8_t *pixels)
+{
+   const uint32_t *row = bucket < heat->numBuckets ? heat->rows[bucket] : NULL;
+   uint32_t page;
+
+   if (!row) {
+      memset(pixels, 0, MEM_NUM_PAGES);
+      return;
+   }
+
+   for (page = 0; page < MEM_NUM_PAGES; page++) {
+      uint64_t count = (uint64_t)row[page] + row[MEM_NUM_PAGES + page];
+      pixels[page] = count ? (uint8_t)(log1p(count) * scale + 0.5) : 0;
+   }
+}
+
+
+/*
+ * writePngChunk --
+ */
+
+static bool
+writePngChunk(FILE *f, const char *type, const uint8_t *data, uint32_t length)
+{
+   uint8_t bytes[4] = { length >> 24, length >> 16, length >> 8, length };
+   uint32_t crc = crc32(0, (const Bytef *)type, 4);
+   uint8_t crcBytes[4];
+
+   if (length) {
+      // A NULL buffer would reset the CRC
+      crc = crc32(crc, data, length);
+   }
+   crcBytes[0] = crc >> 24;
+   crcBytes[1] = crc >> 16;
+   crcBytes[2] = crc >> 8;
+   crcBytes[3] = crc;
+
+   return fwrite(bytes, 4, 1, f) == 1 &&
+          fwrite(type, 4, 1, f) == 1 &&
+          (!length || fwrite(data, length, 1, f) == 1) &&
+          fwrite(crcBytes, 4, 1, f) == 1;
+}
+
+
+/*
+ * writePng --
+ *
+ *    Internal function to write the rendering as an 8-bit grayscale PNG.
+ *    Rows are deflated as we go, so the image never exists in memory.
+ */
+
+static bool
+writePng(const MemTraceHeatmap *heat, uint32_t height, double scale, FILE *f)
+{
+   static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+   uint32_t width = MEM_NUM_PAGES;
+   uint8_t ihdr[13] = {
+      width >> 24, width >> 16, width >> 8, width,
+      height >> 24, height >> 16, height >> 8, height,
+      8, 0, 0, 0, 0,   // 8-bit grayscale, no interlace
+   };
+   uint8_t row[1 + MEM_NUM_PAGES];
+   uint8_t out[64 * 1024];
+   z_stream z;
+   uint32_t b;
+   bool ok;
+
+   memset(&z, 0, sizeof z);
+   if (deflateInit(&z, Z_DEFAULT_COMPRESSION) != Z_OK) {
+      return false;
+   }
+
+   ok = fwrite(signature, sizeof signature, 1, f) == 1 &&
+        writePngChunk(f, "IHDR", ihdr, sizeof ihdr);
+
+   z.next_out = out;
+   z.avail_out = sizeof out;
+
+   for (b = 0; ok && b <= height; b++) {
+      int flush = b == height ? Z_FINISH : Z_NO_FLUSH;
+      int result;
+
+      if (b < height) {
+         row[0] = 0;   // No filter
+         renderRow(heat, b, scale, row + 1);
+         z.next_in = row;
+         z.avail_in = sizeof row;
+      }
+
+      do {
+         result = deflate(&z, flush);
+         if (z.avail_out == 0 || (result == Z_STREAM_END && z.avail_out < sizeof out)) {
+            ok = ok && writePngChunk(f, "IDAT", out, sizeof out - z.avail_out);
+            z.next_out = out;
+            z.avail_out = sizeof out;
+         }
+      } while (ok && (z.avail_in || (flush == Z_FINISH && result != Z_STREAM_END)));
+   }
+
+   deflateEnd(&z);
+   return ok && writePngChunk(f, "IEND", NULL, 0);
+}
+
+
+/*
+ * MemTraceHeatmap_Render --
+ *
+ *    Draw the heatmap as an image: one column per page, one row per
+ *    time bucket, brighter for more accesses. Files ending in ".png"
+ *    are written as PNG, anything else as binary PGM. Neither allows an
+ *    empty image, so a map with no buckets is drawn as one black row.
+ *    Returns false on I/O errors.
+ */
+
+bool
+MemTraceHeatmap_Render(const MemTraceHeatmap *heat, const char *filename)
+{
+   size_t nameLength = strlen(filename);
+   uint32_t height = heat->numBuckets ? heat->numBuckets : 1;
+   uint64_t max = 0;
+   double scale;
+   uint32_t b, page;
+   bool ok = true;
+   FILE *f;
+
+   for (b = 0; b < heat->numBuckets; b++) {
+      const uint32_t *row = heat->rows[b];
+
+      for (page = 0; row && page < MEM_NUM_PAGES; page++) {
+         uint64_t count = (uint64_t)row[page] + row[MEM_NUM_PAGES + page];
+         max = count > max ? count : max;
+      }
+   }
+   scale = max ? 255.0 / log1p(max) : 0;
+
+   f = fopen(filename, "wb");
+   if (!f) {
+      return false;
+   }
+
+   if (nameLength >= 4 && !strcmp(filename + nameLength - 4, ".png")) {
+      ok = writePng(heat, height, scale, f);
+   } else {
+      uint8_t pixels[MEM_NUM_PAGES];
+
+      ok = fprintf(f, "P5\n%u %u\n255\n", MEM_NUM_PAGES, height) > 0;
+      for (b = 0; ok && b < height; b++) {
+         renderRow(heat, b, scale, pixels);
+         ok = fwrite(pixels, sizeof pixels, 1, f) == 1;
+      }
+   }
+
+   if (fclose(f)) {
+      ok = false;
+   }
+   return ok;
+}
@@ -0,0 +1,817 @@
+/*
+ * memtrace_index.c - Time index and memory checkpoints for trace logs,
+ *                    for seeking to a timestamp without a full replay.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "memtrace.h"
+
+/*
+ * Index file layout. All integers are in host byte order.
+ *
+ *   MemTraceIndexHeader
+ *   For each checkpoint:
+ *      Compressed pages
+ *      MemTraceIndexPage[numPages]
+ *   MemTraceIndexEntry[numEntries]
+ *   MemTraceIndexCheckpoint[numCheckpoints]
+ *   MemTraceIndexSummary[numSummaries]
+ *
+ * Pages are compressed as a series of runs, each a 16-bit count of
+ * zero bytes, a 16-bit count of literal bytes, then the literals.
+ * That's crude, but RAM pages are mostly zeroes and it's very fast.
+ */
+
+#define MTIDX_MAGIC    "MTIDX\r\n\032"
+#define MTIDX_VERSION  3     // 3: Address summaries
+
+typedef struct {
+   char     magic[8];
+   uint32_t version;
+   uint32_t pageSize;
+   uint64_t traceSize;
+   uint32_t numEntries;
+   uint32_t numCheckpoints;
+   uint64_t entriesOffset;
+   uint64_t checkpointsOffset;
+   uint64_t summariesOffset;
+   uint32_t numSummaries;
+   uint32_t reserved;
+} MemTraceIndexHeader;
+
+// Worst case for compressPage: a run header for every 5 bytes
+#define MAX_COMPRESSED_PAGE  (MEM_PAGE_SIZE + MEM_PAGE_SIZE / 5 * 4 + 8)
+
+// Zero runs shorter than this are cheaper to store as literals
+#define MIN_ZERO_RUN  5
+
+
+/*
+ * compressPage --
+ *
+ *    Compress one page of memory into 'out', which must have room for
+ *    MAX_COMPRESSED_PAGE bytes. Returns the compressed size.
+ */
+
+static uint32_t
+compressPage(const uint8_t *page, uint8_t *out)
+{
+   uint32_t i = 0;
+   uint8_t *o = out;
+
+   while (i < MEM_PAGE_SIZE) {
+      uint16_t zeros = 0;
+      uint16_t literals = 0;
+
+      while (i + zeros < MEM_PAGE_SIZE && !page[i + zeros]) {
+         zeros++;
+      }
+      i += zeros;
+
+      /*
+       * Take literals until we find a zero run worth breaking for.
+       */
+
+      while (i + literals < MEM_PAGE_SIZE) {
+         uint32_t run = 0;
+
+         while (run < MIN_ZERO_RUN && i + literals + run < MEM_PAGE_SIZE &&
+                !page[i + literals + run]) {
+            run++;
+         }
+         if (run == MIN_ZERO_RUN || i + literals + run == MEM_PAGE_SIZE) {
+            break;
+         }
+         literals += run + 1;
+      }
+
+      memcpy(o, &zeros, sizeof zeros);
+      memcpy(o + 2, &literals, sizeof literals);
+      memcpy(o + 4, page + i, literals);
+      o += 4 + literals;
+      i += literals;
+   }
+
+   return o - out;
+}
+
+
+/*
+ * decompressPage --
+ *
+ *    Inverse of compressPage. Returns false if the data is corrupt.
+ */
+
+static bool
+decompressPage(const uint8_t *in, uint32_t size, uint8_t *page)
+{
+   const uint8_t *end = in + size;
+   uint32_t i = 0;
+
+   while (i < MEM_PAGE_SIZE) {
+      uint16_t zeros, literals;
+
+      if (end - in < 4) {
+         return false;
+      }
+      memcpy(&zeros, in, sizeof zeros);
+      memcpy(&literals, in + 2, sizeof literals);
+      in += 4;
+
+      if (i + zeros + literals > MEM_PAGE_SIZE || end - in < literals) {
+         return false;
+      }
+
+      memset(page + i, 0, zeros);
+      i += zeros;
+      memcpy(page + i, in, literals);
+      i += literals;
+      in += literals;
+   }
+
+   return true;
+}
+
+
+/*
+ * writeCheckpoint --
+ *
+ *    Write every dirty page in 'state' to the index, followed by the
+ *    table describing them, and clear the dirty bits. Fills in 'cp'.
+ */
+
+static bool
+writeCheckpoint(MemTraceState *state, FILE *f, MemTraceIndexCheckpoint *cp)
+{
+   static MemTraceIndexPage pages[MEM_NUM_PAGES];
+   static uint8_t buffer[MAX_COMPRESSED_PAGE];
+   uint32_t page;
+
+   cp->numPages = 0;
+
+   for (page = 0; page < MEM_NUM_PAGES; page++) {
+      if (state->dirtyPages[page >> 5] & (1 << (page & 31))) {
+         MemTraceIndexPage *p = &pages[cp->numPages++];
+
+         p->page = page;
+         p->offset = ftello(f);
+         p->size = compressPage(MemTrace_PeekPage(state, page), buffer);
+
+         if (fwrite(buffer, p->size, 1, f) != 1) {
+            return false;
+         }
+      }
+   }
+
+   cp->pagesOffset = ftello(f);
+   memset(state->dirtyPages, 0, sizeof state->dirtyPages);
+
+   return cp->numPages == 0 ||
+          fwrite(pages, sizeof pages[0], cp->numPages, f) == cp->numPages;
+}
+
+
+/*
+ * summarizeOp --
+ *
+ *    Internal function to add an operation's bytes to a summary.
+ */
+
+static void
+summarizeOp(MemTraceIndexSummary *s, const MemOp *op)
+{
+   uint32_t first = op->addr & MEM_MASK;
+   uint32_t last = (op->addr + op->length - 1) & MEM_MASK;
+   uint32_t page = first >> MEM_PAGE_SHIFT;
+
+   if (!op->length) {
+      return;
+   }
+
+   if (last < first) {
+      // Wrapped around the end of memory
+      s->minAddr = 0;
+      s->maxAddr = MEM_MASK;
+   } else {
+      s->minAddr = first < s->minAddr ? first : s->minAddr;
+      s->maxAddr = last > s->maxAddr ? last : s->maxAddr;
+   }
+
+   for (;;) {
+      s->pages[page >> 5] |= 1 << (page & 31);
+      if (page == last >> MEM_PAGE_SHIFT) {
+         break;
+      }
+      page = (page + 1) % MEM_NUM_PAGES;
+   }
+}
+
+
+/*
+ * traceSize --
+ *
+ *    Internal function to find the size of the whole trace file, which
+ *    is what readers compare against the index. This isn't where the
+ *    decoder stopped: trailing partial packets and damaged data don't
+ *    count toward that.
+ */
+
+static uint64_t
+traceSize(const MemTraceState *state)
+{
+   struct stat st;
+
+   if (state->archive) {
+      return MemTraceArchive_RawSize(state->archive);
+   }
+   if (state->map) {
+      return state->mapSize;
+   }
+   if (state->file && !fstat(fileno(state->file), &st) && S_ISREG(st.st_mode)) {
+      return st.st_size;
+   }
+   return state->fileOffset;
+}
+
+
+/*
+ * MemTraceIndex_Build --
+ *
+ *    Decode a freshly opened trace from start to finish, writing an
+ *    index for it to 'filename'. Decoding errors are skipped, just as
+ *    any other reader would skip them. Returns false on I/O errors.
+ */
+
+bool
+MemTraceIndex_Build(MemTraceState *state, const char *filename)
+{
+   MemTraceIndexHeader header;
+   MemTraceIndexEntry *entries = NULL;
+   MemTraceIndexCheckpoint *checkpoints = NULL;
+   MemTraceIndexSummary *summaries = NULL;
+   uint32_t numEntries = 0, numCheckpoints = 0, numSummaries = 0;
+   uint32_t entriesAlloc = 0, checkpointsAlloc = 0, summariesAlloc = 0;
+   uint64_t nextEntry = 0, nextSummary = 0;
+   MemTraceResult result = MEMTR_SUCCESS;
+   MemOp op;
+   bool ok = false;
+   FILE *f;
+
+   f = fopen(filename, "wb");
+   if (!f) {
+      return false;
+   }
+
+   memset(&header, 0, sizeof header);
+   if (fwrite(&header, sizeof header, 1, f) != 1) {
+      goto done;
+   }
+
+   // The first entry represents the start of the trace, with empty memory.
+   memset(state->dirtyPages, 0, sizeof state->dirtyPages);
+
+   do {
+      if (state->fileOffset >= nextEntry) {
+         MemTraceIndexEntry *e;
+
+         if (numEntries == entriesAlloc) {
+            entriesAlloc = entriesAlloc ? entriesAlloc * 2 : 1024;
+            e = realloc(entries, entriesAlloc * sizeof *entries);
+            if (!e) {
+               goto done;
+            }
+            entries = e;
+         }
+
+         if (numEntries % MTIDX_CHECKPOINT_INTERVAL == 0) {
+            MemTraceIndexCheckpoint *cp;
+
+            if (numCheckpoints == checkpointsAlloc) {
+               checkpointsAlloc = checkpointsAlloc ? checkpointsAlloc * 2 : 64;
+               cp = realloc(checkpoints, checkpointsAlloc * sizeof *checkpoints);
+               if (!cp) {
+                  goto done;
+               }
+               checkpoints = cp;
+            }
+
+            cp = &checkpoints[numCheckpoints++];
+            cp->entry = numEntries;
+            if (!writeCheckpoint(state, f, cp)) {
+               goto done;
+            }
+         }
+
+         e = &entries[numEntries++];
+         e->clocks = state->timestamp.clocks;
+         e->fileOffset = state->fileOffset;
+         e->nextAddr = state->nextAddr;
+         e->checkpoint = numCheckpoints - 1;
+
+         nextEntry = state->fileOffset + MTIDX_ENTRY_INTERVAL;
+      }
+
+      if (state->fileOffset >= nextSummary) {
+         MemTraceIndexSummary *s;
+
+         if (numSummaries == summariesAlloc) {
+            summariesAlloc = summariesAlloc ? summariesAlloc * 2 : 4096;
+            s = realloc(summaries, summariesAlloc * sizeof *summaries);
+            if (!s) {
+               goto done;
+            }
+            summaries = s;
+         }
+
+         s = &summaries[numSummaries++];
+         memset(s, 0, sizeof *s);
+         s->clocks = state->timestamp.clocks;
+         s->fileOffset = state->fileOffset;
+         s->nextAddr = state->nextAddr;
+         s->minAddr = MEM_SIZE_BYTES;
+
+         nextSummary = state->fileOffset + MTIDX_SUMMARY_INTERVAL;
+      }
+
+      result = MemTrace_Next(state, &op);
+
+      // Abandoned bursts still changed memory, so they count too
+      if (result == MEMTR_SUCCESS) {
+         summarizeOp(&summaries[numSummaries - 1], &op);
+      } else if (result != MEMTR_EOF) {
+         summarizeOp(&summaries[numSummaries - 1], &state->lostOp);
+      }
+   } while (result != MEMTR_EOF);
+
+   memcpy(header.magic, MTIDX_MAGIC, sizeof header.magic);
+   header.version = MTIDX_VERSION;
+   header.pageSize = MEM_PAGE_SIZE;
+   header.traceSize = traceSize(state);
+   header.numEntries = numEntries;
+   header.numCheckpoints = numCheckpoints;
+   header.numSummaries = numSummaries;
+
+   header.entriesOffset = ftello(f);
+   if (fwrite(entries, sizeof *entries, numEntries, f) != numEntries) {
+      goto done;
+   }
+
+   header.checkpointsOffset = ftello(f);
+   if (fwrite(checkpoints, sizeof *checkpoints, numCheckpoints, f) != numCheckpoints) {
+      goto done;
+   }
+
+   header.summariesOffset = ftello(f);
+   if (fwrite(summaries, sizeof *summaries, numSummaries, f) != numSummaries) {
+      goto done;
+   }
+
+   if (fseeko(f, 0, SEEK_SET) || fwrite(&header, sizeof header, 1, f) != 1) {
+      goto done;
+   }
+
+   ok = true;
+
+ done:
+   free(entries);
+   free(checkpoints);
+   free(summaries);
+   if (fclose(f)) {
+      ok = false;
+   }
+   return ok;
+}
+
+
+/*
+ * MemTraceIndex_Open --
+ *
+ *    Memory-map an index file built by MemTraceIndex_Build.
+ *    Returns false if it can't be read or isn't a valid index.
+ */
+
+bool
+MemTraceIndex_Open(MemTraceIndex *index, const char *filename)
+{
+   const MemTraceIndexHeader *header;
+   struct stat st;
+   void *map;
+   int fd;
+
+   memset(index, 0, sizeof *index);
+
+   fd = open(filename, O_RDONLY);
+   if (fd < 0) {
+      return false;
+   }
+
+   if (fstat(fd, &st) || st.st_size < sizeof *header) {
+      close(fd);
+      return false;
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      return false;
+   }
+
+   index->map = map;
+   index->mapSize = st.st_size;
+   header = map;
+
+   if (memcmp(header->magic, MTIDX_MAGIC, sizeof header->magic) ||
+       header->version != MTIDX_VERSION ||
+       header->pageSize != MEM_PAGE_SIZE ||
+       header->numEntries == 0 ||
+       header->entriesOffset + (uint64_t)header->numEntries *
+          sizeof(MemTraceIndexEntry) > index->mapSize ||
+       header->checkpointsOffset + (uint64_t)header->numCheckpoints *
+          sizeof(MemTraceIndexCheckpoint) > index->mapSize ||
+       header->summariesOffset + (uint64_t)header->numSummaries *
+          sizeof(MemTraceIndexSummary) > index->mapSize) {
+      MemTraceIndex_Close(index);
+      return false;
+   }
+
+   index->traceSize = header->traceSize;
+   index->numEntries = header->numEntries;
+   index->numCheckpoints = header->numCheckpoints;
+   index->entries = (const void *)(index->map + header->entriesOffset);
+   index->checkpoints = (const void *)(index->map + header->checkpointsOffset);
+   index->numSummaries = header->numSummaries;
+   index->summaries = (const void *)(index->map + header->summariesOffset);
+
+   return true;
+}
+
+
+/*
+ * MemTraceIndex_Close --
+ *
+ *    Clean up after MemTraceIndex_Open.
+ */
+
+void
+MemTraceIndex_Close(MemTraceIndex *index)
+{
+   if (index->map) {
+      munmap((void *)index->map, index->mapSize);
+   }
+   memset(index, 0, sizeof *index);
+}
+
+
+/*
+ * restoreCheckpoint --
+ *
+ *    Rebuild the memory image as of checkpoint 'cp'. We walk backwards
+ *    through the checkpoints, taking the newest copy of each page, and
+ *    stop as soon as we've seen every page. Anything never stored is
+ *    still zero. Returns false if the index is corrupt.
+ */
+
+static bool
+restoreCheckpoint(MemTraceState *state, const MemTraceIndex *index, uint32_t cp)
+{
+   uint32_t found[MEM_NUM_PAGES / 32];
+   uint32_t numFound = 0;
+   uint32_t page;
+
+   memset(found, 0, sizeof found);
+
+   do {
+      const MemTraceIndexCheckpoint *c = &index->checkpoints[cp];
+      const MemTraceIndexPage *pages;
+      uint32_t i;
+
+      if (c->pagesOffset + (uint64_t)c->numPages * sizeof *pages > index->mapSize) {
+         return false;
+      }
+      pages = (const void *)(index->map + c->pagesOffset);
+
+      for (i = 0; i < c->numPages; i++) {
+         const MemTraceIndexPage *p = &pages[i];
+
+         if (p->page >= MEM_NUM_PAGES || p->offset + p->size > index->mapSize) {
+            return false;
+         }
+         if (found[p->page >> 5] & (1 << (p->page & 31))) {
+            continue;
+         }
+         if (!decompressPage(index->map + p->offset, p->size,
+                             MemTrace_EditPage(state, p->page))) {
+            return false;
+         }
+         found[p->page >> 5] |= 1 << (p->page & 31);
+         numFound++;
+      }
+   } while (numFound < MEM_NUM_PAGES && cp--);
+
+   for (page = 0; page < MEM_NUM_PAGES; page++) {
+      if (!(found[page >> 5] & (1 << (page & 31)))) {
+         MemTrace_DropPage(state, page);
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ * MemTrace_SeekToTime --
+ *
+ *    Use an index to jump to a point in the trace, with the memory
+ *    image as it was at that time. We restore the nearest checkpoint
+ *    at or before 'clocks', then replay the remainder of the trace.
+ *
+ *    Like the decoder's time limit, we stop just after the first burst
+ *    that ends past 'clocks'. Returns MEMTR_SUCCESS when positioned,
+ *    MEMTR_EOF if the trace ended first, or MEMTR_ERR_INDEX if the
+ *    index doesn't fit this trace or the trace can't seek.
+ */
+
+MemTraceResult
+MemTrace_SeekToTime(MemTraceState *state, const MemTraceIndex *index,
+                    uint64_t clocks)
+{
+   const MemTraceIndexEntry *e;
+   const MemTraceIndexCheckpoint *cp;
+   uint32_t lo = 0, hi = index->numEntries;
+   MemTraceResult result;
+
+   if ((state->map && state->mapSize != index->traceSize) ||
+       (state->archive && MemTraceArchive_RawSize(state->archive) != index->traceSize)) {
+      return MEMTR_ERR_INDEX;
+   }
+
+   // Find the last entry at or before 'clocks'
+   while (hi - lo > 1) {
+      uint32_t mid = (lo + hi) / 2;
+      if (index->entries[mid].clocks <= clocks) {
+         lo = mid;
+      } else {
+         hi = mid;
+      }
+   }
+
+   e = &index->entries[lo];
+   if (e->checkpoint >= index->numCheckpoints) {
+      return MEMTR_ERR_INDEX;
+   }
+   cp = &index->checkpoints[e->checkpoint];
+   if (cp->entry >= index->numEntries) {
+      return MEMTR_ERR_INDEX;
+   }
+   e = &index->entries[cp->entry];
+
+   if (!MemTrace_Seek(state, e->fileOffset) ||
+       !restoreCheckpoint(state, index, e->checkpoint)) {
+      return MEMTR_ERR_INDEX;
+   }
+
+   state->timestamp.clocks = e->clocks;
+   state->timestamp.seconds = e->clocks / (double)RAM_CLOCK_HZ;
+   state->nextAddr = e->nextAddr;
+   memset(state->dirtyPages, 0, sizeof state->dirtyPages);
+
+   /*
+    * Replay the tail. Errors are skipped, as they were while indexing.
+    */
+
+   do {
+      result = MemTrace_Next(state, NULL);
+      if (result == MEMTR_SUCCESS && state->timestamp.clocks > clocks) {
+         return MEMTR_SUCCESS;
+      }
+   } while (result != MEMTR_EOF);
+
+   return MEMTR_EOF;
+}
+
+
+/*
+ * overlaps --
+ *
+ *    Internal function: do two spans of memory share any bytes? Both
+ *    may wrap around the end of memory, like bursts do.
+ */
+
+static inline bool
+overlaps(uint32_t addrA, uint32_t lengthA, uint32_t addrB, uint32_t lengthB)
+{
+   return lengthA && lengthB &&
+          (((addrA - addrB) & MEM_MASK) < lengthB ||
+           ((addrB - addrA) & MEM_MASK) < lengthA);
+}
+
+
+/*
+ * isCandidate --
+ *
+ *    Internal function: could the operations in summary 'n' touch
+ *    [addr, addr + length)?
+ */
+
+static bool
+isCandidate(const MemTraceIndex *index, uint32_t n, uint32_t addr, uint32_t length)
+{
+   const MemTraceIndexSummary *s = &index->summaries[n];
+   uint32_t page = addr >> MEM_PAGE_SHIFT;
+   uint32_t lastPage = ((addr + length - 1) & MEM_MASK) >> MEM_PAGE_SHIFT;
+
+   if (s->minAddr > s->maxAddr ||
+       !overlaps(s->minAddr, s->maxAddr - s->minAddr + 1, addr, length)) {
+      return false;
+   }
+
+   for (;;) {
+      if (s->pages[page >> 5] & (1 << (page & 31))) {
+         return true;
+      }
+      if (page == lastPage) {
+         return false;
+      }
+      page = (page + 1) % MEM_NUM_PAGES;
+   }
+}
+
+
+/*
+ * findInSpan --
+ *
+ *    Internal function to decode until the file offset reaches 'end',
+ *    passing operations which touch [addr, addr + length) to the
+ *    callback. Errors are passed along too, so the callback can report
+ *    them.
+ *
+ *    Returns MEMTR_EOF when the span is done, MEMTR_SUCCESS if the
+ *    callback asked us to stop, or MEMTR_ERR_NOMEM if an operation
+ *    didn't fit in the batch. That operation is left in state->lostOp
+ *    and the callback has already seen the error, as with
+ *    MemTrace_NextBatch, but we can't go on without losing it.
+ */
+
+static MemTraceResult
+findInSpan(MemTraceState *state, uint64_t end, uint32_t addr, uint32_t length,
+           MemOpBatch *batch, MemTraceBatchFn *callback, void *userdata)
+{
+   batch->count = 0;
+   batch->dataLength = 0;
+
+   while (state->fileOffset < end) {
+      MemTraceResult result;
+      MemOp op;
+
+      result = MemTrace_Next(state, &op);
+
+      if (result == MEMTR_SUCCESS) {
+         if (!overlaps(op.addr & MEM_MASK, op.length, addr, length)) {
+            continue;
+         }
+         if (!MemOpBatch_Add(batch, &op, state->timestamp.clocks, state)) {
+            state->lostOp = op;
+            callback(state, batch, MEMTR_ERR_NOMEM, userdata);
+            return MEMTR_ERR_NOMEM;
+         }
+         if (batch->count < batch->capacity) {
+            continue;
+         }
+      } else if (result == MEMTR_EOF) {
+         break;
+      }
+
+      if (!callback(state, batch, result, userdata)) {
+         return MEMTR_SUCCESS;
+      }
+      batch->count = 0;
+      batch->dataLength = 0;
+   }
+
+   if (batch->count && !callback(state, batch, MEMTR_SUCCESS, userdata)) {
+      return MEMTR_SUCCESS;
+   }
+   return MEMTR_EOF;
+}
+
+
+/*
+ * MemTrace_FindAccesses --
+ *
+ *    Find every operation that touched any byte in [addr, addr + length),
+ *    in order, and pass them to 'callback' in batches. The last call has
+ *    an empty batch and MEMTR_EOF. Each operation's data is complete and
+ *    exact, but the rest of memory isn't kept up to date.
+ *
+ *    With an index, we only decode the stretches of trace whose address
+ *    summaries say they touch the range. Without one ('index' is NULL),
+ *    we decode everything from the current position. If the trace
+ *    stops seeking part way, we decode the rest of it from wherever we
+ *    got to, so nothing is missed or repeated.
+ *
+ *    Returns MEMTR_EOF when finished, MEMTR_SUCCESS if the callback
+ *    stopped us early, or MEMTR_ERR_NOMEM if we ran out of memory,
+ *    after passing that to the callback. Returns MEMTR_ERR_INDEX,
+ *    without touching 'state' or calling the callback, if the index
+ *    doesn't fit this trace.
+ */
+
+MemTraceResult
+MemTrace_FindAccesses(MemTraceState *state, const MemTraceIndex *index,
+                      uint32_t addr, uint32_t length,
+                      MemTraceBatchFn *callback, void *userdata)
+{
+   MemTraceResult result = MEMTR_EOF;
+   MemOpBatch batch;
+   uint32_t n = 0;
+
+   if (index &&
+       ((state->map && state->mapSize != index->traceSize) ||
+        (state->archive && MemTraceArchive_RawSize(state->archive) != index->traceSize))) {
+      return MEMTR_ERR_INDEX;
+   }
+
+   if (length > MEM_SIZE_BYTES) {
+      length = MEM_SIZE_BYTES;
+   }
+   addr &= MEM_MASK;
+
+   if (!MemOpBatch_Alloc(&batch, 1024)) {
+      callback(state, &batch, MEMTR_ERR_NOMEM, userdata);
+      return MEMTR_ERR_NOMEM;
+   }
+
+   if (!index) {
+      result = findInSpan(state, UINT64_MAX, addr, length, &batch, callback, userdata);
+      goto done;
+   }
+
+   while (n < index->numSummaries) {
+      const MemTraceIndexSummary *s = &index->summaries[n];
+      uint64_t end;
+
+      if (!isCandidate(index, n, addr, length)) {
+         n++;
+         continue;
+      }
+
+      // Decode this span and any candidates right after it in one go
+      do {
+         n++;
+      } while (n < index->numSummaries && isCandidate(index, n, addr, length));
+      end = n < index->numSummaries ? index->summaries[n].fileOffset : UINT64_MAX;
+
+      if (!MemTrace_Seek(state, s->fileOffset)) {
+         /*
+          * We're still at the start, or at the end of the last span we
+          * decoded. Either way, carrying on from here is exact.
+          */
+         result = findInSpan(state, UINT64_MAX, addr, length, &batch, callback, userdata);
+         goto done;
+      }
+      state->timestamp.clocks = s->clocks;
+      state->nextAddr = s->nextAddr;
+
+      result = findInSpan(state, end, addr, length, &batch, callback, userdata);
+      if (result != MEMTR_EOF) {
+         goto done;
+      }
+   }
+
+ done:
+   if (result == MEMTR_EOF) {
+      batch.count = 0;
+      batch.dataLength = 0;
+      callback(state, &batch, MEMTR_EOF, userdata);
+   }
+   MemOpBatch_Free(&batch);
+   state->timestamp.seconds = state->timestamp.clocks / (double)RAM_CLOCK_HZ;
+   return result;
+}
@@ -0,0 +1,276 @@
+/*
+ * memtrace_mem.c - Paged memory image for memory trace decoding.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "memtrace.h"
+
+/*
+ * Reference counts are only touched by the state that holds the page,
+ * but a page may be shared by states on different threads, so all
+ * changes are atomic. A count of 1 means we own the page outright.
+ */
+
+static const uint8_t zeroPage[MEM_PAGE_SIZE];
+
+
+/*
+ * releasePage --
+ *
+ *    Drop one reference to a page, freeing it if that was the last.
+ */
+
+static void
+releasePage(MemTracePage *p)
+{
+   if (p && __atomic_sub_fetch(&p->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+      free(p);
+   }
+}
+
+
+/*
+ * MemTrace_PeekPage --
+ *
+ *    Return a read-only pointer to one page of memory. Pages which
+ *    have never been written share a single page of zeroes.
+ */
+
+const uint8_t *
+MemTrace_PeekPage(const MemTraceState *state, uint32_t page)
+{
+   const MemTracePage *p = state->pages[page];
+   return p ? p->data : zeroPage;
+}
+
+
+/*
+ * MemTrace_EditPage --
+ *
+ *    Return a writable pointer to one page of memory, and mark it dirty.
+ *    The page is allocated if it's new, or copied if it's shared.
+ *
+ *    Pages are small enough that we treat running out of memory here
+ *    as fatal, rather than asking every packet to check for it.
+ */
+
+uint8_t *
+MemTrace_EditPage(MemTraceState *state, uint32_t page)
+{
+   MemTracePage *p = state->pages[page];
+
+   if (!p) {
+      p = calloc(1, sizeof *p);
+      if (!p) {
+         goto nomem;
+      }
+      p->refCount = 1;
+      state->pages[page] = p;
+
+   } else if (__atomic_load_n(&p->refCount, __ATOMIC_ACQUIRE) != 1) {
+      MemTracePage *copy = malloc(sizeof *copy);
+
+      if (!copy) {
+         goto nomem;
+      }
+      memcpy(copy->data, p->data, MEM_PAGE_SIZE);
+      copy->refCount = 1;
+      releasePage(p);
+      state->pages[page] = p = copy;
+   }
+
+   state->dirtyPages[page >> 5] |= 1 << (page & 31);
+   return p->data;
+
+ nomem:
+   fprintf(stderr, "MemTrace: Out of memory allocating page %u\n", page);
+   abort();
+}
+
+
+/*
+ * MemTrace_DropPage --
+ *
+ *    Set one page back to zeroes, freeing it if nobody else needs it.
+ */
+
+void
+MemTrace_DropPage(MemTraceState *state, uint32_t page)
+{
+   releasePage(state->pages[page]);
+   state->pages[page] = NULL;
+   state->dirtyPages[page >> 5] |= 1 << (page & 31);
+}
+
+
+/*
+ * MemTrace_Read --
+ *
+ *    Copy 'length' bytes out of memory starting at 'addr', wrapping
+ *    around the end of memory like a burst would.
+ */
+
+void
+MemTrace_Read(const MemTraceState *state, uint32_t addr, uint8_t *data,
+              uint32_t length)
+{
+   while (length) {
+      uint32_t offset = addr & MEM_MASK;
+      uint32_t inPage = offset & (MEM_PAGE_SIZE - 1);
+      uint32_t chunk = MEM_PAGE_SIZE - inPage;
+
+      if (chunk > length) {
+         chunk = length;
+      }
+
+      memcpy(data, MemTrace_PeekPage(state, offset >> MEM_PAGE_SHIFT) + inPage, chunk);
+
+      addr += chunk;
+      data += chunk;
+      length -= chunk;
+   }
+}
+
+
+/*
+ * MemTrace_Write --
+ *
+ *    Store 'length' bytes into memory at 'addr', wrapping around the
+ *    end of memory like a burst would.
+ */
+
+void
+MemTrace_Write(MemTraceState *state, uint32_t addr, const uint8_t *data,
+               uint32_t length)
+{
+   while (length) {
+      uint32_t offset = addr & MEM_MASK;
+      uint32_t inPage = offset & (MEM_PAGE_SIZE - 1);
+      uint32_t chunk = MEM_PAGE_SIZE - inPage;
+
+      if (chunk > length) {
+         chunk = length;
+      }
+
+      memcpy(MemTrace_EditPage(state, offset >> MEM_PAGE_SHIFT) + inPage, data, chunk);
+
+      addr += chunk;
+      data += chunk;
+      length -= chunk;
+   }
+}
+
+
+/*
+ * MemTrace_ClearMemory --
+ *
+ *    Set all of memory back to zeroes, and free our pages. Doesn't
+ *    touch the dirty bits.
+ */
+
+void
+MemTrace_ClearMemory(MemTraceState *state)
+{
+   uint32_t page;
+
+   for (page = 0; page < MEM_NUM_PAGES; page++) {
+      releasePage(state->pages[page]);
+      state->pages[page] = NULL;
+   }
+}
+
+
+/*
+ * MemTrace_WriteImage --
+ *
+ *    Write the whole memory image to 'f', as MEM_SIZE_BYTES of raw
+ *    data. Returns false on I/O errors.
+ */
+
+bool
+MemTrace_WriteImage(const MemTraceState *state, FILE *f)
+{
+   uint32_t page;
+
+   for (page = 0; page < MEM_NUM_PAGES; page++) {
+      if (fwrite(MemTrace_PeekPage(state, page), MEM_PAGE_SIZE, 1, f) != 1) {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ * MemTrace_Clone --
+ *
+ *    Make 'dest' an independent copy of 'src': same position in the
+ *    trace, same timestamp, same memory. Memory pages are shared until
+ *    either state writes to them, so this is cheap.
+ *
+ *    A clone of a memory-mapped trace can keep decoding, sharing the
+ *    original's mapping; close the clone first. A clone of a trace read
+ *    through stdio can't read any further, since the two can't share a
+ *    stream position. It behaves as if it reached EOF.
+ *
+ *    Close the clone with MemTrace_Close.
+ */
+
+void
+MemTrace_Clone(MemTraceState *dest, const MemTraceState *src)
+{
+   uint32_t page;
+
+   memcpy(dest, src, sizeof *dest);
+
+   for (page = 0; page < MEM_NUM_PAGES; page++) {
+      MemTracePage *p = dest->pages[page];
+      if (p) {
+         __atomic_add_fetch(&p->refCount, 1, __ATOMIC_RELAXED);
+      }
+   }
+
+   if (dest->map) {
+      dest->mapBorrowed = true;
+   }
+
+   // Packets the clone decodes aren't the source's to count
+   dest->stats = NULL;
+
+   if (dest->file) {
+      /*
+       * Packets queued or buffered from the source's stream belong
+       * to the source.
+       */
+
+      dest->file = NULL;
+      dest->fileBuf = NULL;
+      dest->archive = NULL;
+      dest->fileBufHead = 0;
+      dest->fileBufTail = 0;
+      dest->batchHead = 0;
+      dest->batchCount = 0;
+   }
+}
@@ -0,0 +1,756 @@
+/*
+ * memtrace_mtz.c - Compressed, seekable archives of memory trace logs.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "memtrace.h"
+
+/*
+ * Archive format (.mtz):
+ *
+ * A header, then the raw trace in blocks of MTZ_BLOCK_SIZE bytes, then
+ * a table with the file offset of each block. Every block starts with
+ * fresh state, so we can seek to any block and decode it alone.
+ *
+ * Within a block, every 4-byte packet with good alignment and checksum
+ * is stored by type and payload, which is all it takes to rebuild it
+ * exactly. Everything else (damage, partial packets at the end) is
+ * stored as literal bytes. The pieces go into separate streams, so
+ * zlib sees like next to like:
+ *
+ *   ops     One code per token; see OP_* below
+ *   addrs   ADDR payloads, as a zigzag varint delta from the address
+ *           the burst would have continued at
+ *   ts      Extra clocks for each READ/WRITE packet, one byte each
+ *   durs    TIMESTAMP payloads, as varints
+ *   words   Data for each READ/WRITE packet, 16-bit little endian
+ *   lits    Literal bytes
+ *
+ * Full-word reads or writes in a row share one op code, so a typical
+ * burst costs an address delta, one code, and its data.
+ *
+ * All fields are stored in host byte order, like .mtidx files.
+ */
+
+#define MTZ_MAGIC       "MTZIP\r\n\032"
+#define MTZ_VERSION     1
+#define MTZ_BLOCK_SIZE  (1024 * 1024)
+#define MTZ_MAX_BLOCK   (16 * 1024 * 1024)   // Sanity limit for readers
+
+#define OP_ADDR         0x00
+#define OP_LITERAL      0x01   // Followed by a varint byte count in 'ops'
+#define OP_TIMESTAMP    0x40
+#define OP_RUN          0x80   // | write << 5 | (count - 1), both byte lanes
+#define OP_SINGLE       0xC0   // | write << 2 | lanes, any byte lanes
+#define MAX_RUN         32
+
+#define ADDR_MASK       0x7FFFFF
+
+enum {
+   S_OPS,
+   S_ADDRS,
+   S_TS,
+   S_DURS,
+   S_WORDS,
+   S_LITS,
+   NUM_STREAMS,
+};
+
+typedef struct {
+   char     magic[8];
+   uint32_t version;
+   uint32_t blockSize;
+   uint64_t rawSize;
+   uint32_t numBlocks;
+   uint32_t reserved;
+   uint64_t indexOffset;     // uint64_t blockOffset[numBlocks]
+} MtzHeader;
+
+typedef struct {
+   uint32_t compressedSize;
+   uint32_t rawSize;
+} MtzBlockHeader;
+
+typedef struct {
+   uint8_t *data;
+   uint32_t length;
+   uint32_t pos;             // For reading
+} Stream;
+
+struct MemTraceArchive {
+   FILE *file;
+   MtzHeader header;
+   uint64_t *blocks;         // Block offsets, or NULL if we can't seek
+   uint32_t nextBlock;
+
+   uint8_t *raw;             // Current block, decoded
+   uint32_t rawLength;
+   uint32_t rawPos;
+
+   uint8_t *compressed;
+   uLongf compressedMax;
+   uint8_t *encoded;
+   uLongf encodedMax;
+};
+
+
+/*
+ * encodedMax --
+ *
+ *    Worst-case size of an encoded block: no stream can grow past the
+ *    size of the raw data plus a little slack, and there's a table of
+ *    stream lengths in front.
+ */
+
+static uint32_t
+encodedMax(uint32_t blockSize)
+{
+   return NUM_STREAMS * (sizeof(uint32_t) + blockSize + 16);
+}
+
+
+/*
+ * Stream writing helpers
+ */
+
+static inline void
+put8(Stream *s, uint8_t value)
+{
+   s->data[s->length++] = value;
+}
+
+static inline void
+putVarint(Stream *s, uint32_t value)
+{
+   while (value >= 0x80) {
+      put8(s, value | 0x80);
+      value >>= 7;
+   }
+   put8(s, value);
+}
+
+static inline void
+putRW(Stream *streams, uint32_t payload)
+{
+   put8(&streams[S_TS], payload >> 18);
+   put8(&streams[S_WORDS], payload);
+   put8(&streams[S_WORDS], payload >> 8);
+}
+
+static inline bool
+isGood(MemPacket p)
+{
+   return MemPacket_IsAligned(p) && MemPacket_IsChecksumCorrect(p);
+}
+
+
+/*
+ * Stream reading helpers. These return false if the stream runs dry.
+ */
+
+static inline bool
+get8(Stream *s, uint8_t *value)
+{
+   if (s->pos >= s->length) {
+      return false;
+   }
+   *value = s->data[s->pos++];
+   return true;
+}
+
+static inline bool
+getVarint(Stream *s, uint32_t *value)
+{
+   uint32_t result = 0;
+   int shift;
+
+   for (shift = 0; shift < 35; shift += 7) {
+      uint8_t b;
+
+      if (!get8(s, &b)) {
+         return false;
+      }
+      result |= (uint32_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) {
+         *value = result;
+         return true;
+      }
+   }
+   return false;
+}
+
+static inline bool
+getRW(Stream *streams, uint32_t lanes, uint32_t *payload)
+{
+   uint8_t ts, lo, hi;
+
+   if (!get8(&streams[S_TS], &ts) || ts >= 32 ||
+       !get8(&streams[S_WORDS], &lo) || !get8(&streams[S_WORDS], &hi)) {
+      return false;
+   }
+   *payload = ((uint32_t)ts << 18) | (lanes << 16) | (hi << 8) | lo;
+   return true;
+}
+
+
+/*
+ * flushLiterals --
+ *
+ *    Internal function to store raw bytes [start, end) as literals.
+ */
+
+static void
+flushLiterals(Stream *streams, const uint8_t *raw, uint32_t start, uint32_t end)
+{
+   if (end > start) {
+      put8(&streams[S_OPS], OP_LITERAL);
+      putVarint(&streams[S_OPS], end - start);
+      memcpy(streams[S_LITS].data + streams[S_LITS].length, raw + start, end - start);
+      streams[S_LITS].length += end - start;
+   }
+}
+
+
+/*
+ * encodeBlock --
+ *
+ *    Split one block of raw trace into streams. Each stream's buffer
+ *    must hold at least 'length' + 16 bytes.
+ */
+
+static void
+encodeBlock(const uint8_t *raw, uint32_t length, Stream *streams)
+{
+   uint32_t nextAddr = 0;
+   uint32_t litStart = 0;
+   uint32_t i = 0;
+
+   while (i + sizeof(MemPacket) <= length) {
+      MemPacket p = MemPacket_FromBytes(raw + i);
+      uint32_t payload = MemPacket_GetPayload(p);
+      MemPacketType type = MemPacket_GetType(p);
+      bool write = type == MEMPKT_WRITE;
+
+      if (!isGood(p)) {
+         i++;
+         continue;
+      }
+      flushLiterals(streams, raw, litStart, i);
+
+      switch (type) {
+
+      case MEMPKT_ADDR: {
+         int32_t delta = (payload - nextAddr) & ADDR_MASK;
+
+         if (delta & 0x400000) {
+            delta -= 0x800000;
+         }
+         put8(&streams[S_OPS], OP_ADDR);
+         putVarint(&streams[S_ADDRS], ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+         nextAddr = payload;
+         i += sizeof p;
+         break;
+      }
+
+      case MEMPKT_TIMESTAMP:
+         put8(&streams[S_OPS], OP_TIMESTAMP);
+         putVarint(&streams[S_DURS], payload);
+         i += sizeof p;
+         break;
+
+      case MEMPKT_READ:
+      case MEMPKT_WRITE:
+         if (((payload >> 16) & 3) == 3) {
+            uint32_t count = 0;
+
+            while (count < MAX_RUN && i + sizeof p <= length) {
+               p = MemPacket_FromBytes(raw + i);
+               payload = MemPacket_GetPayload(p);
+
+               if (!isGood(p) || MemPacket_GetType(p) != type ||
+                   ((payload >> 16) & 3) != 3) {
+                  break;
+               }
+               putRW(streams, payload);
+               count++;
+               i += sizeof p;
+            }
+            put8(&streams[S_OPS], OP_RUN | (write << 5) | (count - 1));
+            nextAddr += count;
+
+         } else {
+            put8(&streams[S_OPS], OP_SINGLE | (write << 2) | ((payload >> 16) & 3));
+            putRW(streams, payload);
+            nextAddr++;
+            i += sizeof p;
+         }
+         nextAddr &= ADDR_MASK;
+         break;
+      }
+
+      litStart = i;
+   }
+
+   flushLiterals(streams, raw, litStart, length);
+}
+
+
+/*
+ * decodeBlock --
+ *
+ *    Inverse of encodeBlock. The streams come from a file, so we check
+ *    everything. Returns false if the block is corrupt.
+ */
+
+static bool
+decodeBlock(Stream *streams, uint8_t *raw, uint32_t length)
+{
+   Stream *ops = &streams[S_OPS];
+   uint32_t nextAddr = 0;
+   uint32_t o = 0;
+   uint8_t code;
+
+   while (get8(ops, &code)) {
+      MemPacketType type;
+      uint32_t payload = 0, count, lanes = 0;
+
+      if (code == OP_LITERAL) {
+         Stream *lits = &streams[S_LITS];
+
+         if (!getVarint(ops, &count) || count > length - o ||
+             count > lits->length - lits->pos) {
+            return false;
+         }
+         memcpy(raw + o, lits->data + lits->pos, count);
+         lits->pos += count;
+         o += count;
+         continue;
+      }
+
+      if (code == OP_ADDR) {
+         uint32_t zigzag;
+
+         if (!getVarint(&streams[S_ADDRS], &zigzag)) {
+            return false;
+         }
+         nextAddr = (nextAddr + ((zigzag >> 1) ^ -(zigzag & 1))) & ADDR_MASK;
+         type = MEMPKT_ADDR;
+         payload = nextAddr;
+         count = 1;
+
+      } else if (code == OP_TIMESTAMP) {
+         if (!getVarint(&streams[S_DURS], &payload) || payload > ADDR_MASK) {
+            return false;
+         }
+         type = MEMPKT_TIMESTAMP;
+         count = 1;
+
+      } else if ((code & 0xC0) == OP_RUN) {
+         type = (code & 0x20) ? MEMPKT_WRITE : MEMPKT_READ;
+         lanes = 3;
+         count = (code & 0x1F) + 1;
+
+      } else if ((code & 0xF8) == OP_SINGLE) {
+         type = (code & 0x04) ? MEMPKT_WRITE : MEMPKT_READ;
+         lanes = code & 3;
+         count = 1;
+
+      } else {
+         return false;
+      }
+
+      while (count--) {
+         if (type == MEMPKT_READ || type == MEMPKT_WRITE) {
+            if (!getRW(streams, lanes, &payload)) {
+               return false;
+            }
+            nextAddr = (nextAddr + 1) & ADDR_MASK;
+         }
+         if (length - o < sizeof(MemPacket)) {
+            return false;
+         }
+         MemPacket_ToBytes(MemPacket_Create(type, payload), raw + o);
+         o += sizeof(MemPacket);
+      }
+   }
+
+   return o == length;
+}
+
+
+/*
+ * MemTraceArchive_IsArchive --
+ *
+ *    Do these bytes, from the beginning of a file, look like an archive?
+ */
+
+bool
+MemTraceArchive_IsArchive(const uint8_t *bytes, size_t length)
+{
+   return length >= MEMTRACE_ARCHIVE_MAGIC_SIZE &&
+          !memcmp(bytes, MTZ_MAGIC, MEMTRACE_ARCHIVE_MAGIC_SIZE);
+}
+
+
+/*
+ * MemTraceArchive_Create --
+ *
+ *    Compress a raw trace from 'in' into an archive on 'out'. 'in' can
+ *    be a pipe, but 'out' must be seekable. Returns false on I/O errors
+ *    or if we run out of memory.
+ */
+
+bool
+MemTraceArchive_Create(FILE *in, FILE *out)
+{
+   uint32_t streamMax = MTZ_BLOCK_SIZE + 16;
+   uLongf compressedMax = compressBound(encodedMax(MTZ_BLOCK_SIZE));
+   Stream streams[NUM_STREAMS];
+   uint8_t *raw = malloc(MTZ_BLOCK_SIZE);
+   uint8_t *encoded = malloc(encodedMax(MTZ_BLOCK_SIZE));
+   uint8_t *compressed = malloc(compressedMax);
+   uint8_t *streamData = malloc(NUM_STREAMS * streamMax);
+   uint64_t *blocks = NULL;
+   uint32_t blocksAlloc = 0;
+   MtzHeader header;
+   bool ok = false;
+   int i;
+
+   memset(&header, 0, sizeof header);
+   memcpy(header.magic, MTZ_MAGIC, sizeof header.magic);
+   header.version = MTZ_VERSION;
+   header.blockSize = MTZ_BLOCK_SIZE;
+
+   if (!raw || !encoded || !compressed || !streamData ||
+       fwrite(&header, sizeof header, 1, out) != 1) {
+      goto done;
+   }
+
+   for (i = 0; i < NUM_STREAMS; i++) {
+      streams[i].data = streamData + i * streamMax;
+   }
+
+   for (;;) {
+      size_t length = fread(raw, 1, MTZ_BLOCK_SIZE, in);
+      MtzBlockHeader block;
+      uint32_t encodedLength = NUM_STREAMS * sizeof(uint32_t);
+      uLongf compressedLength = compressedMax;
+
+      if (length == 0) {
+         break;
+      }
+
+      for (i = 0; i < NUM_STREAMS; i++) {
+         streams[i].length = 0;
+      }
+      encodeBlock(raw, length, streams);
+
+      for (i = 0; i < NUM_STREAMS; i++) {
+         memcpy(encoded + i * sizeof(uint32_t), &streams[i].length, sizeof(uint32_t));
+         memcpy(encoded + encodedLength, streams[i].data, streams[i].length);
+         encodedLength += streams[i].length;
+      }
+
+      if (compress2(compressed, &compressedLength, encoded, encodedLength,
+                    Z_DEFAULT_COMPRESSION) != Z_OK) {
+         goto done;
+      }
+
+      if (header.numBlocks == blocksAlloc) {
+         uint64_t *bigger;
+
+         blocksAlloc = blocksAlloc ? blocksAlloc * 2 : 256;
+         bigger = realloc(blocks, blocksAlloc * sizeof *blocks);
+         if (!bigger) {
+            goto done;
+         }
+         blocks = bigger;
+      }
+      blocks[header.numBlocks++] = ftello(out);
+
+      block.compressedSize = compressedLength;
+      block.rawSize = length;
+      if (fwrite(&block, sizeof block, 1, out) != 1 ||
+          fwrite(compressed, compressedLength, 1, out) != 1) {
+         goto done;
+      }
+
+      header.rawSize += length;
+   }
+
+   if (ferror(in)) {
+      goto done;
+   }
+
+   header.indexOffset = ftello(out);
+   if ((header.numBlocks &&
+        fwrite(blocks, sizeof *blocks, header.numBlocks, out) != header.numBlocks) ||
+       fseeko(out, 0, SEEK_SET) ||
+       fwrite(&header, sizeof header, 1, out) != 1 ||
+       fflush(out)) {
+      goto done;
+   }
+
+   ok = true;
+
+ done:
+   free(raw);
+   free(encoded);
+   free(compressed);
+   free(streamData);
+   free(blocks);
+   return ok;
+}
+
+
+/*
+ * MemTraceArchive_Open --
+ *
+ *    Start reading an archive from 'f', which has just read the magic
+ *    number at the beginning of the file. If 'f' can seek, the archive
+ *    can too. We don't take ownership of 'f'. Returns NULL if the
+ *    archive is damaged or we're out of memory.
+ */
+
+MemTraceArchive *
+MemTraceArchive_Open(FILE *f)
+{
+   MemTraceArchive *ar = calloc(1, sizeof *ar);
+   MtzHeader *h;
+   off_t start;
+
+   if (!ar) {
+      return NULL;
+   }
+   ar->file = f;
+   h = &ar->header;
+
+   memcpy(h->magic, MTZ_MAGIC, sizeof h->magic);
+   if (fread((uint8_t *)h + sizeof h->magic, sizeof *h - sizeof h->magic, 1, f) != 1 ||
+       h->version != MTZ_VERSION ||
+       h->blockSize == 0 || h->blockSize > MTZ_MAX_BLOCK ||
+       h->numBlocks > h->rawSize / h->blockSize + 1) {
+      goto fail;
+   }
+
+   ar->encodedMax = encodedMax(h->blockSize);
+   ar->compressedMax = compressBound(ar->encodedMax);
+   ar->raw = malloc(h->blockSize);
+   ar->encoded = malloc(ar->encodedMax);
+   ar->compressed = malloc(ar->compressedMax);
+   if (!ar->raw || !ar->encoded || !ar->compressed) {
+      goto fail;
+   }
+
+   /*
+    * Load the block table, if this is a file we can seek around in.
+    */
+
+   start = ftello(f);
+   if (h->numBlocks && start >= 0 && !fseeko(f, h->indexOffset, SEEK_SET)) {
+      ar->blocks = malloc(h->numBlocks * sizeof *ar->blocks);
+
+      if (!ar->blocks ||
+          fread(ar->blocks, sizeof *ar->blocks, h->numBlocks, f) != h->numBlocks) {
+         free(ar->blocks);
+         ar->blocks = NULL;
+      }
+      if (fseeko(f, start, SEEK_SET)) {
+         goto fail;
+      }
+   }
+
+   return ar;
+
+ fail:
+   MemTraceArchive_Close(ar);
+   return NULL;
+}
+
+
+/*
+ * MemTraceArchive_Close --
+ */
+
+void
+MemTraceArchive_Close(MemTraceArchive *ar)
+{
+   free(ar->blocks);
+   free(ar->raw);
+   free(ar->encoded);
+   free(ar->compressed);
+   free(ar);
+}
+
+
+/*
+ * loadBlock --
+ *
+ *    Internal function to read and decode the block at the archive's
+ *    current file position. Returns false at the end of the archive,
+ *    or if the block is damaged.
+ */
+
+static bool
+loadBlock(MemTraceArchive *ar)
+{
+   MtzBlockHeader block;
+   Stream streams[NUM_STREAMS];
+   uLongf encodedLength = ar->encodedMax;
+   uint32_t offset = NUM_STREAMS * sizeof(uint32_t);
+   int i;
+
+   ar->rawLength = 0;
+   ar->rawPos = 0;
+
+   if (ar->nextBlock >= ar->header.numBlocks) {
+      return false;
+   }
+
+   if (fread(&block, sizeof block, 1, ar->file) != 1 ||
+       block.rawSize > ar->header.blockSize ||
+       block.compressedSize > ar->compressedMax ||
+       fread(ar->compressed, block.compressedSize, 1, ar->file) != 1 ||
+       uncompress(ar->encoded, &encodedLength, ar->compressed,
+                  block.compressedSize) != Z_OK ||
+       encodedLength < offset) {
+      goto damaged;
+   }
+
+   for (i = 0; i < NUM_STREAMS; i++) {
+      memcpy(&streams[i].length, ar->encoded + i * sizeof(uint32_t), sizeof(uint32_t));
+      if (streams[i].length > encodedLength - offset) {
+         goto damaged;
+      }
+      streams[i].data = ar->encoded + offset;
+      streams[i].pos = 0;
+      offset += streams[i].length;
+   }
+
+   if (!decodeBlock(streams, ar->raw, block.rawSize)) {
+      goto damaged;
+   }
+
+   ar->nextBlock++;
+   ar->rawLength = block.rawSize;
+   return true;
+
+ damaged:
+   /*
+    * There's no way to tell where the next block starts without the
+    * block table, so treat this like the end of the trace. At least
+    * say why it ended early.
+    */
+   fprintf(stderr, "MemTrace: Archive block %u is damaged\n", ar->nextBlock);
+   ar->nextBlock = ar->header.numBlocks;
+   return false;
+}
+
+
+/*
+ * MemTraceArchive_Read --
+ *
+ *    Read up to 'length' bytes of the raw trace, continuing from the
+ *    last read or seek. Returns the number of bytes read, which is
+ *    short only at the end of the archive or at a damaged block.
+ */
+
+size_t
+MemTraceArchive_Read(MemTraceArchive *ar, uint8_t *buffer, size_t length)
+{
+   size_t done = 0;
+
+   while (done < length) {
+      uint32_t chunk;
+
+      if (ar->rawPos == ar->rawLength && !loadBlock(ar)) {
+         break;
+      }
+
+      chunk = ar->rawLength - ar->rawPos;
+      if (chunk > length - done) {
+         chunk = length - done;
+      }
+      memcpy(buffer + done, ar->raw + ar->rawPos, chunk);
+      ar->rawPos += chunk;
+      done += chunk;
+   }
+
+   return done;
+}
+
+
+/*
+ * MemTraceArchive_Seek --
+ *
+ *    Move to a byte offset in the raw trace. Returns false if the
+ *    archive can't seek, or the offset is out of range.
+ */
+
+bool
+MemTraceArchive_Seek(MemTraceArchive *ar, uint64_t offset)
+{
+   uint32_t block;
+
+   if (!ar->blocks || offset > ar->header.rawSize) {
+      return false;
+   }
+
+   block = offset / ar->header.blockSize;
+   ar->rawLength = 0;
+   ar->rawPos = 0;
+
+   if (block >= ar->header.numBlocks) {
+      // Exactly at the end
+      ar->nextBlock = block;
+      return true;
+   }
+
+   if (fseeko(ar->file, ar->blocks[block], SEEK_SET)) {
+      return false;
+   }
+   ar->nextBlock = block;
+   if (!loadBlock(ar)) {
+      return false;
+   }
+
+   ar->rawPos = offset - (uint64_t)block * ar->header.blockSize;
+   return ar->rawPos <= ar->rawLength;
+}
+
+
+/*
+ * MemTraceArchive_RawSize --
+ *
+ *    Size of the original trace, in bytes.
+ */
+
+uint64_t
+MemTraceArchive_RawSize(const MemTraceArchive *ar)
+{
+   return ar->header.rawSize;
+}
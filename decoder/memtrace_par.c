@@ -0,0 +1,541 @@
+/*
+ * memtrace_par.c - Multi-threaded decoding of memory trace logs.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "memtrace.h"
+
+/*
+ * How this works:
+ *
+ * Every packet has the same alignment signature, so we can pick up
+ * the stream at any byte offset. We cut the trace into chunks at sync
+ * points: ADDR packets which begin a run of SYNC_PACKETS good packets.
+ * Nothing carries over an ADDR packet except the clock and memory, so
+ * each chunk can be decoded on its own, starting from clock zero.
+ *
+ * Each chunk is decoded up to and including the ADDR packet at the
+ * start of the next chunk. That packet ends the chunk's last burst just
+ * as it would in a sequential decode, then both chunks count its one
+ * clock of duration. We subtract it once while stitching.
+ *
+ * Decoded chunks are a list of segments, each a MemOpBatch plus the
+ * result that ended it. The main thread takes finished chunks in order,
+ * offsets their clocks by a running prefix sum, applies their data to
+ * the memory image, and hands them to the caller.
+ *
+ * If a damaged region makes a chunk's decoding overrun the next sync
+ * point at the wrong alignment, the two chunks would disagree about
+ * where packets start. We catch that at the seam and decode both
+ * chunks again as one.
+ */
+
+#define CHUNK_SIZE     (4 * 1024 * 1024)
+#define SYNC_PACKETS   16
+#define SEGMENT_OPS    4096
+
+typedef struct Segment {
+   struct Segment *next;
+   MemOpBatch ops;            // Clocks relative to the chunk's start
+   MemTraceResult result;     // What ended this segment...
+   uint64_t fileOffset;       // ...and where we were at the time
+   uint64_t clocks;
+   uint32_t nextAddr;
+   MemTraceResync resync;     // If result is MEMTR_ERR_SYNC
+   MemOp lost;                // Abandoned burst, if result is an error
+   uint8_t *lostData;
+} Segment;
+
+typedef struct {
+   uint64_t start;            // Sync point where this chunk begins
+   uint64_t end;              // Next chunk's sync point, or end of file
+   Segment *segments;
+   uint64_t clocks;           // Duration, not counting the packet at 'end'
+   bool aligned;              // Decoding arrived exactly at 'end'
+   bool done;
+} Chunk;
+
+typedef struct {
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+
+   const MemTraceState *src;
+   Chunk *chunks;
+   uint32_t numChunks;
+   uint32_t nextChunk;        // Next chunk for a worker to claim
+   uint32_t stitched;         // Chunks the main thread is finished with
+   uint32_t window;           // Max chunks decoded ahead of 'stitched'
+   bool stop;
+   bool failed;
+} ParContext;
+
+
+/*
+ * findSync --
+ *
+ *    Find the first sync point at or after 'offset', before 'limit'.
+ *    Returns 'limit' if there isn't one.
+ */
+
+static uint64_t
+findSync(const MemTraceState *src, uint64_t offset, uint64_t limit)
+{
+   while (offset < limit) {
+      offset += MemPacket_FindSync(src->map + offset, limit - offset,
+                                   SYNC_PACKETS, false);
+
+      if (offset + SYNC_PACKETS * sizeof(MemPacket) > limit) {
+         break;
+      }
+      if (MemPacket_GetType(MemPacket_FromBytes(src->map + offset)) == MEMPKT_ADDR) {
+         return offset;
+      }
+      offset++;
+   }
+
+   return limit;
+}
+
+
+/*
+ * freeSegments --
+ */
+
+static void
+freeSegments(Chunk *chunk)
+{
+   Segment *seg = chunk->segments;
+
+   while (seg) {
+      Segment *next = seg->next;
+      MemOpBatch_Free(&seg->ops);
+      free(seg->lostData);
+      free(seg);
+      seg = next;
+   }
+   chunk->segments = NULL;
+}
+
+
+/*
+ * decodeChunk --
+ *
+ *    Decode one chunk into a list of segments, using 'scratch' as our
+ *    decoder state. Returns false if we ran out of memory.
+ */
+
+static bool
+decodeChunk(Chunk *chunk, MemTraceState *scratch, const MemTraceState *src,
+            bool last)
+{
+   uint64_t viewEnd = last ? chunk->end : chunk->end + sizeof(MemPacket);
+   Segment **tail = &chunk->segments;
+   bool crossed = false;
+   MemTraceResult result;
+
+   // A view of the shared mapping which ends just past our last packet
+   scratch->file = NULL;
+   scratch->map = src->map;
+   scratch->mapBorrowed = true;
+   scratch->mapSize = viewEnd;
+   scratch->syncLimit = src->mapSize;
+   scratch->timestamp.clocks = 0;
+   scratch->nextAddr = 0;
+   memset(&scratch->lostOp, 0, sizeof scratch->lostOp);
+   MemTrace_Seek(scratch, chunk->start);
+
+   do {
+      Segment *seg = calloc(1, sizeof *seg);
+
+      if (!seg || !MemOpBatch_Alloc(&seg->ops, SEGMENT_OPS)) {
+         free(seg);
+         return false;
+      }
+      *tail = seg;
+      tail = &seg->next;
+
+      result = MemTrace_NextBatch(scratch, &seg->ops, SEGMENT_OPS);
+
+      seg->result = result;
+      seg->fileOffset = scratch->fileOffset;
+      seg->clocks = scratch->timestamp.clocks;
+      seg->nextAddr = scratch->nextAddr;
+      seg->resync = scratch->resync;
+
+      /*
+       * Only errors abandon a burst. At EOF, lostOp may be left over
+       * from an earlier batch, and we already delivered it then.
+       */
+      if (result != MEMTR_SUCCESS && result != MEMTR_EOF &&
+          scratch->lostOp.length) {
+         const MemOp *lost = &scratch->lostOp;
+
+         seg->lostData = malloc(lost->length);
+         if (!seg->lostData) {
+            return false;
+         }
+         MemTrace_Read(scratch, lost->addr, seg->lostData, lost->length);
+         seg->lost = *lost;
+      }
+
+      if (result == MEMTR_ERR_SYNC &&
+          scratch->resync.fileOffset + scratch->resync.length > chunk->end) {
+         /*
+          * Resync jumped over the next chunk's first packet. It looked
+          * past the end of our view to get there, just as a sequential
+          * decode would.
+          */
+         crossed = true;
+      }
+   } while (result != MEMTR_EOF);
+
+   chunk->aligned = last || (scratch->fileOffset == viewEnd && !crossed);
+   chunk->clocks = scratch->timestamp.clocks - (last ? 0 : 1);
+
+   return true;
+}
+
+
+/*
+ * worker --
+ *
+ *    Thread body. Claim and decode chunks until there are none left.
+ */
+
+static void *
+worker(void *arg)
+{
+   ParContext *ctx = arg;
+   MemTraceState *scratch = calloc(1, sizeof *scratch);
+
+   pthread_mutex_lock(&ctx->lock);
+
+   if (!scratch) {
+      ctx->failed = true;
+      ctx->stop = true;
+      pthread_cond_broadcast(&ctx->cond);
+   }
+
+   while (!ctx->stop && ctx->nextChunk < ctx->numChunks) {
+      uint32_t index;
+      bool ok;
+
+      if (ctx->nextChunk >= ctx->stitched + ctx->window) {
+         pthread_cond_wait(&ctx->cond, &ctx->lock);
+         continue;
+      }
+
+      index = ctx->nextChunk++;
+      pthread_mutex_unlock(&ctx->lock);
+
+      ok = decodeChunk(&ctx->chunks[index], scratch, ctx->src,
+                       index == ctx->numChunks - 1);
+
+      pthread_mutex_lock(&ctx->lock);
+      ctx->chunks[index].done = true;
+      if (!ok) {
+         ctx->failed = true;
+         ctx->stop = true;
+      }
+      pthread_cond_broadcast(&ctx->cond);
+   }
+
+   pthread_mutex_unlock(&ctx->lock);
+   if (scratch) {
+      MemTrace_Close(scratch);
+   }
+   free(scratch);
+   return NULL;
+}
+
+
+/*
+ * waitForChunk --
+ *
+ *    Wait until a worker has finished with chunk 'index'. Returns false
+ *    if decoding was aborted.
+ */
+
+static bool
+waitForChunk(ParContext *ctx, uint32_t index)
+{
+   bool done;
+
+   pthread_mutex_lock(&ctx->lock);
+   while (!ctx->chunks[index].done && !ctx->stop) {
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+   }
+   done = ctx->chunks[index].done && !ctx->failed;
+   pthread_mutex_unlock(&ctx->lock);
+
+   return done;
+}
+
+
+/*
+ * stitchChunk --
+ *
+ *    Deliver a decoded chunk to the caller. 'base' is the absolute
+ *    clock at the chunk's start. Returns false if the callback asked
+ *    us to stop.
+ */
+
+static bool
+stitchChunk(MemTraceState *state, Chunk *chunk, uint64_t base,
+            MemTraceBatchFn *callback, void *userdata)
+{
+   Segment *seg;
+
+   for (seg = chunk->segments; seg; seg = seg->next) {
+      MemOpBatch *ops = &seg->ops;
+      uint32_t i;
+
+      for (i = 0; i < ops->count; i++) {
+         ops->clocks[i] += base;
+         MemTrace_Write(state, ops->addr[i], ops->data + ops->dataOffset[i],
+                        ops->length[i]);
+      }
+      if (seg->lostData) {
+         MemTrace_Write(state, seg->lost.addr, seg->lostData, seg->lost.length);
+      }
+
+      state->fileOffset = seg->fileOffset;
+      state->timestamp.clocks = base + seg->clocks;
+      state->timestamp.seconds = state->timestamp.clocks / (double)RAM_CLOCK_HZ;
+      state->nextAddr = seg->nextAddr;
+      state->resync = seg->resync;
+
+      if (seg->result == MEMTR_EOF) {
+         // The end of a chunk. Our caller reports the real EOF.
+         if (ops->count && !callback(state, ops, MEMTR_SUCCESS, userdata)) {
+            return false;
+         }
+         continue;
+      }
+
+      if (!callback(state, ops, seg->result, userdata)) {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ * decodeSerial --
+ *
+ *    Decode the rest of the trace on this thread, one batch at a time.
+ */
+
+static bool
+decodeSerial(MemTraceState *state, MemTraceBatchFn *callback, void *userdata)
+{
+   MemOpBatch batch;
+   MemTraceResult result;
+   bool ok;
+
+   if (!MemOpBatch_Alloc(&batch, SEGMENT_OPS)) {
+      return false;
+   }
+   do {
+      result = MemTrace_NextBatch(state, &batch, SEGMENT_OPS);
+      ok = callback(state, &batch, result, userdata);
+   } while (ok && result != MEMTR_EOF);
+
+   MemOpBatch_Free(&batch);
+   return ok;
+}
+
+
+/*
+ * MemTrace_DecodeParallel --
+ *
+ *    Decode the rest of a freshly opened trace using 'jobs' threads.
+ *    The callback is invoked from this thread, in trace order, once for
+ *    each batch of operations, exactly as if each batch had come from
+ *    MemTrace_NextBatch: 'state' is positioned just after the batch,
+ *    its memory image includes the batch, and 'result' says what ended
+ *    it. The final call has result MEMTR_EOF.
+ *
+ *    If the callback returns false, we stop early. Returns false if we
+ *    stopped early or ran out of memory.
+ *
+ *    Traces which aren't memory-mapped are decoded on this thread, as
+ *    are all traces if we can't start any worker threads.
+ */
+
+bool
+MemTrace_DecodeParallel(MemTraceState *state, int jobs,
+                        MemTraceBatchFn *callback, void *userdata)
+{
+   ParContext ctx;
+   pthread_t *threads;
+   uint64_t offset, clocks;
+   uint32_t i, allocated, started;
+   bool ok = true;
+
+   if (!state->map || jobs < 2) {
+      return decodeSerial(state, callback, userdata);
+   }
+
+   memset(&ctx, 0, sizeof ctx);
+   pthread_mutex_init(&ctx.lock, NULL);
+   pthread_cond_init(&ctx.cond, NULL);
+   ctx.src = state;
+   ctx.window = jobs * 2;
+
+   /*
+    * Find all the sync points. The first chunk starts wherever we are now.
+    */
+
+   allocated = state->mapSize / CHUNK_SIZE + 2;
+   ctx.chunks = calloc(allocated, sizeof *ctx.chunks);
+   threads = calloc(jobs, sizeof *threads);
+   if (!ctx.chunks || !threads) {
+      free(ctx.chunks);
+      free(threads);
+      return false;
+   }
+
+   offset = state->fileOffset;
+   while (offset < state->mapSize) {
+      uint64_t next = offset + CHUNK_SIZE;
+
+      next = next < state->mapSize ? findSync(state, next, state->mapSize)
+                                   : state->mapSize;
+
+      ctx.chunks[ctx.numChunks].start = offset;
+      ctx.chunks[ctx.numChunks].end = next;
+      ctx.numChunks++;
+      offset = next;
+   }
+   if (ctx.numChunks == 0) {
+      ctx.chunks[0].start = ctx.chunks[0].end = offset;
+      ctx.numChunks = 1;
+   }
+
+   for (started = 0; started < jobs; started++) {
+      if (pthread_create(&threads[started], NULL, worker, &ctx)) {
+         break;
+      }
+   }
+   if (started == 0) {
+      // Nothing has touched 'state' yet, so we can still go it alone
+      pthread_mutex_destroy(&ctx.lock);
+      pthread_cond_destroy(&ctx.cond);
+      free(ctx.chunks);
+      free(threads);
+      return decodeSerial(state, callback, userdata);
+   }
+
+   /*
+    * Stitch chunks together in order.
+    */
+
+   clocks = state->timestamp.clocks;
+
+   for (i = 0; i < ctx.numChunks && ok; i++) {
+      Chunk *chunk = &ctx.chunks[i];
+      uint32_t next = i + 1;
+
+      ok = waitForChunk(&ctx, i);
+
+      while (ok && !chunk->aligned) {
+         /*
+          * This chunk overran the seam at the wrong alignment. Absorb
+          * the next chunk, leaving it empty, and decode the pair again.
+          */
+
+         MemTraceState *scratch;
+
+         pthread_mutex_lock(&ctx.lock);
+         if (ctx.stitched + ctx.window <= next) {
+            // Let the workers reach it
+            ctx.stitched = next + 1 - ctx.window;
+            pthread_cond_broadcast(&ctx.cond);
+         }
+         pthread_mutex_unlock(&ctx.lock);
+
+         ok = waitForChunk(&ctx, next);
+         if (!ok) {
+            break;
+         }
+
+         freeSegments(chunk);
+         freeSegments(&ctx.chunks[next]);
+         chunk->end = ctx.chunks[next].end;
+         ctx.chunks[next].start = ctx.chunks[next].end;
+         ctx.chunks[next].clocks = 0;
+         ctx.chunks[next].aligned = true;
+
+         scratch = calloc(1, sizeof *scratch);
+         ok = scratch && decodeChunk(chunk, scratch, state,
+                                     next == ctx.numChunks - 1);
+         if (scratch) {
+            MemTrace_Close(scratch);
+         }
+         free(scratch);
+         next++;
+      }
+
+      if (ok) {
+         ok = stitchChunk(state, chunk, clocks, callback, userdata);
+         clocks += chunk->clocks;
+      }
+      freeSegments(chunk);
+
+      pthread_mutex_lock(&ctx.lock);
+      if (ctx.stitched < i + 1) {
+         ctx.stitched = i + 1;
+      }
+      if (!ok) {
+         ctx.stop = true;
+      }
+      pthread_cond_broadcast(&ctx.cond);
+      pthread_mutex_unlock(&ctx.lock);
+   }
+
+   if (ok) {
+      MemOpBatch empty = { 0 };
+      ok = callback(state, &empty, MEMTR_EOF, userdata);
+   }
+
+   for (i = 0; i < started; i++) {
+      pthread_join(threads[i], NULL);
+   }
+   for (i = 0; i < ctx.numChunks; i++) {
+      freeSegments(&ctx.chunks[i]);
+   }
+
+   pthread_mutex_destroy(&ctx.lock);
+   pthread_cond_destroy(&ctx.cond);
+   free(ctx.chunks);
+   free(threads);
+
+   return ok;
+}
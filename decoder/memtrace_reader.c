@@ -0,0 +1,344 @@
+/*
+ * memtrace_reader.c - Opaque-handle interface exported by libmemtrace.so.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "memtrace.h"
+#include "libmemtrace.h"
+
+/*
+ * libmemtrace.h can't include memtrace.h, so it has its own copies of
+ * these. They're part of the ABI and must never change.
+ */
+
+_Static_assert(MTREADER_SUCCESS == MEMTR_SUCCESS &&
+               MTREADER_EOF == MEMTR_EOF &&
+               MTREADER_ERR_SYNC == MEMTR_ERR_SYNC &&
+               MTREADER_ERR_CHECKSUM == MEMTR_ERR_CHECKSUM &&
+               MTREADER_ERR_BADBURST == MEMTR_ERR_BADBURST &&
+               MTREADER_ERR_INDEX == MEMTR_ERR_INDEX &&
+               MTREADER_ERR_NOMEM == MEMTR_ERR_NOMEM, "MemTraceResult");
+_Static_assert(MTREADER_READ == MEMOP_READ && MTREADER_WRITE == MEMOP_WRITE,
+               "MemOpType");
+_Static_assert(MTREADER_MEM_SIZE == MEM_SIZE_BYTES &&
+               MTREADER_PAGE_SIZE == MEM_PAGE_SIZE, "memory layout");
+
+#define READER_BATCH_SIZE  4096
+
+/*
+ * A trace shared by a reader and all of its snapshots. The last one
+ * closed closes the file.
+ */
+typedef struct {
+   uint32_t refCount;
+   MemTraceFile file;
+} ReaderFile;
+
+struct MemTraceReader {
+   ReaderFile *shared;
+   MemTraceCursor cursor;
+   MemOpBatch ops;
+   MemTraceReaderBatch batch;
+};
+
+
+/*
+ * MemTraceReader_Version --
+ *
+ *    Returns this library's MEMTRACE_READER_VERSION.
+ */
+
+uint32_t
+MemTraceReader_Version(void)
+{
+   return MEMTRACE_READER_VERSION;
+}
+
+
+/*
+ * MemTraceReader_ErrorString --
+ */
+
+const char *
+MemTraceReader_ErrorString(int result)
+{
+   return MemTrace_ErrorString(result);
+}
+
+
+/*
+ * newReader --
+ *
+ *    Internal function to allocate a reader on a shared file. The
+ *    caller positions its cursor. Returns NULL if we're out of memory.
+ */
+
+static MemTraceReader *
+newReader(ReaderFile *shared)
+{
+   MemTraceReader *reader = calloc(1, sizeof *reader);
+
+   if (!reader) {
+      return NULL;
+   }
+   if (!MemOpBatch_Alloc(&reader->ops, READER_BATCH_SIZE)) {
+      free(reader);
+      return NULL;
+   }
+
+   reader->shared = shared;
+   __atomic_add_fetch(&shared->refCount, 1, __ATOMIC_RELAXED);
+   return reader;
+}
+
+
+/*
+ * releaseFile --
+ *
+ *    Internal function to drop one reader's reference to its file.
+ */
+
+static void
+releaseFile(ReaderFile *shared)
+{
+   if (__atomic_sub_fetch(&shared->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+      MemTraceFile_Close(&shared->file);
+      free(shared);
+   }
+}
+
+
+/*
+ * MemTraceReader_Open --
+ *
+ *    Open a raw trace or archive, and its index if it has one, with a
+ *    reader at the beginning. Returns NULL on error.
+ */
+
+MemTraceReader *
+MemTraceReader_Open(const char *filename)
+{
+   ReaderFile *shared = calloc(1, sizeof *shared);
+   MemTraceReader *reader;
+
+   if (!shared) {
+      return NULL;
+   }
+   if (!MemTraceFile_Open(&shared->file, filename)) {
+      free(shared);
+      return NULL;
+   }
+
+   reader = newReader(shared);
+   if (!reader) {
+      MemTraceFile_Close(&shared->file);
+      free(shared);
+      return NULL;
+   }
+
+   MemTraceCursor_Open(&reader->cursor, &shared->file);
+   return reader;
+}
+
+
+/*
+ * MemTraceReader_Snapshot --
+ *
+ *    Start a new reader at the same position and with the same memory
+ *    as 'reader'. Memory is shared until one of the two writes to it,
+ *    so this is cheap. The two readers can be used from different
+ *    threads, and closed in any order. Returns NULL if we're out of
+ *    memory.
+ */
+
+MemTraceReader *
+MemTraceReader_Snapshot(const MemTraceReader *reader)
+{
+   MemTraceReader *snapshot = newReader(reader->shared);
+
+   if (snapshot) {
+      MemTraceCursor_Clone(&snapshot->cursor, &reader->cursor);
+   }
+   return snapshot;
+}
+
+
+/*
+ * MemTraceReader_Close --
+ */
+
+void
+MemTraceReader_Close(MemTraceReader *reader)
+{
+   if (!reader) {
+      return;
+   }
+
+   MemTraceCursor_Close(&reader->cursor);
+   MemOpBatch_Free(&reader->ops);
+   releaseFile(reader->shared);
+   free(reader);
+}
+
+
+/*
+ * MemTraceReader_NextBatch --
+ *
+ *    Decode up to 'maxOps' operations (at most 4096 at a time), and
+ *    point '*batch' at them. Returns the result that ended the batch,
+ *    as MemTrace_NextBatch does: the operations in the batch are valid
+ *    even if it's an error or EOF.
+ */
+
+int
+MemTraceReader_NextBatch(MemTraceReader *reader, uint32_t maxOps,
+                         const MemTraceReaderBatch **batch)
+{
+   MemOpBatch *ops = &reader->ops;
+   MemTraceResult result = MemTrace_NextBatch(&reader->cursor.state, ops, maxOps);
+
+   reader->batch.count = ops->count;
+   reader->batch.dataLength = ops->dataLength;
+   reader->batch.type = ops->type;
+   reader->batch.addr = ops->addr;
+   reader->batch.length = ops->length;
+   reader->batch.clocks = ops->clocks;
+   reader->batch.dataOffset = ops->dataOffset;
+   reader->batch.data = ops->data;
+
+   *batch = &reader->batch;
+   return result;
+}
+
+
+/*
+ * MemTraceReader_Seek --
+ *
+ *    Move to the first operation after 'clocks', with memory as it was
+ *    then. This is fast with an index; otherwise we decode our way
+ *    there, from the beginning if we're already past it.
+ */
+
+int
+MemTraceReader_Seek(MemTraceReader *reader, uint64_t clocks)
+{
+   return MemTraceCursor_SeekToTime(&reader->cursor, clocks);
+}
+
+
+/*
+ * MemTraceReader_Query --
+ *
+ *    Look up one number about the reader or its trace. Returns 0 for
+ *    anything this version doesn't know about.
+ */
+
+uint64_t
+MemTraceReader_Query(const MemTraceReader *reader, MemTraceReaderQuery what)
+{
+   const MemTraceState *state = &reader->cursor.state;
+
+   switch (what) {
+
+   case MTREADER_CLOCKS:
+      return state->timestamp.clocks;
+
+   case MTREADER_CLOCK_HZ:
+      return RAM_CLOCK_HZ;
+
+   case MTREADER_FILE_OFFSET:
+      return state->fileOffset;
+
+   case MTREADER_FILE_SIZE:
+      return reader->shared->file.size;
+
+   case MTREADER_HAS_INDEX:
+      return reader->shared->file.hasIndex;
+
+   case MTREADER_RESYNC_OFFSET:
+      return state->resync.fileOffset;
+
+   case MTREADER_RESYNC_LENGTH:
+      return state->resync.length;
+
+   case MTREADER_RESYNC_CLOCKS:
+      return state->resync.clockUncertainty;
+   }
+
+   return 0;
+}
+
+
+/*
+ * MemTraceReader_ReadMemory --
+ *
+ *    Copy bytes out of the current memory image, wrapping around its end.
+ */
+
+void
+MemTraceReader_ReadMemory(const MemTraceReader *reader, uint32_t addr,
+                          void *data, uint32_t length)
+{
+   MemTrace_Read(&reader->cursor.state, addr, data, length);
+}
+
+
+/*
+ * MemTraceReader_PeekPage --
+ *
+ *    Look at one page of the current memory image without copying it.
+ *    The pointer is good until the reader's next call. Returns NULL if
+ *    'page' is out of range.
+ */
+
+const uint8_t *
+MemTraceReader_PeekPage(const MemTraceReader *reader, uint32_t page)
+{
+   if (page >= MEM_NUM_PAGES) {
+      return NULL;
+   }
+   return MemTrace_PeekPage(&reader->cursor.state, page);
+}
+
+
+/*
+ * MemTraceReader_WriteImage --
+ *
+ *    Save the whole memory image to a file. Returns false on error.
+ */
+
+bool
+MemTraceReader_WriteImage(const MemTraceReader *reader, const char *filename)
+{
+   FILE *f = fopen(filename, "wb");
+   bool ok;
+
+   if (!f) {
+      return false;
+   }
+
+   ok = MemTrace_WriteImage(&reader->cursor.state, f);
+   return fclose(f) == 0 && ok;
+}
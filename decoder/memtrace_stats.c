@@ -0,0 +1,440 @@
+/*
+ * memtrace_stats.c - Bus utilization, burst length, and idle gap statistics.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "memtrace.h"
+
+
+/*
+ * MemTraceStats_Init --
+ *
+ *    Start empty statistics, with utilization windows 'windowClocks'
+ *    long, and counts for each of 'symbols' (after
+ *    MemTraceSymbols_Finish) if it isn't NULL. Returns false if we're
+ *    out of memory.
+ */
+
+bool
+MemTraceStats_Init(MemTraceStats *stats, uint64_t windowClocks,
+                   const MemTraceSymbols *symbols)
+{
+   memset(stats, 0, sizeof *stats);
+   stats->windowClocks = windowClocks ? windowClocks : 1;
+
+   if (symbols && symbols->numSymbols) {
+      stats->symbols = symbols;
+      stats->perSymbol = calloc(symbols->numSymbols, sizeof *stats->perSymbol);
+      return stats->perSymbol != NULL;
+   }
+   return true;
+}
+
+
+/*
+ * MemTraceStats_Free --
+ */
+
+void
+MemTraceStats_Free(MemTraceStats *stats)
+{
+   free(stats->windows);
+   free(stats->perSymbol);
+   memset(stats, 0, sizeof *stats);
+}
+
+
+/*
+ * getWindow --
+ *
+ *    Internal function to find the window that 'clock' falls in,
+ *    creating it and any empty windows before it. Returns NULL if we're
+ *    out of memory.
+ */
+
+static MemTraceStatsWindow *
+getWindow(MemTraceStats *stats, uint64_t clock)
+{
+   uint64_t w = clock / stats->windowClocks;
+
+   if (w >= stats->numWindows) {
+      uint64_t alloc = stats->windowsAlloc ? stats->windowsAlloc : 64;
+
+      if (w >= UINT32_MAX / 2) {
+         stats->outOfMemory = true;
+         return NULL;
+      }
+      while (alloc <= w) {
+         alloc *= 2;
+      }
+      if (alloc != stats->windowsAlloc) {
+         MemTraceStatsWindow *windows = realloc(stats->windows, alloc * sizeof *windows);
+
+         if (!windows) {
+            stats->outOfMemory = true;
+            return NULL;
+         }
+         stats->windows = windows;
+         stats->windowsAlloc = alloc;
+      }
+
+      memset(stats->windows + stats->numWindows, 0,
+             (w + 1 - stats->numWindows) * sizeof *stats->windows);
+      stats->numWindows = w + 1;
+   }
+
+   return stats->windows + w;
+}
+
+
+/*
+ * MemTraceStats_Packet --
+ *
+ *    Count one packet, which took 'duration' clocks and ended at
+ *    'clocks'. Address and data packets occupy their last clock, and
+ *    any before it are idle. Timestamp packets are idle throughout.
+ *
+ *    This runs for every packet, so the current window's range is
+ *    cached to skip a division.
+ */
+
+void
+MemTraceStats_Packet(MemTraceStats *stats, MemPacketType type, uint32_t duration,
+                     uint64_t clocks)
+{
+   uint64_t busyClock = clocks - 1;
+   uint64_t gap;
+
+   stats->packets[type]++;
+   stats->clocks = clocks;
+
+   if (type == MEMPKT_TIMESTAMP) {
+      stats->idleClocks += duration;
+      return;
+   }
+
+   gap = stats->idleClocks + duration - 1;
+   if (gap) {
+      stats->gaps[63 - __builtin_clzll(gap)]++;
+      stats->idleClocks = 0;
+   }
+   stats->busyClocks++;
+
+   if (busyClock < stats->windowStart || busyClock >= stats->windowEnd) {
+      MemTraceStatsWindow *window = getWindow(stats, busyClock);
+
+      if (!window) {
+         return;
+      }
+      stats->window = window - stats->windows;
+      stats->windowStart = stats->window * stats->windowClocks;
+      stats->windowEnd = stats->windowStart + stats->windowClocks;
+   }
+   stats->windows[stats->window].busyClocks++;
+}
+
+
+/*
+ * MemTraceStats_Add --
+ *
+ *    Count a batch of decoded operations, and the result that ended it.
+ *    Returns false if we ran out of memory, here or while counting
+ *    packets.
+ */
+
+bool
+MemTraceStats_Add(MemTraceStats *stats, const MemOpBatch *batch,
+                  MemTraceResult result)
+{
+   uint32_t n;
+
+   for (n = 0; n < batch->count; n++) {
+      MemOpType type = batch->type[n];
+      uint32_t length = batch->length[n];
+      MemTraceStatsWindow *window = getWindow(stats, batch->clocks[n]);
+
+      stats->ops[type]++;
+      stats->bytes[type] += length;
+      stats->bursts[type][length < MEMTRACE_STATS_MAX_BURST ?
+                          length : MEMTRACE_STATS_MAX_BURST]++;
+
+      if (window) {
+         window->ops[type]++;
+         window->bytes[type] += length;
+      }
+
+      if (stats->symbols) {
+         uint32_t sym = MemTraceSymbols_Find(stats->symbols, batch->addr[n]);
+
+         if (sym != MEMTRACE_NO_SYMBOL) {
+            stats->perSymbol[sym].ops[type]++;
+            stats->perSymbol[sym].bytes[type] += length;
+         }
+      }
+   }
+
+   if (result != MEMTR_SUCCESS && result != MEMTR_EOF) {
+      stats->errors++;
+   }
+
+   return !stats->outOfMemory;
+}
+
+
+/*
+ * writeRatio --
+ *
+ *    Internal function to write a/b as a JSON number, or null if b is
+ *    zero.
+ */
+
+static void
+writeRatio(FILE *f, uint64_t a, uint64_t b)
+{
+   if (b) {
+      fprintf(f, "%.6f", a / (double)b);
+   } else {
+      fprintf(f, "null");
+   }
+}
+
+
+/*
+ * writeBursts --
+ *
+ *    Internal function to write one burst length histogram, as
+ *    [length, count] pairs for the lengths that occurred.
+ */
+
+static void
+writeBursts(FILE *f, const uint64_t *bursts)
+{
+   const char *sep = "";
+   uint32_t length;
+
+   fprintf(f, "[");
+   for (length = 0; length <= MEMTRACE_STATS_MAX_BURST; length++) {
+      if (bursts[length]) {
+         fprintf(f, "%s[%u, %llu]", sep, length, (unsigned long long)bursts[length]);
+         sep = ", ";
+      }
+   }
+   fprintf(f, "]");
+}
+
+
+/*
+ * writeString --
+ *
+ *    Internal function to write a JSON string, with escapes.
+ */
+
+static void
+writeString(FILE *f, const char *str)
+{
+   fputc('"', f);
+   for (; *str; str++) {
+      unsigned char c = *str;
+
+      if (c == '"' || c == '\\') {
+         fprintf(f, "\\%c", c);
+      } else if (c < 0x20) {
+         fprintf(f, "\\u%04x", c);
+      } else {
+         fputc(c, f);
+      }
+   }
+   fputc('"', f);
+}
+
+
+/*
+ * compareSymbolOps --
+ *
+ *    Sort symbols by the operations on them, busiest first.
+ */
+
+static const MemTraceStatsSymbol *sortingSymbols;
+
+static int
+compareSymbolOps(const void *a, const void *b)
+{
+   const MemTraceStatsSymbol *symA = &sortingSymbols[*(const uint32_t *)a];
+   const MemTraceStatsSymbol *symB = &sortingSymbols[*(const uint32_t *)b];
+   uint64_t opsA = symA->ops[MEMOP_READ] + symA->ops[MEMOP_WRITE];
+   uint64_t opsB = symB->ops[MEMOP_READ] + symB->ops[MEMOP_WRITE];
+
+   if (opsA != opsB) {
+      return opsA > opsB ? -1 : 1;
+   }
+   return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+
+/*
+ * writeSymbols --
+ *
+ *    Internal function to write the symbols that were accessed at all,
+ *    busiest first. Returns false if we're out of memory.
+ */
+
+static bool
+writeSymbols(const MemTraceStats *stats, FILE *f)
+{
+   uint32_t *order = malloc(stats->symbols->numSymbols * sizeof *order);
+   const char *sep = "\n";
+   uint32_t i, count = 0;
+
+   if (!order) {
+      return false;
+   }
+   for (i = 0; i < stats->symbols->numSymbols; i++) {
+      const MemTraceStatsSymbol *s = &stats->perSymbol[i];
+
+      if (s->ops[MEMOP_READ] || s->ops[MEMOP_WRITE]) {
+         order[count++] = i;
+      }
+   }
+
+   // qsort has no context argument; this is only ever called from one thread
+   sortingSymbols = stats->perSymbol;
+   qsort(order, count, sizeof *order, compareSymbolOps);
+
+   fprintf(f, ",\n  \"symbols\": [");
+   for (i = 0; i < count; i++) {
+      const MemTraceSymbol *sym = &stats->symbols->symbols[order[i]];
+      const MemTraceStatsSymbol *s = &stats->perSymbol[order[i]];
+
+      fprintf(f, "%s    {\"name\": ", sep);
+      writeString(f, sym->name);
+      fprintf(f, ", \"addr\": %u, \"reads\": %llu, \"read_bytes\": %llu, "
+              "\"writes\": %llu, \"write_bytes\": %llu}",
+              sym->addr,
+              (unsigned long long)s->ops[MEMOP_READ],
+              (unsigned long long)s->bytes[MEMOP_READ],
+              (unsigned long long)s->ops[MEMOP_WRITE],
+              (unsigned long long)s->bytes[MEMOP_WRITE]);
+      sep = ",\n";
+   }
+   fprintf(f, "%s]", count ? "\n  " : "");
+
+   free(order);
+   return true;
+}
+
+
+/*
+ * MemTraceStats_WriteJSON --
+ *
+ *    Write a report of everything we've counted as a JSON object. All
+ *    times are in clocks, with seconds alongside the totals. Returns
+ *    false on I/O errors, or if we're out of memory.
+ */
+
+bool
+MemTraceStats_WriteJSON(const MemTraceStats *stats, FILE *f)
+{
+   const char *sep = "";
+   uint32_t i;
+
+   fprintf(f, "{\n"
+           "  \"version\": 1,\n"
+           "  \"clock_hz\": %u,\n"
+           "  \"clocks\": %llu,\n"
+           "  \"seconds\": %.6f,\n"
+           "  \"busy_clocks\": %llu,\n"
+           "  \"utilization\": ",
+           RAM_CLOCK_HZ,
+           (unsigned long long)stats->clocks, stats->clocks / (double)RAM_CLOCK_HZ,
+           (unsigned long long)stats->busyClocks);
+   writeRatio(f, stats->busyClocks, stats->clocks);
+
+   fprintf(f, ",\n"
+           "  \"packets\": {\"addr\": %llu, \"read\": %llu, \"write\": %llu, "
+           "\"timestamp\": %llu},\n"
+           "  \"errors\": %llu,\n"
+           "  \"reads\": {\"ops\": %llu, \"bytes\": %llu},\n"
+           "  \"writes\": {\"ops\": %llu, \"bytes\": %llu},\n"
+           "  \"read_write_ratio\": {\"ops\": ",
+           (unsigned long long)stats->packets[MEMPKT_ADDR],
+           (unsigned long long)stats->packets[MEMPKT_READ],
+           (unsigned long long)stats->packets[MEMPKT_WRITE],
+           (unsigned long long)stats->packets[MEMPKT_TIMESTAMP],
+           (unsigned long long)stats->errors,
+           (unsigned long long)stats->ops[MEMOP_READ],
+           (unsigned long long)stats->bytes[MEMOP_READ],
+           (unsigned long long)stats->ops[MEMOP_WRITE],
+           (unsigned long long)stats->bytes[MEMOP_WRITE]);
+   writeRatio(f, stats->ops[MEMOP_READ], stats->ops[MEMOP_WRITE]);
+   fprintf(f, ", \"bytes\": ");
+   writeRatio(f, stats->bytes[MEMOP_READ], stats->bytes[MEMOP_WRITE]);
+
+   fprintf(f, "},\n"
+           "  \"burst_bytes_max\": %u,\n"
+           "  \"burst_bytes\": {\n"
+           "    \"read\": ", MEMTRACE_STATS_MAX_BURST);
+   writeBursts(f, stats->bursts[MEMOP_READ]);
+   fprintf(f, ",\n    \"write\": ");
+   writeBursts(f, stats->bursts[MEMOP_WRITE]);
+
+   fprintf(f, "\n  },\n"
+           "  \"idle_gaps_log2\": [");
+   for (i = 0; i < 64; i++) {
+      if (stats->gaps[i]) {
+         fprintf(f, "%s[%u, %llu]", sep, i, (unsigned long long)stats->gaps[i]);
+         sep = ", ";
+      }
+   }
+
+   fprintf(f, "],\n"
+           "  \"window_clocks\": %llu,\n"
+           "  \"windows\": [",
+           (unsigned long long)stats->windowClocks);
+   sep = "\n";
+   for (i = 0; i < stats->numWindows; i++) {
+      const MemTraceStatsWindow *w = stats->windows + i;
+      uint64_t start = i * stats->windowClocks;
+      uint64_t length = stats->clocks - start < stats->windowClocks ?
+                        stats->clocks - start : stats->windowClocks;
+
+      fprintf(f, "%s    {\"start\": %llu, \"busy_clocks\": %llu, \"utilization\": ",
+              sep, (unsigned long long)start, (unsigned long long)w->busyClocks);
+      writeRatio(f, w->busyClocks, length);
+      fprintf(f, ", \"reads\": %llu, \"read_bytes\": %llu, "
+              "\"writes\": %llu, \"write_bytes\": %llu}",
+              (unsigned long long)w->ops[MEMOP_READ],
+              (unsigned long long)w->bytes[MEMOP_READ],
+              (unsigned long long)w->ops[MEMOP_WRITE],
+              (unsigned long long)w->bytes[MEMOP_WRITE]);
+      sep = ",\n";
+   }
+   fprintf(f, "%s]", stats->numWindows ? "\n  " : "");
+
+   if (stats->symbols && !writeSymbols(stats, f)) {
+      return false;
+   }
+   fprintf(f, "\n}\n");
+
+   return !ferror(f);
+}
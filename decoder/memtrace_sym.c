@@ -0,0 +1,592 @@
+/*
+ * memtrace_sym.c - Symbol names for trace addresses, from ELF symbol tables
+ *                  or map files, with a fast interval lookup.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "elf.h"
+#include "memtrace.h"
+
+/*
+ * Symbols can overlap or nest, so they're flattened into a list of
+ * intervals which don't: each starts at a key address and runs until
+ * the next key, and is covered by one symbol (the innermost) or none.
+ *
+ * The keys are stored in Eytzinger order, the order of a breadth-first
+ * walk of a balanced binary search tree, counting from 1. Node k's
+ * children are 2k and 2k+1, so a search walks down the array and the
+ * first few levels share a handful of cache lines. The search finds
+ * the first key above an address; owners[k] is the symbol covering the
+ * space just before key k, and owners[0] the one after the last key.
+ */
+
+typedef struct {
+   uint64_t start;
+   uint32_t symbol;
+} Interval;
+
+
+/*
+ * MemTraceSymbols_Init --
+ */
+
+void
+MemTraceSymbols_Init(MemTraceSymbols *syms)
+{
+   memset(syms, 0, sizeof *syms);
+}
+
+
+/*
+ * MemTraceSymbols_Free --
+ */
+
+void
+MemTraceSymbols_Free(MemTraceSymbols *syms)
+{
+   uint32_t i;
+
+   for (i = 0; i < syms->numSymbols; i++) {
+      free((char *)syms->symbols[i].name);
+   }
+   free(syms->symbols);
+   free(syms->keys);
+   free(syms->owners);
+   memset(syms, 0, sizeof *syms);
+}
+
+
+/*
+ * traceAddr --
+ *
+ *    Internal function to convert an address the CPUs use to a trace
+ *    address. Addresses that are already trace addresses pass through
+ *    if 'allowTrace' is set. Returns false for anything outside traced
+ *    RAM.
+ */
+
+static bool
+traceAddr(uint32_t cpuAddr, bool allowTrace, uint32_t *addr)
+{
+   if (cpuAddr - MEM_CPU_BASE < MEM_SIZE_BYTES) {
+      *addr = cpuAddr - MEM_CPU_BASE;
+      return true;
+   }
+   if (allowTrace && cpuAddr < MEM_SIZE_BYTES) {
+      *addr = cpuAddr;
+      return true;
+   }
+   return false;
+}
+
+
+/*
+ * addSymbol --
+ *
+ *    Internal function to append a symbol, copying its name. Returns
+ *    false if we're out of memory.
+ */
+
+static bool
+addSymbol(MemTraceSymbols *syms, uint32_t addr, uint32_t size,
+          const char *name, size_t nameLength)
+{
+   MemTraceSymbol *sym;
+   char *copy;
+
+   if (syms->numSymbols == syms->symbolsAlloc) {
+      uint32_t alloc = syms->symbolsAlloc ? syms->symbolsAlloc * 2 : 1024;
+      MemTraceSymbol *symbols = realloc(syms->symbols, alloc * sizeof *symbols);
+
+      if (!symbols) {
+         return false;
+      }
+      syms->symbols = symbols;
+      syms->symbolsAlloc = alloc;
+   }
+
+   copy = malloc(nameLength + 1);
+   if (!copy) {
+      return false;
+   }
+   memcpy(copy, name, nameLength);
+   copy[nameLength] = '\0';
+
+   sym = &syms->symbols[syms->numSymbols++];
+   sym->addr = addr;
+   sym->size = size;
+   sym->name = copy;
+
+   if (nameLength > syms->maxNameLength) {
+      syms->maxNameLength = nameLength;
+   }
+
+   // The table must be rebuilt before the next lookup
+   syms->numIntervals = 0;
+   free(syms->keys);
+   free(syms->owners);
+   syms->keys = NULL;
+   syms->owners = NULL;
+   return true;
+}
+
+
+/*
+ * loadElf --
+ *
+ *    Internal function to load every function and object from an ELF32
+ *    file's symbol tables. Addresses are translated to physical ones
+ *    through the loadable segments, just like HWPatch_LoadELF loads
+ *    them. Assumes both this machine and the ELF file are
+ *    little-endian.
+ */
+
+static bool
+loadElf(MemTraceSymbols *syms, const char *fileName,
+        const uint8_t *file, size_t fileSize)
+{
+   const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *)file;
+   uint32_t i, j;
+
+   if (fileSize < sizeof *ehdr ||
+       ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+       ehdr->e_ident[EI_DATA] != ELFDATA2LSB) {
+      fprintf(stderr, "%s: Not a 32-bit little-endian ELF file\n", fileName);
+      return false;
+   }
+
+   if (ehdr->e_shentsize < sizeof(Elf32_Shdr) ||
+       ehdr->e_shoff > fileSize ||
+       (fileSize - ehdr->e_shoff) / ehdr->e_shentsize < ehdr->e_shnum) {
+      fprintf(stderr, "%s: Bad ELF section headers\n", fileName);
+      return false;
+   }
+
+   if (ehdr->e_phnum &&
+       (ehdr->e_phentsize < sizeof(Elf32_Phdr) ||
+        ehdr->e_phoff + (uint64_t)ehdr->e_phnum * ehdr->e_phentsize > fileSize)) {
+      fprintf(stderr, "%s: Bad ELF program headers\n", fileName);
+      return false;
+   }
+
+   for (i = 0; i < ehdr->e_shnum; i++) {
+      const Elf32_Shdr *shdr = (const Elf32_Shdr *)
+         (file + ehdr->e_shoff + i * ehdr->e_shentsize);
+      const Elf32_Shdr *strtab;
+
+      if ((shdr->sh_type != SHT_SYMTAB && shdr->sh_type != SHT_DYNSYM) ||
+          shdr->sh_link >= ehdr->e_shnum) {
+         continue;
+      }
+      strtab = (const Elf32_Shdr *)(file + ehdr->e_shoff +
+                                    shdr->sh_link * ehdr->e_shentsize);
+
+      if (shdr->sh_offset > fileSize || shdr->sh_size > fileSize - shdr->sh_offset ||
+          strtab->sh_offset > fileSize || strtab->sh_size > fileSize - strtab->sh_offset) {
+         fprintf(stderr, "%s: Bad ELF symbol table\n", fileName);
+         return false;
+      }
+
+      for (j = 0; j + sizeof(Elf32_Sym) <= shdr->sh_size; j += sizeof(Elf32_Sym)) {
+         const Elf32_Sym *sym = (const Elf32_Sym *)(file + shdr->sh_offset + j);
+         const char *name = (const char *)file + strtab->sh_offset + sym->st_name;
+         uint32_t type = ELF32_ST_TYPE(sym->st_info);
+         uint32_t value = sym->st_value;
+         uint32_t addr, p;
+         size_t nameLength;
+
+         if (sym->st_shndx == SHN_UNDEF || sym->st_name >= strtab->sh_size ||
+             (type != STT_NOTYPE && type != STT_OBJECT && type != STT_FUNC)) {
+            continue;
+         }
+         nameLength = strnlen(name, strtab->sh_size - sym->st_name);
+
+         // Skip ARM mapping symbols ($a, $t, $d) and unnamed symbols
+         if (nameLength == 0 || name[0] == '$') {
+            continue;
+         }
+
+         // The low bit of a Thumb function's address selects Thumb mode
+         if (ehdr->e_machine == EM_ARM && type == STT_FUNC) {
+            value &= ~1;
+         }
+
+         for (p = 0; p < ehdr->e_phnum; p++) {
+            const Elf32_Phdr *phdr = (const Elf32_Phdr *)
+               (file + ehdr->e_phoff + p * ehdr->e_phentsize);
+
+            if (phdr->p_type == PT_LOAD && value - phdr->p_vaddr < phdr->p_memsz) {
+               value = value - phdr->p_vaddr + phdr->p_paddr;
+               break;
+            }
+         }
+
+         if (traceAddr(value, false, &addr) &&
+             !addSymbol(syms, addr, sym->st_size, name, nameLength)) {
+            return false;
+         }
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ * parseHex --
+ *
+ *    Internal function to parse a whole token as a hex number, with or
+ *    without a leading "0x".
+ */
+
+static bool
+parseHex(const char *token, uint32_t *value)
+{
+   unsigned long long v;
+   char *end;
+
+   if (!isxdigit((unsigned char)token[0])) {
+      return false;
+   }
+   v = strtoull(token, &end, 16);
+   *value = v;
+   return *end == '\0' && v <= UINT32_MAX;
+}
+
+
+/*
+ * loadMap --
+ *
+ *    Internal function to load a plain text map file. Each line holds a
+ *    hex address, an optional hex size, and a name. The output of "nm"
+ *    and "nm -S" works too: a lone letter after the address or size is
+ *    nm's symbol type, and is skipped. (So a one-digit size needs its
+ *    "0x".) Lines that don't start with an address are ignored.
+ */
+
+static bool
+loadMap(MemTraceSymbols *syms, FILE *f)
+{
+   char line[1024];
+
+   while (fgets(line, sizeof line, f)) {
+      char *tokens[4];
+      char *save = NULL;
+      uint32_t numTokens = 0;
+      uint32_t cpuAddr, addr, size = 0;
+      const char *name;
+      char *token;
+
+      for (token = strtok_r(line, " \t\r\n", &save); token && numTokens < 4;
+           token = strtok_r(NULL, " \t\r\n", &save)) {
+         tokens[numTokens++] = token;
+      }
+      if (numTokens < 2 || !parseHex(tokens[0], &cpuAddr)) {
+         continue;
+      }
+
+      // A single letter is a symbol type from nm, never a size
+      name = tokens[numTokens - 1];
+      if (numTokens >= 3 && !(strlen(tokens[1]) == 1 && isalpha((unsigned char)tokens[1][0])) &&
+          !parseHex(tokens[1], &size)) {
+         continue;
+      }
+      if (numTokens == 4 && strlen(tokens[2]) != 1) {
+         continue;
+      }
+
+      if (traceAddr(cpuAddr, true, &addr) &&
+          !addSymbol(syms, addr, size, name, strlen(name))) {
+         return false;
+      }
+   }
+
+   return !ferror(f);
+}
+
+
+/*
+ * MemTraceSymbols_Load --
+ *
+ *    Add the symbols from an ELF file or a map file (see loadMap).
+ *    Addresses may be CPU addresses in traced RAM, which starts at
+ *    MEM_CPU_BASE, or, in map files, trace addresses. Symbols anywhere
+ *    else are ignored. Returns false on errors, which have already
+ *    been described on stderr.
+ */
+
+bool
+MemTraceSymbols_Load(MemTraceSymbols *syms, const char *fileName)
+{
+   FILE *f = fopen(fileName, "rb");
+   uint8_t magic[SELFMAG];
+   bool ok;
+
+   if (!f) {
+      perror(fileName);
+      return false;
+   }
+   errno = 0;
+
+   if (fread(magic, sizeof magic, 1, f) == 1 && !memcmp(magic, ELFMAG, SELFMAG)) {
+      uint8_t *file = NULL;
+      size_t fileSize = 0, capacity = 0, got;
+
+      // Read the whole thing. Symbol tables are usually near the end.
+      rewind(f);
+      do {
+         if (fileSize == capacity) {
+            uint8_t *bigger;
+
+            capacity = capacity ? capacity * 2 : 1024 * 1024;
+            bigger = realloc(file, capacity);
+            if (!bigger) {
+               break;
+            }
+            file = bigger;
+         }
+         got = fread(file + fileSize, 1, capacity - fileSize, f);
+         fileSize += got;
+      } while (got);
+
+      ok = !ferror(f) && fileSize < capacity && loadElf(syms, fileName, file, fileSize);
+      free(file);
+   } else {
+      rewind(f);
+      ok = loadMap(syms, f);
+   }
+
+   if (!ok && (ferror(f) || errno)) {
+      perror(fileName);
+   }
+   fclose(f);
+   return ok;
+}
+
+
+/*
+ * compareSymbols --
+ *
+ *    Sort by address, then outermost first.
+ */
+
+static int
+compareSymbols(const void *a, const void *b)
+{
+   const MemTraceSymbol *symA = a;
+   const MemTraceSymbol *symB = b;
+
+   if (symA->addr != symB->addr) {
+      return symA->addr < symB->addr ? -1 : 1;
+   }
+   if (symA->size != symB->size) {
+      return symA->size > symB->size ? -1 : 1;
+   }
+   return strcmp(symA->name, symB->name);
+}
+
+
+/*
+ * emitInterval --
+ *
+ *    Internal function to start an interval at 'start' covered by
+ *    'symbol', merging it with the intervals before it if possible.
+ */
+
+static void
+emitInterval(Interval *intervals, uint32_t *count, uint64_t start, uint32_t symbol)
+{
+   uint32_t n = *count;
+
+   if (n && intervals[n - 1].start == start) {
+      n--;
+   }
+   if (n ? intervals[n - 1].symbol != symbol : symbol != MEMTRACE_NO_SYMBOL) {
+      intervals[n].start = start;
+      intervals[n].symbol = symbol;
+      n++;
+   }
+   *count = n;
+}
+
+
+/*
+ * fillTree --
+ *
+ *    Internal function to copy sorted intervals into Eytzinger order,
+ *    by walking the implicit tree in order. Returns the next interval.
+ */
+
+static uint32_t
+fillTree(MemTraceSymbols *syms, const Interval *intervals, uint32_t i, uint32_t k)
+{
+   if (k <= syms->numIntervals) {
+      i = fillTree(syms, intervals, i, 2 * k);
+      syms->keys[k] = intervals[i].start;
+      syms->owners[k] = i ? intervals[i - 1].symbol : MEMTRACE_NO_SYMBOL;
+      i = fillTree(syms, intervals, i + 1, 2 * k + 1);
+   }
+   return i;
+}
+
+
+/*
+ * MemTraceSymbols_Finish --
+ *
+ *    Sort the symbols we've loaded and build the lookup table. Symbols
+ *    without a size run until the next symbol. Call after loading
+ *    symbols, before MemTraceSymbols_Find. Returns false if we're out
+ *    of memory.
+ */
+
+bool
+MemTraceSymbols_Finish(MemTraceSymbols *syms)
+{
+   uint32_t n = syms->numSymbols;
+   uint32_t *stack = NULL;
+   uint64_t *ends = NULL;
+   Interval *intervals = NULL;
+   uint32_t numIntervals = 0, depth = 0;
+   uint32_t i, next;
+   bool ok = false;
+
+   qsort(syms->symbols, n, sizeof *syms->symbols, compareSymbols);
+
+   // Drop exact duplicates, common when a file has both symtab and dynsym
+   for (i = 0, next = 0; i < n; i++) {
+      if (next && !compareSymbols(&syms->symbols[next - 1], &syms->symbols[i])) {
+         free((char *)syms->symbols[i].name);
+      } else {
+         syms->symbols[next++] = syms->symbols[i];
+      }
+   }
+   syms->numSymbols = n = next;
+
+   stack = malloc((n + 1) * sizeof *stack);
+   ends = malloc((n + 1) * sizeof *ends);
+   intervals = malloc((2 * n + 1) * sizeof *intervals);
+   if (!stack || !ends || !intervals) {
+      goto done;
+   }
+
+   for (i = 0, next = 0; i < n; i++) {
+      uint32_t addr = syms->symbols[i].addr;
+
+      while (next < n && syms->symbols[next].addr <= addr) {
+         next++;
+      }
+      if (syms->symbols[i].size) {
+         ends[i] = (uint64_t)addr + syms->symbols[i].size;
+      } else {
+         ends[i] = next < n ? syms->symbols[next].addr : (uint64_t)addr + 1;
+      }
+   }
+
+   /*
+    * Sweep through the symbols in order, keeping a stack of the ones
+    * still open. Whenever one starts or ends, the innermost open
+    * symbol owns the space that follows.
+    */
+
+   for (i = 0; i <= n; i++) {
+      uint64_t limit = i < n ? syms->symbols[i].addr : UINT64_MAX;
+
+      while (depth && ends[stack[depth - 1]] <= limit) {
+         uint64_t end = ends[stack[--depth]];
+
+         while (depth && ends[stack[depth - 1]] <= end) {
+            depth--;
+         }
+         emitInterval(intervals, &numIntervals, end,
+                      depth ? stack[depth - 1] : MEMTRACE_NO_SYMBOL);
+      }
+
+      if (i < n) {
+         stack[depth++] = i;
+         emitInterval(intervals, &numIntervals, syms->symbols[i].addr, i);
+      }
+   }
+
+   // Intervals past the end of memory can't be looked up anyway
+   while (numIntervals && intervals[numIntervals - 1].start >= MEM_SIZE_BYTES) {
+      numIntervals--;
+   }
+
+   free(syms->keys);
+   free(syms->owners);
+   syms->keys = malloc((numIntervals + 1) * sizeof *syms->keys);
+   syms->owners = malloc((numIntervals + 1) * sizeof *syms->owners);
+   if (!syms->keys || !syms->owners) {
+      syms->numIntervals = 0;
+      goto done;
+   }
+
+   syms->numIntervals = numIntervals;
+   syms->keys[0] = 0;
+   syms->owners[0] = numIntervals ? intervals[numIntervals - 1].symbol
+                                  : MEMTRACE_NO_SYMBOL;
+   fillTree(syms, intervals, 0, 1);
+   ok = true;
+
+ done:
+   free(stack);
+   free(ends);
+   free(intervals);
+   return ok;
+}
+
+
+/*
+ * MemTraceSymbols_Find --
+ *
+ *    Find the innermost symbol covering a trace address. Returns its
+ *    index in syms->symbols, or MEMTRACE_NO_SYMBOL.
+ *
+ *    The loop has no unpredictable branches, and prefetches the node
+ *    four levels down, which shares a cache line with its 15 siblings.
+ */
+
+uint32_t
+MemTraceSymbols_Find(const MemTraceSymbols *syms, uint32_t addr)
+{
+   const uint32_t *keys = syms->keys;
+   uint32_t n = syms->numIntervals;
+   uint32_t k = 1;
+
+   if (!keys) {
+      return MEMTRACE_NO_SYMBOL;
+   }
+
+   addr &= MEM_MASK;
+   while (k <= n) {
+      __builtin_prefetch(keys + 16 * k);
+      k = 2 * k + (keys[k] <= addr);
+   }
+
+   // Undo the right turns since the last left one, to find the first key above 'addr'
+   k >>= __builtin_ffs(~k);
+   return syms->owners[k];
+}
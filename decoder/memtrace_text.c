@@ -0,0 +1,668 @@
+/*
+ * memtrace_text.c - Fast text dumps of decoded memory operations.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "memtrace.h"
+
+/*
+ * Each operation becomes one line:
+ *
+ *    0.463965s WRITE [ 2] 00dda7e0:  d6f9          ...    ..
+ *
+ * Bytes are converted with lookup tables, and lines are built in large
+ * buffers that go out with a single fwrite each. The output is exactly
+ * what printf("%11.06fs %-5s [%2d] %08x: ...") would have made.
+ *
+ * With more than one job, operations are copied into slots which
+ * worker threads format in parallel. The caller's thread writes the
+ * slots out in order, so the output doesn't depend on the job count.
+ */
+
+#define TEXT_SLOT_OPS     8192
+#define TEXT_FLUSH_SIZE   (1024 * 1024)
+#define TEXT_MIN_WIDTH    32      // Short bursts are padded to this many bytes
+
+typedef struct {
+   MemOpBatch ops;
+   char *text;
+   size_t textLength;
+   size_t textCapacity;
+   bool formatted;         // Protected by the writer's lock
+   bool error;
+} TextSlot;
+
+struct MemTraceTextWriter {
+   FILE *out;
+   const MemTraceSymbols *symbols;
+   bool error;
+
+   TextSlot *slots;
+   uint32_t numSlots;
+   uint64_t filling;       // Sequence number of the slot taking new operations
+   uint64_t taken;         // Slots before this have been claimed by workers
+   uint64_t written;       // Slots before this have been written out
+
+   pthread_t *threads;
+   int numThreads;
+   pthread_mutex_t lock;
+   pthread_cond_t workReady;
+   pthread_cond_t slotDone;
+   bool quit;
+};
+
+static char hexTable[256][2];
+static char asciiTable[256];
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+
+/*
+ * initTables --
+ */
+
+static void
+initTables(void)
+{
+   static const char digits[] = "0123456789abcdef";
+   int i;
+
+   for (i = 0; i < 256; i++) {
+      hexTable[i][0] = digits[i >> 4];
+      hexTable[i][1] = digits[i & 15];
+      asciiTable[i] = (i >= 0x20 && i < 0x7F) ? i : '.';
+   }
+}
+
+
+/*
+ * lineMax --
+ *
+ *    Internal function for the longest line an operation of 'length'
+ *    bytes can produce.
+ */
+
+static inline size_t
+lineMax(uint32_t length, const MemTraceSymbols *symbols)
+{
+   size_t width = length > TEXT_MIN_WIDTH ? length : TEXT_MIN_WIDTH;
+   return 64 + 4 * width + (symbols ? symbols->maxNameLength + 16 : 0);
+}
+
+
+/*
+ * formatDecimal --
+ *
+ *    Internal function to write an unsigned integer, without padding.
+ */
+
+static inline char *
+formatDecimal(char *out, uint64_t value)
+{
+   char digits[20];
+   int n = 0;
+
+   do {
+      digits[n++] = '0' + value % 10;
+      value /= 10;
+   } while (value);
+
+   while (n) {
+      *out++ = digits[--n];
+   }
+   return out;
+}
+
+
+/*
+ * formatHex --
+ *
+ *    Internal function to write an unsigned integer in hex, without
+ *    padding.
+ */
+
+static inline char *
+formatHex(char *out, uint32_t value)
+{
+   int shift = 24;
+
+   while (shift && !(value >> shift)) {
+      shift -= 8;
+   }
+   if (!(value >> shift >> 4)) {
+      *out++ = hexTable[value >> shift][1];
+      shift -= 8;
+   }
+   for (; shift >= 0; shift -= 8) {
+      memcpy(out, hexTable[(value >> shift) & 0xFF], 2);
+      out += 2;
+   }
+   return out;
+}
+
+
+/*
+ * formatSeconds --
+ *
+ *    Internal function for the "%11.06f" timestamp. We round in integer
+ *    math, which agrees with printf except very close to a rounding
+ *    boundary, where the double it would have been given can land on
+ *    either side. Those (and huge timestamps) go through snprintf.
+ */
+
+static inline char *
+formatSeconds(char *out, uint64_t clocks)
+{
+   if (clocks < (1ULL << 40)) {
+      uint64_t scaled = clocks * 1000000;
+      uint64_t micros = scaled / RAM_CLOCK_HZ;
+      uint64_t twiceRem = 2 * (scaled % RAM_CLOCK_HZ);
+      uint64_t margin = twiceRem > RAM_CLOCK_HZ ? twiceRem - RAM_CLOCK_HZ
+                                                : RAM_CLOCK_HZ - twiceRem;
+
+      if (margin > RAM_CLOCK_HZ / 1000) {
+         char digits[32];
+         char *end = digits;
+         uint32_t frac;
+         int i, length;
+
+         micros += twiceRem > RAM_CLOCK_HZ;
+         frac = micros % 1000000;
+
+         end = formatDecimal(end, micros / 1000000);
+         *end++ = '.';
+         for (i = 5; i >= 0; i--) {
+            end[i] = '0' + frac % 10;
+            frac /= 10;
+         }
+         end += 6;
+
+         length = end - digits;
+         while (length < 11) {
+            *out++ = ' ';
+            length++;
+         }
+         memcpy(out, digits, end - digits);
+         return out + (end - digits);
+      }
+   }
+
+   return out + sprintf(out, "%11.06f", clocks / (double)RAM_CLOCK_HZ);
+}
+
+
+/*
+ * formatOp --
+ *
+ *    Internal function to format one operation. 'out' must have room
+ *    for lineMax(length, symbols) bytes. Returns the new end of the text.
+ */
+
+static char *
+formatOp(char *out, uint64_t clocks, uint8_t type, uint32_t addr,
+         uint32_t length, const uint8_t *data, const MemTraceSymbols *symbols)
+{
+   uint32_t width = length > TEXT_MIN_WIDTH ? length : TEXT_MIN_WIDTH;
+   uint32_t i;
+
+   out = formatSeconds(out, clocks);
+
+   memcpy(out, type == MEMOP_WRITE ? "s WRITE [" : "s read  [", 9);
+   out += 9;
+   if (length < 10) {
+      *out++ = ' ';
+   }
+   out = formatDecimal(out, length);
+   *out++ = ']';
+   *out++ = ' ';
+
+   for (i = 0; i < 4; i++) {
+      memcpy(out, hexTable[(addr >> (24 - 8 * i)) & 0xFF], 2);
+      out += 2;
+   }
+   *out++ = ':';
+   *out++ = ' ';
+
+   // Hex, a space before every 16-bit word
+   for (i = 0; i + 2 <= length; i += 2) {
+      out[0] = ' ';
+      memcpy(out + 1, hexTable[data[i]], 2);
+      memcpy(out + 3, hexTable[data[i + 1]], 2);
+      out += 5;
+   }
+   for (; i < width; i++) {
+      if (!(i & 1)) {
+         *out++ = ' ';
+      }
+      if (i < length) {
+         memcpy(out, hexTable[data[i]], 2);
+      } else {
+         memcpy(out, "  ", 2);
+      }
+      out += 2;
+   }
+
+   *out++ = ' ';
+   *out++ = ' ';
+
+   for (i = 0; i < length; i++) {
+      *out++ = asciiTable[data[i]];
+   }
+   for (; i < width; i++) {
+      *out++ = ' ';
+   }
+
+   if (symbols) {
+      uint32_t sym = MemTraceSymbols_Find(symbols, addr);
+
+      if (sym != MEMTRACE_NO_SYMBOL) {
+         const MemTraceSymbol *s = &symbols->symbols[sym];
+         size_t nameLength = strlen(s->name);
+
+         *out++ = ' ';
+         *out++ = ' ';
+         memcpy(out, s->name, nameLength);
+         out += nameLength;
+         memcpy(out, "+0x", 3);
+         out = formatHex(out + 3, (addr & MEM_MASK) - s->addr);
+      }
+   }
+
+   *out++ = '\n';
+   return out;
+}
+
+
+/*
+ * reserveText --
+ *
+ *    Internal function to make room for 'needed' more bytes of text in
+ *    a slot. Returns false if we're out of memory.
+ */
+
+static bool
+reserveText(TextSlot *slot, size_t needed)
+{
+   if (slot->textLength + needed > slot->textCapacity) {
+      size_t capacity = slot->textCapacity ? slot->textCapacity : TEXT_FLUSH_SIZE;
+      char *bigger;
+
+      while (slot->textLength + needed > capacity) {
+         capacity *= 2;
+      }
+      bigger = realloc(slot->text, capacity);
+      if (!bigger) {
+         return false;
+      }
+      slot->text = bigger;
+      slot->textCapacity = capacity;
+   }
+   return true;
+}
+
+
+/*
+ * formatOps --
+ *
+ *    Internal function to append operations [first, first + count) of
+ *    a batch to a slot's text.
+ */
+
+static bool
+formatOps(TextSlot *slot, const MemOpBatch *batch, uint32_t first, uint32_t count,
+          const MemTraceSymbols *symbols)
+{
+   size_t needed = 0;
+   uint32_t n;
+   char *out;
+
+   for (n = first; n < first + count; n++) {
+      needed += lineMax(batch->length[n], symbols);
+   }
+   if (!reserveText(slot, needed)) {
+      return false;
+   }
+
+   out = slot->text + slot->textLength;
+   for (n = first; n < first + count; n++) {
+      out = formatOp(out, batch->clocks[n], batch->type[n], batch->addr[n],
+                     batch->length[n], batch->data + batch->dataOffset[n], symbols);
+   }
+   slot->textLength = out - slot->text;
+   return true;
+}
+
+
+/*
+ * writeSlot --
+ *
+ *    Internal function to write out a slot's text and empty it.
+ */
+
+static void
+writeSlot(MemTraceTextWriter *w, TextSlot *slot)
+{
+   if (slot->error ||
+       (slot->textLength && fwrite(slot->text, slot->textLength, 1, w->out) != 1)) {
+      w->error = true;
+   }
+   slot->textLength = 0;
+   slot->ops.count = 0;
+   slot->ops.dataLength = 0;
+   slot->error = false;
+}
+
+
+/*
+ * copyOps --
+ *
+ *    Internal function to append operations from 'src' to 'dest',
+ *    which must have room for them. Returns false if we can't grow
+ *    the data heap.
+ */
+
+static bool
+copyOps(MemOpBatch *dest, const MemOpBatch *src, uint32_t first, uint32_t count)
+{
+   uint32_t n, dataLength = 0;
+
+   for (n = first; n < first + count; n++) {
+      dataLength += src->length[n];
+   }
+
+   if (dest->dataLength + dataLength > dest->dataCapacity) {
+      uint32_t capacity = dest->dataCapacity * 2;
+      uint8_t *data;
+
+      while (dest->dataLength + dataLength > capacity) {
+         capacity *= 2;
+      }
+      data = realloc(dest->data, capacity);
+      if (!data) {
+         return false;
+      }
+      dest->data = data;
+      dest->dataCapacity = capacity;
+   }
+
+   for (n = first; n < first + count; n++) {
+      uint32_t i = dest->count++;
+
+      dest->type[i] = src->type[n];
+      dest->addr[i] = src->addr[n];
+      dest->length[i] = src->length[n];
+      dest->clocks[i] = src->clocks[n];
+      dest->dataOffset[i] = dest->dataLength;
+      memcpy(dest->data + dest->dataLength, src->data + src->dataOffset[n],
+             src->length[n]);
+      dest->dataLength += src->length[n];
+   }
+   return true;
+}
+
+
+/*
+ * worker --
+ *
+ *    Formatting thread. Claims filled slots in order and formats them.
+ */
+
+static void *
+worker(void *arg)
+{
+   MemTraceTextWriter *w = arg;
+
+   pthread_mutex_lock(&w->lock);
+   for (;;) {
+      TextSlot *slot;
+
+      while (!w->quit && w->taken == w->filling) {
+         pthread_cond_wait(&w->workReady, &w->lock);
+      }
+      if (w->taken == w->filling) {
+         break;
+      }
+      slot = &w->slots[w->taken++ % w->numSlots];
+      pthread_mutex_unlock(&w->lock);
+
+      slot->error = !formatOps(slot, &slot->ops, 0, slot->ops.count, w->symbols);
+
+      pthread_mutex_lock(&w->lock);
+      slot->formatted = true;
+      pthread_cond_broadcast(&w->slotDone);
+   }
+   pthread_mutex_unlock(&w->lock);
+   return NULL;
+}
+
+
+/*
+ * writeFormatted --
+ *
+ *    Internal function to write out formatted slots, in order, until
+ *    fewer than 'pending' slots are still waiting. Called with the
+ *    lock held.
+ */
+
+static void
+writeFormatted(MemTraceTextWriter *w, uint64_t pending)
+{
+   while (w->filling - w->written >= pending && w->written < w->filling) {
+      TextSlot *slot = &w->slots[w->written % w->numSlots];
+
+      while (!slot->formatted) {
+         pthread_cond_wait(&w->slotDone, &w->lock);
+      }
+
+      // Nobody else touches a formatted slot
+      pthread_mutex_unlock(&w->lock);
+      writeSlot(w, slot);
+      pthread_mutex_lock(&w->lock);
+
+      slot->formatted = false;
+      w->written++;
+   }
+}
+
+
+/*
+ * submitSlot --
+ *
+ *    Internal function to hand the slot being filled to the workers,
+ *    and make sure the next one is free.
+ */
+
+static void
+submitSlot(MemTraceTextWriter *w)
+{
+   pthread_mutex_lock(&w->lock);
+   w->filling++;
+   pthread_cond_signal(&w->workReady);
+   writeFormatted(w, w->numSlots);
+   pthread_mutex_unlock(&w->lock);
+}
+
+
+/*
+ * MemTraceText_Create --
+ *
+ *    Start writing decoded operations to 'out' as text, formatting
+ *    with 'jobs' threads. If 'symbols' isn't NULL, each line ends with
+ *    the symbol and offset of the operation's address. Returns NULL if
+ *    we're out of memory.
+ */
+
+MemTraceTextWriter *
+MemTraceText_Create(FILE *out, int jobs, const MemTraceSymbols *symbols)
+{
+   MemTraceTextWriter *w = calloc(1, sizeof *w);
+   uint32_t i;
+
+   pthread_once(&tablesOnce, initTables);
+
+   if (!w) {
+      return NULL;
+   }
+   w->out = out;
+   w->symbols = symbols;
+   pthread_mutex_init(&w->lock, NULL);
+   pthread_cond_init(&w->workReady, NULL);
+   pthread_cond_init(&w->slotDone, NULL);
+
+   /*
+    * One job formats in the caller's thread, straight into slot 0.
+    * Otherwise, give each worker a slot to format while it has
+    * another waiting, plus the one we're filling.
+    */
+
+   w->numSlots = jobs > 1 ? jobs * 2 + 1 : 1;
+   w->slots = calloc(w->numSlots, sizeof *w->slots);
+   if (!w->slots) {
+      goto fail;
+   }
+
+   if (jobs > 1) {
+      for (i = 0; i < w->numSlots; i++) {
+         if (!MemOpBatch_Alloc(&w->slots[i].ops, TEXT_SLOT_OPS)) {
+            goto fail;
+         }
+      }
+
+      w->threads = calloc(jobs, sizeof *w->threads);
+      if (!w->threads) {
+         goto fail;
+      }
+      for (; w->numThreads < jobs; w->numThreads++) {
+         if (pthread_create(&w->threads[w->numThreads], NULL, worker, w)) {
+            goto fail;
+         }
+      }
+   }
+
+   return w;
+
+ fail:
+   MemTraceText_Close(w);
+   return NULL;
+}
+
+
+/*
+ * MemTraceText_Write --
+ *
+ *    Write operations [first, first + count) of a batch. They may be
+ *    buffered until later calls, or MemTraceText_Close. Returns false
+ *    if anything has failed so far.
+ */
+
+bool
+MemTraceText_Write(MemTraceTextWriter *w, const MemOpBatch *batch,
+                   uint32_t first, uint32_t count)
+{
+   if (!w->threads) {
+      TextSlot *slot = &w->slots[0];
+
+      if (!formatOps(slot, batch, first, count, w->symbols)) {
+         w->error = true;
+      }
+      if (slot->textLength >= TEXT_FLUSH_SIZE) {
+         writeSlot(w, slot);
+      }
+      return !w->error;
+   }
+
+   while (count && !w->error) {
+      TextSlot *slot = &w->slots[w->filling % w->numSlots];
+      uint32_t chunk = slot->ops.capacity - slot->ops.count;
+
+      if (chunk > count) {
+         chunk = count;
+      }
+      if (!copyOps(&slot->ops, batch, first, chunk)) {
+         w->error = true;
+         break;
+      }
+      first += chunk;
+      count -= chunk;
+
+      if (slot->ops.count == slot->ops.capacity) {
+         submitSlot(w);
+      }
+   }
+
+   return !w->error;
+}
+
+
+/*
+ * MemTraceText_Close --
+ *
+ *    Write everything that's still buffered, and free the writer.
+ *    Doesn't close the output file. Returns false if any operations
+ *    couldn't be written.
+ */
+
+bool
+MemTraceText_Close(MemTraceTextWriter *w)
+{
+   bool ok;
+   uint32_t i;
+   int t;
+
+   if (w->threads) {
+      if (w->slots[w->filling % w->numSlots].ops.count) {
+         submitSlot(w);
+      }
+
+      pthread_mutex_lock(&w->lock);
+      writeFormatted(w, 1);
+      w->quit = true;
+      pthread_cond_broadcast(&w->workReady);
+      pthread_mutex_unlock(&w->lock);
+
+      for (t = 0; t < w->numThreads; t++) {
+         pthread_join(w->threads[t], NULL);
+      }
+      free(w->threads);
+
+   } else if (w->slots) {
+      writeSlot(w, &w->slots[0]);
+   }
+
+   if (w->slots) {
+      for (i = 0; i < w->numSlots; i++) {
+         MemOpBatch_Free(&w->slots[i].ops);
+         free(w->slots[i].text);
+      }
+      free(w->slots);
+   }
+
+   pthread_mutex_destroy(&w->lock);
+   pthread_cond_destroy(&w->workReady);
+   pthread_cond_destroy(&w->slotDone);
+
+   ok = !w->error;
+   free(w);
+   return ok;
+}
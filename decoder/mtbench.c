@@ -0,0 +1,573 @@
+/*
+ * mtbench.c - Benchmarks for packet unpacking and whole-trace decoding,
+ *             with JSON results that can be compared against a baseline.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include "memtrace.h"
+
+#define BENCH_MAX_RESULTS  32
+#define BENCH_PACKETS      (4 * 1024 * 1024)
+
+typedef struct {
+   char name[64];
+   char unit[16];
+   double value;            // Higher is better
+} BenchResult;
+
+typedef struct {
+   BenchResult results[BENCH_MAX_RESULTS];
+   int numResults;
+} BenchResults;
+
+static volatile uint64_t sink;   // Keeps results of the micro-benchmarks alive
+
+
+/*
+ * now --
+ */
+
+static double
+now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ * addResult --
+ */
+
+static void
+addResult(BenchResults *r, const char *name, const char *unit, double value)
+{
+   BenchResult *result;
+
+   if (r->numResults == BENCH_MAX_RESULTS) {
+      return;
+   }
+   result = &r->results[r->numResults++];
+   snprintf(result->name, sizeof result->name, "%s", name);
+   snprintf(result->unit, sizeof result->unit, "%s", unit);
+   result->value = value;
+
+   fprintf(stderr, "  %-24s %12.1f %s\n", name,
+           value / (strcmp(unit, "MB/s") ? 1e6 : 1), strcmp(unit, "MB/s") ? "M" : "MB/s");
+}
+
+
+/*
+ * Micro-benchmarks: one MemPacket helper over every packet in a buffer.
+ */
+
+#define BENCH_HELPER(fn, expr)                                  \
+   static uint64_t                                              \
+   fn(const uint8_t *bytes, uint32_t count)                     \
+   {                                                            \
+      uint64_t acc = 0;                                         \
+      uint32_t i;                                               \
+                                                                \
+      for (i = 0; i < count; i++) {                             \
+         MemPacket p = MemPacket_FromBytes(bytes + 4 * i);      \
+         acc += (expr);                                         \
+      }                                                         \
+      return acc;                                               \
+   }
+
+BENCH_HELPER(benchFromBytes, p)
+BENCH_HELPER(benchChecksum, MemPacket_IsChecksumCorrect(p))
+BENCH_HELPER(benchAligned, MemPacket_IsAligned(p))
+BENCH_HELPER(benchPayload, MemPacket_GetPayload(p))
+BENCH_HELPER(benchDuration, MemPacket_GetDuration(p))
+
+
+/*
+ * benchKernel --
+ *
+ *    Run a batch kernel over the whole buffer. On a clean trace it never
+ *    stops early.
+ */
+
+static uint64_t
+benchKernel(MemPacketBatchFn kernel, const uint8_t *bytes, uint32_t count)
+{
+   static MemPacketBatch batch;
+   uint64_t acc = 0;
+   uint32_t i;
+
+   for (i = 0; i + MEMPKT_BATCH_SIZE <= count; i += MEMPKT_BATCH_SIZE) {
+      acc += kernel(bytes + 4 * i, MEMPKT_BATCH_SIZE, &batch);
+      acc += batch.duration[MEMPKT_BATCH_SIZE - 1];
+   }
+   return acc;
+}
+
+
+/*
+ * runMicro --
+ *
+ *    Time each helper and each batch kernel this CPU supports, best of
+ *    'runs', in packets per second.
+ */
+
+static void
+runMicro(BenchResults *r, const uint8_t *bytes, uint32_t count, int runs)
+{
+   static const struct {
+      const char *name;
+      uint64_t (*fn)(const uint8_t *bytes, uint32_t count);
+   } helpers[] = {
+      { "fmt_from_bytes", benchFromBytes },
+      { "fmt_checksum", benchChecksum },
+      { "fmt_aligned", benchAligned },
+      { "fmt_payload", benchPayload },
+      { "fmt_duration", benchDuration },
+   };
+   static const char *kernels[] = { "generic", "bmi2", "sse4.1", "avx2", "avx512" };
+   uint32_t i;
+   int run;
+
+   for (i = 0; i < sizeof helpers / sizeof helpers[0]; i++) {
+      double best = 0;
+
+      for (run = 0; run < runs; run++) {
+         double start = now();
+         double rate;
+
+         sink += helpers[i].fn(bytes, count);
+         rate = count / (now() - start);
+         best = rate > best ? rate : best;
+      }
+      addResult(r, helpers[i].name, "packets/s", best);
+   }
+
+   for (i = 0; i < sizeof kernels / sizeof kernels[0]; i++) {
+      MemPacketBatchFn kernel = MemPacket_BatchKernel(kernels[i]);
+      char name[64];
+      double best = 0;
+
+      if (!kernel) {
+         continue;
+      }
+      for (run = 0; run < runs; run++) {
+         double start = now();
+         double rate;
+
+         sink += benchKernel(kernel, bytes, count);
+         rate = count / (now() - start);
+         best = rate > best ? rate : best;
+      }
+      snprintf(name, sizeof name, "batch_%s", kernels[i]);
+      addResult(r, name, "packets/s", best);
+   }
+}
+
+
+/*
+ * Macro-benchmarks: decode a whole trace file, one way or another.
+ * Each returns false on errors.
+ */
+
+typedef enum {
+   DECODE_NEXT,             // MemTrace_Next, one op at a time
+   DECODE_BATCH,            // MemTrace_NextBatch
+   DECODE_IMAGE,            // MemTrace_NextBatch, then write the image
+   DECODE_TEXT,             // Text output, to /dev/null
+} DecodeMode;
+
+static bool
+decodeTrace(const char *traceFile, DecodeMode mode)
+{
+   static MemTraceState state;
+   MemTraceTextWriter *text = NULL;
+   MemTraceResult result;
+   MemOpBatch batch;
+   FILE *null = fopen("/dev/null", "wb");
+   bool ok = true;
+
+   if (!null) {
+      return false;
+   }
+   if (!MemTrace_Open(&state, traceFile)) {
+      fclose(null);
+      return false;
+   }
+   if (!MemOpBatch_Alloc(&batch, 4096)) {
+      MemTrace_Close(&state);
+      fclose(null);
+      return false;
+   }
+   if (mode == DECODE_TEXT) {
+      text = MemTraceText_Create(null, 1, NULL);
+      ok = text != NULL;
+   }
+
+   do {
+      if (mode == DECODE_NEXT) {
+         result = MemTrace_Next(&state, NULL);
+      } else {
+         result = MemTrace_NextBatch(&state, &batch, batch.capacity);
+         if (text && !MemTraceText_Write(text, &batch, 0, batch.count)) {
+            ok = false;
+         }
+      }
+   } while (ok && result != MEMTR_EOF);
+
+   if (text && !MemTraceText_Close(text)) {
+      ok = false;
+   }
+   if (mode == DECODE_IMAGE && !MemTrace_WriteImage(&state, null)) {
+      ok = false;
+   }
+
+   MemTrace_Close(&state);
+   MemOpBatch_Free(&batch);
+   fclose(null);
+   return ok;
+}
+
+
+/*
+ * runMacro --
+ *
+ *    Time each way of decoding the trace, best of 'runs', in MB/s of
+ *    trace.
+ */
+
+static bool
+runMacro(BenchResults *r, const char *traceFile, uint64_t size, int runs)
+{
+   static const char *names[] = {
+      [DECODE_NEXT] = "decode_next",
+      [DECODE_BATCH] = "decode_batch",
+      [DECODE_IMAGE] = "decode_image",
+      [DECODE_TEXT] = "decode_text",
+   };
+   DecodeMode mode;
+   int run;
+
+   for (mode = DECODE_NEXT; mode <= DECODE_TEXT; mode++) {
+      double best = 0;
+
+      for (run = 0; run < runs; run++) {
+         double start = now();
+         double rate;
+
+         if (!decodeTrace(traceFile, mode)) {
+            return false;
+         }
+         rate = size / 1e6 / (now() - start);
+         best = rate > best ? rate : best;
+      }
+      addResult(r, names[mode], "MB/s", best);
+   }
+   return true;
+}
+
+
+/*
+ * writeResults --
+ *
+ *    Write results as JSON, one per line, which readResults depends on.
+ */
+
+static bool
+writeResults(const BenchResults *r, const char *fileName, uint64_t traceSize, int runs)
+{
+   FILE *f = fopen(fileName, "w");
+   int i;
+
+   if (!f) {
+      return false;
+   }
+
+   fprintf(f, "{\n"
+           "  \"version\": 1,\n"
+           "  \"trace_bytes\": %llu,\n"
+           "  \"runs\": %d,\n"
+           "  \"results\": [\n", (unsigned long long)traceSize, runs);
+   for (i = 0; i < r->numResults; i++) {
+      fprintf(f, "    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.1f}%s\n",
+              r->results[i].name, r->results[i].unit, r->results[i].value,
+              i + 1 < r->numResults ? "," : "");
+   }
+   fprintf(f, "  ]\n}\n");
+
+   return fclose(f) == 0;
+}
+
+
+/*
+ * readResults --
+ *
+ *    Read results written by writeResults.
+ */
+
+static bool
+readResults(BenchResults *r, const char *fileName)
+{
+   FILE *f = fopen(fileName, "r");
+   char line[256];
+
+   if (!f) {
+      return false;
+   }
+
+   r->numResults = 0;
+   while (fgets(line, sizeof line, f) && r->numResults < BENCH_MAX_RESULTS) {
+      BenchResult *result = &r->results[r->numResults];
+
+      if (sscanf(line, " {\"name\": \"%63[^\"]\", \"unit\": \"%15[^\"]\", \"value\": %lf}",
+                 result->name, result->unit, &result->value) == 3) {
+         r->numResults++;
+      }
+   }
+
+   fclose(f);
+   return r->numResults > 0;
+}
+
+
+/*
+ * compareResults --
+ *
+ *    Print each result next to the baseline's. Returns the number of
+ *    results that got slower by more than 'threshold' percent.
+ */
+
+static int
+compareResults(const BenchResults *baseline, const BenchResults *current, double threshold)
+{
+   int regressions = 0;
+   int i, j;
+
+   fprintf(stderr, "\n  %-24s %14s %14s %8s\n", "benchmark", "baseline", "current", "change");
+
+   for (i = 0; i < current->numResults; i++) {
+      const BenchResult *cur = &current->results[i];
+
+      for (j = 0; j < baseline->numResults; j++) {
+         const BenchResult *base = &baseline->results[j];
+         double change;
+
+         if (strcmp(base->name, cur->name) || strcmp(base->unit, cur->unit) ||
+             base->value <= 0) {
+            continue;
+         }
+
+         change = (cur->value / base->value - 1) * 100;
+         fprintf(stderr, "  %-24s %14.1f %14.1f %+7.1f%%%s\n", cur->name,
+                 base->value, cur->value, change,
+                 change < -threshold ? "  REGRESSION" : "");
+         regressions += change < -threshold;
+         break;
+      }
+   }
+
+   return regressions;
+}
+
+
+/*
+ * usage --
+ */
+
+static void
+usage(const char *argv0)
+{
+   fprintf(stderr,
+           "\n"
+           "Benchmark packet unpacking and trace decoding.\n"
+           "\n"
+           "usage: %s [options]\n"
+           "       %s --compare <baseline.json> <current.json>\n"
+           "\n"
+           "Options:\n"
+           "  -o, --output=FILE     Write results as JSON. Default bench.json.\n"
+           "  -b, --baseline=FILE   Compare against earlier results.\n"
+           "  -t, --threshold=PCT   Slowdown that counts as a regression.\n"
+           "                        Default 10.\n"
+           "  -s, --size=MB         Size of the synthetic trace. Default 64.\n"
+           "  -r, --runs=N          Best of N runs. Default 3.\n"
+           "\n"
+           "The synthetic trace is always the same (mtgen's mixed workload,\n"
+           "seed 1), so results are comparable between builds. Exits with\n"
+           "status 2 if anything regressed.\n"
+           "\n", argv0, argv0);
+}
+
+
+int
+main(int argc, char **argv)
+{
+   static const struct option longOpts[] = {
+      { "output", required_argument, NULL, 'o' },
+      { "baseline", required_argument, NULL, 'b' },
+      { "threshold", required_argument, NULL, 't' },
+      { "size", required_argument, NULL, 's' },
+      { "runs", required_argument, NULL, 'r' },
+      { "compare", no_argument, NULL, 'c' },
+      { "help", no_argument, NULL, 'h' },
+      { NULL },
+   };
+   static BenchResults results, baseline;
+   const char *outFile = "bench.json";
+   const char *baselineFile = NULL;
+   double threshold = 10;
+   uint64_t size = 64 * 1024 * 1024;
+   int runs = 3;
+   bool compare = false;
+   char traceFile[] = "/tmp/mtbench-XXXXXX";
+   MemTraceGenOptions genOpts = {
+      .workload = MTGEN_MIXED,
+      .seed = 1,
+      .maxBurst = 16,
+      .idleClocks = 64,
+      .writeFraction = 0.5,
+   };
+   static MemTraceGen gen;
+   uint8_t *buffer;
+   FILE *f;
+   int c, fd;
+   bool ok;
+
+   while ((c = getopt_long(argc, argv, "o:b:t:s:r:h", longOpts, NULL)) != -1) {
+      switch (c) {
+
+      case 'o':
+         outFile = optarg;
+         break;
+
+      case 'b':
+         baselineFile = optarg;
+         break;
+
+      case 't':
+         threshold = strtod(optarg, NULL);
+         break;
+
+      case 's':
+         size = strtoull(optarg, NULL, 0) * 1024 * 1024;
+         break;
+
+      case 'r':
+         runs = atoi(optarg);
+         break;
+
+      case 'c':
+         compare = true;
+         break;
+
+      default:
+         usage(argv[0]);
+         return 1;
+      }
+   }
+
+   if (compare) {
+      if (argc - optind != 2) {
+         usage(argv[0]);
+         return 1;
+      }
+      if (!readResults(&baseline, argv[optind]) || !readResults(&results, argv[optind + 1])) {
+         fprintf(stderr, "Can't read results from %s or %s\n",
+                 argv[optind], argv[optind + 1]);
+         return 1;
+      }
+      return compareResults(&baseline, &results, threshold) ? 2 : 0;
+   }
+
+   if (argc != optind || runs < 1 || size < BENCH_PACKETS * sizeof(MemPacket)) {
+      usage(argv[0]);
+      return 1;
+   }
+
+   if (baselineFile && !readResults(&baseline, baselineFile)) {
+      fprintf(stderr, "Can't read results from %s\n", baselineFile);
+      return 1;
+   }
+
+   /*
+    * The micro-benchmarks run on the start of the trace, in memory. The
+    * rest is generated straight to a temporary file.
+    */
+
+   fd = mkstemp(traceFile);
+   f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+   buffer = malloc(BENCH_PACKETS * sizeof(MemPacket));
+   if (!f || !buffer) {
+      perror("mtbench");
+      return 1;
+   }
+
+   MemTraceGen_Init(&gen, &genOpts);
+   ok = true;
+   while (ok && gen.bytes < size) {
+      uint64_t chunk = size - gen.bytes;
+
+      if (chunk > BENCH_PACKETS * sizeof(MemPacket)) {
+         chunk = BENCH_PACKETS * sizeof(MemPacket);
+      }
+      MemTraceGen_Fill(&gen, buffer, chunk);
+      ok = fwrite(buffer, chunk, 1, f) == 1;
+   }
+   if (fclose(f) || !ok) {
+      perror("write");
+      unlink(traceFile);
+      return 1;
+   }
+
+   // The buffer holds the end of the trace now, so regenerate the start
+   MemTraceGen_Init(&gen, &genOpts);
+   MemTraceGen_Fill(&gen, buffer, BENCH_PACKETS * sizeof(MemPacket));
+
+   fprintf(stderr, "Packets per second:\n");
+   runMicro(&results, buffer, BENCH_PACKETS, runs);
+   free(buffer);
+
+   fprintf(stderr, "Decoding a %llu MB trace:\n", (unsigned long long)(size >> 20));
+   ok = runMacro(&results, traceFile, size, runs);
+   unlink(traceFile);
+   if (!ok) {
+      fprintf(stderr, "Error decoding the synthetic trace\n");
+      return 1;
+   }
+
+   if (!writeResults(&results, outFile, size, runs)) {
+      perror(outFile);
+      return 1;
+   }
+
+   if (baselineFile) {
+      return compareResults(&baseline, &results, threshold) ? 2 : 0;
+   }
+   return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * mtgen.c - Generate a synthetic memory trace, with optional faults, for
+ *           testing and benchmarking without capture hardware.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "memtrace.h"
+
+#define MTGEN_CHUNK  (1024 * 1024)
+
+
+/*
+ * parseSize --
+ *
+ *    Parse a byte count, with an optional K, M, or G suffix.
+ */
+
+static bool
+parseSize(const char *str, uint64_t *size)
+{
+   char *end;
+   double value = strtod(str, &end);
+
+   switch (*end) {
+   case 'k': case 'K': value *= 1024; end++; break;
+   case 'm': case 'M': value *= 1024 * 1024; end++; break;
+   case 'g': case 'G': value *= 1024 * 1024 * 1024; end++; break;
+   }
+
+   *size = value;
+   return end != str && *end == '\0' && value >= 0;
+}
+
+
+/*
+ * parseRate --
+ */
+
+static bool
+parseRate(const char *str, double *rate)
+{
+   char *end;
+
+   *rate = strtod(str, &end);
+   return end != str && *end == '\0' && *rate >= 0 && *rate <= 1;
+}
+
+
+/*
+ * usage --
+ */
+
+static void
+usage(const char *argv0)
+{
+   fprintf(stderr,
+           "\n"
+           "Generate a synthetic RAM trace log. The same options always\n"
+           "produce the same trace.\n"
+           "\n"
+           "usage: %s [options] <trace.raw>\n"
+           "\n"
+           "Options:\n"
+           "  -s, --size=BYTES      Trace size, with optional K/M/G suffix.\n"
+           "                        Default 64M.\n"
+           "  -w, --workload=NAME   random, sequential, polling, iohook, or\n"
+           "                        mixed (the default).\n"
+           "  -S, --seed=N          Random seed. Default 1.\n"
+           "  -b, --burst=WORDS     Longest burst, up to 64. Default 16.\n"
+           "  -i, --idle=CLOCKS     Average idle clocks between bursts.\n"
+           "                        Default 64.\n"
+           "  -W, --writes=FRACTION Fraction of random bursts that write.\n"
+           "                        Default 0.5.\n"
+           "  --drop=RATE           Chance of dropping 1-3 bytes of a packet.\n"
+           "  --corrupt=RATE        Chance of a bad checksum in a packet.\n"
+           "  --overflow=RATE       Chance of an overflow marker before a packet.\n"
+           "\n"
+           "Rates are per packet, from 0 to 1. Use \"-\" to write to stdout.\n"
+           "\n", argv0);
+}
+
+
+int
+main(int argc, char **argv)
+{
+   static const char *workloads[] = {
+      [MTGEN_RANDOM] = "random",
+      [MTGEN_SEQUENTIAL] = "sequential",
+      [MTGEN_POLLING] = "polling",
+      [MTGEN_IOHOOK] = "iohook",
+      [MTGEN_MIXED] = "mixed",
+   };
+   static const struct option longOpts[] = {
+      { "size", required_argument, NULL, 's' },
+      { "workload", required_argument, NULL, 'w' },
+      { "seed", required_argument, NULL, 'S' },
+      { "burst", required_argument, NULL, 'b' },
+      { "idle", required_argument, NULL, 'i' },
+      { "writes", required_argument, NULL, 'W' },
+      { "drop", required_argument, NULL, 'd' },
+      { "corrupt", required_argument, NULL, 'c' },
+      { "overflow", required_argument, NULL, 'o' },
+      { "help", no_argument, NULL, 'h' },
+      { NULL },
+   };
+   static MemTraceGen gen;
+   static uint8_t buffer[MTGEN_CHUNK];
+   MemTraceGenOptions opts = {
+      .workload = MTGEN_MIXED,
+      .seed = 1,
+      .maxBurst = 16,
+      .idleClocks = 64,
+      .writeFraction = 0.5,
+   };
+   uint64_t size = 64 * 1024 * 1024;
+   uint64_t remaining;
+   FILE *out;
+   int c, i;
+
+   while ((c = getopt_long(argc, argv, "s:w:S:b:i:W:h", longOpts, NULL)) != -1) {
+      switch (c) {
+
+      case 's':
+         if (!parseSize(optarg, &size)) {
+            fprintf(stderr, "Invalid size '%s'\n", optarg);
+            return 1;
+         }
+         break;
+
+      case 'w':
+         for (i = 0; i <= MTGEN_MIXED && strcmp(optarg, workloads[i]); i++);
+         if (i > MTGEN_MIXED) {
+            fprintf(stderr, "Unknown workload '%s'\n", optarg);
+            return 1;
+         }
+         opts.workload = i;
+         break;
+
+      case 'S':
+         opts.seed = strtoull(optarg, NULL, 0);
+         break;
+
+      case 'b':
+         opts.maxBurst = atoi(optarg);
+         if (opts.maxBurst < 1 || opts.maxBurst > 64) {
+            fprintf(stderr, "Invalid burst length '%s'\n", optarg);
+            return 1;
+         }
+         break;
+
+      case 'i':
+         opts.idleClocks = strtoul(optarg, NULL, 0);
+         break;
+
+      case 'W':
+         if (!parseRate(optarg, &opts.writeFraction)) {
+            fprintf(stderr, "Invalid fraction '%s'\n", optarg);
+            return 1;
+         }
+         break;
+
+      case 'd':
+      case 'c':
+      case 'o':
+         if (!parseRate(optarg, c == 'd' ? &opts.dropRate :
+                                c == 'c' ? &opts.corruptRate : &opts.overflowRate)) {
+            fprintf(stderr, "Invalid rate '%s'\n", optarg);
+            return 1;
+         }
+         break;
+
+      default:
+         usage(argv[0]);
+         return 1;
+      }
+   }
+
+   if (argc - optind != 1) {
+      usage(argv[0]);
+      return 1;
+   }
+
+   if (!strcmp(argv[optind], "-")) {
+      out = stdout;
+   } else {
+      out = fopen(argv[optind], "wb");
+      if (!out) {
+         perror(argv[optind]);
+         return 1;
+      }
+   }
+
+   MemTraceGen_Init(&gen, &opts);
+
+   for (remaining = size; remaining; ) {
+      size_t chunk = remaining < sizeof buffer ? remaining : sizeof buffer;
+
+      MemTraceGen_Fill(&gen, buffer, chunk);
+      if (fwrite(buffer, chunk, 1, out) != 1) {
+         perror("write");
+         return 1;
+      }
+      remaining -= chunk;
+   }
+
+   if (fclose(out)) {
+      perror("write");
+      return 1;
+   }
+
+   fprintf(stderr, "Generated %llu bytes: %llu packets, %llu bursts, %.06fs of trace\n"
+           "Injected %llu drops, %llu bad checksums, %llu overflows\n",
+           (unsigned long long)gen.bytes, (unsigned long long)gen.packets,
+           (unsigned long long)gen.bursts, gen.clocks / (double)RAM_CLOCK_HZ,
+           (unsigned long long)gen.drops, (unsigned long long)gen.corruptions,
+           (unsigned long long)gen.overflows);
+   return 0;
+}
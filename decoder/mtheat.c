@@ -0,0 +1,156 @@
+/*
+ * mtheat.c - Count reads and writes to each page of memory over time,
+ *            and draw them as an image to find hot data structures.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <getopt.h>
+#include "memtrace.h"
+
+
+/*
+ * countBatch --
+ *
+ *    MemTrace_DecodeParallel callback: count one batch of operations.
+ */
+
+static bool
+countBatch(MemTraceState *state, const MemOpBatch *batch,
+           MemTraceResult result, void *userdata)
+{
+   if (!MemTraceHeatmap_Add(userdata, batch)) {
+      if (errno == ERANGE) {
+         fprintf(stderr, "Too many time buckets. Try a longer --bucket.\n");
+      } else {
+         perror("malloc");
+      }
+      exit(1);
+   }
+   return true;
+}
+
+
+/*
+ * usage --
+ */
+
+static void
+usage(const char *argv0)
+{
+   fprintf(stderr,
+           "\n"
+           "Count reads and writes to each 4 kB page of a RAM trace log,\n"
+           "in time buckets.\n"
+           "\n"
+           "usage: %s [options] <trace.raw> <heat.mtheat> [<image.png|image.pgm>]\n"
+           "\n"
+           "Options:\n"
+           "  -t, --bucket=SECONDS  Length of each time bucket. Default 1.\n"
+           "  -j, --jobs=N          Decode with N threads.\n"
+           "\n"
+           "<heat.mtheat> is a gzip-compressed matrix of counts, laid out as\n"
+           "described in memtrace_heat.c. The image has one column per page\n"
+           "and one row per bucket, brighter for more accesses (log scale).\n"
+           "\n", argv0);
+}
+
+
+int
+main(int argc, char **argv)
+{
+   static const struct option longOpts[] = {
+      { "bucket", required_argument, NULL, 't' },
+      { "jobs", required_argument, NULL, 'j' },
+      { "help", no_argument, NULL, 'h' },
+      { NULL },
+   };
+   static MemTraceState state;
+   MemTraceHeatmap heat;
+   double bucketSeconds = 1.0;
+   uint64_t bucketClocks;
+   int jobs = 1;
+   int nargs, c;
+
+   while ((c = getopt_long(argc, argv, "t:j:h", longOpts, NULL)) != -1) {
+      switch (c) {
+
+      case 't':
+         bucketSeconds = strtod(optarg, NULL);
+         break;
+
+      case 'j':
+         jobs = atoi(optarg);
+         if (jobs < 1) {
+            fprintf(stderr, "Invalid job count '%s'\n", optarg);
+            return 1;
+         }
+         break;
+
+      default:
+         usage(argv[0]);
+         return 1;
+      }
+   }
+
+   nargs = argc - optind;
+   if (nargs < 2 || nargs > 3) {
+      usage(argv[0]);
+      return 1;
+   }
+
+   bucketClocks = bucketSeconds * RAM_CLOCK_HZ + 0.5;
+   if (!(bucketSeconds > 0) || bucketClocks < 1) {
+      fprintf(stderr, "Invalid bucket length\n");
+      return 1;
+   }
+
+   if (!MemTrace_Open(&state, argv[optind])) {
+      perror("open");
+      return 1;
+   }
+
+   MemTraceHeatmap_Init(&heat, bucketClocks);
+   if (!MemTrace_DecodeParallel(&state, jobs, countBatch, &heat)) {
+      perror("decode");
+      return 1;
+   }
+   MemTrace_Close(&state);
+
+   if (!MemTraceHeatmap_Write(&heat, argv[optind + 1])) {
+      perror(argv[optind + 1]);
+      return 1;
+   }
+
+   if (nargs >= 3 && !MemTraceHeatmap_Render(&heat, argv[optind + 2])) {
+      perror(argv[optind + 2]);
+      return 1;
+   }
+
+   fprintf(stderr, "Counted %u buckets of %.06fs\n",
+           heat.numBuckets, bucketClocks / (double)RAM_CLOCK_HZ);
+
+   MemTraceHeatmap_Free(&heat);
+   return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * mtindex.c - Build a time index (.mtidx) for a memory trace log,
+ *             so tools can seek to a timestamp without a full replay.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memtrace.h"
+
+
+int
+main(int argc, char **argv)
+{
+   static MemTraceState state;
+   static MemTraceIndex index;
+   char *indexFile;
+
+   if (argc < 2 || argc > 3) {
+      fprintf(stderr,
+              "\n"
+              "Build a time index for a RAM trace log.\n"
+              "\n"
+              "usage: %s <trace.raw> [<index.mtidx>]\n"
+              "\n"
+              "The index is written to <trace.raw>.mtidx by default, where\n"
+              "the decoder will find it.\n"
+              "\n", argv[0]);
+      return 1;
+   }
+
+   if (argc >= 3) {
+      indexFile = argv[2];
+   } else {
+      indexFile = malloc(strlen(argv[1]) + sizeof ".mtidx");
+      sprintf(indexFile, "%s.mtidx", argv[1]);
+   }
+
+   if (!MemTrace_Open(&state, argv[1])) {
+      perror("open");
+      return 1;
+   }
+
+   if (!MemTraceIndex_Build(&state, indexFile)) {
+      perror("Error writing index");
+      return 1;
+   }
+   MemTrace_Close(&state);
+
+   if (!MemTraceIndex_Open(&index, indexFile)) {
+      fprintf(stderr, "Error reading back index \"%s\"\n", indexFile);
+      return 1;
+   }
+
+   fprintf(stderr, "Indexed %.06fs of trace: %u entries, %u checkpoints\n",
+           index.entries[index.numEntries - 1].clocks / (double)RAM_CLOCK_HZ,
+           index.numEntries, index.numCheckpoints);
+
+   MemTraceIndex_Close(&index);
+   return 0;
+}
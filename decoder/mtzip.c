@@ -0,0 +1,150 @@
+/*
+ * mtzip.c - Convert memory trace logs to and from compressed,
+ *           seekable archives (.mtz).
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memtrace.h"
+
+
+/*
+ * extract --
+ *
+ *    Decompress an archive back into the original raw trace.
+ */
+
+static bool
+extract(FILE *in, FILE *out)
+{
+   static uint8_t buffer[1024 * 1024];
+   uint8_t magic[MEMTRACE_ARCHIVE_MAGIC_SIZE];
+   MemTraceArchive *ar;
+   uint64_t remaining;
+   size_t result;
+
+   if (fread(magic, sizeof magic, 1, in) != 1 ||
+       !MemTraceArchive_IsArchive(magic, sizeof magic)) {
+      fprintf(stderr, "Not a trace archive\n");
+      return false;
+   }
+
+   ar = MemTraceArchive_Open(in);
+   if (!ar) {
+      fprintf(stderr, "Damaged trace archive\n");
+      return false;
+   }
+
+   remaining = MemTraceArchive_RawSize(ar);
+   while ((result = MemTraceArchive_Read(ar, buffer, sizeof buffer)) > 0) {
+      if (fwrite(buffer, result, 1, out) != 1) {
+         perror("write");
+         MemTraceArchive_Close(ar);
+         return false;
+      }
+      remaining -= result;
+   }
+   MemTraceArchive_Close(ar);
+
+   if (remaining) {
+      fprintf(stderr, "Damaged trace archive\n");
+      return false;
+   }
+   return true;
+}
+
+
+int
+main(int argc, char **argv)
+{
+   bool decompress = argc > 1 && !strcmp(argv[1], "-d");
+   const char *suffix = decompress ? ".raw" : ".mtz";
+   char *inFile, *outFile;
+   FILE *in, *out;
+   bool ok;
+
+   if (decompress) {
+      argc--;
+      argv++;
+   }
+
+   if (argc < 2 || argc > 3) {
+      fprintf(stderr,
+              "\n"
+              "Compress a RAM trace log into a seekable archive.\n"
+              "\n"
+              "usage: mtzip <trace.raw> [<trace.mtz>]\n"
+              "       mtzip -d <trace.mtz> [<trace.raw>]\n"
+              "\n"
+              "The decoder and mtindex read archives directly. By default,\n"
+              "the output file is the input file plus \".mtz\" (or \".raw\").\n"
+              "\n");
+      return 1;
+   }
+
+   inFile = argv[1];
+   if (argc >= 3) {
+      outFile = argv[2];
+   } else {
+      outFile = malloc(strlen(inFile) + strlen(suffix) + 1);
+      sprintf(outFile, "%s%s", inFile, suffix);
+   }
+
+   in = fopen(inFile, "rb");
+   if (!in) {
+      perror(inFile);
+      return 1;
+   }
+   out = fopen(outFile, "wb");
+   if (!out) {
+      perror(outFile);
+      return 1;
+   }
+
+   if (decompress) {
+      ok = extract(in, out);
+   } else {
+      ok = MemTraceArchive_Create(in, out);
+      if (ok) {
+         unsigned long long inSize = ftello(in);
+         unsigned long long outSize;
+
+         fseeko(out, 0, SEEK_END);
+         outSize = ftello(out);
+
+         fprintf(stderr, "Compressed %llu bytes to %llu (%.2f:1)\n",
+                 inSize, outSize, outSize ? inSize / (double)outSize : 0.0);
+      } else {
+         perror("Error writing archive");
+      }
+   }
+
+   fclose(in);
+   if (fclose(out)) {
+      ok = false;
+   }
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+/*
+ * capture_ring.c - Lock-free ring buffer between the USB thread and the
+ *                  threads that store and parse the trace.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "capture_ring.h"
+
+// How long an idle reader sleeps before looking again
+#define CAPTURE_RING_POLL_NSEC  (200 * 1000)
+
+
+/*
+ * CaptureRing_Init --
+ *
+ *    Allocate a ring of at least 'size' bytes, rounded up to a power of
+ *    two, for 'numReaders' readers. The whole buffer is touched now, so
+ *    the USB thread never waits for the kernel to find it a page.
+ *    Returns false if we're out of memory.
+ */
+
+bool
+CaptureRing_Init(CaptureRing *ring, size_t size, int numReaders)
+{
+   memset(ring, 0, sizeof *ring);
+
+   ring->size = 1;
+   while (ring->size < size) {
+      ring->size <<= 1;
+   }
+
+   ring->buffer = malloc(ring->size);
+   if (!ring->buffer || numReaders > CAPTURE_RING_MAX_READERS) {
+      free(ring->buffer);
+      return false;
+   }
+   memset(ring->buffer, 0, ring->size);
+
+   ring->numReaders = numReaders;
+   return true;
+}
+
+
+/*
+ * CaptureRing_Free --
+ *
+ *    Free the buffer. All threads must be finished with the ring.
+ */
+
+void
+CaptureRing_Free(CaptureRing *ring)
+{
+   free(ring->buffer);
+   ring->buffer = NULL;
+}
+
+
+/*
+ * CaptureRing_Fill --
+ *
+ *    How many bytes the slowest reader hasn't consumed yet. Only the
+ *    writer's thread may ask.
+ */
+
+uint64_t
+CaptureRing_Fill(CaptureRing *ring)
+{
+   uint64_t head = ring->head.pos;
+   uint64_t fill = 0;
+   int i;
+
+   for (i = 0; i < ring->numReaders; i++) {
+      uint64_t waiting = head - __atomic_load_n(&ring->tails[i].pos, __ATOMIC_ACQUIRE);
+
+      if (waiting > fill) {
+         fill = waiting;
+      }
+   }
+   return fill;
+}
+
+
+/*
+ * CaptureRing_Write --
+ *
+ *    Append 'length' bytes, and make them visible to every reader.
+ *    Only one thread may write. Returns false without writing anything
+ *    if there isn't room.
+ */
+
+bool
+CaptureRing_Write(CaptureRing *ring, const uint8_t *data, size_t length)
+{
+   uint64_t head = ring->head.pos;
+   uint64_t fill = CaptureRing_Fill(ring);
+   size_t offset = head & (ring->size - 1);
+   size_t first = ring->size - offset;
+
+   if (length > ring->size - fill) {
+      return false;
+   }
+
+   if (first > length) {
+      first = length;
+   }
+   memcpy(ring->buffer + offset, data, first);
+   memcpy(ring->buffer, data + first, length - first);
+
+   __atomic_store_n(&ring->head.pos, head + length, __ATOMIC_RELEASE);
+
+   if (fill + length > ring->highWater) {
+      ring->highWater = fill + length;
+   }
+   return true;
+}
+
+
+/*
+ * CaptureRing_Close --
+ *
+ *    Called by the writer after its last write. Readers see EOF once
+ *    they've caught up.
+ */
+
+void
+CaptureRing_Close(CaptureRing *ring)
+{
+   __atomic_store_n(&ring->closed, true, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * CaptureRing_Peek --
+ *
+ *    Wait for data, and point '*data' at the oldest bytes 'reader'
+ *    hasn't consumed. Returns how many bytes are there in one contiguous
+ *    span, up to CAPTURE_RING_MAX_CHUNK, or 0 at EOF. The span may end in
+ *    the middle of a packet, wherever the ring wraps.
+ */
+
+size_t
+CaptureRing_Peek(CaptureRing *ring, int reader, const uint8_t **data)
+{
+   const struct timespec poll = { 0, CAPTURE_RING_POLL_NSEC };
+   uint64_t tail = ring->tails[reader].pos;
+
+   for (;;) {
+      bool closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+      uint64_t head = __atomic_load_n(&ring->head.pos, __ATOMIC_ACQUIRE);
+
+      if (head != tail) {
+         size_t offset = tail & (ring->size - 1);
+         size_t length = head - tail;
+
+         if (length > ring->size - offset) {
+            length = ring->size - offset;
+         }
+         if (length > CAPTURE_RING_MAX_CHUNK) {
+            length = CAPTURE_RING_MAX_CHUNK;
+         }
+
+         *data = ring->buffer + offset;
+         return length;
+      }
+
+      // 'closed' was read first, so nothing can have been written after it
+      if (closed) {
+         return 0;
+      }
+
+      nanosleep(&poll, NULL);
+   }
+}
+
+
+/*
+ * CaptureRing_Consume --
+ *
+ *    Release 'length' bytes from the last Peek back to the writer.
+ */
+
+void
+CaptureRing_Consume(CaptureRing *ring, int reader, size_t length)
+{
+   __atomic_store_n(&ring->tails[reader].pos, ring->tails[reader].pos + length,
+                    __ATOMIC_RELEASE);
+}
@@ -0,0 +1,80 @@
+/*
+ * capture_ring.h - Lock-free ring buffer between the USB thread and the
+ *                  threads that store and parse the trace.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __CAPTURE_RING_H
+#define __CAPTURE_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * One thread writes to the ring, and each of up to
+ * CAPTURE_RING_MAX_READERS threads reads everything written, at its own
+ * pace. Writes never block: if the slowest reader is a whole ring behind,
+ * the write fails, and it's up to the writer to give up. Readers sleep
+ * briefly when there's nothing new.
+ *
+ * Each position is a free-running byte count, so the amount waiting is
+ * always head - tail. The head and every tail live on their own cache
+ * lines, so the threads don't fight over them.
+ */
+
+#define CAPTURE_RING_MAX_READERS  2
+#define CAPTURE_RING_MAX_CHUNK    (1024 * 1024)   // Largest span handed to a reader
+
+typedef struct {
+   uint64_t pos;
+   uint8_t pad[64 - sizeof(uint64_t)];
+} CaptureRingCursor;
+
+typedef struct {
+   CaptureRingCursor head;
+   CaptureRingCursor tails[CAPTURE_RING_MAX_READERS];
+
+   uint8_t *buffer;
+   size_t size;               // Power of two
+   int numReaders;
+   bool closed;               // No more writes are coming
+   uint64_t highWater;        // Most bytes ever waiting, as seen by the writer
+} CaptureRing;
+
+
+/*
+ * Public functions
+ */
+
+bool CaptureRing_Init(CaptureRing *ring, size_t size, int numReaders);
+void CaptureRing_Free(CaptureRing *ring);
+
+bool CaptureRing_Write(CaptureRing *ring, const uint8_t *data, size_t length);
+void CaptureRing_Close(CaptureRing *ring);
+uint64_t CaptureRing_Fill(CaptureRing *ring);
+
+size_t CaptureRing_Peek(CaptureRing *ring, int reader, const uint8_t **data);
+void CaptureRing_Consume(CaptureRing *ring, int reader, size_t length);
+
+
+#endif // __CAPTURE_RING_H
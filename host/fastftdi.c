@@ -259,44 +259,56 @@ FTDIDevice_ReadByteSync(FTDIDevice *dev, FTDIInterface interface, uint8_t *byte)
 }
 
 
+/*
+ * Internal function to squeeze the FTDI headers out of a transfer, in
+ * place. Each 512-byte packet carries a 2-byte status header and up to
+ * 510 bytes of payload; afterwards the payloads are back to back at the
+ * start of the buffer. Returns the payload length.
+ *
+ * Every payload moves toward the start of the buffer, so a forward copy
+ * never overwrites bytes it hasn't read yet. memmove() is the fastest
+ * vectorized copy the C library has, and it handles the overlap.
+ */
+
+static int
+CompactPayload(uint8_t *buffer, int length)
+{
+   uint8_t *dest = buffer;
+   uint8_t *packet = buffer;
+
+   while (length > FTDI_HEADER_SIZE) {
+      int payloadLen = (length > FTDI_PACKET_SIZE ? FTDI_PACKET_SIZE : length)
+                       - FTDI_HEADER_SIZE;
+
+      memmove(dest, packet + FTDI_HEADER_SIZE, payloadLen);
+      dest += payloadLen;
+      packet += FTDI_PACKET_SIZE;
+      length -= FTDI_PACKET_SIZE;
+   }
+
+   return dest - buffer;
+}
+
+
 /*
  * Internal callback for one transfer's worth of stream data.
- * Split it into packets and invoke the callbacks.
+ * Strip the packet headers and hand the rest to the callback in one piece.
  */
 
 static void
 ReadStreamCallback(struct libusb_transfer *transfer)
 {
    FTDIStreamState *state = transfer->user_data;
-   int err;
 
    if (state->result == 0) {
       if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+         int length = CompactPayload(transfer->buffer, transfer->actual_length);
 
-         int i;
-         uint8_t *ptr = transfer->buffer;
-         int length = transfer->actual_length;
-         int numPackets = (length + FTDI_PACKET_SIZE - 1) >> FTDI_LOG_PACKET_SIZE;
-
-         for (i = 0; i < numPackets; i++) {
-            int payloadLen;
-            int packetLen = length;
-
-            if (packetLen > FTDI_PACKET_SIZE)
-               packetLen = FTDI_PACKET_SIZE;
-
-            payloadLen = packetLen - FTDI_HEADER_SIZE;
-            state->progress.current.totalBytes += payloadLen;
-
-            state->result = state->callback(ptr + FTDI_HEADER_SIZE, payloadLen,
+         if (length) {
+            state->progress.current.totalBytes += length;
+            state->result = state->callback(transfer->buffer, length,
                                             NULL, state->userdata);
-            if (state->result)
-               break;
-
-            ptr += packetLen;
-            length -= packetLen;
          }
-
       } else {
          state->result = LIBUSB_ERROR_IO;
       }
@@ -305,6 +317,9 @@ ReadStreamCallback(struct libusb_transfer *transfer)
    if (state->result == 0) {
       transfer->status = -1;
       state->result = libusb_submit_transfer(transfer);
+      if (state->result) {
+         transfer->status = LIBUSB_TRANSFER_ERROR;
+      }
    }
 }
 
@@ -316,6 +331,78 @@ TimevalDiff(const struct timeval *a, const struct timeval *b)
 }
 
 
+/*
+ * Internal function to wait until none of a stream's transfers are in
+ * flight. Returns false if libusb stopped handling events first, in
+ * which case the transfers and their buffers must not be freed.
+ */
+
+static bool
+DrainTransfers(FTDIDevice *dev, struct libusb_transfer **transfers,
+               int numTransfers)
+{
+   for (;;) {
+      struct timeval timeout = { 0, 100000 };
+      bool pending = false;
+      int xferIndex;
+      int err;
+
+      for (xferIndex = 0; xferIndex < numTransfers; xferIndex++) {
+         if (transfers[xferIndex] && transfers[xferIndex]->status == -1) {
+            pending = true;
+         }
+      }
+      if (!pending) {
+         return true;
+      }
+
+      err = libusb_handle_events_timeout(dev->libusb, &timeout);
+      if (err && err != LIBUSB_ERROR_INTERRUPTED) {
+         return false;
+      }
+   }
+}
+
+
+/*
+ * Internal functions to allocate and free the memory behind all of a
+ * stream's transfers, as one block. Where libusb and the kernel support
+ * it, this is memory mapped from usbfs, so the kernel can DMA straight
+ * into it instead of copying through a buffer of its own. The block
+ * must outlive every transfer using it, cancelled ones included.
+ */
+
+static uint8_t *
+AllocStreamBuffers(FTDIDevice *dev, size_t size, bool *devMem)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+   uint8_t *buffers = libusb_dev_mem_alloc(dev->handle, size);
+
+   if (buffers) {
+      *devMem = true;
+      return buffers;
+   }
+#endif
+
+   *devMem = false;
+   return malloc(size);
+}
+
+
+static void
+FreeStreamBuffers(FTDIDevice *dev, uint8_t *buffers, size_t size, bool devMem)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+   if (devMem) {
+      libusb_dev_mem_free(dev->handle, buffers, size);
+      return;
+   }
+#endif
+
+   free(buffers);
+}
+
+
 /*
  * Use asynchronous transfers in libusb-1.0 for high-performance
  * streaming of data from a device interface back to the PC. This
@@ -323,8 +410,9 @@ TimevalDiff(const struct timeval *a, const struct timeval *b)
  * or the callback returns a nonzero value. This function returns
  * a libusb error code or the callback's return value.
  *
- * For every contiguous block of received data, the callback will
- * be invoked.
+ * The callback is invoked once per completed transfer, with all of
+ * its payload as one contiguous block (up to packetsPerTransfer * 510
+ * bytes). The block is only valid until the callback returns.
  */
 
 int
@@ -335,6 +423,10 @@ FTDIDevice_ReadStream(FTDIDevice *dev, FTDIInterface interface,
    struct libusb_transfer **transfers;
    FTDIStreamState state = { callback, userdata };
    int bufferSize = packetsPerTransfer * FTDI_PACKET_SIZE;
+   size_t buffersSize = (size_t)bufferSize * numTransfers;
+   uint8_t *buffers;
+   bool devMem;
+   bool drained = true;
    int xferIndex;
    int err = 0;
 
@@ -343,7 +435,8 @@ FTDIDevice_ReadStream(FTDIDevice *dev, FTDIInterface interface,
     */
 
    transfers = calloc(numTransfers, sizeof *transfers);
-   if (!transfers) {
+   buffers = AllocStreamBuffers(dev, buffersSize, &devMem);
+   if (!transfers || !buffers) {
       err = LIBUSB_ERROR_NO_MEM;
       goto cleanup;
    }
@@ -359,18 +452,15 @@ FTDIDevice_ReadStream(FTDIDevice *dev, FTDIInterface interface,
       }
 
       libusb_fill_bulk_transfer(transfer, dev->handle, FTDI_EP_IN(interface),
-                                malloc(bufferSize), bufferSize, ReadStreamCallback,
-                                &state, 0);
-
-      if (!transfer->buffer) {
-         err = LIBUSB_ERROR_NO_MEM;
-         goto cleanup;
-      }
+                                buffers + (size_t)xferIndex * bufferSize, bufferSize,
+                                ReadStreamCallback, &state, 0);
 
       transfer->status = -1;
       err = libusb_submit_transfer(transfer);
-      if (err)
+      if (err) {
+         transfer->status = LIBUSB_TRANSFER_ERROR;
          goto cleanup;
+      }
    }
 
    /*
@@ -422,17 +512,39 @@ FTDIDevice_ReadStream(FTDIDevice *dev, FTDIInterface interface,
 
  cleanup:
    if (transfers) {
+      /*
+       * A cancelled transfer still belongs to libusb until its callback
+       * runs. Keep handling events until every one is back, so nothing
+       * completes into freed memory. (Or into our next ReadStream, whose
+       * callbacks would be handed this one's stale state.)
+       */
+
+      if (!state.result) {
+         // We failed during setup. Stop the callbacks from resubmitting.
+         state.result = err;
+      }
       for (xferIndex = 0; xferIndex < numTransfers; xferIndex++) {
          struct libusb_transfer *transfer = transfers[xferIndex];
 
-         if (transfer) {
-            if (transfer->status == -1)
-               libusb_cancel_transfer(transfer);
-            free(transfer->buffer);
-            libusb_free_transfer(transfer);
+         if (transfer && transfer->status == -1)
+            libusb_cancel_transfer(transfer);
+      }
+      drained = DrainTransfers(dev, transfers, numTransfers);
+
+      if (drained) {
+         for (xferIndex = 0; xferIndex < numTransfers; xferIndex++) {
+            libusb_free_transfer(transfers[xferIndex]);
          }
+         free(transfers);
       }
-      free(transfers);
+   }
+
+   /*
+    * The kernel may still be writing into a transfer we couldn't drain,
+    * and device memory is unmapped from usbfs as soon as we free it.
+    */
+   if (buffers && drained) {
+      FreeStreamBuffers(dev, buffers, buffersSize, devMem);
    }
 
    if (err)
@@ -0,0 +1,219 @@
+/*
+ * flight_recorder.c - Keeps the most recent part of a capture in memory,
+ *                     for saving once something interesting happens.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+#include "flight_recorder.h"
+#include "memtrace_fmt.h"
+#include "memtrace_batch.h"
+
+// Good packets in a row that mark where the saved window may start
+#define SYNC_PACKETS  16
+
+
+/*
+ * FlightRecorder_Init --
+ *
+ *    Map and prefault the ring, so capture never waits on a page
+ *    fault. Explicit huge pages first, then transparent ones, then
+ *    whatever we get. Returns false if there's no memory at all.
+ */
+
+bool
+FlightRecorder_Init(FlightRecorder *fr, size_t size)
+{
+   memset(fr, 0, sizeof *fr);
+   fr->size = size & ~(sizeof(MemPacket) - 1);
+
+#ifdef MAP_HUGETLB
+   fr->mapped = (fr->size + FLIGHT_HUGE_PAGE_SIZE - 1) & ~(size_t)(FLIGHT_HUGE_PAGE_SIZE - 1);
+   fr->buffer = mmap(NULL, fr->mapped, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+   fr->hugePages = fr->buffer != MAP_FAILED;
+#endif
+
+   if (!fr->hugePages) {
+      fr->mapped = fr->size;
+      fr->buffer = mmap(NULL, fr->mapped, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (fr->buffer == MAP_FAILED) {
+         fr->buffer = NULL;
+         return false;
+      }
+#ifdef MADV_HUGEPAGE
+      fr->hugePages = madvise(fr->buffer, fr->mapped, MADV_HUGEPAGE) == 0;
+#endif
+   }
+
+   memset(fr->buffer, 0, fr->mapped);
+   return true;
+}
+
+
+/*
+ * FlightRecorder_Free --
+ */
+
+void
+FlightRecorder_Free(FlightRecorder *fr)
+{
+   if (fr->buffer) {
+      munmap(fr->buffer, fr->mapped);
+      fr->buffer = NULL;
+   }
+}
+
+
+/*
+ * FlightRecorder_Write --
+ *
+ *    Record more of the stream, overwriting the oldest data.
+ */
+
+void
+FlightRecorder_Write(FlightRecorder *fr, const uint8_t *data, size_t length)
+{
+   if (length > fr->size) {
+      fr->total += length - fr->size;
+      data += length - fr->size;
+      length = fr->size;
+   }
+
+   while (length) {
+      size_t offset = fr->total % fr->size;
+      size_t chunk = fr->size - offset;
+
+      if (chunk > length) {
+         chunk = length;
+      }
+      memcpy(fr->buffer + offset, data, chunk);
+      fr->total += chunk;
+      data += chunk;
+      length -= chunk;
+   }
+}
+
+
+/*
+ * findSync --
+ *
+ *    Internal function to find where the first run of good packets
+ *    starts, at or after stream offset 'start' and before 'end'. The window may wrap
+ *    around the end of the ring, so a run which straddles the wrap is
+ *    looked for in a scratch copy of the bytes on either side of it.
+ *    Returns 'start' if there's no run anywhere.
+ */
+
+static uint64_t
+findSync(const FlightRecorder *fr, uint64_t start, uint64_t end)
+{
+   const size_t needed = SYNC_PACKETS * sizeof(MemPacket);
+   uint8_t scratch[2 * SYNC_PACKETS * sizeof(MemPacket)];
+   uint64_t pos = start;
+
+   while (pos < end) {
+      size_t offset = pos % fr->size;
+      size_t length = fr->size - offset;
+      size_t skip, tail, head;
+      bool atEnd;
+
+      if (length >= end - pos) {
+         length = end - pos;
+         skip = MemPacket_FindSync(fr->buffer + offset, length, SYNC_PACKETS, true);
+         return skip < length ? pos + skip : start;
+      }
+
+      skip = MemPacket_FindSync(fr->buffer + offset, length, SYNC_PACKETS, false);
+      if (skip + needed <= length) {
+         return pos + skip;
+      }
+
+      // What's left before the wrap might start a run which continues after it
+      tail = length - skip;
+      head = sizeof scratch - tail;
+      if (head > end - pos - length) {
+         head = end - pos - length;
+      }
+      memcpy(scratch, fr->buffer + offset + skip, tail);
+      memcpy(scratch + tail, fr->buffer, head);
+
+      pos += skip;
+      atEnd = pos + tail + head == end;
+      skip = MemPacket_FindSync(scratch, tail + head, SYNC_PACKETS, atEnd);
+      if (atEnd ? skip < tail + head : skip + needed <= tail + head) {
+         return pos + skip;
+      }
+      if (atEnd) {
+         return start;
+      }
+      pos += skip;
+   }
+
+   return start;
+}
+
+
+/*
+ * FlightRecorder_Save --
+ *
+ *    Write what the ring holds before stream offset 'end' to 'store',
+ *    oldest first. 'end' may be short of everything recorded, when the
+ *    recorder is ahead of whoever decided where the window ends. The
+ *    window starts on a packet boundary: stream offsets are packet-
+ *    aligned, and if USB data was ever dropped, we move forward to the
+ *    next run of good packets so the decoder starts cleanly. Returns
+ *    false on a write error. '*saved' gets the number of bytes written.
+ */
+
+bool
+FlightRecorder_Save(FlightRecorder *fr, TraceStore *store, uint64_t end,
+                    uint64_t *saved)
+{
+   uint64_t start = fr->total > fr->size ? fr->total - fr->size : 0;
+   size_t offset, length;
+
+   if (end > fr->total) {
+      end = fr->total;
+   }
+   start = (start + sizeof(MemPacket) - 1) & ~(uint64_t)(sizeof(MemPacket) - 1);
+   if (start > end) {
+      start = end;
+   }
+   start = findSync(fr, start, end);
+
+   *saved = end - start;
+   while (start < end) {
+      offset = start % fr->size;
+      length = fr->size - offset;
+      if (length > end - start) {
+         length = end - start;
+      }
+      if (!TraceStore_Write(store, fr->buffer + offset, length)) {
+         return false;
+      }
+      start += length;
+   }
+   return true;
+}
@@ -0,0 +1,65 @@
+/*
+ * flight_recorder.h - Keeps the most recent part of a capture in memory,
+ *                     for saving once something interesting happens.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __FLIGHT_RECORDER_H
+#define __FLIGHT_RECORDER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "trace_store.h"
+
+/*
+ * A fixed-size ring of raw trace data that is always overwritten, so
+ * it holds the last 'size' bytes of the stream. It's backed by huge
+ * pages where we can get them, since a large ring touched at capture
+ * rate would otherwise spend a lot of time in TLB misses.
+ *
+ * The first byte recorded must be the first byte of a packet.
+ */
+
+#define FLIGHT_HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+
+typedef struct {
+   uint8_t *buffer;
+   size_t size;            // Multiple of the packet size
+   size_t mapped;
+   uint64_t total;         // Bytes ever recorded
+   bool hugePages;
+} FlightRecorder;
+
+
+/*
+ * Public functions
+ */
+
+bool FlightRecorder_Init(FlightRecorder *fr, size_t size);
+void FlightRecorder_Free(FlightRecorder *fr);
+void FlightRecorder_Write(FlightRecorder *fr, const uint8_t *data, size_t length);
+bool FlightRecorder_Save(FlightRecorder *fr, TraceStore *store, uint64_t end,
+                         uint64_t *saved);
+
+
+#endif // __FLIGHT_RECORDER_H
@@ -29,14 +29,27 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include "hw_trace.h"
+#include "capture_ring.h"
+#include "trace_store.h"
+#include "usb_tune.h"
+#include "flight_recorder.h"
+#include "trigger.h"
 #include "memtrace_fmt.h"
+#include "memtrace_batch.h"
 #include "iohook_defs.h"
 #include "iohook_svc.h"
 
 #define MIN(a,b)  ((a) > (b) ? (b) : (a))
 
-#define RAM_ADDR_MASK  0x00FFFFFF
+#define DEFAULT_RING_MB  256
+
+#define DEFAULT_FLIGHT_POST  1.0   // Seconds of trace clock
+
+// Ring readers
+#define READER_PARSER  0
+#define READER_DISK    1
 
 typedef union {
    uint16_t words[IOH_PACKET_LEN / sizeof(uint16_t)];
@@ -54,7 +67,13 @@ typedef union {
 static bool detectOverrun(uint8_t *buffer, int length);
 static int readCallback(uint8_t *buffer, int length,
                         FTDIProgressInfo *progress, void *userdata);
+static void *parserThread(void *arg);
+static void *diskThread(void *arg);
 static void sigintHandler(int signum);
+static void sigusr1Handler(int signum);
+static bool armTrigger(void);
+static void saveFlightRecorder(void);
+static bool runTriggers(int type, uint32_t addr, uint16_t word);
 
 
 /*
@@ -63,12 +82,41 @@ static void sigintHandler(int signum);
  * XXX: A lot of this can be cleaned up by passing in userdata to
  *      the USB callback. The only mandatory thing here currently
  *      is exitRequested.
+ *
+ * The USB thread only copies data into 'ring'. The parser thread owns
+ * the packet-level state below, and the disk thread owns 'store'.
+ * Either of them can ask the USB thread to stop with stopRequested.
+ * The status line reads what the parser publishes in 'status'.
+ *
+ * In flight recorder mode there's no disk thread. The parser copies
+ * each block into 'flight' before parsing it, and counts the bytes it
+ * has parsed in 'parsedBytes'. Triggers and the end of the post-trigger
+ * window are placed by that count, at the packet that caused them, so
+ * what we save ends exactly where the window closes. Stop conditions
+ * are triggers instead. SIGUSR1 asks for a trigger with
+ * triggerRequested.
  */
 
-static FILE *outputFile;
+static TraceStore *store;
+static const char *traceFilename;
+static int storeFlags;
 static bool useIOHooks;
 static bool exitRequested;
+static bool stopRequested;
 static bool streamStartFound;
+static CaptureRing ring;
+static size_t ringSize = DEFAULT_RING_MB * 1024 * 1024;
+static int packetsPerTransfer = USBTUNE_DEFAULT_PACKETS;
+static int numTransfers = USBTUNE_DEFAULT_TRANSFERS;
+static size_t flightSize;
+static double flightPost = DEFAULT_FLIGHT_POST;
+static FlightRecorder flight;
+static bool triggerRequested;
+static bool triggered;
+static uint64_t triggerClock;
+static uint64_t triggerBytes;
+static uint64_t parsedBytes;
+static TriggerSet triggers;
 static uint64_t timestamp;
 static uint8_t packetBuf[4];
 static int packetBufSize;
@@ -81,14 +129,18 @@ static HWPatch *hwPatch;
 static uint8_t *ioHookPatch;
 static FTDIDevice *hwDev;
 
+static struct {
+   uint64_t timestamp;
+   uint32_t lastReadAddr;
+   uint32_t lastWriteAddr;
+} status;
+
 static struct {
    double   time;
    double   size;
-   uint32_t addr;
 } stop = {
    .time = HUGE_VAL,
    .size = HUGE_VAL,
-   .addr = (uint32_t)-1,
 };
 
 
@@ -113,25 +165,42 @@ HW_Trace(FTDIDevice *dev, HWPatch *patch, const char *filename,
    int err;
    uint32_t traceFlags;
    uint32_t powerFlags = POWERFLAG_DSI_BATT;
-   
+   pthread_t parser, disk;
+
    // Blank line between initialization messages and live tracing
    fprintf(stderr, "\n");
 
    useIOHooks = iohook;
    exitRequested = false;
+   stopRequested = false;
    timestamp = 0;
    ioHookSequence = 0;
    hwPatch = patch;
    hwDev = dev;
+   traceFilename = filename;
+   triggerRequested = false;
+   triggered = false;
 
    if (filename) {
-      outputFile = fopen(filename, "wb");
-      if (!outputFile) {
+      store = TraceStore_Open(filename, storeFlags);
+      if (!store) {
          perror("Error opening output file");
          exit(1);
       }
    } else {
-      outputFile = NULL;
+      store = NULL;
+   }
+
+   if (store && flightSize) {
+      if (!FlightRecorder_Init(&flight, flightSize)) {
+         fprintf(stderr, "Can't allocate a %u MB flight recorder\n",
+                 (unsigned)(flightSize >> 20));
+         exit(1);
+      }
+      fprintf(stderr, "Flight recorder: keeping the last %u MB%s, "
+              "%.02fs after a trigger.\n", (unsigned)(flightSize >> 20),
+              flight.hugePages ? " in huge pages" : "", flightPost);
+      signal(SIGUSR1, sigusr1Handler);
    }
 
    /*
@@ -140,7 +209,7 @@ HW_Trace(FTDIDevice *dev, HWPatch *patch, const char *filename,
     */
 
    traceFlags = TRACEFLAG_WRITES;
-   if (outputFile)
+   if (store)
       traceFlags |= TRACEFLAG_READS;
 
    /*
@@ -157,22 +226,58 @@ HW_Trace(FTDIDevice *dev, HWPatch *patch, const char *filename,
    HW_ConfigWrite(dev, REG_TRACEFLAGS, traceFlags, false);
    HW_ConfigWrite(dev, REG_POWERFLAGS, powerFlags, false);
 
+   /*
+    * Start the threads that drain the ring: one parses, and one writes
+    * to disk if we have a file and no flight recorder.
+    */
+
+   if (!CaptureRing_Init(&ring, ringSize, store && !flightSize ? 2 : 1)) {
+      fprintf(stderr, "Can't allocate a %u MB capture ring\n",
+              (unsigned)(ringSize >> 20));
+      exit(1);
+   }
+   if (pthread_create(&parser, NULL, parserThread, NULL) ||
+       (store && !flightSize && pthread_create(&disk, NULL, diskThread, NULL))) {
+      perror("Error starting capture threads");
+      exit(1);
+   }
+
    /*
     * Capture data until we're interrupted.
     */
 
    signal(SIGINT, sigintHandler);
-   err = FTDIDevice_ReadStream(dev, FTDI_INTERFACE_A, readCallback, NULL, 8, 256);
-   if (err < 0 && !exitRequested)
-      exit(1);
+   err = FTDIDevice_ReadStream(dev, FTDI_INTERFACE_A, readCallback, NULL,
+                               packetsPerTransfer, numTransfers);
+
+   // Let the other threads finish with what we've captured
+   CaptureRing_Close(&ring);
+   pthread_join(parser, NULL);
+   if (store && !flightSize) {
+      pthread_join(disk, NULL);
+   }
 
-   if (outputFile) {
-      fclose(outputFile);
-      outputFile = NULL;
+   if (store && flightSize) {
+      saveFlightRecorder();
    }
 
+   if (store && !TraceStore_Finish(store)) {
+      fprintf(stderr, "The trace file is incomplete.\n");
+   }
+
+   if (err < 0 && !exitRequested && !stopRequested)
+      exit(1);
+
    HWTrace_HideStatus();
-   fprintf(stderr, "Capture ended.\n");
+   fprintf(stderr, "Capture ended. Ring high-water mark: %.1f of %u MB.\n",
+           ring.highWater / (1024.0 * 1024.0), (unsigned)(ring.size >> 20));
+   CaptureRing_Free(&ring);
+
+   if (store) {
+      TraceStore_PrintStats(store, stderr);
+      TraceStore_Close(store);
+      store = NULL;
+   }
 }
 
 
@@ -271,6 +376,10 @@ ioHookTrace(uint32_t index, uint16_t word)
          return false;
       }
 
+      if (rxSvc == IOH_SVC_TRIGGER && flightSize && !triggered) {
+         armTrigger();
+      }
+
       // Handle the hook packet. This returns the response length.
       txLen = IOH_HandlePacket(hwDev, rxSvc, buf.data, rxLen);
 
@@ -292,48 +401,172 @@ ioHookTrace(uint32_t index, uint16_t word)
 
 
 /*
- * parsePacket --
+ * stopLabel --
  *
- *    Decode a single received packet. Look for communications errors
- *    and, if applicable, invoke I/O hooks.
- *    Returns true on success, false on failure.
+ *    What a met stop condition is called in messages.
  */
 
-static bool
-parsePacket(uint8_t *buffer)
+static const char *
+stopLabel(void)
 {
-   MemPacket packet = MemPacket_FromBytes(buffer);
-   MemPacketType type = MemPacket_GetType(packet);
-   uint16_t word = MemPacket_RW_Word(packet);
+   return flightSize ? "TRIGGER" : "STOP";
+}
 
-   // Overflow errors are always fatal
-   if (MemPacket_IsOverflow(packet)) {
-      dataError("Hardware buffer overrun",
-                "The USB bus or PC can't keep up with the incoming "
-                "data. Capture has been aborted.");
+
+/*
+ * armTrigger --
+ *
+ *    A stop condition was met, in the parser thread. Without a flight
+ *    recorder, the capture ends: returns false. With one, the post-
+ *    trigger window starts now, and we keep going: returns true.
+ */
+
+static bool
+armTrigger(void)
+{
+   if (!flightSize) {
       return false;
    }
+   if (!triggered) {
+      triggered = true;
+      triggerClock = timestamp;
+      triggerBytes = parsedBytes;
+   }
+   return true;
+}
 
-   // Complain about serious but non-fatal data errors.
-   if (!MemPacket_IsAligned(packet)) {
-      dataError("Packet alignment error",
-                "A trace packet is not properly aligned. Some USB data "
-                "has been dropped or corrupted.");
-      return true;
+
+/*
+ * requestTrigger --
+ *
+ *    Ask the parser to arm the flight recorder, from any thread or a
+ *    signal handler.
+ */
+
+static void
+requestTrigger(void)
+{
+   __atomic_store_n(&triggerRequested, true, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * snapshotFlightRecorder --
+ *
+ *    Save what the flight recorder holds so far to a numbered file next
+ *    to the trace, and keep capturing.
+ */
+
+static void
+snapshotFlightRecorder(const Trigger *t)
+{
+   static int numSnapshots;
+   double seconds = timestamp / (double)RAM_CLOCK_HZ;
+   TraceStore *snapshot;
+   uint64_t saved;
+   char *name;
+   bool ok;
+
+   if (!store || !flightSize) {
+      fprintf(stderr, "SNAPSHOT: %s at %.06fs, but there's no flight recorder "
+              "to save.\n", t->spec, seconds);
+      return;
    }
-   if (!MemPacket_IsChecksumCorrect(packet)) {
-      dataError("Packet checksum error",
-                "A trace packet has an incorrect checksum. Some USB data "
-                "has been dropped or corrupted.");
-      return true;
+
+   name = malloc(strlen(traceFilename) + 16);
+   sprintf(name, "%s.snap%d", traceFilename, ++numSnapshots);
+   snapshot = TraceStore_Open(name, storeFlags);
+   if (!snapshot) {
+      perror("Error opening snapshot file");
+      free(name);
+      return;
+   }
+   ok = FlightRecorder_Save(&flight, snapshot, parsedBytes, &saved);
+   ok = TraceStore_Finish(snapshot) && ok;
+   TraceStore_Close(snapshot);
+
+   fprintf(stderr, "SNAPSHOT: %s at %.06fs, %s %.1f MB to %s\n", t->spec, seconds,
+           ok ? "saved" : "error saving", saved / (1024.0 * 1024.0), name);
+   free(name);
+}
+
+
+/*
+ * runTriggers --
+ *
+ *    Check an operation that TriggerSet_MayMatch says might interest a
+ *    trigger, and carry out the actions of any that fire. Returns false
+ *    to end the capture.
+ */
+
+static bool
+runTriggers(int type, uint32_t addr, uint16_t word)
+{
+   uint32_t fired = TriggerSet_Check(&triggers, type, addr, word);
+   const char *op = type == TRIGGER_READ ? "read" : "write";
+   double seconds = timestamp / (double)RAM_CLOCK_HZ;
+   bool keepGoing = true;
+
+   while (fired) {
+      const Trigger *t = &triggers.triggers[__builtin_ctz(fired)];
+
+      fired &= fired - 1;
+      HWTrace_HideStatus();
+
+      switch (t->action) {
+
+      case TRIGGER_STOP:
+         fprintf(stderr, "%s: %s at %.06fs, %s 0x%08x = 0x%04x\n",
+                 stopLabel(), t->spec, seconds, op, addr, word);
+         if (!armTrigger()) {
+            keepGoing = false;
+         }
+         break;
+
+      case TRIGGER_MARK:
+         fprintf(stderr, "MARK: %s at %.06fs (clock %llu)\n", t->spec, seconds,
+                 (unsigned long long)timestamp);
+         break;
+
+      case TRIGGER_SNAPSHOT:
+         snapshotFlightRecorder(t);
+         break;
+
+      case TRIGGER_PRINT:
+         fprintf(stderr, "WATCH: %.06fs %s 0x%08x = 0x%04x\n", seconds, op, addr, word);
+         break;
+      }
    }
 
-   timestamp += MemPacket_GetDuration(packet);
+   return keepGoing;
+}
+
+
+/*
+ * parseValidPacket --
+ *
+ *    Act on one packet that has already been checked for alignment
+ *    and checksum errors, and unpacked. Invokes I/O hooks and looks
+ *    for stop conditions. Returns true on success, false on failure
+ *    or once the flight recorder's post-trigger window has closed.
+ */
+
+static inline bool
+parseValidPacket(MemPacketType type, uint32_t payload, uint32_t duration)
+{
+   uint16_t word = payload & 0xFFFF;
+
+   timestamp += duration;
+
+   if (__builtin_expect(triggered, 0) &&
+       timestamp - triggerClock >= flightPost * RAM_CLOCK_HZ) {
+      return false;
+   }
 
    switch (type) {
 
    case MEMPKT_ADDR:
-      lastAddr = MemPacket_GetPayload(packet) << 1;
+      lastAddr = payload << 1;
       burstIndex = 0;
       break;
 
@@ -341,10 +574,8 @@ parsePacket(uint8_t *buffer)
       lastReadAddr = lastAddr + (burstIndex << 1);
       burstIndex++;
 
-      if (lastReadAddr == stop.addr) {
-         HWTrace_HideStatus();
-         fprintf(stderr, "STOP: Requested stop at address 0x%08x "
-                 "(read burst at 0x%08x)\n", stop.addr, lastAddr);
+      if (TriggerSet_MayMatch(&triggers, lastReadAddr) &&
+          !runTriggers(TRIGGER_READ, lastReadAddr, word)) {
          return false;
       }
       break;
@@ -357,35 +588,81 @@ parsePacket(uint8_t *buffer)
       }
       burstIndex++;
 
-      if (lastReadAddr == stop.addr) {
-         HWTrace_HideStatus();
-         fprintf(stderr, "STOP: Requested stop at address 0x%08x "
-                 "(write burst at 0x%08x)\n", stop.addr, lastAddr);
+      if (TriggerSet_MayMatch(&triggers, lastWriteAddr) &&
+          !runTriggers(TRIGGER_WRITE, lastWriteAddr, word)) {
          return false;
       }
       break;
+
+   case MEMPKT_TIMESTAMP:
+      break;
    }
 
    return true;
 }
 
 
+/*
+ * parsePacket --
+ *
+ *    Decode a single received packet. Look for communications errors
+ *    and, if applicable, invoke I/O hooks.
+ *    Returns true on success, false on failure.
+ */
+
+static bool
+parsePacket(uint8_t *buffer)
+{
+   MemPacket packet = MemPacket_FromBytes(buffer);
+
+   // Overflow errors are always fatal
+   if (MemPacket_IsOverflow(packet)) {
+      dataError("Hardware buffer overrun",
+                "The USB bus or PC can't keep up with the incoming "
+                "data. Capture has been aborted.");
+      return false;
+   }
+
+   // Complain about serious but non-fatal data errors.
+   if (!MemPacket_IsAligned(packet)) {
+      dataError("Packet alignment error",
+                "A trace packet is not properly aligned. Some USB data "
+                "has been dropped or corrupted.");
+      return true;
+   }
+   if (!MemPacket_IsChecksumCorrect(packet)) {
+      dataError("Packet checksum error",
+                "A trace packet has an incorrect checksum. Some USB data "
+                "has been dropped or corrupted.");
+      return true;
+   }
+
+   return parseValidPacket(MemPacket_GetType(packet),
+                           MemPacket_GetPayload(packet),
+                           MemPacket_GetDuration(packet));
+}
+
+
 /*
  * parseBlock --
  *
- *    Decode a block of received data.
+ *    Decode a block of received data, counting it in parsedBytes as
+ *    we go: while a packet is being parsed, parsedBytes is its end.
  *    Returns true on success, false on failure.
  */
 
 static inline bool
 parseBlock(uint8_t *buffer, int length)
 {
+   static MemPacketBatch batch;
+
    if (packetBufSize) {
       // Process any partial packet from last time
       int l = MIN(length, sizeof packetBuf - packetBufSize);
       memcpy(packetBuf + packetBufSize, buffer, l);
       buffer += l;
       length -= l;
+      parsedBytes += l;
 
       if (l + packetBufSize == sizeof packetBuf) {
          // Got a full packet
@@ -400,11 +677,29 @@ parseBlock(uint8_t *buffer, int length)
 
    // Process full packets
    while (length >= sizeof(MemPacket)) {
-      if (!parsePacket(buffer)) {
-         return false;
+      int count = MIN(length / sizeof(MemPacket), MEMPKT_BATCH_SIZE);
+      int valid = MemPacket_DecodeBatch(buffer, count, &batch);
+      int i;
+
+      // The batch kernel validated and unpacked everything up to 'valid'
+      for (i = 0; i < valid; i++) {
+         parsedBytes += sizeof(MemPacket);
+         if (!parseValidPacket(batch.type[i], batch.payload[i], batch.duration[i])) {
+            return false;
+         }
+      }
+      length -= valid * sizeof(MemPacket);
+      buffer += valid * sizeof(MemPacket);
+
+      // Anything it stopped at gets the full treatment, with error reporting
+      if (valid < count) {
+         parsedBytes += sizeof(MemPacket);
+         if (!parsePacket(buffer)) {
+            return false;
+         }
+         length -= sizeof(MemPacket);
+         buffer += sizeof(MemPacket);
       }
-      length -= sizeof(MemPacket);
-      buffer += sizeof(MemPacket);
    }
 
    // Save any remainder
@@ -412,18 +707,172 @@ parseBlock(uint8_t *buffer, int length)
       assert(packetBufSize == 0);
       memcpy(packetBuf, buffer, length);
       packetBufSize = length;
+      parsedBytes += length;
    }
 
    return true;
 }
 
 
+/*
+ * requestStop --
+ *
+ *    Ask the USB thread to end the capture, from any thread.
+ */
+
+static void
+requestStop(void)
+{
+   __atomic_store_n(&stopRequested, true, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * checkFlightWindow --
+ *
+ *    In the parser thread, after each block: look for triggers that
+ *    aren't tied to a packet, and end the capture if the post-trigger
+ *    window has already passed on the trace clock. Returns false when
+ *    it has. Otherwise the packet which closes it ends parseBlock.
+ */
+
+static bool
+checkFlightWindow(void)
+{
+   if (!triggered) {
+      double seconds = timestamp / (double)RAM_CLOCK_HZ;
+      double mb = parsedBytes / (1024.0 * 1024.0);
+
+      if (seconds > stop.time) {
+         HWTrace_HideStatus();
+         fprintf(stderr, "TRIGGER: Requested stop at %.02fs\n", stop.time);
+         armTrigger();
+      } else if (mb > stop.size) {
+         HWTrace_HideStatus();
+         fprintf(stderr, "TRIGGER: Requested stop at %.02f MB\n", stop.size);
+         armTrigger();
+      } else if (__atomic_load_n(&triggerRequested, __ATOMIC_ACQUIRE)) {
+         HWTrace_HideStatus();
+         fprintf(stderr, "TRIGGER: Signal received at %.02fs\n", seconds);
+         armTrigger();
+      }
+   }
+
+   if (triggered && timestamp - triggerClock >= flightPost * RAM_CLOCK_HZ) {
+      requestStop();
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ * parserThread --
+ *
+ *    Parses everything in the ring: runs I/O hooks, checks stop
+ *    conditions, and publishes progress for the status line. After a
+ *    stop, it keeps draining the ring so the disk thread can finish.
+ */
+
+static void *
+parserThread(void *arg)
+{
+   bool parsing = true;
+   const uint8_t *data;
+   size_t length;
+
+   while ((length = CaptureRing_Peek(&ring, READER_PARSER, &data))) {
+      if (parsing && flightSize) {
+         FlightRecorder_Write(&flight, data, length);
+      }
+      if (parsing && !parseBlock((uint8_t *)data, length)) {
+         parsing = false;
+         requestStop();
+      }
+      CaptureRing_Consume(&ring, READER_PARSER, length);
+
+      if (parsing && flightSize && !checkFlightWindow()) {
+         parsing = false;
+      }
+
+      __atomic_store_n(&status.timestamp, timestamp, __ATOMIC_RELAXED);
+      __atomic_store_n(&status.lastReadAddr, lastReadAddr, __ATOMIC_RELAXED);
+      __atomic_store_n(&status.lastWriteAddr, lastWriteAddr, __ATOMIC_RELAXED);
+   }
+   return NULL;
+}
+
+
+/*
+ * diskThread --
+ *
+ *    Writes everything in the ring to the trace store. After a write
+ *    error, it keeps draining the ring so the parser can finish.
+ */
+
+static void *
+diskThread(void *arg)
+{
+   bool writing = true;
+   const uint8_t *data;
+   size_t length;
+
+   while ((length = CaptureRing_Peek(&ring, READER_DISK, &data))) {
+      if (writing && !TraceStore_Write(store, data, length)) {
+         writing = false;
+         requestStop();
+      }
+      CaptureRing_Consume(&ring, READER_DISK, length);
+   }
+   return NULL;
+}
+
+
+/*
+ * saveFlightRecorder --
+ *
+ *    After the capture, write the flight recorder's window to the trace
+ *    file. If nothing triggered it, that's just the end of the capture.
+ */
+
+static void
+saveFlightRecorder(void)
+{
+   uint64_t post = parsedBytes - triggerBytes;
+   uint64_t saved;
+
+   HWTrace_HideStatus();
+   if (!triggered) {
+      fprintf(stderr, "Flight recorder: never triggered, saving the end of the capture.\n");
+   }
+
+   // The recorder may hold a little more than we parsed; that's past the window
+   if (!FlightRecorder_Save(&flight, store, parsedBytes, &saved)) {
+      fprintf(stderr, "Flight recorder: error writing the trace.\n");
+   } else {
+      if (triggered && saved <= post) {
+         fprintf(stderr, "Flight recorder: the post-trigger window filled the whole "
+                 "recorder. Nothing from before the trigger was kept.\n");
+      }
+      fprintf(stderr, "Flight recorder: saved %.1f MB", saved / (1024.0 * 1024.0));
+      if (triggered) {
+         fprintf(stderr, ", %.1f MB of it before the trigger",
+                 saved > post ? (saved - post) / (1024.0 * 1024.0) : 0.0);
+      }
+      fprintf(stderr, ".\n");
+   }
+   FlightRecorder_Free(&flight);
+}
+
+
 /*
  * readCallback --
  *
  *    Callback from fastftdi, processes one contiguous block of trace
- *    data from the device. This block is sent to disk if we have a
- *    file open, and commands are parsed out of it.
+ *    data from the device. This runs in libusb's event handling, so
+ *    all it does is copy the block into the ring, where the parser and
+ *    disk threads pick it up. If they fall a whole ring behind, the
+ *    capture is over.
  */
 
 static int
@@ -451,47 +900,44 @@ readCallback(uint8_t *buffer, int length, FTDIProgressInfo *progress, void *user
          }
       }
 
-      /*
-       * Write to disk first, so if there's a bug in parseBlock we can
-       * use the trace to debug it.
-       */
-      if (outputFile) {
-         if (fwrite(buffer, length, 1, outputFile) != 1) {
-            perror("Write error");
-            return 1;
-         }
-      }
-
-      if (!parseBlock(buffer, length)) {
+      if (!CaptureRing_Write(&ring, buffer, length)) {
+         dataError("Capture ring overrun",
+                   "The disk or the trace parser can't keep up with the incoming "
+                   "data. Capture has been aborted. A larger ring (--ring) can "
+                   "absorb longer stalls.");
          return 1;
       }
    }
 
    if (progress) {
-      double seconds = timestamp / (double)RAM_CLOCK_HZ;
+      double seconds = __atomic_load_n(&status.timestamp, __ATOMIC_RELAXED) /
+                       (double)RAM_CLOCK_HZ;
       double mb = progress->current.totalBytes / (1024.0 * 1024.0);
 
       fprintf(stderr, "%10.02fs [ %9.3f MB captured ] %7.1f kB/s current, "
-              "%7.1f kB/s average - RD:%08x WR:%08x\r",
+              "%7.1f kB/s average, ring %3.0f%% - RD:%08x WR:%08x\r",
               seconds, mb,
               progress->currentRate / 1024.0,
               progress->totalRate / 1024.0,
-              lastReadAddr, lastWriteAddr);
+              CaptureRing_Fill(&ring) * 100.0 / ring.size,
+              __atomic_load_n(&status.lastReadAddr, __ATOMIC_RELAXED),
+              __atomic_load_n(&status.lastWriteAddr, __ATOMIC_RELAXED));
 
-      if (seconds > stop.time) {
+      // With a flight recorder, the parser checks these as triggers
+      if (seconds > stop.time && !flightSize) {
          HWTrace_HideStatus();
          fprintf(stderr, "STOP: Requested stop at %.02fs\n", stop.time);
          return 1;
       }
 
-      if (mb > stop.size) {
+      if (mb > stop.size && !flightSize) {
          HWTrace_HideStatus();
          fprintf(stderr, "STOP: Requested stop at %.02f MB\n", stop.size);
          return 1;
       }
    }
 
-   return exitRequested ? 1 : 0;
+   return exitRequested || __atomic_load_n(&stopRequested, __ATOMIC_ACQUIRE) ? 1 : 0;
 }
 
 
@@ -508,6 +954,19 @@ sigintHandler(int signum)
 }
 
 
+/*
+ * sigusr1Handler --
+ *
+ *    SIGUSR1 triggers the flight recorder.
+ */
+
+static void
+sigusr1Handler(int signum)
+{
+   requestTrigger();
+}
+
+
 /*
  * HWTrace_HideStatus --
  *
@@ -517,13 +976,92 @@ sigintHandler(int signum)
 void
 HWTrace_HideStatus(void)
 {
-   char spaces[110];
+   char spaces[125];
    memset(spaces, ' ', sizeof spaces);
    spaces[sizeof spaces - 1] = '\0';
    fprintf(stderr, "%s\r", spaces);
 }
 
 
+/*
+ * HWTrace_SetRingSize --
+ *
+ *    Set the size of the ring between the USB thread and the threads
+ *    that parse and store the trace. It absorbs stalls in either one,
+ *    up to about one ring's worth of capture time.
+ */
+
+void
+HWTrace_SetRingSize(uint32_t megabytes)
+{
+   ringSize = (size_t)megabytes * 1024 * 1024;
+}
+
+
+/*
+ * HWTrace_SetTransferSize --
+ *
+ *    Set how many USB packets go in each transfer, and how many
+ *    transfers we keep queued. See usb_tune.h.
+ */
+
+void
+HWTrace_SetTransferSize(int packets, int transfers)
+{
+   packetsPerTransfer = packets;
+   numTransfers = transfers;
+}
+
+
+/*
+ * HWTrace_SetFlightRecorder --
+ *
+ *    Instead of writing the whole capture, keep only the last
+ *    'megabytes' in memory. A stop condition, an IOH_SVC_TRIGGER hook or
+ *    SIGUSR1 triggers it, capture carries on for 'postSeconds' of trace
+ *    clock, and then the trace file gets what the recorder holds.
+ *    Zero megabytes turns it off.
+ */
+
+void
+HWTrace_SetFlightRecorder(uint32_t megabytes, double postSeconds)
+{
+   flightSize = (size_t)megabytes * 1024 * 1024;
+   flightPost = postSeconds;
+}
+
+
+/*
+ * HWTrace_SetStorageFlags --
+ *
+ *    Set TRACESTORE_* flags for the trace file. By default it's written
+ *    with direct I/O through io_uring, where those are available.
+ */
+
+void
+HWTrace_SetStorageFlags(int flags)
+{
+   storeFlags = flags;
+}
+
+
+/*
+ * HWTrace_ParseTrigger --
+ *
+ *    Add a trigger, in the syntax described in trigger.h.
+ *    Exits on error.
+ */
+
+void
+HWTrace_ParseTrigger(const char *spec)
+{
+   if (!TriggerSet_Parse(&triggers, spec)) {
+      fprintf(stderr, "Can't parse trigger \"%s\".\n", spec);
+      exit(1);
+   }
+}
+
+
 /*
  * HWTrace_ParseStopCondition --
  *
@@ -543,17 +1081,21 @@ HWTrace_ParseStopCondition(const char *stopCond)
       *delim1 = '\0';
 
       if (!strcmp(str, "time")) {
-         stop.time = atof(arg1);
+         stop.time = MIN(stop.time, atof(arg1));
          goto done;
       }
 
       if (!strcmp(str, "size")) {
-         stop.size = atof(arg1);
+         stop.size = MIN(stop.size, atof(arg1));
          goto done;
       }
 
       if (!strcmp(str, "addr")) {
-         stop.addr = strtoul(arg1, NULL, 16) & RAM_ADDR_MASK;
+         char *spec = malloc(strlen(arg1) + 16);
+
+         sprintf(spec, "stop:rw:%s", arg1);
+         HWTrace_ParseTrigger(spec);
+         free(spec);
          goto done;
       }
    }
@@ -31,6 +31,11 @@
 void HWTrace_InitIOHookPatch(HWPatch *patch);
 void HWTrace_HideStatus(void);
 void HWTrace_ParseStopCondition(const char *stopCond);
+void HWTrace_ParseTrigger(const char *spec);
+void HWTrace_SetRingSize(uint32_t megabytes);
+void HWTrace_SetStorageFlags(int flags);
+void HWTrace_SetTransferSize(int packets, int transfers);
+void HWTrace_SetFlightRecorder(uint32_t megabytes, double postSeconds);
 
 void HW_Trace(FTDIDevice *dev, HWPatch *patch, const char *filename,
               bool iohook, bool resetDSI);
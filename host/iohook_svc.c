@@ -84,6 +84,12 @@ IOH_HandlePacket(FTDIDevice *dev, uint8_t service, void *data, uint8_t length)
       return 0;
    }
 
+   case IOH_SVC_TRIGGER: {
+      HWTrace_HideStatus();
+      fprintf(stderr, "TRIGGER: %s\n", packetString(data, length));
+      return 0;
+   }
+
    case IOH_SVC_QUIT: {
       HWTrace_HideStatus();
       fprintf(stderr, "QUIT: %s\n", packetString(data, length));
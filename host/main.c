@@ -33,6 +33,8 @@
 #include "hw_common.h"
 #include "hw_trace.h"
 #include "hw_patch.h"
+#include "trace_store.h"
+#include "usb_tune.h"
 
 #define DEFAULT_FPGA_BITSTREAM   "stable.bit"
 #define CLOCK_FAST               16.756
@@ -73,6 +75,25 @@ usage(const char *argv0)
            "  -i, --iohook          Enable I/O hooks which allow patches to log data\n"
            "                          to the PC and to read and write data files.\n"
            "  -S, --stop=COND       Stop when the specified condition (below) is met\n"
+           "  -t, --trigger=SPEC    Act when a sequence of memory operations is seen.\n"
+           "                          May be specified more than once. See below.\n"
+           "  -R, --ring=MB         Buffer this much trace in memory, so stalls in\n"
+           "                          writing or parsing don't overrun the hardware.\n"
+           "                          Default 256 MB.\n"
+           "  -B, --buffered-io     Write the trace through the page cache, instead\n"
+           "                          of with direct I/O.\n"
+           "  -U, --no-uring        Write the trace with pwrite(), not io_uring.\n"
+           "  -T, --usb-tune        Measure which USB transfer settings work best\n"
+           "                          with this host, and remember them.\n"
+           "  -u, --usb=P:N         Keep N transfers of P USB packets each in flight,\n"
+           "                          instead of the tuned or default settings\n"
+           "                          (%d:%d).\n"
+           "  -W, --flight=MB       Flight recorder: keep only the last MB of trace\n"
+           "                          in memory. Stop conditions, I/O hook triggers\n"
+           "                          and SIGUSR1 become triggers. The trace file\n"
+           "                          gets the window around the first one.\n"
+           "  -P, --post=SECONDS    Keep capturing this long after a flight recorder\n"
+           "                          trigger. Default 1 second.\n"
            "\n"
            "About patch options:\n"
            "  * All addresses are in hexadecimal.\n"
@@ -97,10 +118,24 @@ usage(const char *argv0)
            "  -S size:MB               Stop after MB megabytes of trace data received.\n"
            "  -S addr:ADDR             Stop when a hexadecimal address is touched.\n"
            "\n"
+           "Triggers:\n"
+           "  -t ACTION:STEP[>STEP...]\n"
+           "      ACTION is stop, mark (print the trace time), snapshot (save the\n"
+           "      flight recorder so far) or print (a live watch). The action runs\n"
+           "      each time the last STEP matches, after the ones before it have.\n"
+           "  STEP: read|write|rw:ADDR[..END|+LENGTH][,data=VALUE[/MASK]][,count=N]\n"
+           "      Matches operations in the range whose data word, masked, equals\n"
+           "      VALUE. With a count, only every Nth match counts.\n"
+           "  -t print:write:02001000+10          Watch writes to 16 bytes.\n"
+           "  -t stop:write:02001000,data=1>read:02002000\n"
+           "                                      Stop on the first read of 02002000\n"
+           "                                      after 1 is written to 02001000.\n"
+           "\n"
            "Copyright (C) 2009 Micah Elizabeth Scott <beth@scanlime.org>\n",
            argv0,
            DEFAULT_FPGA_BITSTREAM,
-           CLOCK_FAST, CLOCK_DEFAULT, CLOCK_SLOW);
+           CLOCK_FAST, CLOCK_DEFAULT, CLOCK_SLOW,
+           USBTUNE_DEFAULT_PACKETS, USBTUNE_DEFAULT_TRANSFERS);
    exit(1);
 }
 
@@ -115,6 +150,12 @@ int main(int argc, char **argv)
    bool resetFPGA = true;
    bool resetDSI = true;
    bool iohook = false;
+   int storeFlags = 0;
+   bool usbTune = false;
+   USBTuneSettings usbOverride = { 0, 0 };
+   USBTuneSettings usb;
+   uint32_t flightMB = 0;
+   double flightPost = 1.0;
    int err, c;
 
    HWPatch_Init(&patch);
@@ -131,10 +172,18 @@ int main(int argc, char **argv)
          {"patch", 1, NULL, 'p'},
          {"iohook", 0, NULL, 'i'},
          {"stop", 1, NULL, 'S'},
+         {"trigger", 1, NULL, 't'},
+         {"ring", 1, NULL, 'R'},
+         {"buffered-io", 0, NULL, 'B'},
+         {"no-uring", 0, NULL, 'U'},
+         {"usb-tune", 0, NULL, 'T'},
+         {"usb", 1, NULL, 'u'},
+         {"flight", 1, NULL, 'W'},
+         {"post", 1, NULL, 'P'},
          {NULL},
       };
 
-      c = getopt_long(argc, argv, "FDb:fsc:p:iS:", long_options, &option_index);
+      c = getopt_long(argc, argv, "FDb:fsc:p:iS:t:R:BUTu:W:P:", long_options, &option_index);
       if (c == -1)
          break;
 
@@ -176,6 +225,61 @@ int main(int argc, char **argv)
          HWTrace_ParseStopCondition(optarg);
          break;
 
+      case 't':
+         HWTrace_ParseTrigger(optarg);
+         break;
+
+      case 'R': {
+         int ringMB;
+         char extra;
+
+         if (sscanf(optarg, "%d%c", &ringMB, &extra) != 1 || ringMB <= 0) {
+            usage(argv[0]);
+         }
+         HWTrace_SetRingSize(ringMB);
+         break;
+      }
+
+      case 'B':
+         storeFlags |= TRACESTORE_BUFFERED;
+         break;
+
+      case 'U':
+         storeFlags |= TRACESTORE_NO_URING;
+         break;
+
+      case 'T':
+         usbTune = true;
+         break;
+
+      case 'u':
+         if (sscanf(optarg, "%d:%d", &usbOverride.packetsPerTransfer,
+                    &usbOverride.numTransfers) != 2 ||
+             usbOverride.packetsPerTransfer <= 0 || usbOverride.numTransfers <= 0) {
+            usage(argv[0]);
+         }
+         break;
+
+      case 'W': {
+         int megabytes;
+         char extra;
+
+         if (sscanf(optarg, "%d%c", &megabytes, &extra) != 1 || megabytes <= 0) {
+            usage(argv[0]);
+         }
+         flightMB = megabytes;
+         break;
+      }
+
+      case 'P': {
+         char extra;
+
+         if (sscanf(optarg, "%lf%c", &flightPost, &extra) != 1 || !(flightPost >= 0)) {
+            usage(argv[0]);
+         }
+         break;
+      }
+
       default:
          usage(argv[0]);
       }
@@ -189,6 +293,11 @@ int main(int argc, char **argv)
       usage(argv[0]);
    }
 
+   if (flightMB && !tracefile) {
+      fprintf(stderr, "The flight recorder needs a trace file.\n");
+      return 1;
+   }
+
    err = FTDIDevice_Open(&dev);
    if (err) {
       fprintf(stderr, "USB: Error opening device\n");
@@ -197,12 +306,27 @@ int main(int argc, char **argv)
 
    if (iohook)
       HWTrace_InitIOHookPatch(&patch);
+   HWTrace_SetStorageFlags(storeFlags);
+   HWTrace_SetFlightRecorder(flightMB, flightPost);
 
    HW_Init(&dev, resetFPGA ? bitstream : NULL);
    HW_ConfigWrite(&dev, REG_POWERFLAGS, POWERFLAG_DSI_BATT, false);
    HW_SetSystemClock(&dev, clock);
    HW_LoadPatch(&dev, &patch);
 
+   USBTune_Init(&usb);
+   if (usbOverride.packetsPerTransfer) {
+      usb = usbOverride;
+   } else if (usbTune) {
+      USBTune_Run(&dev, &usb);
+      if (!USBTune_Save(&usb)) {
+         perror("Error saving USB settings");
+      }
+   } else {
+      USBTune_Load(&usb);
+   }
+   HWTrace_SetTransferSize(usb.packetsPerTransfer, usb.numTransfers);
+
    if (tracefile || iohook)
       HW_Trace(&dev, &patch, tracefile, iohook, resetDSI);
 
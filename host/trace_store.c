@@ -0,0 +1,722 @@
+/*
+ * trace_store.c - Writes the raw trace to disk with large aligned, direct
+ *                 writes, and keeps track of how long they take.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE   // O_DIRECT, fallocate
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "trace_store.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_URING
+#endif
+#endif
+
+// Enough for the logical block size of any disk we'll meet
+#define STORE_ALIGNMENT  4096
+
+typedef struct {
+   uint8_t *data;
+   uint32_t length;
+   uint64_t offset;
+   uint64_t submitted;     // When the write started, in nanoseconds
+   bool busy;              // Write in flight
+} StoreBuffer;
+
+#ifdef HAVE_URING
+typedef struct {
+   int fd;
+   unsigned *sqTail;
+   unsigned *sqMask;
+   unsigned *sqArray;
+   unsigned *cqHead;
+   unsigned *cqTail;
+   unsigned *cqMask;
+   struct io_uring_sqe *sqes;
+   struct io_uring_cqe *cqes;
+   void *sqRing;
+   void *cqRing;
+   size_t sqRingSize;
+   size_t cqRingSize;
+   size_t sqesSize;
+} StoreUring;
+#endif
+
+struct TraceStore {
+   int fd;
+   bool direct;            // Bypassing the page cache
+   bool uring;             // Writing through 'ring'
+   bool haveRing;          // 'ring' needs freeing, even if we stopped using it
+   bool error;
+   uint64_t offset;        // Where the next write goes
+   uint64_t allocated;     // Space reserved by fallocate
+   uint64_t bytes;         // Trace data accepted, without padding
+
+   StoreBuffer buffers[TRACESTORE_NUM_BUFFERS];
+   int current;            // Buffer being filled
+
+   uint64_t writeTime;     // Nanoseconds with at least one write in flight
+   uint64_t busySince;
+   int inFlight;
+   uint32_t *latencies;    // Microseconds, one per write
+   uint32_t numLatencies;
+   uint32_t latenciesAlloc;
+
+#ifdef HAVE_URING
+   StoreUring ring;
+#endif
+};
+
+
+/*
+ * nanoseconds --
+ */
+
+static uint64_t
+nanoseconds(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+#ifdef HAVE_URING
+
+/*
+ * uringInit --
+ *
+ *    Internal function to set up an io_uring with room for 'entries'
+ *    writes, mapping its queues the way liburing would. Returns false
+ *    if the kernel (or a sandbox) won't give us one.
+ */
+
+static bool
+uringInit(StoreUring *u, unsigned entries)
+{
+   struct io_uring_params p;
+
+   memset(&p, 0, sizeof p);
+   u->fd = syscall(__NR_io_uring_setup, entries, &p);
+   if (u->fd < 0) {
+      return false;
+   }
+
+   u->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   u->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      if (u->cqRingSize > u->sqRingSize) {
+         u->sqRingSize = u->cqRingSize;
+      }
+      u->cqRingSize = 0;
+   }
+
+   u->sqRing = mmap(NULL, u->sqRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+   if (u->sqRing == MAP_FAILED) {
+      close(u->fd);
+      return false;
+   }
+
+   u->cqRing = u->sqRing;
+   if (u->cqRingSize) {
+      u->cqRing = mmap(NULL, u->cqRingSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+      if (u->cqRing == MAP_FAILED) {
+         munmap(u->sqRing, u->sqRingSize);
+         close(u->fd);
+         return false;
+      }
+   }
+
+   u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+   u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+   if (u->sqes == MAP_FAILED) {
+      if (u->cqRingSize) {
+         munmap(u->cqRing, u->cqRingSize);
+      }
+      munmap(u->sqRing, u->sqRingSize);
+      close(u->fd);
+      return false;
+   }
+
+   u->sqTail = (unsigned *)((uint8_t *)u->sqRing + p.sq_off.tail);
+   u->sqMask = (unsigned *)((uint8_t *)u->sqRing + p.sq_off.ring_mask);
+   u->sqArray = (unsigned *)((uint8_t *)u->sqRing + p.sq_off.array);
+   u->cqHead = (unsigned *)((uint8_t *)u->cqRing + p.cq_off.head);
+   u->cqTail = (unsigned *)((uint8_t *)u->cqRing + p.cq_off.tail);
+   u->cqMask = (unsigned *)((uint8_t *)u->cqRing + p.cq_off.ring_mask);
+   u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cqRing + p.cq_off.cqes);
+   return true;
+}
+
+
+/*
+ * uringFree --
+ */
+
+static void
+uringFree(StoreUring *u)
+{
+   munmap(u->sqes, u->sqesSize);
+   if (u->cqRingSize) {
+      munmap(u->cqRing, u->cqRingSize);
+   }
+   munmap(u->sqRing, u->sqRingSize);
+   close(u->fd);
+}
+
+
+/*
+ * uringWrite --
+ *
+ *    Internal function to queue and submit one write. The queue always
+ *    has room, since it's as deep as our number of buffers. Returns
+ *    false if the kernel wouldn't take it.
+ */
+
+static bool
+uringWrite(StoreUring *u, int fd, const void *data, uint32_t length,
+           uint64_t offset, uint64_t userData)
+{
+   unsigned tail = *u->sqTail;
+   unsigned index = tail & *u->sqMask;
+   struct io_uring_sqe *sqe = &u->sqes[index];
+   int result;
+
+   memset(sqe, 0, sizeof *sqe);
+   sqe->opcode = IORING_OP_WRITE;
+   sqe->fd = fd;
+   sqe->addr = (uintptr_t)data;
+   sqe->len = length;
+   sqe->off = offset;
+   sqe->user_data = userData;
+
+   u->sqArray[index] = index;
+   __atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+   /*
+    * GETEVENTS with no minimum doesn't wait, but it does run any
+    * completions the kernel has deferred to this thread. Without it, a
+    * write punted to a worker can sit finished and unreported for as
+    * long as we don't block in the ring.
+    */
+   do {
+      result = syscall(__NR_io_uring_enter, u->fd, 1, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+   } while (result < 0 && errno == EINTR);
+
+   return result == 1;
+}
+
+
+/*
+ * uringPoll --
+ *
+ *    Internal function to take the next completed write off the queue,
+ *    if there is one. Never blocks.
+ */
+
+static bool
+uringPoll(StoreUring *u, uint64_t *userData, int *result)
+{
+   unsigned head = *u->cqHead;
+   struct io_uring_cqe *cqe;
+
+   if (head == __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+      return false;
+   }
+
+   cqe = &u->cqes[head & *u->cqMask];
+   *userData = cqe->user_data;
+   *result = cqe->res;
+   __atomic_store_n(u->cqHead, head + 1, __ATOMIC_RELEASE);
+   return true;
+}
+
+
+/*
+ * uringWait --
+ *
+ *    Internal function to wait for the next completed write. Returns
+ *    false if we can't wait.
+ */
+
+static bool
+uringWait(StoreUring *u, uint64_t *userData, int *result)
+{
+   while (!uringPoll(u, userData, result)) {
+      if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+          errno != EINTR) {
+         return false;
+      }
+   }
+   return true;
+}
+
+#endif /* HAVE_URING */
+
+
+/*
+ * pwriteAll --
+ *
+ *    Internal function to synchronously write all of 'length' bytes.
+ *    If the filesystem won't do a direct write, we turn O_DIRECT off
+ *    and try again. Returns false on error, with errno set.
+ */
+
+static bool
+pwriteAll(TraceStore *store, const uint8_t *data, size_t length, uint64_t offset)
+{
+   while (length) {
+      ssize_t result = pwrite(store->fd, data, length, offset);
+
+      if (result < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+#ifdef O_DIRECT
+         if (errno == EINVAL && store->direct) {
+            store->direct = false;
+            fcntl(store->fd, F_SETFL, fcntl(store->fd, F_GETFL) & ~O_DIRECT);
+            continue;
+         }
+#endif
+         return false;
+      }
+
+      data += result;
+      length -= result;
+      offset += result;
+   }
+   return true;
+}
+
+
+/*
+ * recordLatency --
+ *
+ *    Internal function to remember how long one write took, and close
+ *    off a busy period if it was the last one in flight.
+ */
+
+static void
+recordLatency(TraceStore *store, uint64_t submitted)
+{
+   uint64_t now = nanoseconds();
+   uint64_t elapsed = now - submitted;
+
+   if (--store->inFlight == 0) {
+      store->writeTime += now - store->busySince;
+   }
+   if (store->numLatencies == store->latenciesAlloc) {
+      uint32_t alloc = store->latenciesAlloc ? store->latenciesAlloc * 2 : 1024;
+      uint32_t *latencies = realloc(store->latencies, alloc * sizeof *latencies);
+
+      if (!latencies) {
+         return;
+      }
+      store->latencies = latencies;
+      store->latenciesAlloc = alloc;
+   }
+
+   store->latencies[store->numLatencies++] = elapsed / 1000;
+}
+
+
+/*
+ * completeBuffer --
+ *
+ *    Internal function to finish off a buffer whose asynchronous write
+ *    has completed with 'result'. A short or failed write is finished
+ *    synchronously. If io_uring can't do this kind of write at all, we
+ *    stop using it.
+ */
+
+static void
+completeBuffer(TraceStore *store, StoreBuffer *buf, int result)
+{
+   uint32_t done = result > 0 ? result : 0;
+
+   if (result == -EINVAL || result == -EOPNOTSUPP) {
+      store->uring = false;
+   }
+
+   if (done < buf->length &&
+       !pwriteAll(store, buf->data + done, buf->length - done, buf->offset + done)) {
+      perror("Trace write error");
+      store->error = true;
+   }
+
+   recordLatency(store, buf->submitted);
+   buf->busy = false;
+}
+
+
+/*
+ * reapBuffers --
+ *
+ *    Internal function to retire any writes that have already finished,
+ *    so their latency is measured when they complete rather than when
+ *    we next need the buffer.
+ */
+
+static void
+reapBuffers(TraceStore *store)
+{
+#ifdef HAVE_URING
+   uint64_t userData;
+   int result;
+
+   if (store->haveRing) {
+      while (uringPoll(&store->ring, &userData, &result)) {
+         completeBuffer(store, &store->buffers[userData], result);
+      }
+   }
+#endif
+}
+
+
+/*
+ * waitForBuffer --
+ *
+ *    Internal function to wait until a buffer's write has finished.
+ */
+
+static void
+waitForBuffer(TraceStore *store, StoreBuffer *buf)
+{
+#ifdef HAVE_URING
+   while (buf->busy) {
+      uint64_t userData;
+      int result;
+
+      if (!uringWait(&store->ring, &userData, &result)) {
+         perror("Trace write error");
+         store->error = true;
+         return;
+      }
+      completeBuffer(store, &store->buffers[userData], result);
+   }
+#endif
+}
+
+
+/*
+ * submitBuffer --
+ *
+ *    Internal function to write out the current buffer, and move on to
+ *    the next one once it's free. Space is reserved ahead of the write
+ *    if it's about to run past what we've already allocated.
+ */
+
+static void
+submitBuffer(TraceStore *store)
+{
+   StoreBuffer *buf = &store->buffers[store->current];
+
+   buf->offset = store->offset;
+   buf->submitted = nanoseconds();
+   store->offset += buf->length;
+
+   if (store->inFlight++ == 0) {
+      store->busySince = buf->submitted;
+   }
+
+#ifdef __linux__
+   if (store->offset > store->allocated) {
+      if (fallocate(store->fd, FALLOC_FL_KEEP_SIZE, store->allocated,
+                    TRACESTORE_PREALLOCATE) == 0) {
+         store->allocated += TRACESTORE_PREALLOCATE;
+      } else {
+         // Not supported here. Don't try again.
+         store->allocated = UINT64_MAX;
+      }
+   }
+#endif
+
+#ifdef HAVE_URING
+   if (store->uring) {
+      if (uringWrite(&store->ring, store->fd, buf->data, buf->length,
+                     buf->offset, store->current)) {
+         buf->busy = true;
+      } else {
+         /*
+          * The write is still in the submission queue, so it would go
+          * out the next time we entered the kernel. Never do that.
+          */
+         store->uring = false;
+      }
+   }
+#endif
+
+   if (!buf->busy) {
+      if (!pwriteAll(store, buf->data, buf->length, buf->offset)) {
+         perror("Trace write error");
+         store->error = true;
+      }
+      recordLatency(store, buf->submitted);
+   }
+
+   store->current = (store->current + 1) % TRACESTORE_NUM_BUFFERS;
+   buf = &store->buffers[store->current];
+   waitForBuffer(store, buf);
+   buf->length = 0;
+}
+
+
+/*
+ * TraceStore_Open --
+ *
+ *    Create (or truncate) a trace file. 'flags' can turn off O_DIRECT
+ *    or io_uring. Returns NULL with errno set on error.
+ */
+
+TraceStore *
+TraceStore_Open(const char *filename, int flags)
+{
+   const int openFlags = O_WRONLY | O_CREAT | O_TRUNC;
+   TraceStore *store = calloc(1, sizeof *store);
+   int i;
+
+   if (!store) {
+      return NULL;
+   }
+
+   store->fd = -1;
+#ifdef O_DIRECT
+   if (!(flags & TRACESTORE_BUFFERED)) {
+      // Some filesystems (tmpfs, for one) refuse O_DIRECT at open time
+      store->fd = open(filename, openFlags | O_DIRECT, 0666);
+      store->direct = store->fd >= 0;
+   }
+#endif
+   if (store->fd < 0) {
+      store->fd = open(filename, openFlags, 0666);
+   }
+   if (store->fd < 0) {
+      free(store);
+      return NULL;
+   }
+#ifdef F_NOCACHE
+   if (!(flags & TRACESTORE_BUFFERED)) {
+      store->direct = fcntl(store->fd, F_NOCACHE, 1) == 0;
+   }
+#endif
+
+   for (i = 0; i < TRACESTORE_NUM_BUFFERS; i++) {
+      void *data;
+
+      if (posix_memalign(&data, STORE_ALIGNMENT, TRACESTORE_BUFFER_SIZE)) {
+         TraceStore_Close(store);
+         errno = ENOMEM;
+         return NULL;
+      }
+      store->buffers[i].data = data;
+   }
+
+#ifdef HAVE_URING
+   if (!(flags & TRACESTORE_NO_URING)) {
+      store->uring = store->haveRing = uringInit(&store->ring, TRACESTORE_NUM_BUFFERS);
+   }
+#endif
+
+   return store;
+}
+
+
+/*
+ * TraceStore_Write --
+ *
+ *    Append data to the trace. It's copied, so the caller can reuse its
+ *    buffer right away. Returns false if any write so far has failed.
+ */
+
+bool
+TraceStore_Write(TraceStore *store, const uint8_t *data, size_t length)
+{
+   reapBuffers(store);
+
+   while (length && !store->error) {
+      StoreBuffer *buf = &store->buffers[store->current];
+      size_t chunk = TRACESTORE_BUFFER_SIZE - buf->length;
+
+      if (chunk > length) {
+         chunk = length;
+      }
+      memcpy(buf->data + buf->length, data, chunk);
+      buf->length += chunk;
+      store->bytes += chunk;
+      data += chunk;
+      length -= chunk;
+
+      if (buf->length == TRACESTORE_BUFFER_SIZE) {
+         submitBuffer(store);
+      }
+   }
+
+   return !store->error;
+}
+
+
+/*
+ * TraceStore_Finish --
+ *
+ *    Write anything still buffered, and wait for every write to finish.
+ *    A direct write has to be a whole number of blocks, so the last one
+ *    is padded out and then truncated away, along with any space we
+ *    reserved and didn't use. Nothing more can be written afterwards.
+ *    Returns false if any write failed.
+ */
+
+bool
+TraceStore_Finish(TraceStore *store)
+{
+   StoreBuffer *buf = &store->buffers[store->current];
+   int i;
+
+   if (buf->length && !store->error) {
+      if (store->direct) {
+         uint32_t padded = (buf->length + STORE_ALIGNMENT - 1) & ~(STORE_ALIGNMENT - 1);
+
+         memset(buf->data + buf->length, 0, padded - buf->length);
+         buf->length = padded;
+      }
+      submitBuffer(store);
+   }
+
+   for (i = 0; i < TRACESTORE_NUM_BUFFERS; i++) {
+      waitForBuffer(store, &store->buffers[i]);
+   }
+
+   if (ftruncate(store->fd, store->bytes) < 0) {
+      perror("Error truncating trace file");
+      store->error = true;
+   }
+
+   return !store->error;
+}
+
+
+/*
+ * compareLatency --
+ */
+
+static int
+compareLatency(const void *a, const void *b)
+{
+   uint32_t x = *(const uint32_t *)a;
+   uint32_t y = *(const uint32_t *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+
+/*
+ * TraceStore_PrintStats --
+ *
+ *    Describe how the trace was written, and the distribution of write
+ *    latencies: how long each buffer took from submission to completion.
+ */
+
+void
+TraceStore_PrintStats(const TraceStore *store, FILE *f)
+{
+   static const struct {
+      const char *name;
+      double fraction;
+   } percentiles[] = {
+      { "p50", 0.50 },
+      { "p90", 0.90 },
+      { "p99", 0.99 },
+      { "p99.9", 0.999 },
+   };
+   double seconds = store->writeTime * 1e-9;
+   uint32_t n = store->numLatencies;
+   uint32_t *sorted;
+   uint32_t i;
+
+   fprintf(f, "Disk: %.1f MB in %u writes, %.1f MB/s while writing, %s%s\n",
+           store->bytes / (1024.0 * 1024.0), n,
+           seconds > 0 ? store->bytes / (1024.0 * 1024.0) / seconds : 0.0,
+           store->direct ? "direct " : "buffered ",
+           store->uring ? "io_uring" : "pwrite");
+
+   sorted = malloc(n * sizeof *sorted);
+   if (!n || !sorted) {
+      free(sorted);
+      return;
+   }
+   memcpy(sorted, store->latencies, n * sizeof *sorted);
+   qsort(sorted, n, sizeof *sorted, compareLatency);
+
+   fprintf(f, "Write latency:");
+   for (i = 0; i < sizeof percentiles / sizeof percentiles[0]; i++) {
+      fprintf(f, " %s %.2f ms,", percentiles[i].name,
+              sorted[(uint32_t)(percentiles[i].fraction * (n - 1))] / 1000.0);
+   }
+   fprintf(f, " max %.2f ms\n", sorted[n - 1] / 1000.0);
+
+   free(sorted);
+}
+
+
+/*
+ * TraceStore_Close --
+ *
+ *    Close the file and free everything. Call TraceStore_Finish first,
+ *    or any buffered data is lost.
+ */
+
+void
+TraceStore_Close(TraceStore *store)
+{
+   int i;
+
+#ifdef HAVE_URING
+   if (store->haveRing) {
+      for (i = 0; i < TRACESTORE_NUM_BUFFERS; i++) {
+         waitForBuffer(store, &store->buffers[i]);
+      }
+      uringFree(&store->ring);
+   }
+#endif
+
+   for (i = 0; i < TRACESTORE_NUM_BUFFERS; i++) {
+      free(store->buffers[i].data);
+   }
+   free(store->latencies);
+   close(store->fd);
+   free(store);
+}
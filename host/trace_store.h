@@ -0,0 +1,65 @@
+/*
+ * trace_store.h - Writes the raw trace to disk with large aligned, direct
+ *                 writes, and keeps track of how long they take.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __TRACE_STORE_H
+#define __TRACE_STORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Data is collected into TRACESTORE_BUFFER_SIZE buffers, and each full
+ * buffer becomes one write. Where the OS allows it, writes bypass the
+ * page cache (O_DIRECT), go through io_uring with up to
+ * TRACESTORE_NUM_BUFFERS - 1 in flight, and land in space fallocate()
+ * reserved ahead of them. Anything unavailable falls back quietly, as
+ * far as plain pwrite() from the calling thread.
+ */
+
+#define TRACESTORE_BUFFER_SIZE    (4 * 1024 * 1024)
+#define TRACESTORE_NUM_BUFFERS    4
+#define TRACESTORE_PREALLOCATE    (256 * 1024 * 1024)
+
+// Flags for TraceStore_Open
+#define TRACESTORE_BUFFERED   (1 << 0)   // Use the page cache
+#define TRACESTORE_NO_URING   (1 << 1)   // Use pwrite
+
+typedef struct TraceStore TraceStore;
+
+
+/*
+ * Public functions
+ */
+
+TraceStore *TraceStore_Open(const char *filename, int flags);
+bool TraceStore_Write(TraceStore *store, const uint8_t *data, size_t length);
+bool TraceStore_Finish(TraceStore *store);
+void TraceStore_PrintStats(const TraceStore *store, FILE *f);
+void TraceStore_Close(TraceStore *store);
+
+
+#endif // __TRACE_STORE_H
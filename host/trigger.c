@@ -0,0 +1,270 @@
+/*
+ * trigger.c - Conditions on traced memory operations, compiled so the
+ *             parser can check them at capture rate.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "trigger.h"
+
+static const struct {
+   const char *name;
+   TriggerAction action;
+} actionNames[] = {
+   { "stop", TRIGGER_STOP },
+   { "mark", TRIGGER_MARK },
+   { "snapshot", TRIGGER_SNAPSHOT },
+   { "print", TRIGGER_PRINT },
+};
+
+
+/*
+ * coverStep --
+ *
+ *    Internal function to add (delta = 1) or remove (delta = -1) one
+ *    step's pages from the set. Each page counts the current steps
+ *    covering it, so a trigger moving on only touches the pages of the
+ *    step it left and the step it's now waiting for.
+ */
+
+static void
+coverStep(TriggerSet *set, const TriggerStep *step, int delta)
+{
+   uint32_t page = step->first >> TRIGGER_PAGE_SHIFT;
+   uint32_t last = (step->end - 1) >> TRIGGER_PAGE_SHIFT;
+
+   for (; page <= last; page++) {
+      set->pageRefs[page] += delta;
+      if (set->pageRefs[page]) {
+         set->pages[page >> 3] |= 1 << (page & 7);
+      } else {
+         set->pages[page >> 3] &= ~(1 << (page & 7));
+      }
+   }
+}
+
+
+/*
+ * parseStep --
+ *
+ *    Internal function to parse one STEP of a trigger spec, in place.
+ *    Returns false on a syntax error.
+ */
+
+static bool
+parseStep(TriggerStep *step, char *str)
+{
+   char *tokSave;
+   char *field = strtok_r(str, ",", &tokSave);
+   char *colon = field ? strchr(field, ':') : NULL;
+   unsigned long first, length;
+   char *end;
+
+   if (!colon) {
+      return false;
+   }
+   *colon = '\0';
+
+   if (!strcmp(field, "read")) {
+      step->types = TRIGGER_READ;
+   } else if (!strcmp(field, "write")) {
+      step->types = TRIGGER_WRITE;
+   } else if (!strcmp(field, "rw")) {
+      step->types = TRIGGER_READ | TRIGGER_WRITE;
+   } else {
+      return false;
+   }
+
+   first = strtoul(colon + 1, &end, 16);
+   if (end == colon + 1) {
+      return false;
+   }
+   if (end[0] == '+') {
+      length = strtoul(end + 1, &end, 16);
+   } else if (end[0] == '.' && end[1] == '.') {
+      unsigned long second = strtoul(end + 2, &end, 16);
+
+      if (second <= first) {
+         return false;
+      }
+      length = second - first;
+   } else {
+      length = 1;
+   }
+
+   first &= TRIGGER_ADDR_MASK;
+   if (*end || !length || length > TRIGGER_ADDR_MASK + 1 - first) {
+      return false;
+   }
+   step->first = first & ~1;
+   step->end = first + length;
+   step->value = 0;
+   step->mask = 0;
+   step->count = 1;
+
+   while ((field = strtok_r(NULL, ",", &tokSave))) {
+      if (!strncmp(field, "data=", 5)) {
+         step->value = strtoul(field + 5, &end, 16);
+         step->mask = 0xFFFF;
+         if (*end == '/') {
+            step->mask = strtoul(end + 1, &end, 16);
+         }
+         step->value &= step->mask;
+      } else if (!strncmp(field, "count=", 6)) {
+         step->count = strtoul(field + 6, &end, 10);
+         if (!step->count) {
+            return false;
+         }
+      } else {
+         return false;
+      }
+      if (*end) {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+
+/*
+ * TriggerSet_Init --
+ */
+
+void
+TriggerSet_Init(TriggerSet *set)
+{
+   memset(set, 0, sizeof *set);
+}
+
+
+/*
+ * TriggerSet_Parse --
+ *
+ *    Add a trigger from a spec string (see trigger.h). Returns false if
+ *    it doesn't parse, or the set is full.
+ */
+
+bool
+TriggerSet_Parse(TriggerSet *set, const char *spec)
+{
+   Trigger *t = &set->triggers[set->numTriggers];
+   char *str, *colon, *stepStr, *tokSave;
+   int i;
+
+   if (set->numTriggers == TRIGGER_MAX) {
+      return false;
+   }
+
+   memset(t, 0, sizeof *t);
+   str = strdup(spec);
+   colon = strchr(str, ':');
+   if (!colon) {
+      goto error;
+   }
+   *colon = '\0';
+
+   for (i = 0; i < sizeof actionNames / sizeof actionNames[0]; i++) {
+      if (!strcmp(str, actionNames[i].name)) {
+         break;
+      }
+   }
+   if (i == sizeof actionNames / sizeof actionNames[0]) {
+      goto error;
+   }
+   t->action = actionNames[i].action;
+
+   for (stepStr = strtok_r(colon + 1, ">", &tokSave); stepStr;
+        stepStr = strtok_r(NULL, ">", &tokSave)) {
+      if (t->numSteps == TRIGGER_MAX_STEPS ||
+          !parseStep(&t->steps[t->numSteps++], stepStr)) {
+         goto error;
+      }
+   }
+   if (!t->numSteps) {
+      goto error;
+   }
+
+   free(str);
+   t->spec = strdup(spec);
+   set->numTriggers++;
+   coverStep(set, &t->steps[0], 1);
+   return true;
+
+ error:
+   free(str);
+   return false;
+}
+
+
+/*
+ * TriggerSet_Check --
+ *
+ *    Advance every trigger that this operation matches. 'type' is
+ *    TRIGGER_READ or TRIGGER_WRITE, and 'addr' is the address of the
+ *    word. Returns a bitmask of the triggers that fired. A stop fires
+ *    once; anything else starts over at its first step.
+ *
+ *    Only worth calling when TriggerSet_MayMatch says so.
+ */
+
+uint32_t
+TriggerSet_Check(TriggerSet *set, int type, uint32_t addr, uint16_t word)
+{
+   uint32_t fired = 0;
+   int i;
+
+   addr &= TRIGGER_ADDR_MASK;
+
+   for (i = 0; i < set->numTriggers; i++) {
+      Trigger *t = &set->triggers[i];
+      const TriggerStep *step;
+      int oldState = t->state;
+
+      if (t->state >= t->numSteps) {
+         continue;
+      }
+      step = &t->steps[t->state];
+      if (!(step->types & type) || addr < step->first || addr >= step->end ||
+          (word & step->mask) != step->value || ++t->hits < step->count) {
+         continue;
+      }
+
+      t->hits = 0;
+      if (++t->state == t->numSteps) {
+         fired |= 1u << i;
+         t->fired++;
+         if (t->action != TRIGGER_STOP) {
+            t->state = 0;
+         }
+      }
+      if (t->state != oldState) {
+         coverStep(set, step, -1);
+         if (t->state < t->numSteps) {
+            coverStep(set, &t->steps[t->state], 1);
+         }
+      }
+   }
+
+   return fired;
+}
@@ -0,0 +1,121 @@
+/*
+ * trigger.h - Conditions on traced memory operations, compiled so the
+ *             parser can check them at capture rate.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __TRIGGER_H
+#define __TRIGGER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * A trigger is a sequence of steps, and an action to take when the
+ * last step matches. Each step matches reads and/or writes to a range
+ * of addresses, optionally only where (word & mask) == value, and
+ * optionally only on every Nth such operation. Until a step has
+ * matched, later steps aren't looked at.
+ *
+ * The set keeps a bitmap of the RAM pages that any trigger's current
+ * step covers. Almost every operation misses it, so that one lookup
+ * is the whole cost of having triggers. Only hits walk the triggers,
+ * and only a trigger moving between steps updates the bitmap.
+ *
+ * Spec syntax, as given to TriggerSet_Parse:
+ *
+ *   ACTION:STEP[>STEP...]
+ *   ACTION = stop | mark | snapshot | print
+ *   STEP   = read|write|rw:ADDR[..END|+LENGTH][,data=VALUE[/MASK]][,count=N]
+ *
+ * Numbers are hexadecimal, except N. END is exclusive.
+ */
+
+#define TRIGGER_MAX         32       // Per set; fired triggers are a bitmask
+#define TRIGGER_MAX_STEPS   8
+#define TRIGGER_ADDR_MASK   0x00FFFFFF
+#define TRIGGER_PAGE_SHIFT  12
+#define TRIGGER_NUM_PAGES   ((TRIGGER_ADDR_MASK + 1) >> TRIGGER_PAGE_SHIFT)
+
+#define TRIGGER_READ        (1 << 0)
+#define TRIGGER_WRITE       (1 << 1)
+
+typedef enum {
+   TRIGGER_STOP,        // Stop the capture (or trigger the flight recorder)
+   TRIGGER_MARK,        // Note the trace time
+   TRIGGER_SNAPSHOT,    // Save the flight recorder's window so far
+   TRIGGER_PRINT,       // Show the operation: a live watch
+} TriggerAction;
+
+typedef struct {
+   int types;
+   uint32_t first;      // Word-aligned
+   uint32_t end;
+   uint16_t value;
+   uint16_t mask;
+   uint32_t count;
+} TriggerStep;
+
+typedef struct {
+   char *spec;
+   TriggerAction action;
+   int numSteps;
+   TriggerStep steps[TRIGGER_MAX_STEPS];
+
+   int state;           // Step we're waiting for. numSteps once a stop has fired.
+   uint32_t hits;       // Matches of that step so far
+   uint64_t fired;
+} Trigger;
+
+typedef struct {
+   uint8_t pages[TRIGGER_NUM_PAGES / 8];
+   uint8_t pageRefs[TRIGGER_NUM_PAGES];    // Current steps covering each page
+   int numTriggers;
+   Trigger triggers[TRIGGER_MAX];
+} TriggerSet;
+
+
+/*
+ * Public functions
+ */
+
+void TriggerSet_Init(TriggerSet *set);
+bool TriggerSet_Parse(TriggerSet *set, const char *spec);
+uint32_t TriggerSet_Check(TriggerSet *set, int type, uint32_t addr, uint16_t word);
+
+
+/*
+ * TriggerSet_MayMatch --
+ *
+ *    The fast path: could any trigger care about an operation here?
+ */
+
+static inline bool
+TriggerSet_MayMatch(const TriggerSet *set, uint32_t addr)
+{
+   uint32_t page = (addr & TRIGGER_ADDR_MASK) >> TRIGGER_PAGE_SHIFT;
+
+   return set->pages[page >> 3] & (1 << (page & 7));
+}
+
+
+#endif // __TRIGGER_H
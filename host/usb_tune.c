@@ -0,0 +1,365 @@
+/*
+ * usb_tune.c - Choosing USB transfer sizes by measuring them.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "usb_tune.h"
+#include "hw_common.h"
+
+// Completions before this much time has passed are just the backlog
+#define WARMUP_SECONDS  0.25
+
+typedef struct {
+   USBTuneSettings settings;
+   int err;
+   double rate;         // Payload bytes per second
+   double jitter;       // Std. deviation of the time between transfers, ms
+   double cpu;          // Fraction of one CPU
+} TuneResult;
+
+typedef struct {
+   double start;
+   double measureStart;
+   double last;
+   uint64_t bytes;
+   uint64_t intervals;
+   double sum;
+   double sumSquares;
+} TuneState;
+
+
+/*
+ * now --
+ */
+
+static double
+now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ * cpuSeconds --
+ *
+ *    Internal function: user plus system time used by this process.
+ */
+
+static double
+cpuSeconds(void)
+{
+   struct rusage usage;
+
+   getrusage(RUSAGE_SELF, &usage);
+   return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+          usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+
+/*
+ * tuneCallback --
+ *
+ *    Stream callback for one measurement. Counts payload and the gaps
+ *    between completed transfers, and ends the stream on time.
+ */
+
+static int
+tuneCallback(uint8_t *buffer, int length, FTDIProgressInfo *progress, void *userdata)
+{
+   TuneState *t = userdata;
+   double time = now();
+
+   if (length && time >= t->measureStart) {
+      if (t->last) {
+         double interval = time - t->last;
+
+         t->sum += interval;
+         t->sumSquares += interval * interval;
+         t->intervals++;
+      }
+      t->last = time;
+      t->bytes += length;
+   }
+
+   return time - t->start >= WARMUP_SECONDS + USBTUNE_SECONDS;
+}
+
+
+/*
+ * measure --
+ *
+ *    Internal function to stream for a while with one setting.
+ */
+
+static void
+measure(FTDIDevice *dev, TuneResult *result)
+{
+   TuneState t;
+   double cpu, seconds;
+
+   memset(&t, 0, sizeof t);
+   t.start = now();
+   t.measureStart = t.start + WARMUP_SECONDS;
+   cpu = cpuSeconds();
+
+   result->err = FTDIDevice_ReadStream(dev, FTDI_INTERFACE_A, tuneCallback, &t,
+                                       result->settings.packetsPerTransfer,
+                                       result->settings.numTransfers);
+   if (result->err == 1) {
+      // Our callback ended it
+      result->err = 0;
+   }
+
+   seconds = now() - t.start;
+   result->cpu = (cpuSeconds() - cpu) / seconds;
+   result->rate = t.last > t.measureStart ? t.bytes / (t.last - t.measureStart) : 0;
+   result->jitter = 0;
+   if (t.intervals > 1) {
+      double mean = t.sum / t.intervals;
+      double variance = t.sumSquares / t.intervals - mean * mean;
+
+      result->jitter = variance > 0 ? sqrt(variance) * 1000.0 : 0;
+   }
+}
+
+
+/*
+ * USBTune_Init --
+ *
+ *    The settings memhost has always used.
+ */
+
+void
+USBTune_Init(USBTuneSettings *settings)
+{
+   settings->packetsPerTransfer = USBTUNE_DEFAULT_PACKETS;
+   settings->numTransfers = USBTUNE_DEFAULT_TRANSFERS;
+}
+
+
+/*
+ * USBTune_Run --
+ *
+ *    Turn on tracing, measure each combination of transfer size and
+ *    depth, and print what we found. 'settings' gets the winner, and
+ *    keeps its old value if nothing worked. Tracing is off and the
+ *    device's buffers are drained when we return.
+ *
+ *    The DSi needs to be running, so there's memory traffic to stream.
+ */
+
+void
+USBTune_Run(FTDIDevice *dev, USBTuneSettings *settings)
+{
+   static const int packets[] = { 4, 8, 16, 32, 64 };
+   static const int transfers[] = { 16, 64, 256 };
+   const int numPackets = sizeof packets / sizeof packets[0];
+   const int numTransfers = sizeof transfers / sizeof transfers[0];
+   TuneResult results[sizeof packets / sizeof packets[0] *
+                      sizeof transfers / sizeof transfers[0]];
+   TuneResult *best = NULL;
+   double bestRate = 0;
+   int i, numResults = 0;
+
+   fprintf(stderr, "Tuning USB transfers, %.0f seconds...\n\n"
+           "packets transfers       kB/s  jitter ms    CPU %%\n",
+           numPackets * numTransfers * (WARMUP_SECONDS + USBTUNE_SECONDS));
+
+   HW_ConfigWrite(dev, REG_TRACEFLAGS, TRACEFLAG_READS | TRACEFLAG_WRITES, false);
+
+   for (i = 0; i < numPackets * numTransfers; i++) {
+      TuneResult *r = &results[numResults++];
+
+      memset(r, 0, sizeof *r);
+      r->settings.packetsPerTransfer = packets[i / numTransfers];
+      r->settings.numTransfers = transfers[i % numTransfers];
+      measure(dev, r);
+
+      if (r->err) {
+         fprintf(stderr, "%7d %9d   error %d\n", r->settings.packetsPerTransfer,
+                 r->settings.numTransfers, r->err);
+         continue;
+      }
+      fprintf(stderr, "%7d %9d %10.1f %10.3f %8.1f\n", r->settings.packetsPerTransfer,
+              r->settings.numTransfers, r->rate / 1024.0, r->jitter, r->cpu * 100.0);
+      if (r->rate > bestRate) {
+         bestRate = r->rate;
+      }
+   }
+
+   HW_ConfigWrite(dev, REG_TRACEFLAGS, 0, false);
+   while (FTDIDevice_ReadByteSync(dev, FTDI_INTERFACE_A, NULL) >= 0);
+
+   /*
+    * Rates within the slack are as good as each other. Of those, take
+    * the cheapest, and break ties on jitter.
+    */
+
+   for (i = 0; i < numResults; i++) {
+      TuneResult *r = &results[i];
+
+      if (r->err || r->rate <= 0 || r->rate < bestRate * (1.0 - USBTUNE_RATE_SLACK)) {
+         continue;
+      }
+      if (!best || r->cpu < best->cpu - 0.01 ||
+          (r->cpu <= best->cpu + 0.01 && r->jitter < best->jitter)) {
+         best = r;
+      }
+   }
+
+   if (best) {
+      *settings = best->settings;
+      fprintf(stderr, "\nBest: %d packets per transfer, %d transfers\n\n",
+              settings->packetsPerTransfer, settings->numTransfers);
+   } else {
+      fprintf(stderr, "\nNo data from the device. Keeping %d packets per transfer, "
+              "%d transfers\n\n", settings->packetsPerTransfer, settings->numTransfers);
+   }
+}
+
+
+/*
+ * tuneFilePath --
+ *
+ *    Internal function to find where saved settings live. Returns false
+ *    if we have no home directory or host name.
+ */
+
+static bool
+tuneFilePath(char *path, size_t pathSize, char *host, size_t hostSize)
+{
+   const char *home = getenv("HOME");
+
+   if (!home || gethostname(host, hostSize) < 0) {
+      return false;
+   }
+   host[hostSize - 1] = '\0';
+   snprintf(path, pathSize, "%s/%s", home, USBTUNE_FILENAME);
+   return true;
+}
+
+
+/*
+ * USBTune_Load --
+ *
+ *    Look up the settings saved for this host. Returns false, leaving
+ *    'settings' alone, if there aren't any.
+ */
+
+bool
+USBTune_Load(USBTuneSettings *settings)
+{
+   char path[PATH_MAX], host[256], line[512];
+   bool found = false;
+   FILE *f;
+
+   if (!tuneFilePath(path, sizeof path, host, sizeof host) || !(f = fopen(path, "r"))) {
+      return false;
+   }
+
+   while (fgets(line, sizeof line, f)) {
+      char name[256];
+      int packets, transfers;
+
+      if (sscanf(line, "%255s %d %d", name, &packets, &transfers) == 3 &&
+          !strcmp(name, host) && packets > 0 && transfers > 0) {
+         settings->packetsPerTransfer = packets;
+         settings->numTransfers = transfers;
+         found = true;
+      }
+   }
+
+   fclose(f);
+   return found;
+}
+
+
+/*
+ * USBTune_Save --
+ *
+ *    Remember these settings for this host, replacing any we had.
+ *    Other hosts' lines are kept, so a shared home directory works.
+ *    We write a new file next to the old one and rename it into place,
+ *    so a failure part way never loses anyone's settings. Returns
+ *    false on error.
+ */
+
+bool
+USBTune_Save(const USBTuneSettings *settings)
+{
+   char path[PATH_MAX], tmpPath[PATH_MAX + 300], host[256], line[512];
+   FILE *in, *out;
+   bool ok = true;
+
+   if (!tuneFilePath(path, sizeof path, host, sizeof host)) {
+      return false;
+   }
+
+   // Named for the host, so two hosts saving at once don't collide
+   snprintf(tmpPath, sizeof tmpPath, "%s.%s.tmp", path, host);
+   if (!(out = fopen(tmpPath, "w"))) {
+      return false;
+   }
+
+   if ((in = fopen(path, "r"))) {
+      while (ok && fgets(line, sizeof line, in)) {
+         char name[256];
+
+         if (sscanf(line, "%255s", name) == 1 && !strcmp(name, host)) {
+            continue;
+         }
+         ok = fputs(line, out) >= 0;
+      }
+      if (ferror(in)) {
+         ok = false;
+      }
+      fclose(in);
+   } else if (errno != ENOENT) {
+      ok = false;
+   }
+
+   if (ok) {
+      ok = fprintf(out, "%s %d %d\n", host, settings->packetsPerTransfer,
+                   settings->numTransfers) > 0;
+   }
+   if (fclose(out)) {
+      ok = false;
+   }
+
+   if (!ok || rename(tmpPath, path)) {
+      unlink(tmpPath);
+      return false;
+   }
+   return true;
+}
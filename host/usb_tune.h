@@ -0,0 +1,65 @@
+/*
+ * usb_tune.h - Choosing USB transfer sizes by measuring them.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __USB_TUNE_H
+#define __USB_TUNE_H
+
+#include <stdbool.h>
+#include "fastftdi.h"
+
+/*
+ * FTDIDevice_ReadStream keeps numTransfers transfers of
+ * packetsPerTransfer USB packets each in flight. What works best
+ * depends on the host controller, so USBTune_Run streams trace data
+ * from the device with each of a grid of settings, and picks the
+ * fastest. Among settings within USBTUNE_RATE_SLACK of the fastest,
+ * it prefers the one using the least CPU, then the least jitter in the
+ * time between completed transfers.
+ *
+ * Results are kept per host name in ~/USBTUNE_FILENAME.
+ */
+
+#define USBTUNE_DEFAULT_PACKETS    8
+#define USBTUNE_DEFAULT_TRANSFERS  256
+#define USBTUNE_SECONDS            1.0    // Per setting
+#define USBTUNE_RATE_SLACK         0.03
+#define USBTUNE_FILENAME           ".memhost-usb"
+
+typedef struct {
+   int packetsPerTransfer;
+   int numTransfers;
+} USBTuneSettings;
+
+
+/*
+ * Public functions
+ */
+
+void USBTune_Init(USBTuneSettings *settings);
+bool USBTune_Load(USBTuneSettings *settings);
+bool USBTune_Save(const USBTuneSettings *settings);
+void USBTune_Run(FTDIDevice *dev, USBTuneSettings *settings);
+
+
+#endif // __USB_TUNE_H
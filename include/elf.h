@@ -34,6 +34,28 @@ typedef struct {
 	uint32_t p_align;
 } Elf32_Phdr;
 
+typedef struct {
+	uint32_t sh_name;
+	uint32_t sh_type;
+	uint32_t sh_flags;
+	uint32_t sh_addr;
+	uint32_t sh_offset;
+	uint32_t sh_size;
+	uint32_t sh_link;
+	uint32_t sh_info;
+	uint32_t sh_addralign;
+	uint32_t sh_entsize;
+} Elf32_Shdr;
+
+typedef struct {
+	uint32_t st_name;
+	uint32_t st_value;
+	uint32_t st_size;
+	unsigned char st_info;
+	unsigned char st_other;
+	uint16_t st_shndx;
+} Elf32_Sym;
+
 #define PT_NULL     0
 #define PT_LOAD     1
 #define PT_DYNAMIC  2
@@ -72,6 +94,23 @@ typedef struct {
 #define EV_CURRENT      1
 #define EV_NUM          2
 
+#define EM_ARM          40              /* e_machine */
+
+#define SHT_NULL        0               /* sh_type */
+#define SHT_SYMTAB      2
+#define SHT_STRTAB      3
+#define SHT_DYNSYM      11
+
+#define SHN_UNDEF       0               /* st_shndx */
+
+#define ELF32_ST_TYPE(i)   ((i) & 0xf)
+
+#define STT_NOTYPE      0               /* ELF32_ST_TYPE(st_info) */
+#define STT_OBJECT      1
+#define STT_FUNC        2
+#define STT_SECTION     3
+#define STT_FILE        4
+
 /* These constants define the permissions on sections in the program
    header, p_flags. */
 #define PF_R            0x4
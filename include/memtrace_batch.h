@@ -0,0 +1,510 @@
+/*
+ * memtrace_batch.h - Vectorized validation and unpacking for runs of
+ *                    packets in the hardware memory tracer's log format.
+ *
+ * Copyright (C) 2009 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __MEMTRACE_BATCH_H
+#define __MEMTRACE_BATCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memtrace_fmt.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MEMPKT_BATCH_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * The batch kernels decode up to MEMPKT_BATCH_SIZE raw packets at a
+ * time. They stop at the first packet which is misaligned or has a bad
+ * checksum, and return the number of good packets before it. Callers
+ * handle that packet with the usual one-at-a-time functions, so they
+ * can report exactly the same errors as before.
+ *
+ * On a clean stream, every packet is validated and unpacked here.
+ */
+
+#define MEMPKT_BATCH_SIZE   64
+
+typedef struct {
+   MemPacket packet[MEMPKT_BATCH_SIZE];     // Byte-swapped raw packet
+   uint32_t  payload[MEMPKT_BATCH_SIZE];    // MemPacket_GetPayload()
+   uint32_t  duration[MEMPKT_BATCH_SIZE];   // MemPacket_GetDuration()
+   uint32_t  type[MEMPKT_BATCH_SIZE];       // MemPacket_GetType()
+} MemPacketBatch;
+
+typedef int (*MemPacketBatchFn)(const uint8_t *bytes, int count,
+                                MemPacketBatch *batch);
+
+/*
+ * Constants shared by all variants. The payload is 23 bits, scattered
+ * between the alignment bits; PAYLOAD_BITS selects them for PEXT.
+ */
+
+#define MEMPKT_ALIGN_MASK     0x80808080
+#define MEMPKT_ALIGN_VALUE    0x80000000
+#define MEMPKT_PAYLOAD_BITS   0x1F7F7F78
+
+/*
+ * Portable version. This is the reference implementation.
+ */
+
+static inline int
+MemPacketBatch_Scalar(const uint8_t *bytes, int first, int count,
+                      MemPacketBatch *batch)
+{
+   int i;
+
+   for (i = first; i < count; i++) {
+      MemPacket p = MemPacket_FromBytes(bytes + i * sizeof p);
+
+      if (!MemPacket_IsAligned(p) || !MemPacket_IsChecksumCorrect(p)) {
+         break;
+      }
+
+      batch->packet[i] = p;
+      batch->payload[i] = MemPacket_GetPayload(p);
+      batch->duration[i] = MemPacket_GetDuration(p);
+      batch->type[i] = MemPacket_GetType(p);
+   }
+
+   return i;
+}
+
+static inline int
+MemPacket_DecodeBatchGeneric(const uint8_t *bytes, int count, MemPacketBatch *batch)
+{
+   return MemPacketBatch_Scalar(bytes, 0, count, batch);
+}
+
+
+#ifdef MEMPKT_BATCH_X86
+
+/*
+ * Scalar version for CPUs with BMI2. The payload is one PEXT, and the
+ * checksum is a plain sum of shifted payloads: the bits above each
+ * 3-bit digit never carry into the low 3 bits, so there's no need to
+ * mask each digit first.
+ */
+
+static inline __attribute__((target("bmi2"))) int
+MemPacket_DecodeBatchBMI2(const uint8_t *bytes, int count, MemPacketBatch *batch)
+{
+   int i;
+
+   for (i = 0; i < count; i++) {
+      MemPacket p = MemPacket_FromBytes(bytes + i * sizeof p);
+      uint32_t payload = _pext_u32(p, MEMPKT_PAYLOAD_BITS);
+      uint32_t type = (p >> 29) & 3;
+      uint32_t sum = type + payload + (payload >> 3) + (payload >> 6) +
+                     (payload >> 9) + (payload >> 12) + (payload >> 15) +
+                     (payload >> 18) + (payload >> 21);
+
+      if ((p & MEMPKT_ALIGN_MASK) != MEMPKT_ALIGN_VALUE || ((sum ^ p) & 7)) {
+         break;
+      }
+
+      batch->packet[i] = p;
+      batch->payload[i] = payload;
+      batch->type[i] = type;
+      batch->duration[i] = 1 + (type == MEMPKT_TIMESTAMP ? payload :
+                                type == MEMPKT_ADDR ? 0 : payload >> 18);
+   }
+
+   return i;
+}
+
+
+/*
+ * SSE4.1 version, 4 packets per iteration.
+ */
+
+static inline __attribute__((target("sse4.1"))) int
+MemPacket_DecodeBatchSSE41(const uint8_t *bytes, int count, MemPacketBatch *batch)
+{
+   const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                      11, 10, 9, 8, 15, 14, 13, 12);
+   const __m128i seven = _mm_set1_epi32(7);
+   const __m128i one = _mm_set1_epi32(1);
+   int i;
+
+   for (i = 0; i + 4 <= count; i += 4) {
+      __m128i p = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(bytes + i * 4)),
+                                   swap);
+      __m128i payload, type, sum, ok, isTs, isAddr, dur;
+      int mask;
+
+      payload = _mm_or_si128(
+         _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x0F)),
+                      _mm_and_si128(_mm_srli_epi32(p, 4), _mm_set1_epi32(0x7F0))),
+         _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x3F800)),
+                      _mm_and_si128(_mm_srli_epi32(p, 6), _mm_set1_epi32(0x7C0000))));
+      type = _mm_and_si128(_mm_srli_epi32(p, 29), _mm_set1_epi32(3));
+
+      sum = _mm_add_epi32(type, payload);
+      sum = _mm_add_epi32(sum, _mm_srli_epi32(payload, 3));
+      sum = _mm_add_epi32(sum, _mm_srli_epi32(payload, 6));
+      sum = _mm_add_epi32(sum, _mm_srli_epi32(payload, 9));
+      sum = _mm_add_epi32(sum, _mm_srli_epi32(payload, 12));
+      sum = _mm_add_epi32(sum, _mm_srli_epi32(payload, 15));
+      sum = _mm_add_epi32(sum, _mm_srli_epi32(payload, 18));
+      sum = _mm_add_epi32(sum, _mm_srli_epi32(payload, 21));
+
+      ok = _mm_and_si128(
+         _mm_cmpeq_epi32(_mm_and_si128(sum, seven), _mm_and_si128(p, seven)),
+         _mm_cmpeq_epi32(_mm_and_si128(p, _mm_set1_epi32(MEMPKT_ALIGN_MASK)),
+                         _mm_set1_epi32(MEMPKT_ALIGN_VALUE)));
+
+      isTs = _mm_cmpeq_epi32(type, _mm_set1_epi32(MEMPKT_TIMESTAMP));
+      isAddr = _mm_cmpeq_epi32(type, _mm_setzero_si128());
+      dur = _mm_blendv_epi8(_mm_srli_epi32(payload, 18), payload, isTs);
+      dur = _mm_add_epi32(_mm_andnot_si128(isAddr, dur), one);
+
+      _mm_storeu_si128((__m128i *)(batch->packet + i), p);
+      _mm_storeu_si128((__m128i *)(batch->payload + i), payload);
+      _mm_storeu_si128((__m128i *)(batch->type + i), type);
+      _mm_storeu_si128((__m128i *)(batch->duration + i), dur);
+
+      mask = _mm_movemask_ps(_mm_castsi128_ps(ok));
+      if (mask != 0xF) {
+         return i + __builtin_ctz(~mask);
+      }
+   }
+
+   return MemPacketBatch_Scalar(bytes, i, count, batch);
+}
+
+
+/*
+ * AVX2 version, 8 packets per iteration.
+ */
+
+static inline __attribute__((target("avx2"))) int
+MemPacket_DecodeBatchAVX2(const uint8_t *bytes, int count, MemPacketBatch *batch)
+{
+   const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                         11, 10, 9, 8, 15, 14, 13, 12,
+                                         3, 2, 1, 0, 7, 6, 5, 4,
+                                         11, 10, 9, 8, 15, 14, 13, 12);
+   const __m256i seven = _mm256_set1_epi32(7);
+   const __m256i one = _mm256_set1_epi32(1);
+   int i;
+
+   for (i = 0; i + 8 <= count; i += 8) {
+      __m256i p = _mm256_shuffle_epi8(
+         _mm256_loadu_si256((const __m256i *)(bytes + i * 4)), swap);
+      __m256i payload, type, sum, ok, isTs, isAddr, dur;
+      int mask;
+
+      payload = _mm256_or_si256(
+         _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(p, 3), _mm256_set1_epi32(0x0F)),
+                         _mm256_and_si256(_mm256_srli_epi32(p, 4), _mm256_set1_epi32(0x7F0))),
+         _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(p, 5), _mm256_set1_epi32(0x3F800)),
+                         _mm256_and_si256(_mm256_srli_epi32(p, 6), _mm256_set1_epi32(0x7C0000))));
+      type = _mm256_and_si256(_mm256_srli_epi32(p, 29), _mm256_set1_epi32(3));
+
+      sum = _mm256_add_epi32(type, payload);
+      sum = _mm256_add_epi32(sum, _mm256_srli_epi32(payload, 3));
+      sum = _mm256_add_epi32(sum, _mm256_srli_epi32(payload, 6));
+      sum = _mm256_add_epi32(sum, _mm256_srli_epi32(payload, 9));
+      sum = _mm256_add_epi32(sum, _mm256_srli_epi32(payload, 12));
+      sum = _mm256_add_epi32(sum, _mm256_srli_epi32(payload, 15));
+      sum = _mm256_add_epi32(sum, _mm256_srli_epi32(payload, 18));
+      sum = _mm256_add_epi32(sum, _mm256_srli_epi32(payload, 21));
+
+      ok = _mm256_and_si256(
+         _mm256_cmpeq_epi32(_mm256_and_si256(sum, seven), _mm256_and_si256(p, seven)),
+         _mm256_cmpeq_epi32(_mm256_and_si256(p, _mm256_set1_epi32(MEMPKT_ALIGN_MASK)),
+                            _mm256_set1_epi32(MEMPKT_ALIGN_VALUE)));
+
+      isTs = _mm256_cmpeq_epi32(type, _mm256_set1_epi32(MEMPKT_TIMESTAMP));
+      isAddr = _mm256_cmpeq_epi32(type, _mm256_setzero_si256());
+      dur = _mm256_blendv_epi8(_mm256_srli_epi32(payload, 18), payload, isTs);
+      dur = _mm256_add_epi32(_mm256_andnot_si256(isAddr, dur), one);
+
+      _mm256_storeu_si256((__m256i *)(batch->packet + i), p);
+      _mm256_storeu_si256((__m256i *)(batch->payload + i), payload);
+      _mm256_storeu_si256((__m256i *)(batch->type + i), type);
+      _mm256_storeu_si256((__m256i *)(batch->duration + i), dur);
+
+      mask = _mm256_movemask_ps(_mm256_castsi256_ps(ok));
+      if (mask != 0xFF) {
+         return i + __builtin_ctz(~mask);
+      }
+   }
+
+   return MemPacketBatch_Scalar(bytes, i, count, batch);
+}
+
+
+/*
+ * AVX-512 version, 16 packets per iteration. Needs AVX512BW for the
+ * byte shuffle.
+ */
+
+static inline __attribute__((target("avx512f,avx512bw"))) int
+MemPacket_DecodeBatchAVX512(const uint8_t *bytes, int count, MemPacketBatch *batch)
+{
+   const __m512i swap = _mm512_set4_epi32(0x0c0d0e0f, 0x08090a0b,
+                                          0x04050607, 0x00010203);
+   const __m512i seven = _mm512_set1_epi32(7);
+   const __m512i one = _mm512_set1_epi32(1);
+   int i;
+
+   for (i = 0; i + 16 <= count; i += 16) {
+      __m512i p = _mm512_shuffle_epi8(_mm512_loadu_si512(bytes + i * 4), swap);
+      __m512i payload, type, sum, dur;
+      __mmask16 ok, isTs, isAddr;
+
+      payload = _mm512_or_si512(
+         _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi32(p, 3), _mm512_set1_epi32(0x0F)),
+                         _mm512_and_si512(_mm512_srli_epi32(p, 4), _mm512_set1_epi32(0x7F0))),
+         _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi32(p, 5), _mm512_set1_epi32(0x3F800)),
+                         _mm512_and_si512(_mm512_srli_epi32(p, 6), _mm512_set1_epi32(0x7C0000))));
+      type = _mm512_and_si512(_mm512_srli_epi32(p, 29), _mm512_set1_epi32(3));
+
+      sum = _mm512_add_epi32(type, payload);
+      sum = _mm512_add_epi32(sum, _mm512_srli_epi32(payload, 3));
+      sum = _mm512_add_epi32(sum, _mm512_srli_epi32(payload, 6));
+      sum = _mm512_add_epi32(sum, _mm512_srli_epi32(payload, 9));
+      sum = _mm512_add_epi32(sum, _mm512_srli_epi32(payload, 12));
+      sum = _mm512_add_epi32(sum, _mm512_srli_epi32(payload, 15));
+      sum = _mm512_add_epi32(sum, _mm512_srli_epi32(payload, 18));
+      sum = _mm512_add_epi32(sum, _mm512_srli_epi32(payload, 21));
+
+      ok = _mm512_cmpeq_epi32_mask(_mm512_and_si512(sum, seven),
+                                   _mm512_and_si512(p, seven)) &
+           _mm512_cmpeq_epi32_mask(_mm512_and_si512(p, _mm512_set1_epi32(MEMPKT_ALIGN_MASK)),
+                                   _mm512_set1_epi32(MEMPKT_ALIGN_VALUE));
+
+      isTs = _mm512_cmpeq_epi32_mask(type, _mm512_set1_epi32(MEMPKT_TIMESTAMP));
+      isAddr = _mm512_cmpeq_epi32_mask(type, _mm512_setzero_si512());
+      dur = _mm512_mask_mov_epi32(_mm512_srli_epi32(payload, 18), isTs, payload);
+      dur = _mm512_add_epi32(_mm512_maskz_mov_epi32(~isAddr, dur), one);
+
+      _mm512_storeu_si512(batch->packet + i, p);
+      _mm512_storeu_si512(batch->payload + i, payload);
+      _mm512_storeu_si512(batch->type + i, type);
+      _mm512_storeu_si512(batch->duration + i, dur);
+
+      if (ok != 0xFFFF) {
+         return i + __builtin_ctz(~(uint32_t)ok);
+      }
+   }
+
+   return MemPacketBatch_Scalar(bytes, i, count, batch);
+}
+
+#endif /* MEMPKT_BATCH_X86 */
+
+
+/*
+ * MemPacket_BatchKernel --
+ *
+ *    Look up a batch kernel by name ("generic", "bmi2", "sse4.1", "avx2",
+ *    or "avx512"). Returns NULL if the kernel is unknown, or if this CPU
+ *    can't run it. A NULL name picks the fastest kernel we can run.
+ */
+
+static inline MemPacketBatchFn
+MemPacket_BatchKernel(const char *name)
+{
+#ifdef MEMPKT_BATCH_X86
+   __builtin_cpu_init();
+
+   if (!name || !strcmp(name, "avx512")) {
+      if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+         return MemPacket_DecodeBatchAVX512;
+      }
+   }
+   if (!name || !strcmp(name, "avx2")) {
+      if (__builtin_cpu_supports("avx2")) {
+         return MemPacket_DecodeBatchAVX2;
+      }
+   }
+   if (!name || !strcmp(name, "sse4.1")) {
+      if (__builtin_cpu_supports("sse4.1")) {
+         return MemPacket_DecodeBatchSSE41;
+      }
+   }
+   if (!name || !strcmp(name, "bmi2")) {
+      if (__builtin_cpu_supports("bmi2")) {
+         return MemPacket_DecodeBatchBMI2;
+      }
+   }
+#endif
+
+   if (!name || !strcmp(name, "generic")) {
+      return MemPacket_DecodeBatchGeneric;
+   }
+
+   return NULL;
+}
+
+
+/*
+ * MemPacket_DecodeBatch --
+ *
+ *    Validate and unpack up to 'count' packets (at most MEMPKT_BATCH_SIZE)
+ *    from 'bytes'. Returns the number of leading packets that are aligned
+ *    and have correct checksums; only those entries of 'batch' are valid.
+ *
+ *    The kernel is chosen the first time we're called. Setting
+ *    MEMTRACE_KERNEL in the environment overrides the choice.
+ */
+
+static inline int
+MemPacket_DecodeBatch(const uint8_t *bytes, int count, MemPacketBatch *batch)
+{
+   static MemPacketBatchFn kernel;
+   MemPacketBatchFn fn = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+
+   if (!fn) {
+      // Threads may race to get here. They'll all pick the same kernel.
+      const char *name = getenv("MEMTRACE_KERNEL");
+
+      fn = name ? MemPacket_BatchKernel(name) : NULL;
+      if (!fn) {
+         fn = MemPacket_BatchKernel(NULL);
+      }
+      __atomic_store_n(&kernel, fn, __ATOMIC_RELAXED);
+   }
+
+   return fn(bytes, count, batch);
+}
+
+
+
+/*
+ * MemPacket_SignBits --
+ *
+ *    Collect the top bit of each of 64 bytes into a mask, with byte 0
+ *    in bit 0. SSE2 is part of x86-64, so this needs no dispatch.
+ */
+
+static inline uint64_t
+MemPacket_SignBits(const uint8_t *bytes)
+{
+#ifdef MEMPKT_BATCH_X86
+   const __m128i *v = (const __m128i *)bytes;
+   uint64_t m0 = (uint16_t)_mm_movemask_epi8(_mm_loadu_si128(v + 0));
+   uint64_t m1 = (uint16_t)_mm_movemask_epi8(_mm_loadu_si128(v + 1));
+   uint64_t m2 = (uint16_t)_mm_movemask_epi8(_mm_loadu_si128(v + 2));
+   uint64_t m3 = (uint16_t)_mm_movemask_epi8(_mm_loadu_si128(v + 3));
+
+   return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   /*
+    * Eight bytes per multiply: each sign bit lands in its own position
+    * of the top byte, and no two partial products overlap.
+    */
+   uint64_t mask = 0;
+   int i;
+
+   for (i = 0; i < 8; i++) {
+      uint64_t w;
+      memcpy(&w, bytes + i * 8, sizeof w);
+      w = ((w & 0x8080808080808080ULL) * 0x0002040810204081ULL) >> 56;
+      mask |= w << (i * 8);
+   }
+   return mask;
+#else
+   uint64_t mask = 0;
+   int i;
+
+   for (i = 0; i < 64; i++) {
+      mask |= (uint64_t)(bytes[i] >> 7) << i;
+   }
+   return mask;
+#endif
+}
+
+
+/*
+ * MemPacket_FindSync --
+ *
+ *    Find the first offset in 'bytes' where 'count' packets in a row
+ *    (at most MEMPKT_BATCH_SIZE) are aligned and have good checksums.
+ *
+ *    If there isn't one, returns the first offset we couldn't rule out
+ *    because the run would extend past 'length'. If 'atEnd' is set,
+ *    'length' is the end of the trace: a shorter run is accepted if it
+ *    reaches all the way there, and 'length' means nothing was found.
+ */
+
+static inline size_t
+MemPacket_FindSync(const uint8_t *bytes, size_t length, int count, bool atEnd)
+{
+   const size_t needed = count * sizeof(MemPacket);
+   MemPacketBatch batch;
+   size_t offset = 0;
+
+   /*
+    * 64 bytes at a time, pick out the offsets which look like the start
+    * of a packet: one set top bit, followed by three clear ones. Only
+    * the first 61 offsets have all four bytes inside the window.
+    */
+
+   while (offset + 64 <= length && offset + 61 + needed <= length) {
+      uint64_t sign = MemPacket_SignBits(bytes + offset);
+      uint64_t start = sign & ~(sign >> 1) & ~(sign >> 2) & ~(sign >> 3);
+
+      start &= (1ULL << 61) - 1;
+
+      while (start) {
+         size_t candidate = offset + __builtin_ctzll(start);
+
+         if (MemPacket_DecodeBatch(bytes + candidate, count, &batch) == count) {
+            return candidate;
+         }
+         start &= start - 1;
+      }
+      offset += 61;
+   }
+
+   for (; offset + needed <= length; offset++) {
+      if (MemPacket_IsAligned(MemPacket_FromBytes(bytes + offset)) &&
+          MemPacket_DecodeBatch(bytes + offset, count, &batch) == count) {
+         return offset;
+      }
+   }
+
+   if (!atEnd) {
+      return offset;
+   }
+
+   for (; offset + sizeof(MemPacket) <= length; offset++) {
+      int remaining = (length - offset) / sizeof(MemPacket);
+
+      if (MemPacket_IsAligned(MemPacket_FromBytes(bytes + offset)) &&
+          MemPacket_DecodeBatch(bytes + offset, remaining, &batch) == remaining) {
+         return offset;
+      }
+   }
+
+   return length;
+}
+
+#endif /* __MEMTRACE_BATCH_H */
@@ -50,14 +50,14 @@ typedef enum {
  */
 
 static inline MemPacket
-MemPacket_FromBytes(uint8_t *bytes)
+MemPacket_FromBytes(const uint8_t *bytes)
 {
    /*
     * Reassemble a 32-bit big-endian packet from the bytes. There's a
     * generic C implementation and a faster x86/gcc implementation.
     */
 #if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
-   uint32_t r = *(uint32_t*)bytes;
+   uint32_t r = *(const uint32_t*)bytes;
    asm ("bswap %0" : "+r" (r));
    return r;
 #else
@@ -122,6 +122,32 @@ MemPacket_IsAligned(MemPacket p)
    return (p & 0x80808080) == 0x80000000;
 }
 
+/*
+ * Creating a packet from its type and payload, and storing it as bytes.
+ * These are the inverse of MemPacket_GetType/GetPayload and FromBytes.
+ */
+
+static inline MemPacket
+MemPacket_Create(MemPacketType type, uint32_t payload)
+{
+   MemPacket p = 0x80000000 | ((uint32_t)type << 29) |
+                 ((payload & 0x0F) << 3) |
+                 ((payload & 0x7F0) << 4) |
+                 ((payload & 0x3F800) << 5) |
+                 ((payload & 0x7C0000) << 6);
+
+   return p | MemPacket_ComputeCheck(p);
+}
+
+static inline void
+MemPacket_ToBytes(MemPacket p, uint8_t *bytes)
+{
+   bytes[0] = p >> 24;
+   bytes[1] = p >> 16;
+   bytes[2] = p >> 8;
+   bytes[3] = p;
+}
+
 static inline bool
 MemPacket_IsOverflow(MemPacket p)
 {
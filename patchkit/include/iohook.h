@@ -81,6 +81,12 @@ IOHook_Quit(const char *str)
    while (1);
 }
 
+static inline void
+IOHook_Trigger(const char *str)
+{
+   IOHook_SendStr(IOH_SVC_TRIGGER, str);
+}
+
 static inline void
 IOHook_FOpenW(const char *str)
 {